@@ -20,6 +20,7 @@ resolution: 1920x1080x32
 /LunOS
 protocol: limine
 path: boot():/LunOS.kernel
+cmdline: cma=32M
 EOF
 
 # Copy Limine configuration to EFI directory as well (for UEFI boot)
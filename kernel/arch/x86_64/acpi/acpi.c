@@ -0,0 +1,113 @@
+#include <kernel/acpi.h>
+#include <kernel/limine_requests.h>
+#include <kernel/buddy_allocator.h>
+#include <kernel/klogging.h>
+#include <klib/string.h>
+
+static struct acpi_sdt_header *root_table = NULL;
+// XSDT entries are 64 bit, RSDT ones 32 bit
+static int root_entry_size = 4;
+
+static bool acpi_checksum_ok(const void *table, uint32_t length){
+    const uint8_t *bytes = table;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++)
+        sum += bytes[i];
+    return sum == 0;
+}
+
+// Limine's HHDM only covers memory the memory map says is there, so we
+// check before touching anything instead of taking a page fault for it
+static void *acpi_map(uint64_t phys, uint64_t length){
+    struct limine_memmap_response *mmap = get_memmap_request()->response;
+    if (!mmap)
+        return NULL;
+
+    for (uint64_t i = 0; i < mmap->entry_count; i++) {
+        struct limine_memmap_entry *entry = mmap->entries[i];
+        if (phys < entry->base || phys + length > entry->base + entry->length)
+            continue;
+
+        switch (entry->type) {
+            case LIMINE_MEMMAP_USABLE:
+            case LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE:
+            case LIMINE_MEMMAP_ACPI_RECLAIMABLE:
+            case LIMINE_MEMMAP_ACPI_NVS:
+                return phys_to_virt(phys);
+            default:
+                return NULL;
+        }
+    }
+    return NULL;
+}
+
+// Maps the header first since that's the only way to learn the length
+static struct acpi_sdt_header *acpi_map_table(uint64_t phys){
+    struct acpi_sdt_header *header = acpi_map(phys, sizeof(*header));
+    if (!header || header->length < sizeof(*header))
+        return NULL;
+    if (!acpi_map(phys, header->length))
+        return NULL;
+    return header;
+}
+
+int acpi_init(void){
+    struct limine_rsdp_request *req = get_rsdp_request();
+    if (!req->response || !req->response->address) {
+        KWARN("Bootloader didn't give us an RSDP\n");
+        return -1;
+    }
+
+    // Physical since base revision 3, older ones handed out an HHDM pointer
+    uint64_t rsdp_phys = (uint64_t)req->response->address;
+    if (rsdp_phys >= get_hhdm_offset())
+        rsdp_phys -= get_hhdm_offset();
+
+    struct acpi_rsdp *rsdp = acpi_map(rsdp_phys, sizeof(*rsdp));
+    if (!rsdp || memcmp(rsdp->signature, "RSD PTR ", 8) != 0 || !acpi_checksum_ok(rsdp, 20)) {
+        KWARN("RSDP at 0x%lx is unreadable or broken\n", rsdp_phys);
+        return -1;
+    }
+
+    if (rsdp->revision >= 2 && rsdp->xsdt_address) {
+        root_table = acpi_map_table(rsdp->xsdt_address);
+        root_entry_size = 8;
+    } else {
+        root_table = acpi_map_table(rsdp->rsdt_address);
+        root_entry_size = 4;
+    }
+
+    if (!root_table || !acpi_checksum_ok(root_table, root_table->length)) {
+        KWARN("ACPI root table is unreadable or broken\n");
+        root_table = NULL;
+        return -1;
+    }
+
+    KSUCCESS("ACPI %s found, revision %d\n", root_entry_size == 8 ? "XSDT" : "RSDT",
+                                                                    rsdp->revision);
+    return 0;
+}
+
+struct acpi_sdt_header *acpi_find_table(const char *signature){
+    if (!root_table)
+        return NULL;
+
+    uint32_t count = (root_table->length - sizeof(*root_table)) / root_entry_size;
+    uint8_t *entries = (uint8_t*)(root_table + 1);
+
+    for (uint32_t i = 0; i < count; i++) {
+        // Entries aren't necessarily aligned, copy them out
+        uint64_t phys = 0;
+        memcpy(&phys, entries + i * root_entry_size, root_entry_size);
+
+        struct acpi_sdt_header *table = acpi_map_table(phys);
+        if (!table || memcmp(table->signature, signature, 4) != 0)
+            continue;
+        if (!acpi_checksum_ok(table, table->length)) {
+            KWARN("ACPI table %s has a bad checksum, ignoring it\n", signature);
+            continue;
+        }
+        return table;
+    }
+    return NULL;
+}
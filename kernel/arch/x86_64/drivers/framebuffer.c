@@ -1,6 +1,9 @@
 #include <kernel/framebuffer.h>
+#include <kernel/ioremap.h>
 
 static struct limine_framebuffer *primary_fb = NULL;
+// Where we draw, Limine's HHDM address until fb_remap_wc gives us our own
+static volatile uint32_t *fb_base = NULL;
 
 int fb_init(void) {
     struct limine_framebuffer_request *fb_req = get_framebuffer_request();
@@ -10,6 +13,24 @@ int fb_init(void) {
     }
 
     primary_fb = fb_req->response->framebuffers[0];
+    fb_base = primary_fb->address;
+    return 0;
+}
+
+// Pixels only ever get written and mostly in order, write combining turns
+// them into full cache line bursts instead of one bus write per pixel
+int fb_remap_wc(void) {
+    if (!primary_fb)
+        return -1;
+
+    phys_addr phys = (virt_addr)primary_fb->address - get_hhdm_offset();
+    uint64_t size = primary_fb->pitch * primary_fb->height;
+
+    volatile uint32_t *wc = ioremap(phys, size, IOREMAP_WC);
+    if (!wc)
+        return -1;
+
+    fb_base = wc;
     return 0;
 }
 
@@ -20,7 +41,7 @@ struct limine_framebuffer* fb_get(void) {
 void fb_put_pixel(uint32_t x, uint32_t y, uint32_t color) {
     if (!primary_fb) return;
 
-    volatile uint32_t *fb_ptr = primary_fb->address;
+    volatile uint32_t *fb_ptr = fb_base;
     if (x < primary_fb->width && y < primary_fb->height) {
         fb_ptr[y * (primary_fb->pitch / 4) + x] = color;
     }
@@ -29,7 +50,7 @@ void fb_put_pixel(uint32_t x, uint32_t y, uint32_t color) {
 void fb_clear(uint32_t color) {
     if (!primary_fb) return;
 
-    volatile uint32_t *fb_ptr = primary_fb->address;
+    volatile uint32_t *fb_ptr = fb_base;
     for (uint32_t y = 0; y < primary_fb->height; y++) {
         for (uint32_t x = 0; x < primary_fb->width; x++) {
             fb_ptr[y * (primary_fb->pitch / 4) + x] = color;
@@ -41,7 +62,7 @@ void fb_put_char(char c, uint32_t x, uint32_t y, uint32_t fg_color, uint32_t bg_
     if (!primary_fb) return;
 
     const uint8_t *char_bitmap = font_get_char(c);
-    volatile uint32_t *fb_ptr = primary_fb->address;
+    volatile uint32_t *fb_ptr = fb_base;
 
     for (int row = 0; row < FONT_HEIGHT; row++) {
         uint8_t byte = char_bitmap[row];
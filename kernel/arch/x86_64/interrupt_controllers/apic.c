@@ -1,33 +1,30 @@
 #include <kernel/apic.h>
 #include <kernel/timer.h>
 #include <kernel/vmm.h> 
+#include <kernel/ioremap.h>
 #include <kernel/klogging.h>
 #include <kernel/idt_init.h>
 #include <kernel/smp.h>
 #include <kernel/scheduler.h>
+#include <kernel/memutils.h>
+#include <kernel/tick.h>
 
 #include <klib/string.h>
 
 static volatile uint32_t *apic_base = NULL;
 static uint32_t apic_timer_frequency = 0;
+static int tsc_deadline = -1;   // -1 until we asked CPUID
 DEFINE_PER_CPU_VOLATILE(uint64_t, timer_ticks);
 
 // For BSP use
 int apic_global_init(void) {
     // Map APIC base - this only needs to be done once
-    virt_addr apic_vaddr = 0xFFFFFF8000000000UL;
-    uint64_t mmio_flags = PTE_PRESENT | PTE_WRITABLE | PTE_CACHE_DISABLE | PTE_WRITETHROUGH; 
-    
-    struct addr_space *kernel_as = get_kernel_as();
-    
-    int result = vmm_map_range(kernel_as, apic_vaddr, APIC_BASE_ADDR, 0x1000, mmio_flags);
-    if (result != 0) {
+    apic_base = ioremap(APIC_BASE_ADDR, PAGE_SIZE, IOREMAP_UC);
+    if (!apic_base) {
         KERROR("Failed to map APIC base address\n");
         return -1;
     }
-    
-    apic_base = (volatile uint32_t*)apic_vaddr;
-    KSUCCESS("APIC mapped at virtual address 0x%lx\n", apic_vaddr);
+    KSUCCESS("APIC mapped at virtual address %p\n", apic_base);
     
     // Calibrate timer using PIT (only needs to be done once)
     apic_timer_calibrate();
@@ -143,10 +140,80 @@ void apic_timer_set_frequency(uint32_t frequency) {
     apic_write(APIC_TIMER_INITIAL, initial_count);
     
 }
+bool apic_timer_tsc_deadline(void) {
+    if (tsc_deadline < 0) {
+        uint32_t eax = 1, ebx, ecx = 0, edx;
+        __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+        tsc_deadline = (ecx >> 24) & 1;
+    }
+    return tsc_deadline;
+}
+
+void apic_timer_set_oneshot(void) {
+    apic_write(APIC_TIMER_DIVIDE, 0x3);
+    apic_write(APIC_TIMER_INITIAL, 0);
+
+    if (apic_timer_tsc_deadline()) {
+        apic_write(APIC_TIMER_LVT, APIC_TIMER_TSC_DEADLINE | APIC_TIMER_VECTOR | APIC_TIMER_LVT_MASKED);
+        // SDM 10.5.4.1: the LVT write has to land before the first
+        // IA32_TSC_DEADLINE write or that one may be ignored
+        __asm__ __volatile__("mfence" : : : "memory");
+        write_msr(MSR_IA32_TSC_DEADLINE, 0);
+    } else {
+        apic_write(APIC_TIMER_LVT, APIC_TIMER_ONESHOT | APIC_TIMER_VECTOR | APIC_TIMER_LVT_MASKED);
+    }
+}
+
+void apic_timer_arm(uint64_t deadline) {
+    if (tsc_deadline > 0) {
+        write_msr(MSR_IA32_TSC_DEADLINE, deadline);
+        return;
+    }
+
+    // Counting mode, convert from TSC cycles to APIC ticks. Anything past a
+    // second gets cut short, the handler just arms it again
+    uint64_t now = read_tsc();
+    uint64_t tsc_per_ms = tsc_cycles_per_ms();
+    uint64_t delta = deadline > now ? deadline - now : 0;
+    if (delta > 1000 * tsc_per_ms)
+        delta = 1000 * tsc_per_ms;
+
+    uint64_t count = delta * (apic_timer_frequency / 1000) / tsc_per_ms;
+    apic_write(APIC_TIMER_INITIAL, count ? (uint32_t)count : 1);
+}
+
+void apic_timer_cancel(void) {
+    if (tsc_deadline > 0)
+        write_msr(MSR_IA32_TSC_DEADLINE, 0);
+    else
+        apic_write(APIC_TIMER_INITIAL, 0);
+}
+
 void apic_timer_handler(void) {
     apic_write(APIC_EOI, 0);
+    this_core_write(timer_ticks, this_core_read(timer_ticks) + 1);
    
-    schedule();
+    // In one shot mode it can also be a ktimer that went off
+    if (tick_interrupt())
+        scheduler_tick();
+    preempt_schedule_irq();
+}
+
+void apic_eoi(void) {
+    apic_write(APIC_EOI, 0);
+}
+
+void apic_send_ipi(uint32_t lapic_id, uint8_t vector) {
+    // The two halves of the ICR have to go out as a pair
+    int_flags flags = save_and_disable_interrupts();
+
+    // xAPIC only takes one command at a time
+    while (apic_read(APIC_ICR_LOW) & APIC_ICR_PENDING)
+        cpu_pause();
+
+    apic_write(APIC_ICR_HIGH, lapic_id << APIC_ICR_DEST_SHIFT);
+    apic_write(APIC_ICR_LOW, APIC_ICR_ASSERT | vector);
+    restore_interrupts(flags);
 }
 
 void apic_timer_enable(void) {
@@ -3,7 +3,18 @@
 #include <kernel/halt.h>
 #include <kernel/memmgr.h>
 #include <kernel/scheduler.h>
+#include <kernel/task_manager.h>
 #include <kernel/apic.h>
+#include <kernel/ipi.h>
+
+DEFINE_PER_CPU_GLOBAL(bool, in_irq);
+
+volatile unsigned long ipi_sync_pending;
+
+// TLB shootdowns are the only ones that wait for an answer so far
+void ipi_sync_handle(void){
+    vmm_shootdown_poll();
+}
 
 static void decode_page_fault_error(uint64_t err_code) {
     kprintf("Error code: 0x%lx\n", err_code);
@@ -42,12 +53,27 @@ static void isr14_page_fault(uint64_t cr2, uint64_t err_code){
         kprintf("This page fault occured in kernel space.. Time to panic :d\n");
         hcf();
     }
+
+    struct task *current = get_current_task();
+
+    // Demand paging, copy on write and stack/heap growth all end up here,
+    // if it got resolved we just retry the faulting instruction
+    if(mm_page_fault_handler(cr2, err_code) == 0)
+        load_next_task(&current->cpu_context);
+
     KERROR("Page fault occurred at address: %lx\n", cr2);
     decode_page_fault_error(err_code);
-    hcf();
-    //mm_page_fault_handler(cr2, fr->err_code);
-}
 
+    // A kernel task touching the user half is a kernel bug
+    if(!current || !current->md){
+        kprintf("Kernel task faulted in user space.. Time to panic :d\n");
+        hcf();
+    }
+
+    // Should be a proper SIGSEGV once we have signals
+    current->exit_signal = SIGSEGV;
+    task_exit(-1);
+}
 
 static void isr_reserved(void){
     kprintf("ISR is reserved by INTEL!? How are we even here\n");
@@ -59,6 +85,11 @@ void print_check(void){
 }
 
 void isr_dispatch(struct interrupt_frame *fr){
+    // Cleared on the way out, or in preempt_schedule_irq for the handlers
+    // that leave through it
+    if (fr->int_no >= 32)
+        this_core_write(in_irq, true);
+
     switch (fr->int_no){
         // 0 - 32 - Exception handlers
         case 0: 
@@ -112,5 +143,18 @@ void isr_dispatch(struct interrupt_frame *fr){
         case 64:
             apic_timer_handler();
             break;
+        case SCHED_RESCHED_VECTOR:
+            preempt_schedule_irq();
+            break;
+        case SCHED_IPI_VECTOR:
+            apic_eoi();
+            sched_ipi_handler();
+            break;
+        case VMM_SHOOTDOWN_VECTOR:
+            ipi_sync_handle();
+            apic_eoi();
+            break;
     }
+
+    this_core_write(in_irq, false);
 }
@@ -47,6 +47,19 @@ static volatile struct limine_smp_request smp_request = {
     .revision = 0
 };
 
+// Kernel file request, we only want the command line out of it
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_kernel_file_request kernel_file_request = {
+    .id = LIMINE_KERNEL_FILE_REQUEST,
+    .revision = 0
+};
+
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_rsdp_request rsdp_request = {
+    .id = LIMINE_RSDP_REQUEST,
+    .revision = 0
+};
+
 // Getter functions
  
 struct limine_framebuffer_request* get_framebuffer_request(void) {
@@ -69,3 +82,10 @@ struct limine_smp_request* get_smp_request(void) {
     return (struct limine_smp_request*)&smp_request;
 }
 
+struct limine_kernel_file_request* get_kernel_file_request(void) {
+    return (struct limine_kernel_file_request*)&kernel_file_request;
+}
+
+struct limine_rsdp_request* get_rsdp_request(void) {
+    return (struct limine_rsdp_request*)&rsdp_request;
+}
@@ -1,8 +1,113 @@
 #include <kernel/buddy_allocator.h>
+#include <klib/string.h>
+#include <kernel/cma.h>
+#include <kernel/numa.h>
 
 struct buddy_arena buddy_arenas[MAX_BUDDY_ARENAS];
 static uint8_t buddy_arena_counter = 0;
 
+// Both only change under the pmm lock but get read without it
+static atomic64 nr_free_pages = ATOMIC64_INIT(0);
+static uint64_t nr_total_pages = 0;
+
+struct zone zones[MAX_NR_ZONES] = {
+    [ZONE_DMA]    = { .name = "DMA",    .start = 0,              .end = ZONE_DMA_END },
+    [ZONE_DMA32]  = { .name = "DMA32",  .start = ZONE_DMA_END,   .end = ZONE_DMA32_END },
+    [ZONE_NORMAL] = { .name = "Normal", .start = ZONE_DMA32_END, .end = UINT64_MAX },
+};
+
+struct reserved_range {
+    uint64_t start;
+    uint64_t end;
+    const char *why;
+};
+
+// Holes we punch into usable memory ourselves, sorted by address. Firmware
+// isn't always honest about these, QEMU + Limine with UEFI reports the VGA
+// window as free and touching 0xA0000 page faults
+static const struct reserved_range reserved_ranges[] = {
+    // A physical address of 0 is what every allocator returns on failure
+    { 0x0,     0x1000,   "null page" },
+    { 0xA0000, 0x100000, "VGA window and BIOS ROMs" },
+};
+
+#define NR_RESERVED_RANGES (sizeof(reserved_ranges) / sizeof(reserved_ranges[0]))
+
+uint64_t buddy_free_page_count(void){
+    return atomic64_read(&nr_free_pages);
+}
+
+uint64_t buddy_total_page_count(void){
+    return nr_total_pages;
+}
+
+uint64_t buddy_zone_free_page_count(enum zone_type zone){
+    return atomic64_read(&zones[zone].nr_free);
+}
+
+static enum zone_type phys_to_zone(uint64_t phys){
+    if (phys < ZONE_DMA_END)
+        return ZONE_DMA;
+    if (phys < ZONE_DMA32_END)
+        return ZONE_DMA32;
+    return ZONE_NORMAL;
+}
+
+static void account_free(struct buddy_arena *arena, long pages){
+    atomic64_add(pages, &nr_free_pages);
+    atomic64_add(pages, &zones[arena->zone].nr_free);
+}
+
+static void add_arena(uint64_t start, uint64_t end){
+    if (buddy_arena_counter >= MAX_BUDDY_ARENAS) {
+        KWARN("Number of arenas is too small, yell at the dev to increase it\n");
+        return;
+    }
+    if (add_buddy_arena(buddy_arena_counter, start, end - start) != 0)
+        return;
+
+    struct buddy_arena *arena = &buddy_arenas[buddy_arena_counter];
+    KSUCCESS("Buddy Arena %d initialized (node %d, %s)\n", buddy_arena_counter, 
+                                            arena->node, zones[arena->zone].name);
+    kprintf("     Base:  0x%lx\n", arena->frame_base);
+    kprintf("     Size:  %lu bytes (%lu MiB)\n", end - start, (end - start) / (1024 * 1024));
+    buddy_arena_counter++;
+}
+
+// One arena per zone and node the range touches
+static void add_zone_arenas(uint64_t start, uint64_t end){
+    for (int z = 0; z < MAX_NR_ZONES && start < end; z++) {
+        uint64_t lo = start > zones[z].start ? start : zones[z].start;
+        uint64_t hi = end < zones[z].end ? end : zones[z].end;
+
+        while (lo < hi) {
+            uint64_t split = numa_range_end(lo);
+            if (split > hi)
+                split = hi;
+            add_arena(lo, split);
+            lo = split;
+        }
+    }
+}
+
+static void add_usable_range(uint64_t start, uint64_t end){
+    for (uint64_t i = 0; i < NR_RESERVED_RANGES && start < end; i++) {
+        const struct reserved_range *hole = &reserved_ranges[i];
+        if (hole->end <= start || hole->start >= end)
+            continue;
+
+        uint64_t lo = start > hole->start ? start : hole->start;
+        uint64_t hi = end < hole->end ? end : hole->end;
+        kprintf("     Reserved 0x%lx - 0x%lx (%s)\n", lo, hi, hole->why);
+
+        if (start < hole->start)
+            add_zone_arenas(start, hole->start);
+        start = hole->end;
+    }
+    if (start < end)
+        add_zone_arenas(start, end);
+}
+
 void buddy_allocator_init(void){
     struct limine_memmap_request *mmap_req = get_memmap_request();
     if(!mmap_req){
@@ -14,32 +119,17 @@ void buddy_allocator_init(void){
         KERROR("CRITICAL ERROR: Couldn't get response from mmap request\nHalting");
         hcf();
     }
+
+    // Has to be picked before the arenas hand its pages to the free lists
+    cma_reserve(mmap_response);
     
     for(uint64_t i = 0; i < mmap_response->entry_count; i++){
         struct limine_memmap_entry *entry = mmap_response->entries[i];
 
-        if(entry->type != 0)
+        if(entry->type != LIMINE_MEMMAP_USABLE)
             continue;
-        
-        if(buddy_arena_counter >= MAX_BUDDY_ARENAS){
-            KWARN("Number of arenas is too small, yell at the dev to increase it\n");
-            break;
-        }
-        // I don't want to allocate first page (I forgot why)
-        if(!entry->base)
-            entry->base += PAGE_FRAME_SIZE;
-
-        if(add_buddy_arena(buddy_arena_counter,entry->base, entry->length) == 0)
-        {   
-            uint64_t aligned_base = (entry->base + PAGE_FRAME_SIZE - 1) & ~(PAGE_FRAME_SIZE - 1);
-            uint64_t end = entry->base + entry->length;
-            uint64_t aligned_len = (aligned_base >= end) ? 0 : (end - aligned_base);
-
-            KSUCCESS("Buddy Arena %d initialized\n", buddy_arena_counter);
-            kprintf("     Base:  0x%lx\n", aligned_base);
-            kprintf("     Size:  %lu bytes (%lu MiB)\n", aligned_len, aligned_len / (1024 * 1024));
-            buddy_arena_counter++;
-        }
+
+        add_usable_range(entry->base, entry->base + entry->length);
     }
 }
 
@@ -48,15 +138,6 @@ int add_buddy_arena(uint8_t arena_idx, uint64_t base, uint64_t len){
         KERROR("Not enough arenas, yell at the dev to increase it\n");
         return -1;    
     }
-    // CRITICAL! For whatever reason QEMU + Limine with UEFI 
-    // recognizes VGA memory hole as FREE meanwhile it isn't 
-    // and if I try to test it on non real hardware address A0000 will always 
-    // page fault therefore we SKIP the affected arena entirely for QEMU testing 
-    if(arena_idx == 0){
-        buddy_arena_counter++;
-        return 0;
-    }
-    
     // Align to page size 
     uint64_t aligned_base = (base + PAGE_FRAME_SIZE - 1) & ~(PAGE_FRAME_SIZE - 1);
     uint64_t end = base + len;
@@ -68,9 +149,30 @@ int add_buddy_arena(uint8_t arena_idx, uint64_t base, uint64_t len){
     
     if (aligned_len < PAGE_FRAME_SIZE)
         return -1;
+
+    // Carve the frame metadata out of the start of the arena, if the arena 
+    // is so small that nothing is left after that it simply goes without it
+    uint64_t frame_count = aligned_len / PAGE_FRAME_SIZE;
+    uint64_t meta_size = frame_count * sizeof(struct page_frame);
+    uint64_t meta_len = (meta_size + PAGE_FRAME_SIZE - 1) & ~(PAGE_FRAME_SIZE - 1);
+
+    buddy_arenas[arena_idx].frames = NULL;
+    buddy_arenas[arena_idx].frame_base = aligned_base;
+    buddy_arenas[arena_idx].frame_count = 0;
+
+    if (meta_len + PAGE_FRAME_SIZE <= aligned_len) {
+        buddy_arenas[arena_idx].frames = phys_to_virt(aligned_base);
+        buddy_arenas[arena_idx].frame_count = frame_count;
+        memset(buddy_arenas[arena_idx].frames, 0, meta_size);
+
+        aligned_base += meta_len;
+        aligned_len -= meta_len;
+    }
     
     buddy_arenas[arena_idx].base = aligned_base;
     buddy_arenas[arena_idx].length = aligned_len;
+    buddy_arenas[arena_idx].zone = phys_to_zone(aligned_base);
+    buddy_arenas[arena_idx].node = phys_to_node(aligned_base);
     
     uint8_t max_order = 0;
     while (((1ULL << (max_order + 1)) * PAGE_FRAME_SIZE) <= aligned_len) {
@@ -97,9 +199,22 @@ void populate_buddy_blocks(uint8_t arena_idx){
     uint64_t current_addr = arena->base;
     uint64_t end_addr = arena->base + arena->length;
     uint8_t max_order = arena->max_arena_order;
+
+    // The contiguous area keeps its frame metadata but stays off the free 
+    // lists, blocks below it must not run into it
+    phys_addr cma_start, cma_end;
+    cma_range(&cma_start, &cma_end);
     
     while (current_addr < end_addr) {
-        uint64_t remaining = end_addr - current_addr;
+        if (current_addr >= cma_start && current_addr < cma_end) {
+            current_addr = cma_end;
+            continue;
+        }
+
+        uint64_t limit = end_addr;
+        if (current_addr < cma_start && cma_start < end_addr)
+            limit = cma_start;
+        uint64_t remaining = limit - current_addr;
         
         if (remaining < PAGE_FRAME_SIZE)
             break;
@@ -138,62 +253,95 @@ void populate_buddy_blocks(uint8_t arena_idx){
         block->next = arena->free_list[best_order];
         arena->free_list[best_order] = block;
         
+        account_free(arena, 1L << best_order);
+        nr_total_pages += 1UL << best_order;
+        zones[arena->zone].nr_total += 1UL << best_order;
         current_addr += block_size;
     }
 }
 
-uint64_t buddy_alloc_pages(uint8_t order){
-    if (order > MAX_SUPPORTED_ORDER)
-        return 0;
-    
-    for(int i = 0; i < buddy_arena_counter; i++){
-        struct buddy_arena *arena = &buddy_arenas[i];
+static uint64_t alloc_from_arena(struct buddy_arena *arena, uint8_t order){
+    // If we got a block of that order allocate it
+    // Otherwise we deal with splitting...
+    if(arena->free_list[order] != NULL){
+        // Get the block and unlink it
+        struct free_block *block = arena->free_list[order];
+        arena->free_list[order] = block->next;
+        account_free(arena, -(1L << order));
+        return block->phys_addr;
+    }
 
-        // If we got a block of that order allocate it
-        // Otherwise we deal with splitting...
-        if(arena->free_list[order] != NULL){
-            // Get the block and unlink it
-            struct free_block *block = arena->free_list[order];
-            arena->free_list[order] = block->next;
-            return block->phys_addr;
+    // Start with one order higher and if that exists split it into 2
+    // if not we go even higher to split that one and then we allocate 
+    // the appropriate one
+    for(int j = order + 1; j <= arena->max_arena_order; j++){
+        if(arena->free_list[j] == NULL)
+            continue;
+
+        // Unlink the block as we split it
+        struct free_block *block = arena->free_list[j];
+        arena->free_list[j] = block->next;
+  
+        // K = j - 1 as we try to get the appropriate order
+        // This handles the case if we went up 2 orders higher (or more) 
+        // instead of 1 - basically it just keeps on splitting until our
+        // asked order
+        uint64_t addr = block->phys_addr;
+        for(int k = j - 1; k >= order; --k){
+            // addr is the start of left buddy, we keep right buddy
+            // and continue splitting the left
+            uint64_t buddy_size = (1ULL << k) * PAGE_FRAME_SIZE;
+            uint64_t buddy_addr = addr + buddy_size; 
+            
+            struct free_block *buddy = (struct free_block*)phys_to_virt(buddy_addr);
+            buddy->current_order = k;
+            buddy->phys_addr = buddy_addr;
+            buddy->next = arena->free_list[k];
+            arena->free_list[k] = buddy;
         }
+        // left budy is now appropriate order and we 
+        // return its address 
+        account_free(arena, -(1L << order));
+        return addr;
+    } 
+    return 0;
+}
 
-        // Start with one order higher and if that exists split it into 2
-        // if not we go even higher to split that one and then we allocate 
-        // the appropriate one
-        for(int j = order + 1; j <= arena->max_arena_order; j++){
-            if(arena->free_list[j] == NULL)
+uint64_t buddy_alloc_pages_node(uint8_t order, enum zone_type zone, int node, uint64_t nodemask){
+    if (order > MAX_SUPPORTED_ORDER || zone >= MAX_NR_ZONES)
+        return 0;
+
+    for (int i = 0; i < nr_numa_nodes; i++) {
+        int n = numa_fallback_node(node, i);
+        if (!(nodemask & (1UL << n)))
+            continue;
+
+        for (int z = zone; z >= 0; z--) {
+            if ((uint64_t)atomic64_read(&zones[z].nr_free) < (1UL << order))
                 continue;
-    
-            // Unlink the block as we split it
-            struct free_block *block = arena->free_list[j];
-            arena->free_list[j] = block->next;
-  
-            // K = j - 1 as we try to get the appropriate order
-            // This handles the case if we went up 2 orders higher (or more) 
-            // instead of 1 - basically it just keeps on splitting until our
-            // asked order
-            uint64_t addr = block->phys_addr;
-            for(int k = j - 1; k >= order; --k){
-                // addr is the start of left buddy, we keep right buddy
-                // and continue splitting the left
-                uint64_t buddy_size = (1ULL << k) * PAGE_FRAME_SIZE;
-                uint64_t buddy_addr = addr + buddy_size; 
-                
-                struct free_block *buddy = (struct free_block*)phys_to_virt(buddy_addr);
-                buddy->current_order = k;
-                buddy->phys_addr = buddy_addr;
-                buddy->next = arena->free_list[k];
-                arena->free_list[k] = buddy;
+
+            for (int a = 0; a < buddy_arena_counter; a++) {
+                if (buddy_arenas[a].zone != z || buddy_arenas[a].node != n)
+                    continue;
+                uint64_t phys = alloc_from_arena(&buddy_arenas[a], order);
+                if (phys) {
+                    numa_count_alloc(n, node);
+                    return phys;
+                }
             }
-            // left budy is now appropriate order and we 
-            // return its address 
-            return addr;
-        } 
+        }
     }
     return 0;
 }
 
+uint64_t buddy_alloc_pages_zone(uint8_t order, enum zone_type zone){
+    return buddy_alloc_pages_node(order, zone, numa_node_id(), NUMA_ALL_NODES);
+}
+
+uint64_t buddy_alloc_pages(uint8_t order){
+    return buddy_alloc_pages_zone(order, ZONE_NORMAL);
+}
+
 void buddy_free_pages(uint64_t phys_addr, uint8_t order){
     // This should never happen ** I HOPE **
     if(order > MAX_SUPPORTED_ORDER){
@@ -217,6 +365,8 @@ void buddy_free_pages(uint64_t phys_addr, uint8_t order){
         return;
     }
 
+    account_free(arena, 1L << order);
+
     //kprintf("\nphys_addr: %lx\n", phys_addr);
     while(order < arena->max_arena_order){
 
@@ -273,6 +423,30 @@ void buddy_free_page(uint64_t phys_addr) {
     buddy_free_pages(phys_addr, 0);
 }
 
+struct page_frame *phys_to_frame(uint64_t phys_addr){
+    for(int i = 0; i < buddy_arena_counter; i++){
+        struct buddy_arena *arena = &buddy_arenas[i];
+        if(!arena->frames || phys_addr < arena->frame_base)
+            continue;
+
+        uint64_t idx = (phys_addr - arena->frame_base) / PAGE_FRAME_SIZE;
+        if(idx < arena->frame_count)
+            return &arena->frames[idx];
+    }
+    // MMIO, reserved memory or a tiny arena without metadata
+    return NULL;
+}
+
+uint64_t frame_to_phys(struct page_frame *frame){
+    for(int i = 0; i < buddy_arena_counter; i++){
+        struct buddy_arena *arena = &buddy_arenas[i];
+        if(arena->frames && frame >= arena->frames && 
+                frame < arena->frames + arena->frame_count)
+            return arena->frame_base + (uint64_t)(frame - arena->frames) * PAGE_FRAME_SIZE;
+    }
+    return 0;
+}
+
 
 
 
@@ -328,3 +502,10 @@ void print_arena_summary(uint8_t arena_idx) {
     uint64_t lost = arena->length - total_free_bytes;
     kprintf("     Difference (rounding/fragmentation): %lu bytes\n\n", lost);
 }
+
+void print_zone_summary(void) {
+    kprintf("Zones:\n");
+    for (int z = 0; z < MAX_NR_ZONES; z++)
+        kprintf("     %s: %lu of %lu pages free\n", zones[z].name,
+                atomic64_read(&zones[z].nr_free), zones[z].nr_total);
+}
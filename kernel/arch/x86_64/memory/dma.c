@@ -0,0 +1,57 @@
+#include <kernel/dma.h>
+#include <kernel/cma.h>
+#include <kernel/pmm.h>
+#include <kernel/vmm.h>
+#include <klib/string.h>
+
+static uint8_t size_to_order(uint64_t nr_pages){
+    uint8_t order = 0;
+    while ((1UL << order) < nr_pages)
+        order++;
+    return order;
+}
+
+void *dma_alloc_coherent(size_t size, phys_addr *dma_handle){
+    if (!size || !dma_handle)
+        return NULL;
+
+    uint64_t nr_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint8_t order = size_to_order(nr_pages);
+    phys_addr phys = 0;
+
+    // Aligned to its size like a buddy block would be, devices tend to 
+    // like that, but no more than the area itself is
+    if (nr_pages > 1) {
+        uint64_t align = 1UL << order;
+        if (align > CMA_ALIGN / PAGE_SIZE)
+            align = CMA_ALIGN / PAGE_SIZE;
+        phys = cma_alloc(nr_pages, align);
+    }
+    if (!phys && order <= MAX_SUPPORTED_ORDER)
+        phys = pmm_alloc_pages(order);
+    if (!phys) {
+        KERROR("No contiguous %lu pages for DMA\n", nr_pages);
+        return NULL;
+    }
+
+    void *vaddr = phys_to_virt(phys);
+    memset(vaddr, 0, nr_pages * PAGE_SIZE);
+    *dma_handle = phys;
+    return vaddr;
+}
+
+void dma_free_coherent(size_t size, void *vaddr, phys_addr dma_handle){
+    if (!vaddr)
+        return;
+
+    if (virt_to_phys(vaddr) != dma_handle) {
+        KERROR("dma_free_coherent: %p doesn't go with 0x%lx\n", vaddr, dma_handle);
+        return;
+    }
+
+    uint64_t nr_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (cma_contains(dma_handle))
+        cma_release(dma_handle, nr_pages);
+    else
+        pmm_put_page(dma_handle);
+}
@@ -0,0 +1,190 @@
+#include <kernel/ioremap.h>
+#include <kernel/pmm.h>
+#include <kernel/spinlock.h>
+#include <kernel/smp.h>
+#include <ds/lists.h>
+
+struct ioremap_area {
+    virt_addr start;
+    uint64_t size;          // Everything we reserved, mapped or not
+    virt_addr map_start;    // What's mapped, page aligned
+    virt_addr map_end;
+    struct list_node list;
+};
+
+// Sorted by start so finding a hole is one pass
+static struct list_node ioremap_areas = { &ioremap_areas, &ioremap_areas };
+static DEFINE_SPINLOCK(ioremap_lock);
+
+static const uint64_t ioremap_cache_bits[] = {
+    [IOREMAP_UC] = PTE_CACHE_DISABLE | PTE_WRITETHROUGH,
+    [IOREMAP_WC] = PTE_WRITETHROUGH,
+    [IOREMAP_WT] = PTE_CACHE_DISABLE,
+    [IOREMAP_WB] = 0,
+};
+
+void pat_init_cpu(void){
+    // Intel wants the caches flushed around a PAT change so nothing that 
+    // got cached under the old types survives it
+    __asm__ volatile("wbinvd" ::: "memory");
+    write_msr(IA32_PAT_MSR, PAT_LAYOUT);
+    __asm__ volatile("wbinvd" ::: "memory");
+    vmm_flush_tlb_all();
+}
+
+// First hole that fits, returns the area to insert in front of through 
+// before (the list head if it goes last). Caller holds ioremap_lock
+static virt_addr ioremap_find_range(uint64_t size, uint64_t align, 
+                                        struct list_node **before){
+    virt_addr candidate = IOREMAP_START;
+    struct list_node *node;
+
+    for (node = ioremap_areas.next; node != &ioremap_areas; node = node->next) {
+        struct ioremap_area *area = container_of(node, struct ioremap_area, list);
+        candidate = (candidate + align - 1) & ~(align - 1);
+        if (candidate + size <= area->start)
+            break;
+        candidate = area->start + area->size;
+    }
+
+    candidate = (candidate + align - 1) & ~(align - 1);
+    if (candidate + size > IOREMAP_END || candidate + size < candidate)
+        return 0;
+
+    *before = node;
+    return candidate;
+}
+
+// The entries are global so other CPUs keep them across CR3 switches, the
+// range can't go back to ioremap_find_range before everyone flushed it
+static void ioremap_clear(virt_addr start, virt_addr end){
+    struct addr_space *kernel_as = get_kernel_as();
+    virt_addr v = start;
+
+    while (v < end) {
+        page_table_entry *pde = vmm_walk_pd(kernel_as, v, false);
+        if (pde && (*pde & PTE_HUGE)) {
+            *pde = 0;
+            vmm_flush_tlb_single(v);
+            v += HUGE_PAGE_SIZE;
+            continue;
+        }
+
+        page_table_entry *pte = vmm_walk_page_table(kernel_as, v, false);
+        if (pte) {
+            *pte = 0;
+            vmm_flush_tlb_single(v);
+        }
+        v += PAGE_SIZE;
+    }
+
+    vmm_shootdown(NULL, cpu_online_mask(), start, end);
+}
+
+// virt and phys are congruent modulo 2MiB so whatever 2MiB aligned chunks
+// fit in the middle go in as huge pages
+static int ioremap_map(virt_addr virt, phys_addr phys, uint64_t size, uint64_t flags){
+    struct addr_space *kernel_as = get_kernel_as();
+    virt_addr v = virt;
+    phys_addr p = phys;
+    phys_addr end = phys + size;
+
+    while (p < end) {
+        if (!(p & ~HUGE_PAGE_MASK) && !(v & ~HUGE_PAGE_MASK) && end - p >= HUGE_PAGE_SIZE) {
+            page_table_entry *pde = vmm_walk_pd(kernel_as, v, true);
+            if (!pde)
+                goto fail;
+            *pde = p | flags | PTE_HUGE;
+            p += HUGE_PAGE_SIZE;
+            v += HUGE_PAGE_SIZE;
+            continue;
+        }
+
+        page_table_entry *pte = vmm_walk_page_table(kernel_as, v, true);
+        if (!pte)
+            goto fail;
+        *pte = p | flags;
+        p += PAGE_SIZE;
+        v += PAGE_SIZE;
+    }
+    return 0;
+
+fail:
+    ioremap_clear(virt, v);
+    return -1;
+}
+
+void *ioremap(phys_addr phys, size_t size, int attr){
+    if (!size || attr < IOREMAP_UC || attr > IOREMAP_WB)
+        return NULL;
+
+    phys_addr map_phys = vmm_page_align_down(phys);
+    uint64_t map_size = vmm_page_align_up(phys + size) - map_phys;
+
+    // Big enough for a huge page, start the reservation 2MiB aligned and 
+    // shift the mapping by phys's offset into its 2MiB page
+    uint64_t align = PAGE_SIZE;
+    uint64_t lead = 0;
+    if (map_size >= HUGE_PAGE_SIZE) {
+        align = HUGE_PAGE_SIZE;
+        lead = map_phys & ~HUGE_PAGE_MASK;
+    }
+
+    struct ioremap_area *area = kmalloc(sizeof(*area));
+    if (!area)
+        return NULL;
+
+    int_flags flags;
+    spinlock_lock_intsave(&ioremap_lock, &flags);
+
+    struct list_node *before;
+    virt_addr start = ioremap_find_range(lead + map_size, align, &before);
+    if (!start) {
+        spinlock_unlock_intrestore(&ioremap_lock, flags);
+        KERROR("ioremap: no room for %lx bytes\n", size);
+        kfree(area);
+        return NULL;
+    }
+
+    area->start = start;
+    area->size = lead + map_size;
+    area->map_start = start + lead;
+    area->map_end = area->map_start + map_size;
+    list_add(&area->list, before->prev, before);
+
+    uint64_t pte_flags = PTE_PRESENT | PTE_WRITABLE | PTE_GLOBAL | ioremap_cache_bits[attr];
+    if (ioremap_map(area->map_start, map_phys, map_size, pte_flags) != 0) {
+        list_del(&area->list);
+        spinlock_unlock_intrestore(&ioremap_lock, flags);
+        KERROR("ioremap: couldn't map %lx\n", phys);
+        kfree(area);
+        return NULL;
+    }
+
+    spinlock_unlock_intrestore(&ioremap_lock, flags);
+    return (void*)(area->map_start + (phys - map_phys));
+}
+
+void iounmap(void *addr){
+    virt_addr vaddr = (virt_addr)addr;
+    if (vaddr < IOREMAP_START || vaddr >= IOREMAP_END)
+        return;
+
+    int_flags flags;
+    spinlock_lock_intsave(&ioremap_lock, &flags);
+
+    for (struct list_node *node = ioremap_areas.next; node != &ioremap_areas; node = node->next) {
+        struct ioremap_area *area = container_of(node, struct ioremap_area, list);
+        if (vaddr < area->map_start || vaddr >= area->map_end)
+            continue;
+
+        ioremap_clear(area->map_start, area->map_end);
+        list_del(&area->list);
+        spinlock_unlock_intrestore(&ioremap_lock, flags);
+        kfree(area);
+        return;
+    }
+
+    spinlock_unlock_intrestore(&ioremap_lock, flags);
+    KWARN("iounmap: %p isn't mapped\n", addr);
+}
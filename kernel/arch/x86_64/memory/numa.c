@@ -0,0 +1,315 @@
+#include <kernel/numa.h>
+#include <kernel/acpi.h>
+#include <kernel/cmdline.h>
+#include <kernel/smp.h>
+#include <kernel/klogging.h>
+#include <klib/string.h>
+
+struct srat {
+    struct acpi_sdt_header header;
+    uint32_t reserved1;
+    uint64_t reserved2;
+    // Variable length entries follow
+} _packed;
+
+#define SRAT_CPU_AFFINITY       0
+#define SRAT_MEM_AFFINITY       1
+#define SRAT_X2APIC_AFFINITY    2
+
+#define SRAT_ENABLED            (1 << 0)
+
+struct srat_entry {
+    uint8_t type;
+    uint8_t length;
+} _packed;
+
+struct srat_cpu_affinity {
+    uint8_t type;
+    uint8_t length;
+    uint8_t proximity_lo;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t proximity_hi[3];
+    uint32_t clock_domain;
+} _packed;
+
+struct srat_mem_affinity {
+    uint8_t type;
+    uint8_t length;
+    uint32_t proximity;
+    uint16_t reserved1;
+    uint64_t base;
+    uint64_t size;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} _packed;
+
+struct srat_x2apic_affinity {
+    uint8_t type;
+    uint8_t length;
+    uint16_t reserved1;
+    uint32_t proximity;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} _packed;
+
+struct slit {
+    struct acpi_sdt_header header;
+    uint64_t localities;
+    uint8_t distances[];        // localities x localities, row is the source
+} _packed;
+
+struct numa_range {
+    uint64_t start;
+    uint64_t end;
+    int node;
+};
+
+int nr_numa_nodes = 1;
+struct numa_stats numa_stats[MAX_NUMA_NODES];
+
+static uint32_t node_pxm[MAX_NUMA_NODES];
+static struct numa_range ranges[NUMA_MAX_RANGES];
+static int nr_ranges = 0;
+
+// We only do xAPIC so ids fit in a byte, anything we don't know is node 0
+static uint8_t apic_node[256];
+DEFINE_PER_CPU(int, cpu_node);
+
+static uint8_t distances[MAX_NUMA_NODES][MAX_NUMA_NODES];
+// Every node's view of the others, closest first
+static uint8_t fallback[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
+static int pxm_to_node(uint32_t pxm){
+    for (int i = 0; i < nr_numa_nodes; i++) {
+        if (node_pxm[i] == pxm)
+            return i;
+    }
+    if (nr_numa_nodes == MAX_NUMA_NODES) {
+        KWARN("More than %d NUMA nodes, folding domain %u into node 0\n", 
+                                                    MAX_NUMA_NODES, pxm);
+        return 0;
+    }
+    node_pxm[nr_numa_nodes] = pxm;
+    return nr_numa_nodes++;
+}
+
+static void add_range(uint64_t start, uint64_t end, int node){
+    if (nr_ranges == NUMA_MAX_RANGES) {
+        KWARN("Too many SRAT memory ranges, 0x%lx - 0x%lx stays on node 0\n", start, end);
+        return;
+    }
+
+    // Kept sorted, there are only a handful of them
+    int i = nr_ranges;
+    while (i > 0 && ranges[i - 1].start > start) {
+        ranges[i] = ranges[i - 1];
+        i--;
+    }
+    ranges[i].start = start;
+    ranges[i].end = end;
+    ranges[i].node = node;
+    nr_ranges++;
+}
+
+// Whatever the firmware claims, we never read past the entry it gave us
+static size_t srat_entry_min_length(uint8_t type){
+    switch (type) {
+        case SRAT_CPU_AFFINITY:     return sizeof(struct srat_cpu_affinity);
+        case SRAT_MEM_AFFINITY:     return sizeof(struct srat_mem_affinity);
+        case SRAT_X2APIC_AFFINITY:  return sizeof(struct srat_x2apic_affinity);
+        default:                    return sizeof(struct srat_entry);
+    }
+}
+
+static void parse_srat(struct srat *srat){
+    uint8_t *ptr = (uint8_t*)(srat + 1);
+    uint8_t *end = (uint8_t*)srat + srat->header.length;
+
+    while (ptr + sizeof(struct srat_entry) <= end) {
+        struct srat_entry *entry = (struct srat_entry*)ptr;
+        if (entry->length < sizeof(*entry) || ptr + entry->length > end)
+            break;
+        if (entry->length < srat_entry_min_length(entry->type)) {
+            KWARN("SRAT entry of type %u is only %u bytes, skipping it\n", 
+                                                entry->type, entry->length);
+            ptr += entry->length;
+            continue;
+        }
+
+        if (entry->type == SRAT_CPU_AFFINITY) {
+            struct srat_cpu_affinity *cpu = (struct srat_cpu_affinity*)entry;
+            uint32_t pxm = cpu->proximity_lo | (uint32_t)cpu->proximity_hi[0] << 8 |
+                        (uint32_t)cpu->proximity_hi[1] << 16 | (uint32_t)cpu->proximity_hi[2] << 24;
+            if (cpu->flags & SRAT_ENABLED)
+                apic_node[cpu->apic_id] = pxm_to_node(pxm);
+        } else if (entry->type == SRAT_X2APIC_AFFINITY) {
+            struct srat_x2apic_affinity *cpu = (struct srat_x2apic_affinity*)entry;
+            if ((cpu->flags & SRAT_ENABLED) && cpu->x2apic_id < 256)
+                apic_node[cpu->x2apic_id] = pxm_to_node(cpu->proximity);
+        } else if (entry->type == SRAT_MEM_AFFINITY) {
+            struct srat_mem_affinity *mem = (struct srat_mem_affinity*)entry;
+            if ((mem->flags & SRAT_ENABLED) && mem->size)
+                add_range(mem->base, mem->base + mem->size, pxm_to_node(mem->proximity));
+        }
+
+        ptr += entry->length;
+    }
+}
+
+static int parse_slit(struct slit *slit){
+    // The matrix has to fit in what acpi_map_table mapped for us
+    uint64_t localities = slit->localities;
+    if (slit->header.length < sizeof(*slit) || (localities && 
+            localities > (slit->header.length - sizeof(*slit)) / localities)) {
+        KWARN("SLIT claims %lu localities but is only %u bytes, ignoring it\n",
+                                            localities, slit->header.length);
+        return -1;
+    }
+
+    for (int i = 0; i < nr_numa_nodes; i++) {
+        for (int j = 0; j < nr_numa_nodes; j++) {
+            if (node_pxm[i] >= slit->localities || node_pxm[j] >= slit->localities)
+                continue;
+            distances[i][j] = slit->distances[node_pxm[i] * slit->localities + node_pxm[j]];
+        }
+    }
+    return 0;
+}
+
+static void build_fallback_lists(void){
+    for (int n = 0; n < nr_numa_nodes; n++) {
+        bool used[MAX_NUMA_NODES] = { false };
+
+        // Selection sort, ties go to the lower id
+        for (int i = 0; i < nr_numa_nodes; i++) {
+            int best = -1;
+            for (int m = 0; m < nr_numa_nodes; m++) {
+                if (!used[m] && (best < 0 || distances[n][m] < distances[n][best]))
+                    best = m;
+            }
+            used[best] = true;
+            fallback[n][i] = best;
+        }
+    }
+}
+
+static void numa_reset(void){
+    nr_numa_nodes = 1;
+    nr_ranges = 0;
+    node_pxm[0] = 0;
+    for (int i = 0; i < 256; i++)
+        apic_node[i] = 0;
+}
+
+void numa_init(void){
+    for (int i = 0; i < MAX_NUMA_NODES; i++) {
+        for (int j = 0; j < MAX_NUMA_NODES; j++)
+            distances[i][j] = i == j ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+    }
+    numa_reset();
+    nr_numa_nodes = 0;
+
+    struct srat *srat = NULL;
+    const char *opt = cmdline_get("numa");
+    if (opt && strcmp(opt, "off") == 0)
+        kprintf("NUMA turned off on the command line\n");
+    else if (acpi_init() == 0)
+        srat = (struct srat*)acpi_find_table("SRAT");
+
+    if (srat)
+        parse_srat(srat);
+
+    // A SRAT that doesn't say where memory is doesn't help us
+    if (!nr_ranges) {
+        numa_reset();
+        build_fallback_lists();
+        kprintf("No NUMA information, all memory and CPUs are on node 0\n");
+        return;
+    }
+
+    struct slit *slit = (struct slit*)acpi_find_table("SLIT");
+    if (slit && parse_slit(slit) != 0)
+        slit = NULL;
+    build_fallback_lists();
+
+    KSUCCESS("Found %d NUMA node(s)%s\n", nr_numa_nodes, slit ? "" : ", no SLIT so distances are guessed");
+    for (int i = 0; i < nr_ranges; i++)
+        kprintf("     Node %d: 0x%lx - 0x%lx\n", ranges[i].node, ranges[i].start, ranges[i].end);
+}
+
+void numa_cpu_online(uint32_t cpu, uint32_t lapic_id){
+    if (cpu >= MAX_CORES)
+        return;
+    __percpu_cpu_node[cpu] = lapic_id < 256 ? apic_node[lapic_id] : 0;
+}
+
+int phys_to_node(uint64_t phys){
+    for (int i = 0; i < nr_ranges; i++) {
+        if (phys >= ranges[i].start && phys < ranges[i].end)
+            return ranges[i].node;
+    }
+    return 0;
+}
+
+uint64_t numa_range_end(uint64_t phys){
+    for (int i = 0; i < nr_ranges; i++) {
+        if (phys < ranges[i].start)
+            return ranges[i].start;
+        if (phys < ranges[i].end)
+            return ranges[i].end;
+    }
+    return UINT64_MAX;
+}
+
+int cpu_to_node(int cpu){
+    if (cpu < 0 || cpu >= MAX_CORES)
+        return 0;
+    return __percpu_cpu_node[cpu];
+}
+
+int numa_node_id(void){
+    return this_core_read(cpu_node);
+}
+
+int numa_distance(int from, int to){
+    return distances[from][to];
+}
+
+int numa_fallback_node(int node, int i){
+    return fallback[node][i];
+}
+
+void numa_count_alloc(int got, int wanted){
+    if (got == wanted)
+        atomic64_inc(&numa_stats[got].hit);
+    else
+        atomic64_inc(&numa_stats[got].miss);
+
+    if (got == numa_node_id())
+        atomic64_inc(&numa_stats[got].local);
+    else
+        atomic64_inc(&numa_stats[got].remote);
+}
+
+void numa_print_stats(void){
+    kprintf("NUMA:\n");
+    for (int n = 0; n < nr_numa_nodes; n++) {
+        kprintf("     Node %d: hit %lu miss %lu local %lu remote %lu\n", n,
+                atomic64_read(&numa_stats[n].hit), atomic64_read(&numa_stats[n].miss),
+                atomic64_read(&numa_stats[n].local), atomic64_read(&numa_stats[n].remote));
+        kprintf("         CPUs:");
+        for (int cpu = 0; cpu < total_cpus && cpu < MAX_CORES; cpu++) {
+            if (__percpu_cpu_node[cpu] == n)
+                kprintf(" %d", cpu);
+        }
+        kprintf("\n         Distances:");
+        for (int m = 0; m < nr_numa_nodes; m++)
+            kprintf(" %d", distances[n][m]);
+        kprintf("\n");
+    }
+}
@@ -1,9 +1,13 @@
 #include <kernel/pmm.h>
 #include <kernel/spinlock.h>
+#include <kernel/reclaim.h>
+#include <kernel/cma.h>
+#include <kernel/mempolicy.h>
 
 #define SLAB_THRESHOLD 2048  // Use slab for allocations <= 2KB
 
-static DEFINE_SPINLOCK(kmalloc_lock);
+// Alloc and free have to share it, slab and buddy state is touched by both
+static DEFINE_SPINLOCK(pmm_lock);
 
 void *kmalloc(size_t size) {
     if (!size) {
@@ -14,9 +18,9 @@ void *kmalloc(size_t size) {
     // Use slab allocator for small allocations
     if (size <= SLAB_THRESHOLD) {
         int_flags flags;
-        spinlock_lock_intsave(&kmalloc_lock, &flags);
+        spinlock_lock_intsave(&pmm_lock, &flags);
         void *ptr = slab_alloc_size(size);
-        spinlock_unlock_intrestore(&kmalloc_lock, flags);
+        spinlock_unlock_intrestore(&pmm_lock, flags);
 
         if (ptr) {
             return ptr;
@@ -42,9 +46,9 @@ void *kmalloc(size_t size) {
     }
     
     int_flags flags;
-    spinlock_lock_intsave(&kmalloc_lock, &flags);
+    spinlock_lock_intsave(&pmm_lock, &flags);
     uint64_t phys_addr = buddy_alloc_pages(order);
-    spinlock_unlock_intrestore(&kmalloc_lock, flags);
+    spinlock_unlock_intrestore(&pmm_lock, flags);
 
     if (phys_addr == 0) {
         KERROR("Buddy failed to allocate pages\n");
@@ -67,8 +71,6 @@ void *kmalloc(size_t size) {
     return (void *)start_of_data;
 }
 
-static DEFINE_SPINLOCK(kfree_lock);
-
 void kfree(void *ptr){
     if(!ptr){
         return;
@@ -82,9 +84,9 @@ void kfree(void *ptr){
             return;
         }   
         int_flags flags;
-        spinlock_lock_intsave(&kfree_lock, &flags);
+        spinlock_lock_intsave(&pmm_lock, &flags);
         slab_free(slab, ptr);
-        spinlock_unlock_intrestore(&kfree_lock, flags);
+        spinlock_unlock_intrestore(&pmm_lock, flags);
         return;
     }
 
@@ -123,22 +125,88 @@ void kfree(void *ptr){
     uint64_t phys_addr = virt_to_phys(header);
 
     int_flags flags;
-    spinlock_lock_intsave(&kfree_lock, &flags);
+    spinlock_lock_intsave(&pmm_lock, &flags);
     buddy_free_pages(phys_addr, header->order);
-    spinlock_unlock_intrestore(&kfree_lock, flags);
+    spinlock_unlock_intrestore(&pmm_lock, flags);
 }
 
 uint64_t pmm_alloc_page(void){
+    uint64_t nodemask;
+    int node = mempolicy_node(&nodemask);
+
     int_flags flags;
-    spinlock_lock_intsave(&kmalloc_lock, &flags);
-    uint64_t phys = buddy_alloc_page();
-    spinlock_unlock_intrestore(&kmalloc_lock, flags);
+    spinlock_lock_intsave(&pmm_lock, &flags);
+    uint64_t phys = buddy_alloc_pages_node(0, ZONE_NORMAL, node, nodemask);
+    spinlock_unlock_intrestore(&pmm_lock, flags);
+
+    struct page_frame *frame = phys_to_frame(phys);
+    if (phys && frame) {
+        atomic_set(&frame->refcount, 1);
+        frame->order = 0;
+    }
+    reclaim_check_watermarks();
+    return phys;
+}
+
+uint64_t pmm_alloc_pages(uint8_t order){
+    return pmm_alloc_pages_zone(order, ZONE_NORMAL);
+}
+
+uint64_t pmm_alloc_pages_zone(uint8_t order, enum zone_type zone){
+    uint64_t nodemask;
+    int node = mempolicy_node(&nodemask);
+
+    int_flags flags;
+    spinlock_lock_intsave(&pmm_lock, &flags);
+    uint64_t phys = buddy_alloc_pages_node(order, zone, node, nodemask);
+    spinlock_unlock_intrestore(&pmm_lock, flags);
+
+    struct page_frame *frame = phys_to_frame(phys);
+    if (phys && frame) {
+        atomic_set(&frame->refcount, 1);
+        frame->order = order;
+    }
+    reclaim_check_watermarks();
     return phys;
 }
 
 void pmm_free_page(uint64_t phys){
     int_flags flags;
-    spinlock_lock_intsave(&kfree_lock, &flags);
+    spinlock_lock_intsave(&pmm_lock, &flags);
     buddy_free_page(phys);
-    spinlock_unlock_intrestore(&kfree_lock, flags);
+    spinlock_unlock_intrestore(&pmm_lock, flags);
+}
+
+void pmm_get_page(uint64_t phys){
+    struct page_frame *frame = phys_to_frame(phys);
+    if (frame)
+        atomic_inc(&frame->refcount);
+}
+
+void pmm_put_page(uint64_t phys){
+    struct page_frame *frame = phys_to_frame(phys);
+    // Not RAM we manage (MMIO for example) so there's nothing to free
+    if (!frame)
+        return;
+
+    if (atomic_dec_and_test(&frame->refcount)) {
+        // LRU, reverse mapping and swap cache bits all go with the last user
+        page_frame_release(frame);
+
+        // Lent out of the contiguous area, it goes back there
+        if (cma_contains(phys)) {
+            cma_free_page(phys);
+            return;
+        }
+
+        int_flags flags;
+        spinlock_lock_intsave(&pmm_lock, &flags);
+        buddy_free_pages(phys, frame->order);
+        spinlock_unlock_intrestore(&pmm_lock, flags);
+    }
+}
+
+int pmm_page_refcount(uint64_t phys){
+    struct page_frame *frame = phys_to_frame(phys);
+    return frame ? atomic_read(&frame->refcount) : 0;
 }
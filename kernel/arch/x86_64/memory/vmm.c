@@ -1,5 +1,11 @@
 #include <kernel/vmm.h>
 #include <kernel/pmm.h>
+#include <kernel/swap.h>
+#include <kernel/reclaim.h>
+#include <kernel/smp.h>
+#include <kernel/ioremap.h>
+#include <kernel/idt_init.h>
+#include <kernel/apic.h>
 #include <klib/string.h>
 
 static struct page_table* current_pml4 = NULL;
@@ -7,6 +13,32 @@ static uint64_t hhdm_offset;
 
 static struct addr_space *kernel_as = NULL;
 
+// What each CPU has in CR3, so switching away can clear its cpu_mask bit,
+// and which TLB generation of it was current when we last flushed
+DEFINE_PER_CPU(struct addr_space*, loaded_as);
+DEFINE_PER_CPU(long, loaded_tlb_gen);
+
+struct tlb_stats tlb_stats;
+
+// One shootdown in flight at a time, the CPUs it's aimed at clear their
+// bit in ipi_sync_pending once they flushed
+static DEFINE_SPINLOCK(shootdown_lock);
+static struct {
+    struct addr_space *as;
+    virt_addr start;
+    virt_addr end;
+    bool tables;        // Page tables got freed, lazy CPUs have to leave too
+} shootdown;
+
+static void shootdown_cpus(struct addr_space *as, unsigned long cpus, 
+                        virt_addr start, virt_addr end, bool tables);
+
+extern void isr67(void);
+
+static bool as_is_loaded(struct addr_space *as){
+    return PTE_ADDR(get_cr3()) == (phys_addr)as->pml4 - hhdm_offset;
+}
+
 static struct page_table* get_current_pml4(void){
     if(!current_pml4){
         phys_addr cr3 = get_cr3();
@@ -26,15 +58,31 @@ void vmm_free_page_table(struct page_table *pt){
     pmm_free_page(phys);
 }
 
+// Frames mapped in user space are refcounted since fork can share them
+// so we drop our reference instead of freeing them outright
+static void free_pt_table(phys_addr pt_phys) {
+    struct page_table *pt = (struct page_table*)(pt_phys + hhdm_offset);
+
+    for (int i = 0; i < 512; i++) {
+        if (pt->entries[i] & PTE_PRESENT)
+            pmm_put_page(PTE_ADDR(pt->entries[i]));
+        else if (is_swap_pte(pt->entries[i]))
+            swap_entry_free(pt->entries[i]);
+    }
+
+    vmm_free_page_table(pt);
+}
+
 static void free_pd_table(phys_addr pd_phys) {
     struct page_table *pd = (struct page_table*)(pd_phys + hhdm_offset);
     
     for (int i = 0; i < 512; i++) {
-        if (pd->entries[i] & PTE_PRESENT) {
-            phys_addr pt_phys = PTE_ADDR(pd->entries[i]);
-            struct page_table *pt = (struct page_table*)(pt_phys + hhdm_offset);
-            vmm_free_page_table(pt);  
-        }
+        if (!(pd->entries[i] & PTE_PRESENT)) 
+            continue;
+        if (pd->entries[i] & PTE_HUGE)
+            pmm_put_page(PTE_ADDR(pd->entries[i]));
+        else
+            free_pt_table(PTE_ADDR(pd->entries[i]));
     }
     
     vmm_free_page_table(pd);
@@ -53,6 +101,50 @@ static void free_pdp_table(phys_addr pdp_phys) {
 }
 
 
+// Limine builds the HHDM and kernel image mappings for us but doesn't mark 
+// them global, without that every CR3 reload throws the kernel TLB entries away.
+// We only touch leaf entries since bit 8 isn't the global bit on the upper levels
+static void mark_kernel_half_global(struct page_table *pml4){
+    for (int i = 256; i < 512; i++) {
+        if (!(pml4->entries[i] & PTE_PRESENT))
+            continue;
+
+        struct page_table *pdp = (struct page_table*)(PTE_ADDR(pml4->entries[i]) + hhdm_offset);
+        for (int j = 0; j < 512; j++) {
+            if (!(pdp->entries[j] & PTE_PRESENT))
+                continue;
+            // 1GiB page
+            if (pdp->entries[j] & PTE_HUGE) {
+                pdp->entries[j] |= PTE_GLOBAL;
+                continue;
+            }
+
+            struct page_table *pd = (struct page_table*)(PTE_ADDR(pdp->entries[j]) + hhdm_offset);
+            for (int k = 0; k < 512; k++) {
+                if (!(pd->entries[k] & PTE_PRESENT))
+                    continue;
+                // 2MiB page
+                if (pd->entries[k] & PTE_HUGE) {
+                    pd->entries[k] |= PTE_GLOBAL;
+                    continue;
+                }
+
+                struct page_table *pt = (struct page_table*)(PTE_ADDR(pd->entries[k]) + hhdm_offset);
+                for (int l = 0; l < 512; l++) {
+                    if (pt->entries[l] & PTE_PRESENT)
+                        pt->entries[l] |= PTE_GLOBAL;
+                }
+            }
+        }
+    }
+}
+
+// Has to run on every CPU, page tables are shared but CR4 and the PAT are per CPU
+void vmm_init_cpu(void){
+    set_cr4(get_cr4() | CR4_PGE);
+    pat_init_cpu();
+}
+
 int vmm_init(void){
     hhdm_offset = get_hhdm_offset();
     current_pml4 = get_current_pml4();
@@ -71,6 +163,12 @@ int vmm_init(void){
     }
 
     kernel_as->pml4 = current_pml4;
+
+    create_gate_entry(VMM_SHOOTDOWN_VECTOR, isr67, 0x08, 0x8E);
+    vmm_init_cpu();
+    mark_kernel_half_global(kernel_as->pml4);
+    // Entries that were cached before we set the bit aren't global yet 
+    vmm_flush_tlb_all();
     
     return 0;
 }
@@ -108,6 +206,12 @@ void vmm_destroy_address_space(struct addr_space* as) {
         KERROR("Either tried to destroy kernel addr space or a NULL addr space\n");
         return;
     }
+
+    // A kernel task could still be borrowing it here or on any other CPU 
+    // that ran it last, everyone gets off before the tables go away
+    if (as_is_loaded(as))
+        vmm_switch_address_space(kernel_as);
+    shootdown_cpus(as, as->cpu_mask, 0, KERNEL_SPACE_START, true);
     
     for (int i = 0; i < 256; i++) {
         if (as->pml4->entries[i] & PTE_PRESENT) {
@@ -126,7 +230,151 @@ void vmm_switch_address_space(struct addr_space* as) {
         return;
     }
     phys_addr pml4_phys = (phys_addr)as->pml4 - hhdm_offset;
+
+    // A shootdown that makes us leave can't land halfway through
+    int_flags flags = save_and_disable_interrupts();
+    int cpu = get_current_core_id();
+    struct addr_space *prev = __percpu_loaded_as[cpu];
+
+    if (prev == as) {
+        // Back from a kernel task (or switching to ourselves). Clearing the
+        // lazy bit before reading the generation pairs with unmappers 
+        // bumping it before they look at as_active_cpus, one of us sees 
+        // the other (both are locked instructions)
+        atomic_clear_bit(cpu, &as->lazy_mask);
+        if (__percpu_loaded_tlb_gen[cpu] == atomic64_read(&as->tlb_gen)) {
+            atomic64_inc(&tlb_stats.cr3_skipped);
+            restore_interrupts(flags);
+            return;
+        }
+        atomic64_inc(&tlb_stats.stale_reloads);
+    } else {
+        // Set before the switch, cleared after, so the mask never claims 
+        // less than what is really loaded
+        atomic_set_bit(cpu, &as->cpu_mask);
+        __percpu_loaded_as[cpu] = as;
+    }
+
+    // Whatever gets bumped after this read gets caught on the next switch
+    long gen = atomic64_read(&as->tlb_gen);
     set_cr3(pml4_phys);
+    __percpu_loaded_tlb_gen[cpu] = gen;
+    atomic64_inc(&tlb_stats.cr3_writes);
+
+    if (prev && prev != as) {
+        atomic_clear_bit(cpu, &prev->lazy_mask);
+        atomic_clear_bit(cpu, &prev->cpu_mask);
+    }
+    restore_interrupts(flags);
+}
+
+// The kernel half is the same everywhere so the kernel task just runs on
+// top of whatever user address space was there. Its TLB entries stay but
+// get flushed before that address space runs user code again if anything
+// got unmapped in the meantime
+void vmm_enter_lazy_tlb(void){
+    int cpu = get_current_core_id();
+    struct addr_space *as = __percpu_loaded_as[cpu];
+    if (as && as != kernel_as)
+        atomic_set_bit(cpu, &as->lazy_mask);
+}
+
+void vmm_bump_tlb_gen(struct addr_space *as){
+    atomic64_inc(&as->tlb_gen);
+}
+
+// Called from the IPI and from anyone spinning in cpu_relax, the IPI may well
+// find its work already done
+void vmm_shootdown_poll(void){
+    int cpu = get_current_core_id();
+    if (!(ipi_sync_pending & (1UL << cpu)))
+        return;
+
+    // Lazy CPUs don't run user code on it, the generation catches stale
+    // leaf entries there. Freed page tables are another story, the CPU can
+    // still walk them speculatively through its paging structure caches 
+    // (setting accessed bits in whatever the frame became) so those CPUs
+    // switch to the kernel address space instead
+    struct addr_space *as = shootdown.as;
+    if (!as) {
+        vmm_flush_tlb_range(shootdown.start, shootdown.end);
+    } else if (__percpu_loaded_as[cpu] == as) {
+        if (!(as->lazy_mask & (1UL << cpu)))
+            vmm_flush_tlb_range(shootdown.start, shootdown.end);
+        else if (shootdown.tables)
+            vmm_switch_address_space(kernel_as);
+    }
+
+    atomic_clear_bit(cpu, &ipi_sync_pending);
+}
+
+static void shootdown_cpus(struct addr_space *as, unsigned long cpus, 
+                        virt_addr start, virt_addr end, bool tables){
+    int_flags flags = save_and_disable_interrupts();
+    cpus &= cpu_online_mask() & ~(1UL << get_current_core_id());
+    if (!cpus) {
+        restore_interrupts(flags);
+        return;
+    }
+
+    // Whoever holds it might be shooting at us, we answer while we spin
+    spinlock_lock(&shootdown_lock);
+    shootdown.as = as;
+    shootdown.start = start;
+    shootdown.end = end;
+    shootdown.tables = tables;
+    memory_barrier();
+    ipi_sync_pending = cpus;
+
+    for (int i = 0; i < MAX_CORES; i++) {
+        if (cpu_in_mask(i, cpus))
+            apic_send_ipi(cpu_to_lapic_id(i), VMM_SHOOTDOWN_VECTOR);
+    }
+    while (ipi_sync_pending)
+        cpu_pause();
+
+    spinlock_unlock(&shootdown_lock);
+    restore_interrupts(flags);
+    atomic64_inc(&tlb_stats.shootdowns);
+}
+
+void vmm_shootdown(struct addr_space *as, unsigned long cpus, 
+                            virt_addr start, virt_addr end){
+    shootdown_cpus(as, cpus, start, end, false);
+}
+
+// After the bump, anyone that comes back from lazy from here on reloads 
+// CR3 by itself (see vmm_switch_address_space). Unless page tables went 
+// away too, then lazy CPUs get the IPI as well
+static void flush_tlb_as(struct addr_space *as, virt_addr start, 
+                                    virt_addr end, bool tables){
+    long gen = atomic64_inc_return(&as->tlb_gen);
+
+    shootdown_cpus(as, tables ? as->cpu_mask : as_active_cpus(as), 
+                                                start, end, tables);
+
+    if (!as_is_loaded(as))
+        return;
+
+    vmm_flush_tlb_range(start, end);
+    // Our flush only covers our range, so we're only up to date if we were
+    // before the bump and nobody else bumped it since
+    int cpu = get_current_core_id();
+    if (__percpu_loaded_as[cpu] == as && __percpu_loaded_tlb_gen[cpu] == gen - 1 &&
+                                    atomic64_read(&as->tlb_gen) == gen)
+        __percpu_loaded_tlb_gen[cpu] = gen;
+}
+
+void vmm_flush_tlb_as(struct addr_space *as, virt_addr start, virt_addr end){
+    flush_tlb_as(as, start, end, false);
+}
+
+void vmm_print_tlb_stats(void){
+    kprintf("TLB:\n");
+    kprintf("     CR3 writes:     %lu\n", atomic64_read(&tlb_stats.cr3_writes));
+    kprintf("     CR3 skipped:    %lu\n", atomic64_read(&tlb_stats.cr3_skipped));
+    kprintf("     Stale reloads:  %lu\n", atomic64_read(&tlb_stats.stale_reloads));
+    kprintf("     Shootdowns:     %lu\n", atomic64_read(&tlb_stats.shootdowns));
 }
 
 struct page_table* vmm_alloc_page_table(void){
@@ -141,7 +389,10 @@ struct page_table* vmm_alloc_page_table(void){
 }
 
 
-page_table_entry* vmm_walk_page_table(struct addr_space *as, virt_addr vaddr, bool create) {
+// Level 0 is the PML4 entry and level 3 the PT entry, hit_level (if given)
+// tells at which level we actually stopped
+static page_table_entry* walk_to_level(struct addr_space *as, virt_addr vaddr, 
+                                    int target, bool create, int *hit_level) {
     if(!as || !as->pml4)
         return NULL;
 
@@ -159,10 +410,11 @@ page_table_entry* vmm_walk_page_table(struct addr_space *as, virt_addr vaddr, bo
         uint32_t idx = indices[level];
         page_table_entry* entry = &current->entries[idx];
         
-        if (level == 3) {
-            // Last level - return pointer to PTE
+        if (hit_level)
+            *hit_level = level;
+
+        if (level == target) 
             return entry;
-        }
         
         if (!(*entry & PTE_PRESENT)) {
             if (!create) 
@@ -176,6 +428,9 @@ page_table_entry* vmm_walk_page_table(struct addr_space *as, virt_addr vaddr, bo
             // hence why we always add PTE_USER
             phys_addr phys = (phys_addr)new_pt - hhdm_offset;
             *entry = phys | PTE_PRESENT | PTE_WRITABLE | PTE_USER;    
+        } else if (level > 0 && (*entry & PTE_HUGE)) {
+            // This entry maps memory itself, there is no next table
+            return entry;
         }
         
         // Move to next level
@@ -186,7 +441,123 @@ page_table_entry* vmm_walk_page_table(struct addr_space *as, virt_addr vaddr, bo
     return NULL; 
 }
 
-static int _vmm_map_page_no_flush(struct addr_space *as, virt_addr vaddr, 
+page_table_entry* vmm_walk_page_table(struct addr_space *as, virt_addr vaddr, bool create) {
+    return walk_to_level(as, vaddr, 3, create, NULL);
+}
+
+page_table_entry* vmm_walk_pd(struct addr_space *as, virt_addr vaddr, bool create) {
+    return walk_to_level(as, vaddr, 2, create, NULL);
+}
+
+int vmm_split_huge(struct addr_space *as, virt_addr vaddr) {
+    page_table_entry *pde = vmm_walk_pd(as, vaddr, false);
+    if (!pde || !(*pde & PTE_PRESENT) || !(*pde & PTE_HUGE))
+        return 0;
+
+    phys_addr head = PTE_ADDR(*pde);
+    uint64_t flags = PTE_FLAGS(*pde) & ~PTE_HUGE;
+
+    struct page_table *pt = vmm_alloc_page_table();
+    if (!pt)
+        return -1;
+
+    if (pmm_page_refcount(head) == 1) {
+        // Nobody else maps it so the block just becomes 512 ordinary frames
+        for (int i = 0; i < 512; i++) {
+            phys_addr phys = head + i * PAGE_SIZE;
+            struct page_frame *frame = phys_to_frame(phys);
+            if (frame) {
+                atomic_set(&frame->refcount, 1);
+                frame->order = 0;
+            }
+            rmap_inherit_huge(phys, head, i);
+            pt->entries[i] = phys | flags;
+        }
+    } else {
+        for (int i = 0; i < 512; i++) {
+            phys_addr phys = pmm_alloc_page();
+            if (!phys) {
+                for (int j = 0; j < i; j++)
+                    pmm_put_page(PTE_ADDR(pt->entries[j]));
+                vmm_free_page_table(pt);
+                return -1;
+            }
+            memcpy(phys_to_virt(phys), phys_to_virt(head + i * PAGE_SIZE), PAGE_SIZE);
+            rmap_inherit_huge(phys, head, i);
+            pt->entries[i] = phys | flags;
+        }
+        pmm_put_page(head);
+    }
+
+    *pde = ((phys_addr)pt - hhdm_offset) | PTE_PRESENT | PTE_WRITABLE | PTE_USER;
+
+    // A leaf turned into a table, invlpg isn't enough for the paging 
+    // structure caches here
+    vmm_flush_tlb_as(as, 0, KERNEL_SPACE_START);
+    return 0;
+}
+
+static page_table_entry protect_entry(page_table_entry entry, uint64_t flags,
+                                                                bool shared) {
+    page_table_entry new_entry = PTE_ADDR(entry) | PTE_PRESENT |
+        (entry & (PTE_COW | PTE_ACCESSED | PTE_DIRTY | PTE_HUGE)) |
+        (flags & (PTE_USER | PTE_NX));
+
+    if (flags & PTE_WRITABLE) {
+        if (entry & PTE_WRITABLE) {
+            new_entry |= PTE_WRITABLE;
+        } else if (shared) {
+            // Whatever its swap slot holds stops being a good copy
+            struct page_frame *frame = phys_to_frame(PTE_ADDR(entry));
+            if (frame)
+                atomic_clear_bit(PG_CLEAN, &frame->flags);
+            new_entry |= PTE_WRITABLE;
+        } else {
+            new_entry |= PTE_COW;
+        }
+    }
+    return new_entry;
+}
+
+int vmm_protect_range(struct addr_space *as, virt_addr start, virt_addr end, 
+                                                uint64_t flags, bool shared) {
+    if (!as || start >= end || end > KERNEL_SPACE_START)
+        return -1;
+
+    start = vmm_page_align_down(start);
+    end = vmm_page_align_up(end);
+
+    virt_addr va = start;
+    while (va < end) {
+        virt_addr huge_base = va & HUGE_PAGE_MASK;
+        page_table_entry *pde = vmm_walk_pd(as, va, false);
+
+        if (!pde || !(*pde & PTE_PRESENT)) {
+            va = huge_base + HUGE_PAGE_SIZE;
+            continue;
+        }
+
+        if (*pde & PTE_HUGE) {
+            if (huge_base >= start && huge_base + HUGE_PAGE_SIZE <= end) {
+                *pde = protect_entry(*pde, flags, shared);
+                va = huge_base + HUGE_PAGE_SIZE;
+                continue;
+            }
+            if (vmm_split_huge(as, va) != 0)
+                return -1;
+        }
+
+        page_table_entry *pte = vmm_walk_page_table(as, va, false);
+        if (pte && (*pte & PTE_PRESENT))
+            *pte = protect_entry(*pte, flags, shared);
+        va += PAGE_SIZE;
+    }
+
+    vmm_flush_tlb_as(as, start, end);
+    return 0;
+}
+
+int vmm_map_page_no_flush(struct addr_space *as, virt_addr vaddr, 
         phys_addr paddr, uint64_t flags){
 
     if(!as){
@@ -209,6 +580,9 @@ static int _vmm_map_page_no_flush(struct addr_space *as, virt_addr vaddr,
         return -1;
     }
 
+    if(vaddr >= KERNEL_SPACE_START)
+        flags |= PTE_GLOBAL;
+
     *pte = paddr | flags | PTE_PRESENT;
     as->total_pages++;
 
@@ -238,6 +612,9 @@ int vmm_map_page(struct addr_space *as, virt_addr vaddr,
         return -1;
     }
 
+    if(vaddr >= KERNEL_SPACE_START)
+        flags |= PTE_GLOBAL;
+
     *pte = paddr | flags | PTE_PRESENT;
     vmm_flush_tlb_single(vaddr);
     as->total_pages++;
@@ -263,13 +640,13 @@ int vmm_map_range(struct addr_space *as, virt_addr vaddr,
     phys_addr pstart = vmm_page_align_down(paddr);
 
     for (virt_addr v = vstart, p = pstart; v < vend; v += PAGE_SIZE, p += PAGE_SIZE) {
-    if (_vmm_map_page_no_flush(as, v, p, flags) != 0) {
+    if (vmm_map_page_no_flush(as, v, p, flags) != 0) {
             // Rollback on failure
             vmm_unmap_range(as, vstart, v - vstart);
             return -1;
         }
     }
-    vmm_flush_tlb();
+    vmm_flush_tlb_range(vstart, vend);
     return 0;
 }
 
@@ -317,18 +694,308 @@ int vmm_unmap_range(struct addr_space *as, virt_addr vaddr, size_t size) {
     for (virt_addr v = vstart; v < vend; v += PAGE_SIZE) {
         _vmm_unmap_page_no_flush(as, v);
     }
-    vmm_flush_tlb(); 
+    vmm_flush_tlb_range(vstart, vend);
     return 0;
 }
 
+void tlb_gather_init(struct tlb_gather *tlb, struct addr_space *as){
+    tlb->as = as;
+    tlb->start = ~0UL;
+    tlb->end = 0;
+    tlb->nr_frames = 0;
+    tlb->nr_tables = 0;
+}
+
+void tlb_gather_flush(struct tlb_gather *tlb){
+    if (tlb->start < tlb->end) {
+        // Freed page tables can sit in the paging structure caches, invlpg
+        // only drops those for the address it's given. Either way it's one
+        // shootdown for the whole batch
+        if (tlb->nr_tables)
+            flush_tlb_as(tlb->as, 0, KERNEL_SPACE_START, true);
+        else
+            flush_tlb_as(tlb->as, tlb->start, tlb->end, false);
+    }
+
+    for (int i = 0; i < tlb->nr_frames; i++)
+        pmm_put_page(tlb->frames[i]);
+    for (int i = 0; i < tlb->nr_tables; i++)
+        pmm_free_page(tlb->tables[i]);
+
+    tlb->start = ~0UL;
+    tlb->end = 0;
+    tlb->nr_frames = 0;
+    tlb->nr_tables = 0;
+}
+
+static void tlb_gather_range(struct tlb_gather *tlb, virt_addr start, virt_addr end){
+    if (start < tlb->start)
+        tlb->start = start;
+    if (end > tlb->end)
+        tlb->end = end;
+}
+
+void tlb_gather_frame(struct tlb_gather *tlb, virt_addr vaddr, phys_addr phys){
+    if (tlb->nr_frames == TLB_GATHER_BATCH)
+        tlb_gather_flush(tlb);
+    tlb_gather_range(tlb, vaddr, vaddr + PAGE_SIZE);
+    tlb->frames[tlb->nr_frames++] = phys;
+}
+
+void tlb_gather_table(struct tlb_gather *tlb, virt_addr start, 
+                                    virt_addr end, phys_addr phys){
+    if (tlb->nr_tables == TLB_GATHER_BATCH)
+        tlb_gather_flush(tlb);
+    tlb_gather_range(tlb, start, end);
+    tlb->tables[tlb->nr_tables++] = phys;
+}
+
+static bool table_is_empty(struct page_table *table){
+    for (int i = 0; i < 512; i++) {
+        if (table->entries[i])
+            return false;
+    }
+    return true;
+}
+
+// Same walk as copy_table_level, tables get checked on the way back up so 
+// anything the zap emptied goes away with it
+static uint64_t zap_table_level(struct tlb_gather *tlb, struct page_table *table,
+        int level, virt_addr base, virt_addr start, virt_addr end){
+
+    int shift = 39 - 9 * level;
+    uint64_t entry_span = 1UL << shift;
+    uint64_t zapped = 0;
+
+    uint32_t first = (start - base) >> shift;
+    uint32_t last = (end - 1 - base) >> shift;
+
+    for (uint32_t i = first; i <= last; i++) {
+        page_table_entry *entry = &table->entries[i];
+
+        // Swapped out pages only hold a slot, they aren't part of rss
+        if (level == 3 && is_swap_pte(*entry)) {
+            swap_entry_free(*entry);
+            *entry = 0;
+            continue;
+        }
+
+        if (!(*entry & PTE_PRESENT))
+            continue;
+
+        virt_addr entry_base = base + i * entry_span;
+
+        if (level == 3) {
+            tlb_gather_frame(tlb, entry_base, PTE_ADDR(*entry));
+            *entry = 0;
+            tlb->as->total_pages--;
+            zapped++;
+            continue;
+        }
+
+        if (level == 2 && (*entry & PTE_HUGE)) {
+            if (start <= entry_base && entry_base + entry_span <= end) {
+                tlb_gather_frame(tlb, entry_base, PTE_ADDR(*entry));
+                tlb_gather_range(tlb, entry_base, entry_base + entry_span);
+                *entry = 0;
+                tlb->as->total_pages -= 512;
+                zapped += 512;
+                continue;
+            }
+            // Only part of it goes away so it has to be split first
+            if (vmm_split_huge(tlb->as, entry_base) != 0) {
+                KERROR("Couldn't split huge page for a partial unmap\n");
+                continue;
+            }
+        }
+
+        virt_addr sub_start = start > entry_base ? start : entry_base;
+        virt_addr sub_end = end < entry_base + entry_span ? end : entry_base + entry_span;
+
+        struct page_table *next = (struct page_table*)(PTE_ADDR(*entry) + hhdm_offset);
+        zapped += zap_table_level(tlb, next, level + 1, entry_base, sub_start, sub_end);
+
+        if (table_is_empty(next)) {
+            tlb_gather_table(tlb, entry_base, entry_base + entry_span, PTE_ADDR(*entry));
+            *entry = 0;
+        }
+    }
+
+    return zapped;
+}
+
+uint64_t vmm_zap_range(struct tlb_gather *tlb, virt_addr start, virt_addr end){
+    if (!tlb || !tlb->as || start >= end)
+        return 0;
+
+    if (end > KERNEL_SPACE_START) {
+        KERROR("Tried to zap kernel half page tables\n");
+        return 0;
+    }
+
+    start = vmm_page_align_down(start);
+    end = vmm_page_align_up(end);
+
+    return zap_table_level(tlb, tlb->as->pml4, 0, 0, start, end);
+}
+
+// Same walk again but read only, fn gets the leaves and a non zero return 
+// stops everything right there
+static int walk_table_level(struct page_table *table, int level, virt_addr base, 
+            virt_addr start, virt_addr end, vmm_walk_fn fn, void *arg){
+
+    int shift = 39 - 9 * level;
+    uint64_t entry_span = 1UL << shift;
+
+    uint32_t first = (start - base) >> shift;
+    uint32_t last = (end - 1 - base) >> shift;
+
+    for (uint32_t i = first; i <= last; i++) {
+        page_table_entry *entry = &table->entries[i];
+        if (!(*entry & PTE_PRESENT))
+            continue;
+
+        virt_addr entry_base = base + i * entry_span;
+        int ret;
+
+        if (level == 3 || (level == 2 && (*entry & PTE_HUGE))) {
+            ret = fn(entry, entry_base, entry_span, arg);
+        } else {
+            virt_addr sub_start = start > entry_base ? start : entry_base;
+            virt_addr sub_end = end < entry_base + entry_span ? end : entry_base + entry_span;
+            struct page_table *next = (struct page_table*)(PTE_ADDR(*entry) + hhdm_offset);
+            ret = walk_table_level(next, level + 1, entry_base, sub_start, sub_end, fn, arg);
+        }
+
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
+
+int vmm_walk_range(struct addr_space *as, virt_addr start, virt_addr end, 
+                                                    vmm_walk_fn fn, void *arg){
+    if (!as || !fn || start >= end || end > KERNEL_SPACE_START)
+        return 0;
+
+    start = vmm_page_align_down(start);
+    end = vmm_page_align_up(end);
+
+    return walk_table_level(as->pml4, 0, 0, start, end, fn, arg);
+}
+
+static void copy_leaf_entry(page_table_entry *dst, page_table_entry *src, bool cow){
+    page_table_entry pte = *src;
+
+    // The child gets its own reference on the slot and faults it back in 
+    // through the swap cache, ending up on the same frame as the parent
+    if (is_swap_pte(pte)) {
+        swap_entry_dup(pte);
+        *dst = pte;
+        return;
+    }
+
+    if (!(pte & PTE_PRESENT)) {
+        *dst = 0;
+        return;
+    }
+
+    if (cow && (pte & PTE_WRITABLE)) {
+        pte = (pte & ~PTE_WRITABLE) | PTE_COW;
+        *src = pte;
+    }
+
+    pmm_get_page(PTE_ADDR(pte));
+    *dst = pte;
+}
+
+// We go down one level at a time and only over the indexes that [start, end)
+// covers, holes are skipped a whole table at a time and last level tables
+// are copied in one pass instead of walking from PML4 for every single page
+static int copy_table_level(struct addr_space *dst_as, struct page_table *dst, 
+        struct page_table *src, int level, virt_addr base, 
+        virt_addr start, virt_addr end, bool cow){
+
+    int shift = 39 - 9 * level;
+    uint64_t entry_span = 1UL << shift;
+
+    uint32_t first = (start - base) >> shift;
+    uint32_t last = (end - 1 - base) >> shift;
+
+    for (uint32_t i = first; i <= last; i++) {
+        if (level == 3 && is_swap_pte(src->entries[i])) {
+            copy_leaf_entry(&dst->entries[i], &src->entries[i], cow);
+            continue;
+        }
+
+        if (!(src->entries[i] & PTE_PRESENT))
+            continue;
+
+        // Huge PD entries are leaves too and get shared the same way
+        if (level == 3 || (level == 2 && (src->entries[i] & PTE_HUGE))) {
+            if (!(dst->entries[i] & PTE_PRESENT))
+                dst_as->total_pages += level == 3 ? 1 : 512;
+            copy_leaf_entry(&dst->entries[i], &src->entries[i], cow);
+            continue;
+        }
+
+        if (!(dst->entries[i] & PTE_PRESENT)) {
+            struct page_table *new_pt = vmm_alloc_page_table();
+            if (!new_pt)
+                return -1;
+            dst->entries[i] = ((phys_addr)new_pt - hhdm_offset) | PTE_FLAGS(src->entries[i]);
+        }
+
+        virt_addr entry_base = base + i * entry_span;
+        virt_addr sub_start = start > entry_base ? start : entry_base;
+        virt_addr sub_end = end < entry_base + entry_span ? end : entry_base + entry_span;
+
+        struct page_table *src_next = (struct page_table*)(PTE_ADDR(src->entries[i]) + hhdm_offset);
+        struct page_table *dst_next = (struct page_table*)(PTE_ADDR(dst->entries[i]) + hhdm_offset);
+
+        if (copy_table_level(dst_as, dst_next, src_next, level + 1, 
+                    entry_base, sub_start, sub_end, cow) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int vmm_copy_range(struct addr_space *dst, struct addr_space *src,
+        virt_addr start, virt_addr end, bool cow){
+
+    if (!dst || !src || start >= end) {
+        KERROR("Cannot copy page tables, NULL address space or empty range\n");
+        return -1;
+    }
+
+    if (end > KERNEL_SPACE_START) {
+        KERROR("Tried to copy kernel half page tables, those are shared anyway\n");
+        return -1;
+    }
+
+    start = vmm_page_align_down(start);
+    end = vmm_page_align_up(end);
+
+    return copy_table_level(dst, dst->pml4, src->pml4, 0, 0, start, end, cow);
+}
+
 phys_addr vmm_virt_to_phys(struct addr_space *as, virt_addr vaddr) {
     if(!as)
         return 0;
 
-    page_table_entry* pte = vmm_walk_page_table(as, vaddr, false);
+    int level;
+    page_table_entry* pte = walk_to_level(as, vaddr, 3, false, &level);
     if (!pte || !(*pte & PTE_PRESENT)) {
         return 0;
     }
+
+    // 1GiB pages on the PDP level, 2MiB ones on the PD level
+    if (level < 3) {
+        uint64_t page_mask = (1UL << (39 - 9 * level)) - 1;
+        return (PTE_ADDR(*pte) & ~page_mask) | (vaddr & page_mask);
+    }
     
     return PTE_ADDR(*pte) | PAGE_OFFSET(vaddr);
 }
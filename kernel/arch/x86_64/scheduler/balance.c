@@ -0,0 +1,254 @@
+#include <kernel/scheduler.h>
+#include <kernel/numa.h>
+#include <kernel/mempolicy.h>
+#include <kernel/memutils.h>
+#include <kernel/timer.h>
+#include <kernel/tick.h>
+#include <kernel/task_manager.h>
+
+static struct {
+    atomic64 migrations;
+    atomic64 passes;
+    atomic64 failed;        // Found an imbalance but had nothing it could move
+    atomic64 hot_skipped;   // Left alone because their cache was still warm
+} balance_stats;
+
+static uint64_t migration_cost;     // SCHED_MIGRATION_COST_US in TSC cycles
+static uint64_t last_report_tsc;
+static uint64_t last_report_migrations;
+
+void sched_balance_init(void){
+    migration_cost = tsc_cycles_per_ms() * SCHED_MIGRATION_COST_US / 1000;
+    last_report_tsc = read_tsc();
+    last_report_migrations = 0;
+}
+
+// Busiest by load on our own node first, its caches and memory are closer.
+// Anything less than a whole task of difference isn't worth a migration
+static int find_busiest_cpu(int this_cpu){
+    int cpus = total_cpus ? total_cpus : 1;
+    int this_node = cpu_to_node(this_cpu);
+    unsigned long this_load = sched_load(this_cpu);
+    int busiest = -1;
+
+    for (int pass = 0; pass < 2 && busiest < 0; pass++) {
+        unsigned long max = this_load;
+        for (int i = 0; i < cpus; i++) {
+            if (i == this_cpu || (pass == 0 && cpu_to_node(i) != this_node))
+                continue;
+            if (sched_cpu_isolated(i))
+                continue;
+            if (sched_nr_running(i) < 2)
+                continue;
+            unsigned long load = sched_load(i);
+            if (load > max) {
+                max = load;
+                busiest = i;
+            }
+        }
+    }
+    return busiest;
+}
+
+// Both runqueue locks held
+static bool can_migrate(struct runqueue *src, struct task *task, int dst_cpu,
+                                                        bool allow_hot){
+    // Running, or its CPU may still be on its stack
+    if (task == src->curr || task == src->prev)
+        return false;
+    if (!cpu_in_mask(dst_cpu, task->cpus_allowed))
+        return false;
+    if (!(mempolicy_cpu_nodes(task) & (1UL << cpu_to_node(dst_cpu))))
+        return false;
+
+    if (!allow_hot && task->last_ran && read_tsc() - task->last_ran < migration_cost) {
+        atomic64_inc(&balance_stats.hot_skipped);
+        return false;
+    }
+    return true;
+}
+
+static int migrate_tasks(struct runqueue *src, struct runqueue *dst, int dst_cpu,
+                                                        int max, bool allow_hot){
+    int moved = 0;
+    struct list_node *node = src->queued.next;
+
+    while (node != &src->queued && moved < max) {
+        struct task *task = container_of(node, struct task, rq_node);
+        node = node->next;
+
+        // Only while it makes things more even, moving more than half the
+        // difference would just have it bounce back on the next pass
+        if (src->load <= dst->load || 2 * task->weight > src->load - dst->load)
+            continue;
+        if (!can_migrate(src, task, dst_cpu, allow_hot))
+            continue;
+
+        dequeue_task(src, task);
+        task->cpu_id = dst_cpu;
+        enqueue_task(dst, task, false);
+        moved++;
+    }
+    return moved;
+}
+
+// Idle CPUs with their tick stopped don't balance by themselves, when we 
+// have more than we can run we wake one up and it pulls from whoever is 
+// busiest
+static void nohz_kick(int this_cpu){
+    int cpus = total_cpus ? total_cpus : 1;
+    for (int i = 0; i < cpus; i++) {
+        if (i != this_cpu && tick_stopped(i) && !sched_nr_running(i) &&
+                !sched_cpu_isolated(i)) {
+            sched_kick_cpu(i);
+            return;
+        }
+    }
+}
+
+void sched_balance(int cpu, bool idle){
+    // Only runs what got pinned to it, and nothing gets taken away either
+    if (sched_cpu_isolated(cpu))
+        return;
+
+    if (!idle && sched_nr_running(cpu) >= 2)
+        nohz_kick(cpu);
+
+    int busiest_cpu = find_busiest_cpu(cpu);
+    if (busiest_cpu < 0)
+        return;
+
+    struct runqueue *this_rq = &__percpu_runqueues[cpu];
+    struct runqueue *busiest = &__percpu_runqueues[busiest_cpu];
+    int moved = 0;
+
+    int_flags flags = save_and_disable_interrupts();
+    acquire_locks_ordered(&this_rq->lock, &busiest->lock);
+
+    // Things might have changed since we peeked
+    if (busiest->nr_running >= 2 && busiest->load > this_rq->load) {
+        int max = idle ? 1 : SCHED_BALANCE_MAX_MOVE;
+        bool allow_hot = this_rq->balance_failed >= SCHED_CACHE_NICE_TRIES;
+        moved = migrate_tasks(busiest, this_rq, cpu, max, allow_hot);
+
+        if (moved)
+            this_rq->balance_failed = 0;
+        else
+            this_rq->balance_failed++;
+    }
+
+    spinlock_unlock(&busiest->lock);
+    spinlock_unlock(&this_rq->lock);
+    restore_interrupts(flags);
+
+    atomic64_inc(&balance_stats.passes);
+    if (moved)
+        atomic64_add(moved, &balance_stats.migrations);
+    else
+        atomic64_inc(&balance_stats.failed);
+}
+
+static bool cpu_is_idle(int cpu){
+    struct runqueue *rq = &__percpu_runqueues[cpu];
+    return !sched_nr_running(cpu) && 
+           *(struct task * volatile *)&rq->curr == rq->idle;
+}
+
+// Would task start running right away if it got queued on cpu
+static bool rt_can_preempt(int cpu, struct task *task){
+    struct runqueue *rq = &__percpu_runqueues[cpu];
+    struct task *curr = *(struct task * volatile *)&rq->curr;
+    if (!curr || curr == rq->idle || curr->sched_class != &rt_sched_class)
+        return !rq->rt.throttled;
+    return task->rt_priority < curr->rt_priority;
+}
+
+// A cold cache costs a lot less than waiting behind another RT task, so 
+// an RT task goes wherever it gets the CPU first
+static int select_rt_cpu(struct task *task, int prev, bool prev_allowed){
+    if (prev_allowed && rt_can_preempt(prev, task))
+        return prev;
+
+    int cpus = total_cpus ? total_cpus : 1;
+    int fallback = -1;
+    for (int i = 0; i < cpus; i++) {
+        if (!cpu_in_mask(i, task->cpus_allowed))
+            continue;
+        if (cpu_is_idle(i))
+            return i;
+        if (fallback < 0 && rt_can_preempt(i, task))
+            fallback = i;
+    }
+    if (fallback >= 0)
+        return fallback;
+    return prev_allowed ? prev : find_least_busy_cpu(task);
+}
+
+// Lockless, it's only a guess and the balancer sorts out bad ones
+int sched_select_wake_cpu(struct task *task){
+    int prev = task->cpu_id;
+    uint64_t allowed = task->cpus_allowed;
+    bool prev_allowed = cpu_in_mask(prev, allowed);
+
+    if (task->sched_class == &rt_sched_class)
+        return select_rt_cpu(task, prev, prev_allowed);
+
+    if (prev_allowed && task->last_ran && read_tsc() - task->last_ran < migration_cost)
+        return prev;
+    if (prev_allowed && cpu_is_idle(prev))
+        return prev;
+
+    // Cold anyway, an idle CPU gets it running right away. Same node 
+    // first, then anywhere its memory policy allows
+    int cpus = total_cpus ? total_cpus : 1;
+    int prev_node = cpu_to_node(prev);
+    uint64_t nodes = mempolicy_cpu_nodes(task);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < cpus; i++) {
+            int node = cpu_to_node(i);
+            if (!cpu_in_mask(i, allowed) || !(nodes & (1UL << node)) || 
+                    (pass == 0 && node != prev_node))
+                continue;
+            if (cpu_is_idle(i))
+                return i;
+        }
+    }
+    // Its affinity changed while it slept
+    return prev_allowed ? prev : find_least_busy_cpu(task);
+}
+
+void sched_print_balance_stats(void){
+    int cpus = total_cpus ? total_cpus : 1;
+    int min_len = INT32_MAX, max_len = 0;
+    unsigned long min_load = UINT64_MAX, max_load = 0;
+
+    for (int i = 0; i < cpus; i++) {
+        int len = sched_nr_running(i);
+        unsigned long load = sched_load(i);
+        if (len < min_len)
+            min_len = len;
+        if (len > max_len)
+            max_len = len;
+        if (load < min_load)
+            min_load = load;
+        if (load > max_load)
+            max_load = load;
+    }
+
+    uint64_t now = read_tsc();
+    uint64_t ms = (now - last_report_tsc) / tsc_cycles_per_ms();
+    uint64_t migrations = atomic64_read(&balance_stats.migrations);
+    uint64_t per_sec = ms ? (migrations - last_report_migrations) * 1000 / ms : 0;
+    last_report_tsc = now;
+    last_report_migrations = migrations;
+
+    kprintf("Load balancing:\n");
+    kprintf("     Migrations:       %lu (%lu/s over the last %lu ms)\n", migrations, per_sec, ms);
+    kprintf("     Passes:           %lu, %lu moved nothing\n",
+            atomic64_read(&balance_stats.passes), atomic64_read(&balance_stats.failed));
+    kprintf("     Cache hot skips:  %lu\n", atomic64_read(&balance_stats.hot_skipped));
+    kprintf("     Runqueue length:  min %d, max %d, imbalance %d\n",
+            min_len, max_len, max_len - min_len);
+    kprintf("     Load:             min %lu, max %lu, imbalance %lu\n",
+            min_load, max_load, max_load - min_load);
+}
@@ -0,0 +1,107 @@
+#include <kernel/scheduler.h>
+#include <kernel/idt_init.h>
+#include <kernel/cmdline.h>
+#include <kernel/halt.h>
+#include <kernel/apic.h>
+#include <klib/string.h>
+
+// MWAIT wakes up on any write to the monitored line, so every CPU gets a
+// line of its own or neighbours would keep waking each other
+struct idle_state {
+    volatile uint32_t wake;         // The monitored word
+    volatile uint32_t polling;      // In MWAIT, a write to wake is all it takes
+} __attribute__((aligned(64)));
+
+static struct idle_state idle_states[MAX_CORES];
+static bool have_mwait;
+
+extern void isr65(void);
+extern void isr66(void);
+
+static bool cpu_has_mwait(void){
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return ecx & (1 << 3);
+}
+
+void sched_idle_init(void){
+    create_gate_entry(SCHED_RESCHED_VECTOR, isr65, 0x08, 0x8E);
+    create_gate_entry(SCHED_IPI_VECTOR, isr66, 0x08, 0x8E);
+
+    // KVM usually traps MWAIT, idle=halt is there for when that hurts
+    const char *idle = cmdline_get("idle");
+    have_mwait = cpu_has_mwait() && !(idle && !strcmp(idle, "halt"));
+    kprintf("Idle: %s\n", have_mwait ? "MWAIT on a per CPU wake flag" : "HLT");
+}
+
+// Whatever is running on this CPU right now becomes its idle task, the boot
+// stack is as good as any since idle never gives it back
+void sched_init_idle(int cpu){
+    struct task *idle = create_task();
+    if (!idle) {
+        KERROR("Couldn't allocate the idle task for CPU %d\n", cpu);
+        hcf();
+    }
+
+    idle->cpu_id = cpu;
+    idle->cpus_allowed = 1UL << cpu;
+    idle->priority = PRIO_IDLE;
+    idle->kernel_stack_base = NULL;
+
+    struct runqueue *rq = &__percpu_runqueues[cpu];
+    rq->idle = idle;
+    rq->curr = idle;
+    __percpu_current_task[cpu] = idle;
+}
+
+void sched_kick_cpu(int cpu){
+    struct idle_state *state = &idle_states[cpu];
+
+    // Harmless if it isn't waiting in MWAIT, it clears it before every wait.
+    // The fence pairs with the one in mwait_idle, either it sees the work 
+    // we queued or we see it polling
+    state->wake = 1;
+    memory_barrier();
+    if (!state->polling)
+        apic_send_ipi(cpu_to_lapic_id(cpu), SCHED_IPI_VECTOR);
+}
+
+// C1 only, deeper states can stop the local APIC timer
+static void mwait_idle(struct idle_state *state, int cpu){
+    state->wake = 0;
+    __asm__ __volatile__("monitor" : : "a"(&state->wake), "c"(0), "d"(0));
+    state->polling = 1;
+    memory_barrier();
+
+    // Anything queued after the monitor got armed writes wake and MWAIT
+    // falls straight through
+    if (!state->wake && !sched_nr_running(cpu))
+        __asm__ __volatile__("sti; mwait" : : "a"(0), "c"(0) : "memory");
+
+    state->polling = 0;
+}
+
+void cpu_idle(void){
+    int cpu = get_current_core_id();
+    struct idle_state *state = &idle_states[cpu];
+
+    while (1) {
+        // Kicked out of MWAIT, nobody sent the IPI that would have run these
+        sched_ttwu_pending();
+        if (sched_nr_running(cpu)) {
+            schedule();
+            continue;
+        }
+
+        // A CPU without a tick never balances on its own, so every time
+        // we wake up we look for work before going back to sleep
+        sched_balance(cpu, true);
+        if (sched_nr_running(cpu))
+            continue;
+
+        if (have_mwait)
+            mwait_idle(state, cpu);
+        else
+            __asm__ __volatile__("sti; hlt" : : : "memory");
+    }
+}
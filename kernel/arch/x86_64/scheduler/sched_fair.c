@@ -0,0 +1,228 @@
+#include <kernel/scheduler.h>
+#include <kernel/memutils.h>
+#include <kernel/timer.h>
+
+// Same table Linux uses for nice -20..19, every step is ~1.25x the weight
+// so a nice level is worth about 10% CPU against a neighbour
+static const unsigned long prio_to_weight[40] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+     9548,  7620,  6100,  4904,  3906,
+     3121,  2501,  1991,  1586,  1277,
+     1024,   820,   655,   526,   423,
+      335,   272,   215,   172,   137,
+      110,    87,    70,    56,    45,
+       36,    29,    23,    18,    15,
+};
+
+// In TSC cycles, filled in by init_rq
+static uint64_t sched_latency;
+static uint64_t min_granularity;
+static uint64_t wakeup_granularity;
+
+// Priorities 0..100 squeezed onto the 40 nice levels
+unsigned long sched_prio_to_weight(int prio){
+    if (prio < 0)
+        prio = 0;
+    if (prio > MAX_PRIO)
+        prio = MAX_PRIO;
+    return prio_to_weight[prio * 39 / MAX_PRIO];
+}
+
+static inline bool vruntime_before(uint64_t a, uint64_t b){
+    return (int64_t)(a - b) < 0;
+}
+
+static struct task *leftmost(struct fair_rq *frq){
+    struct rb_node *node = rb_first(&frq->tasks);
+    return node ? rb_entry(node, struct task, run_node) : NULL;
+}
+
+static void tree_insert(struct fair_rq *frq, struct task *task){
+    struct rb_node **link = &frq->tasks.node;
+    struct rb_node *parent = NULL;
+
+    // Equal keys go right so tasks with the same vruntime run in FIFO order
+    while (*link) {
+        parent = *link;
+        struct task *entry = rb_entry(parent, struct task, run_node);
+        if (vruntime_before(task->vruntime, entry->vruntime))
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+
+    rb_link_node(&task->run_node, parent, link);
+    rb_insert_color(&task->run_node, &frq->tasks, NULL);
+}
+
+static void update_min_vruntime(struct fair_rq *frq){
+    struct task *left = leftmost(frq);
+    uint64_t vruntime = frq->min_vruntime;
+
+    if (frq->curr)
+        vruntime = frq->curr->vruntime;
+    if (left && (!frq->curr || vruntime_before(left->vruntime, vruntime)))
+        vruntime = left->vruntime;
+
+    if (vruntime_before(frq->min_vruntime, vruntime))
+        frq->min_vruntime = vruntime;
+}
+
+// Charges curr for the time since we last looked
+static void update_curr(struct fair_rq *frq){
+    struct task *curr = frq->curr;
+    if (!curr)
+        return;
+
+    uint64_t now = read_tsc();
+    uint64_t delta = now - curr->exec_start;
+    curr->exec_start = now;
+
+    curr->sum_exec += delta;
+    curr->vruntime += delta * NICE_0_WEIGHT / curr->weight;
+    update_min_vruntime(frq);
+}
+
+// Its share of the latency period, by weight
+static uint64_t sched_slice(struct fair_rq *frq, struct task *task){
+    uint64_t period = sched_latency;
+    // Too many tasks to give each min_granularity, stretch the period
+    if ((uint64_t)frq->nr_running * min_granularity > period)
+        period = frq->nr_running * min_granularity;
+    return period * task->weight / frq->load;
+}
+
+static void fair_init_rq(struct runqueue *rq){
+    uint64_t per_ms = tsc_cycles_per_ms();
+    sched_latency = SCHED_LATENCY_MS * per_ms;
+    min_granularity = SCHED_MIN_GRANULARITY_MS * per_ms;
+    wakeup_granularity = SCHED_WAKEUP_GRANULARITY_MS * per_ms;
+
+    rb_root_init(&rq->fair.tasks);
+    rq->fair.curr = NULL;
+    rq->fair.min_vruntime = 0;
+    rq->fair.load = 0;
+    rq->fair.nr_running = 0;
+    rq->fair.skip = NULL;
+}
+
+static void fair_enqueue(struct runqueue *rq, struct task *task, bool wakeup){
+    struct fair_rq *frq = &rq->fair;
+    update_curr(frq);
+
+    // Off the runqueue vruntime is kept relative to min_vruntime so it means
+    // the same thing on whichever CPU the task lands on next. A new task 
+    // starts right at min_vruntime so forking can't be used to jump the 
+    // queue, a sleeper gets half a latency period of credit, more than that
+    // and it could hog the CPU after a long sleep
+    task->vruntime += frq->min_vruntime;
+    if (wakeup) {
+        uint64_t floor = frq->min_vruntime - sched_latency / 2;
+        if (vruntime_before(task->vruntime, floor))
+            task->vruntime = floor;
+    }
+
+    frq->load += task->weight;
+    frq->nr_running++;
+    tree_insert(frq, task);
+}
+
+static void fair_dequeue(struct runqueue *rq, struct task *task){
+    struct fair_rq *frq = &rq->fair;
+    update_curr(frq);
+
+    if (frq->skip == task)
+        frq->skip = NULL;
+    if (frq->curr == task)
+        frq->curr = NULL;
+    else
+        rb_erase(&task->run_node, &frq->tasks, NULL);
+
+    frq->load -= task->weight;
+    frq->nr_running--;
+    update_min_vruntime(frq);
+    task->vruntime -= frq->min_vruntime;
+}
+
+static struct task *fair_pick_next(struct runqueue *rq){
+    struct fair_rq *frq = &rq->fair;
+    struct task *next = leftmost(frq);
+    if (!next)
+        return NULL;
+
+    // Whoever yielded goes after the next one in line, without touching
+    // its vruntime
+    if (next == frq->skip) {
+        struct rb_node *second = rb_next(&next->run_node);
+        if (second)
+            next = rb_entry(second, struct task, run_node);
+    }
+    frq->skip = NULL;
+
+    // The running task is kept out of the tree, its key keeps changing
+    rb_erase(&next->run_node, &frq->tasks, NULL);
+    frq->curr = next;
+    next->exec_start = read_tsc();
+    next->prev_sum_exec = next->sum_exec;
+    return next;
+}
+
+static void fair_put_prev(struct runqueue *rq, struct task *prev){
+    struct fair_rq *frq = &rq->fair;
+    if (frq->curr != prev)
+        return;
+
+    update_curr(frq);
+    tree_insert(frq, prev);
+    frq->curr = NULL;
+}
+
+// Instead of a switch every tick, curr keeps going until it had its slice
+// or got too far ahead of the leftmost task
+static void fair_tick(struct runqueue *rq, struct task *curr){
+    struct fair_rq *frq = &rq->fair;
+    if (frq->curr != curr)
+        return;
+
+    update_curr(frq);
+
+    uint64_t ran = curr->sum_exec - curr->prev_sum_exec;
+    uint64_t ideal = sched_slice(frq, curr);
+    if (ran > ideal) {
+        rq->need_resched = true;
+        return;
+    }
+    if (ran < min_granularity)
+        return;
+
+    struct task *left = leftmost(frq);
+    if (left && (int64_t)(curr->vruntime - left->vruntime) > (int64_t)ideal)
+        rq->need_resched = true;
+}
+
+static void fair_check_preempt(struct runqueue *rq, struct task *task){
+    struct fair_rq *frq = &rq->fair;
+    if (!frq->curr)
+        return;
+
+    update_curr(frq);
+    if ((int64_t)(frq->curr->vruntime - task->vruntime) > (int64_t)wakeup_granularity)
+        rq->need_resched = true;
+}
+
+static void fair_yield(struct runqueue *rq, struct task *curr){
+    rq->fair.skip = curr;
+}
+
+const struct sched_class fair_sched_class = {
+    .name = "fair",
+    .init_rq = fair_init_rq,
+    .enqueue = fair_enqueue,
+    .dequeue = fair_dequeue,
+    .pick_next = fair_pick_next,
+    .put_prev = fair_put_prev,
+    .tick = fair_tick,
+    .check_preempt = fair_check_preempt,
+    .yield = fair_yield,
+};
@@ -0,0 +1,126 @@
+#include <kernel/scheduler.h>
+
+// Linear from SCHED_MAX_TIMESLICE at priority 0 down to the min at MAX_PRIO
+int sched_timeslice(int priority){
+    if (priority < 0)
+        priority = 0;
+    if (priority > MAX_PRIO)
+        priority = MAX_PRIO;
+    return SCHED_MIN_TIMESLICE + 
+        (SCHED_MAX_TIMESLICE - SCHED_MIN_TIMESLICE) * (MAX_PRIO - priority) / MAX_PRIO;
+}
+
+static void prio_array_init(struct prio_array *array){
+    for (int i = 0; i < SCHED_BITMAP_WORDS; i++)
+        array->bitmap[i] = 0;
+    for (int i = 0; i < SCHED_NR_PRIO; i++)
+        list_init(&array->queues[i]);
+    array->nr_active = 0;
+}
+
+static void array_add(struct task *task, struct prio_array *array){
+    int prio = task->priority;
+    list_add_tail(&task->tasks_runnable, &array->queues[prio]);
+    array->bitmap[prio / 64] |= 1UL << (prio % 64);
+    array->nr_active++;
+    task->array = array;
+}
+
+static void array_del(struct task *task){
+    struct prio_array *array = task->array;
+    int prio = task->priority;
+
+    list_del(&task->tasks_runnable);
+    if (list_empty(&array->queues[prio]))
+        array->bitmap[prio / 64] &= ~(1UL << (prio % 64));
+    array->nr_active--;
+    task->array = NULL;
+}
+
+static int first_prio(struct prio_array *array){
+    for (int i = 0; i < SCHED_BITMAP_WORDS; i++) {
+        if (array->bitmap[i])
+            return i * 64 + __builtin_ctzl(array->bitmap[i]);
+    }
+    return -1;
+}
+
+static void prio_init_rq(struct runqueue *rq){
+    prio_array_init(&rq->prio.arrays[0]);
+    prio_array_init(&rq->prio.arrays[1]);
+    rq->prio.active = &rq->prio.arrays[0];
+    rq->prio.expired = &rq->prio.arrays[1];
+}
+
+static void prio_enqueue(struct runqueue *rq, struct task *task, bool wakeup){
+    (void)wakeup;
+    if (task->priority < 0 || task->priority > MAX_PRIO)
+        task->priority = PRIO_DEFAULT;
+    if (task->time_slice <= 0)
+        task->time_slice = sched_timeslice(task->priority);
+    array_add(task, rq->prio.active);
+}
+
+static void prio_dequeue(struct runqueue *rq, struct task *task){
+    (void)rq;
+    array_del(task);
+}
+
+// Current stays queued while it runs, at the head of its level since 
+// everyone else got added behind it
+static struct task *prio_pick_next(struct runqueue *rq){
+    struct prio_rq *prq = &rq->prio;
+
+    // Everybody had their turn, start the next round
+    if (!prq->active->nr_active) {
+        struct prio_array *tmp = prq->active;
+        prq->active = prq->expired;
+        prq->expired = tmp;
+    }
+
+    int prio = first_prio(prq->active);
+    if (prio < 0)
+        return NULL;
+    return container_of(prq->active->queues[prio].next, struct task, tasks_runnable);
+}
+
+static void prio_put_prev(struct runqueue *rq, struct task *prev){
+    (void)rq;
+    (void)prev;
+}
+
+// Slice used up, it waits in expired until everyone else had a go
+static void prio_tick(struct runqueue *rq, struct task *curr){
+    if (curr->array != rq->prio.active || --curr->time_slice > 0)
+        return;
+
+    array_del(curr);
+    curr->time_slice = sched_timeslice(curr->priority);
+    array_add(curr, rq->prio.expired);
+    rq->need_resched = true;
+}
+
+static void prio_check_preempt(struct runqueue *rq, struct task *task){
+    if (rq->curr && task->priority < rq->curr->priority)
+        rq->need_resched = true;
+}
+
+// Back of its level, the rest of the level goes first
+static void prio_yield(struct runqueue *rq, struct task *curr){
+    (void)rq;
+    struct prio_array *array = curr->array;
+    array_del(curr);
+    array_add(curr, array);
+}
+
+const struct sched_class prio_sched_class = {
+    .name = "prio",
+    .init_rq = prio_init_rq,
+    .enqueue = prio_enqueue,
+    .dequeue = prio_dequeue,
+    .pick_next = prio_pick_next,
+    .put_prev = prio_put_prev,
+    .tick = prio_tick,
+    .check_preempt = prio_check_preempt,
+    .yield = prio_yield,
+};
@@ -0,0 +1,170 @@
+#include <kernel/scheduler.h>
+#include <kernel/ktimer.h>
+#include <kernel/memutils.h>
+#include <kernel/timer.h>
+
+// In TSC cycles, filled in by init_rq
+static uint64_t rt_period;
+static uint64_t rt_runtime;
+
+static void rt_queue_add(struct prio_array *queue, struct task *task){
+    int prio = task->rt_priority;
+    list_add_tail(&task->tasks_runnable, &queue->queues[prio]);
+    queue->bitmap[prio / 64] |= 1UL << (prio % 64);
+    queue->nr_active++;
+}
+
+static void rt_queue_del(struct prio_array *queue, struct task *task){
+    int prio = task->rt_priority;
+    list_del(&task->tasks_runnable);
+    if (list_empty(&queue->queues[prio]))
+        queue->bitmap[prio / 64] &= ~(1UL << (prio % 64));
+    queue->nr_active--;
+}
+
+static struct task *rt_queue_first(struct prio_array *queue){
+    for (int i = 0; i < SCHED_BITMAP_WORDS; i++) {
+        if (queue->bitmap[i]) {
+            int prio = i * 64 + __builtin_ctzl(queue->bitmap[i]);
+            return container_of(queue->queues[prio].next, struct task, tasks_runnable);
+        }
+    }
+    return NULL;
+}
+
+// Period is over, RT tasks may run again. From the timer interrupt on the
+// CPU that throttled, which isn't necessarily the runqueue's own
+static void rt_unthrottle(struct ktimer *timer){
+    struct runqueue *rq = timer->data;
+    int cpu = rq - __percpu_runqueues;
+    bool kick;
+
+    spinlock_lock(&rq->lock);
+    rq->rt.throttled = false;
+    rq->rt.time = 0;
+    rq->rt.period_start = read_tsc();
+    kick = rq->rt.queue.nr_active != 0;
+    if (kick)
+        rq->need_resched = true;
+    spinlock_unlock(&rq->lock);
+
+    if (kick && cpu != (int)get_current_core_id())
+        sched_kick_cpu(cpu);
+}
+
+// Charges curr and the runqueue's RT budget for the time since we last 
+// looked. Once RT tasks used up SCHED_RT_RUNTIME_MS of the period they 
+// are all off until it ends, whatever else is queued gets the rest
+static void update_curr(struct runqueue *rq, struct task *curr){
+    struct rt_rq *rt = &rq->rt;
+    uint64_t now = read_tsc();
+    uint64_t delta = now - curr->exec_start;
+    curr->exec_start = now;
+    curr->sum_exec += delta;
+
+    if (now - rt->period_start >= rt_period) {
+        rt->period_start = now;
+        rt->time = 0;
+    }
+    rt->time += delta;
+
+    if (!rt->throttled && rt->time > rt_runtime) {
+        rt->throttled = true;
+        rt->throttle_count++;
+        rq->need_resched = true;
+        ktimer_arm(&rt->unthrottle, rt->period_start + rt_period);
+    }
+}
+
+static void rt_init_rq(struct runqueue *rq){
+    uint64_t per_ms = tsc_cycles_per_ms();
+    rt_period = SCHED_RT_PERIOD_MS * per_ms;
+    rt_runtime = SCHED_RT_RUNTIME_MS * per_ms;
+
+    struct prio_array *queue = &rq->rt.queue;
+    for (int i = 0; i < SCHED_BITMAP_WORDS; i++)
+        queue->bitmap[i] = 0;
+    for (int i = 0; i < SCHED_NR_PRIO; i++)
+        list_init(&queue->queues[i]);
+    queue->nr_active = 0;
+
+    rq->rt.time = 0;
+    rq->rt.period_start = 0;
+    rq->rt.throttled = false;
+    rq->rt.throttle_count = 0;
+    ktimer_init(&rq->rt.unthrottle, rt_unthrottle, rq);
+}
+
+// Waking up or not, to the back of its level. FIFO tasks behind one of the
+// same priority wait until it sleeps or yields
+static void rt_enqueue(struct runqueue *rq, struct task *task, bool wakeup){
+    (void)wakeup;
+    if (task->rt_priority < 0 || task->rt_priority > MAX_PRIO)
+        task->rt_priority = MAX_PRIO;
+    if (task->policy == SCHED_RR && task->time_slice <= 0)
+        task->time_slice = SCHED_RR_TIMESLICE;
+    // Switched over from another class while running
+    if (task == rq->curr)
+        task->exec_start = read_tsc();
+    rt_queue_add(&rq->rt.queue, task);
+}
+
+static void rt_dequeue(struct runqueue *rq, struct task *task){
+    if (task == rq->curr)
+        update_curr(rq, task);
+    rt_queue_del(&rq->rt.queue, task);
+}
+
+// Current stays queued while it runs, like in the prio class
+static struct task *rt_pick_next(struct runqueue *rq){
+    if (rq->rt.throttled)
+        return NULL;
+
+    struct task *next = rt_queue_first(&rq->rt.queue);
+    if (next)
+        next->exec_start = read_tsc();
+    return next;
+}
+
+static void rt_put_prev(struct runqueue *rq, struct task *prev){
+    update_curr(rq, prev);
+}
+
+// FIFO runs until something more important shows up, RR also hands over 
+// to the rest of its level every SCHED_RR_TIMESLICE ticks
+static void rt_tick(struct runqueue *rq, struct task *curr){
+    update_curr(rq, curr);
+
+    if (curr->policy != SCHED_RR || --curr->time_slice > 0)
+        return;
+
+    curr->time_slice = SCHED_RR_TIMESLICE;
+    struct list_node *level = &rq->rt.queue.queues[curr->rt_priority];
+    if (level->next != level->prev) {
+        rt_queue_del(&rq->rt.queue, curr);
+        rt_queue_add(&rq->rt.queue, curr);
+        rq->need_resched = true;
+    }
+}
+
+static void rt_check_preempt(struct runqueue *rq, struct task *task){
+    if (rq->curr && task->rt_priority < rq->curr->rt_priority)
+        rq->need_resched = true;
+}
+
+static void rt_yield(struct runqueue *rq, struct task *curr){
+    rt_queue_del(&rq->rt.queue, curr);
+    rt_queue_add(&rq->rt.queue, curr);
+}
+
+const struct sched_class rt_sched_class = {
+    .name = "rt",
+    .init_rq = rt_init_rq,
+    .enqueue = rt_enqueue,
+    .dequeue = rt_dequeue,
+    .pick_next = rt_pick_next,
+    .put_prev = rt_put_prev,
+    .tick = rt_tick,
+    .check_preempt = rt_check_preempt,
+    .yield = rt_yield,
+};
@@ -1,96 +1,838 @@
 #include <kernel/scheduler.h>
 #include <kernel/smp.h>
 #include <kernel/spinlock.h>
+#include <kernel/memutils.h>
+#include <kernel/pmm.h>
+#include <kernel/cmdline.h>
+#include <kernel/tick.h>
+#include <kernel/ktimer.h>
+#include <kernel/timer.h>
+#include <kernel/task_manager.h>
+#include <kernel/isr_handler.h>
+#include <kernel/apic.h>
+#include <klib/string.h>
 
 struct list_node all_tasks; 
+uint64_t sched_isolated_cpus;
 
 DEFINE_PER_CPU_GLOBAL(struct task*, current_task);
-DEFINE_PER_CPU_GLOBAL(struct list_node, cpu_runqueue);
-DEFINE_PER_CPU(spinlock, runqueue_lock);
+DEFINE_PER_CPU_GLOBAL(struct runqueue, runqueues);
+// Tasks woken from interrupts, pushed from any CPU without locking and 
+// linked through wake_next. Only the owning CPU takes them off
+DEFINE_PER_CPU(atomic64, wake_lists);
+
+static struct {
+    atomic64 wakeups;
+    atomic64 queued;        // Went through a wake list
+    atomic64 kicks;         // Target CPU had to be interrupted or woken
+} wake_stats;
+
+// In the order they get asked for a task
+static const struct sched_class *sched_classes[] = {
+    &rt_sched_class,
+    &prio_sched_class,
+    &fair_sched_class,
+};
+#define NR_SCHED_CLASSES (sizeof(sched_classes) / sizeof(sched_classes[0]))
+
+static const struct sched_class *default_class = &prio_sched_class;
+
+static int class_index(const struct sched_class *class){
+    for (int i = 0; i < (int)NR_SCHED_CLASSES; i++) {
+        if (sched_classes[i] == class)
+            return i;
+    }
+    return NR_SCHED_CLASSES;
+}
+
+static void runqueue_init(struct runqueue *rq){
+    rq->lock = (spinlock)SPINLOCK_INIT;
+    rq->curr = NULL;
+    rq->idle = NULL;
+    rq->need_resched = false;
+    rq->nr_running = 0;
+    rq->load = 0;
+    rq->switches = 0;
+    list_init(&rq->queued);
+    rq->prev = NULL;
+    rq->push_prev = false;
+    rq->balance_ticks = 0;
+    rq->balance_failed = 0;
+    for (int i = 0; i < (int)NR_SCHED_CLASSES; i++)
+        sched_classes[i]->init_rq(rq);
+}
 
 void scheduler_init(void){
     list_init(&all_tasks);
+
+    const char *sched = cmdline_get("sched");
+    if (sched && !strcmp(sched, "fair"))
+        default_class = &fair_sched_class;
+    else if (sched && strcmp(sched, "prio"))
+        KWARN("Unknown sched=%s, sticking with prio\n", sched);
+
+    // Somebody has to run the kernel threads
+    sched_isolated_cpus = cmdline_get_cpu_mask("isolcpus");
+    if (cpu_in_mask(0, sched_isolated_cpus)) {
+        KWARN("CPU 0 can't be isolated\n");
+        sched_isolated_cpus &= ~1UL;
+    }
+    if (sched_isolated_cpus)
+        kprintf("Scheduler: isolated CPUs 0x%lx\n", sched_isolated_cpus);
     
     for(int i = 0; i < MAX_CORES; i++){
-        list_init(&__percpu_cpu_runqueue[i]);
-        __percpu_runqueue_lock[i] = (spinlock)SPINLOCK_INIT;
+        runqueue_init(&__percpu_runqueues[i]);
+        // Staggered so the CPUs don't all balance on the same tick
+        __percpu_runqueues[i].balance_ticks = i % SCHED_BALANCE_INTERVAL;
         __percpu_current_task[i] = NULL;
+        atomic64_init(&__percpu_wake_lists[i], 0);
     }
+    sched_balance_init();
+    sched_idle_init();
+    // From here on the boot CPU runs as its idle task
+    sched_init_idle(0);
+    kprintf("Scheduler: new tasks go to the %s class\n", default_class->name);
+}
+
+void sched_init_task(struct task *task){
+    task->sched_class = default_class;
+    task->policy = SCHED_NORMAL;
+    task->rt_priority = 0;
+    task->cpus_allowed = ~sched_isolated_cpus;
+    task->on_rq = false;
+    list_init(&task->rq_node);
+    task->last_ran = 0;
+    task->switch_sp = 0;
+    task->wake_next = NULL;
+    atomic_init(&task->wake_pending, 0);
+    task->time_slice = 0;
+    task->array = NULL;
+    task->vruntime = 0;
+    task->exec_start = 0;
+    task->sum_exec = 0;
+    task->prev_sum_exec = 0;
+    task->weight = NICE_0_WEIGHT;
+}
+
+// The rest of these expect the runqueue lock to be held
+void enqueue_task(struct runqueue *rq, struct task *task, bool wakeup){
+    task->weight = sched_prio_to_weight(task->priority);
+    task->sched_class->enqueue(rq, task, wakeup);
+    task->on_rq = true;
+    list_add_tail(&task->rq_node, &rq->queued);
+    rq->nr_running++;
+    rq->load += task->weight;
+
+    struct task *curr = rq->curr;
+    if (curr && curr == rq->idle)
+        rq->need_resched = true;
+    if (!curr || !curr->on_rq)
+        return;
+    if (curr->sched_class == task->sched_class)
+        task->sched_class->check_preempt(rq, task);
+    else if (class_index(task->sched_class) < class_index(curr->sched_class))
+        rq->need_resched = true;
+}
+
+void dequeue_task(struct runqueue *rq, struct task *task){
+    task->sched_class->dequeue(rq, task);
+    task->on_rq = false;
+    list_del(&task->rq_node);
+    rq->nr_running--;
+    rq->load -= task->weight;
+}
+
+static struct task *pick_next_task(struct runqueue *rq){
+    for (int i = 0; i < (int)NR_SCHED_CLASSES; i++) {
+        struct task *next = sched_classes[i]->pick_next(rq);
+        if (next)
+            return next;
+    }
+    return NULL;
 }
 
 void sched_task(struct task* task, int cpu_id) { 
     if (!task)
         return;
     
-    // Add to current CPU's runqueue using tasks_runnable node
+    struct runqueue *rq = &__percpu_runqueues[cpu_id];
+
     // note: it isn't necessary to disable interrupts but it will 
-    // prove useful later when I switch to a priority scheduler or 
-    // if we switch to a task that calls sched_task immediately
+    // prove useful if we switch to a task that calls sched_task immediately
     // (makes it not waste a lot of cycles before the task that locked
     // releases the lock
     int_flags flags;
-    spinlock_lock_intsave(&__percpu_runqueue_lock[cpu_id], &flags);
-    list_add_tail(&task->tasks_runnable, &__percpu_cpu_runqueue[cpu_id]);
-    spinlock_unlock_intrestore(&__percpu_runqueue_lock[cpu_id], flags);
+    spinlock_lock_intsave(&rq->lock, &flags);
+    // Anything that has run before is coming back from a sleep
+    if (!task->on_rq)
+        enqueue_task(rq, task, task->sum_exec != 0);
+    bool kick = cpu_id != (int)get_current_core_id() && 
+                (rq->need_resched || tick_reduced(cpu_id));
+    spinlock_unlock_intrestore(&rq->lock, flags);
+
+    if (kick)
+        sched_kick_cpu(cpu_id);
+}
+
+// Locks the runqueue the task is on, the balancer may move it while we wait
+static struct runqueue *task_rq_lock(struct task *task, int_flags *flags){
+    while (1) {
+        int cpu = task->cpu_id;
+        struct runqueue *rq = &__percpu_runqueues[cpu];
+        spinlock_lock_intsave(&rq->lock, flags);
+        if (task->cpu_id == cpu)
+            return rq;
+        spinlock_unlock_intrestore(&rq->lock, *flags);
+    }
+}
+
+static bool task_sleeping(struct task *task){
+    return task->state == TASK_SLEEPING_INTERRUPTIBLE || 
+           task->state == TASK_SLEEPING_UNINTERRUPTIBLE;
+}
+
+// The task's runqueue and dst, both locked
+static struct runqueue *task_rq_lock_both(struct task *task, struct runqueue *dst,
+                                                            int_flags *flags){
+    while (1) {
+        int cpu = task->cpu_id;
+        struct runqueue *rq = &__percpu_runqueues[cpu];
+        *flags = save_and_disable_interrupts();
+        if (rq == dst)
+            spinlock_lock(&rq->lock);
+        else
+            acquire_locks_ordered(&rq->lock, &dst->lock);
+        if (task->cpu_id == cpu)
+            return rq;
+
+        spinlock_unlock(&rq->lock);
+        if (rq != dst)
+            spinlock_unlock(&dst->lock);
+        restore_interrupts(*flags);
+    }
+}
+
+static bool ttwu_activate(struct task *task, int cpu){
+    struct runqueue *dst = &__percpu_runqueues[cpu];
+    int_flags flags;
+    struct runqueue *rq = task_rq_lock_both(task, dst, &flags);
+    bool woken = task_sleeping(task);
+    bool kick = false;
+    bool preempt_self = false;
+
+    if (woken) {
+        task->state = TASK_RUNNING;
+        // Still queued if it hadn't gotten to schedule() yet, it just keeps 
+        // going. If its old CPU may still be on its stack it goes back there
+        if (!task->on_rq) {
+            struct runqueue *target = dst;
+            if (task == rq->curr || task == rq->prev) {
+                target = rq;
+                cpu = task->cpu_id;
+            }
+            task->cpu_id = cpu;
+            enqueue_task(target, task, true);
+
+            // Only worth interrupting it if it has to preempt, or if it 
+            // won't look at its runqueue again for a while
+            kick = cpu != (int)get_current_core_id() && 
+                   (target->need_resched || tick_reduced(cpu));
+            // Our own CPU, from task context nobody would look at 
+            // need_resched before the next tick. A self IPI preempts us 
+            // as soon as interrupts are back on, whatever lock we are in
+            preempt_self = cpu == (int)get_current_core_id() && target->need_resched &&
+                           target->curr != target->idle && !in_interrupt();
+        }
+    }
+
+    spinlock_unlock(&rq->lock);
+    if (rq != dst)
+        spinlock_unlock(&dst->lock);
+    restore_interrupts(flags);
+
+    if (kick) {
+        atomic64_inc(&wake_stats.kicks);
+        sched_kick_cpu(cpu);
+    }
+    if (preempt_self)
+        apic_send_ipi(cpu_to_lapic_id(cpu), SCHED_IPI_VECTOR);
+    return woken;
+}
+
+// True if the list was empty, the CPU hasn't been told yet
+static bool wake_list_add(int cpu, struct task *task){
+    atomic64 *head = &__percpu_wake_lists[cpu];
+    long first = atomic64_read(head);
+    do {
+        task->wake_next = (struct task *)first;
+    } while (!atomic64_try_cmpxchg(head, &first, (long)task));
+    return first == 0;
+}
+
+bool sched_wake_up(struct task *task){
+    if (!task || !task_sleeping(task))
+        return false;
+
+    atomic64_inc(&wake_stats.wakeups);
+    int cpu = sched_select_wake_cpu(task);
+
+    // An interrupt handler shouldn't sit spinning on other CPUs' runqueue
+    // locks, the target does the wakeup itself once it sees the list. If 
+    // the task is on one already that wakeup covers us too
+    if (in_interrupt() && cpu != (int)get_current_core_id()) {
+        if (atomic_xchg(&task->wake_pending, 1))
+            return true;
+        atomic64_inc(&wake_stats.queued);
+        if (wake_list_add(cpu, task)) {
+            atomic64_inc(&wake_stats.kicks);
+            sched_kick_cpu(cpu);
+        }
+        return true;
+    }
+
+    return ttwu_activate(task, cpu);
+}
+
+void sched_ttwu_pending(void){
+    atomic64 *head = &this_core_read(wake_lists);
+    if (!atomic64_read(head))
+        return;
+
+    // Newest first, flipped so they get woken in the order they came in
+    struct task *list = (struct task *)atomic64_xchg(head, 0);
+    struct task *ordered = NULL;
+    while (list) {
+        struct task *next = list->wake_next;
+        list->wake_next = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    int cpu = get_current_core_id();
+    while (ordered) {
+        struct task *task = ordered;
+        ordered = task->wake_next;
+        // Read next first, once pending is clear it can be pushed again
+        atomic_xchg(&task->wake_pending, 0);
+        ttwu_activate(task, cpu);
+    }
+}
+
+void sched_ipi_handler(void){
+    sched_ttwu_pending();
+    preempt_schedule_irq();
+}
+
+// A task nobody has queued, on the least busy CPU it's allowed on
+static void sched_push_task(struct task *task){
+    int cpu = find_least_busy_cpu(task);
+    struct runqueue *rq = &__percpu_runqueues[cpu];
+
+    int_flags flags;
+    spinlock_lock_intsave(&rq->lock, &flags);
+    task->cpu_id = cpu;
+    enqueue_task(rq, task, false);
+    bool kick = cpu != (int)get_current_core_id() && 
+                (rq->need_resched || tick_reduced(cpu));
+    spinlock_unlock_intrestore(&rq->lock, flags);
+
+    if (kick)
+        sched_kick_cpu(cpu);
+}
+
+int sched_set_affinity(struct task *task, uint64_t mask){
+    mask &= cpu_online_mask();
+    if (!task || !mask)
+        return -1;
+
+    int_flags flags;
+    struct runqueue *rq = task_rq_lock(task, &flags);
+    int cpu = task->cpu_id;
+    struct task *push = NULL;
+    bool resched = false;
+
+    task->cpus_allowed = mask;
+    // Asleep it gets placed inside the new mask when it wakes up
+    if (task->on_rq && !cpu_in_mask(cpu, mask)) {
+        if (task == rq->curr || task == rq->prev) {
+            // Its CPU is on its stack, __schedule moves it once it's off
+            rq->need_resched = true;
+            resched = true;
+        } else {
+            dequeue_task(rq, task);
+            push = task;
+        }
+    }
+    spinlock_unlock_intrestore(&rq->lock, flags);
+
+    if (push)
+        sched_push_task(push);
+    else if (resched && cpu == (int)get_current_core_id())
+        schedule();
+    else if (resched)
+        sched_kick_cpu(cpu);
+    return 0;
+}
+
+int sched_setscheduler(struct task *task, int policy, int rt_priority){
+    if (!task || policy < SCHED_NORMAL || policy > SCHED_RR)
+        return -1;
+    if (rt_priority < 0 || rt_priority > MAX_PRIO)
+        return -1;
+
+    int_flags flags;
+    struct runqueue *rq = task_rq_lock(task, &flags);
+    int cpu = task->cpu_id;
+    bool queued = task->on_rq;
+    bool running = task == rq->curr;
+
+    // Out of the old class and into the new one, a running task goes back
+    // through pick_next of its new class on the next schedule
+    if (queued)
+        dequeue_task(rq, task);
+    task->policy = policy;
+    task->rt_priority = rt_priority;
+    task->sched_class = policy == SCHED_NORMAL ? default_class : &rt_sched_class;
+    task->time_slice = 0;
+    if (queued)
+        enqueue_task(rq, task, false);
+    if (running)
+        rq->need_resched = true;
+    bool resched = rq->need_resched;
+    spinlock_unlock_intrestore(&rq->lock, flags);
+
+    if (resched && cpu == (int)get_current_core_id())
+        schedule();
+    else if (resched)
+        sched_kick_cpu(cpu);
+    return 0;
 }
 
 void sched_remove_task(struct task* task){
     if(!task)
         return;
 
-    // Same story as task_sched
+    // Same story as sched_task
     int_flags flags;
-    spinlock_lock_intsave(&__percpu_runqueue_lock[task->cpu_id], &flags);
-    list_del(&task->tasks_runnable);
-    spinlock_unlock_intrestore(&__percpu_runqueue_lock[task->cpu_id], flags);
+    struct runqueue *rq = task_rq_lock(task, &flags);
+
+    if (task->on_rq)
+        dequeue_task(rq, task);
+    spinlock_unlock_intrestore(&rq->lock, flags);
 }
 
 struct task* get_current_task(void){
     return this_core_read(current_task);
 }
 
-extern spinlock task_list_lock;
-void schedule(void){
+void scheduler_tick(void){
     struct task *current = this_core_read(current_task);
+    struct runqueue *rq = &this_core_read(runqueues);
+    if (!current)
+        return;
+
+    spinlock_lock(&rq->lock);
+    if (current->on_rq)
+        current->sched_class->tick(rq, current);
+    bool balance = ++rq->balance_ticks >= SCHED_BALANCE_INTERVAL;
+    if (balance)
+        rq->balance_ticks = 0;
+    spinlock_unlock(&rq->lock);
+
+    if (balance)
+        sched_balance(get_current_core_id(), false);
+}
+
+// Where prev's state goes depends on how it got here. Through an interrupt
+// the ISR stub already put all of it in cpu_context, so it has nothing 
+// left to save and we come back to it with an iretq. Called directly 
+// prev is in the middle of C code, switch_to keeps its callee saved 
+// registers on its stack and this function returns once it runs again
+static void context_switch(struct task *prev, struct task *next, bool from_irq){
+    uint64_t next_sp = next->switch_sp;
+    next->switch_sp = 0;
+
+    if (from_irq) {
+        if (next_sp)
+            resume_switched(next_sp);
+        load_next_task(&next->cpu_context);
+    }
+
+    if (next_sp)
+        switch_to(&prev->switch_sp, next_sp);
+    else
+        switch_to_interrupted(&prev->switch_sp, &next->cpu_context);
+}
+
+// Interrupts are off
+static void __schedule(bool from_irq){
+    struct task *current = this_core_read(current_task);
+    struct runqueue *rq = &this_core_read(runqueues);
     struct task *next = NULL;
 
+    // Nothing waiting behind current, see if another CPU has some to spare
+    if (sched_nr_running(get_current_core_id()) <= 1)
+        sched_balance(get_current_core_id(), true);
+
+    int cpu = get_current_core_id();
+    spinlock_lock(&rq->lock);
+
+    // We are on current's stack, whatever ran before it is safe to move now.
+    // If it isn't allowed here anymore this is where it leaves
+    struct task *push = NULL;
+    struct task *prev = rq->prev;
+    if (prev && (rq->push_prev || (prev->on_rq && !cpu_in_mask(cpu, prev->cpus_allowed)))) {
+        if (prev->on_rq)
+            dequeue_task(rq, prev);
+        push = prev;
+    }
+    rq->prev = NULL;
+    rq->push_prev = false;
+
+    // Going to sleep. Checked under the lock so a wakeup that came in after
+    // the state got set just leaves it running. A preempted task stays 
+    // queued whatever its state says, it may not be on a wait queue yet
+    if (!from_irq && current->state != TASK_RUNNING && current->on_rq && 
+            current != rq->idle)
+        dequeue_task(rq, current);
+
+    // Its affinity changed, it comes off now and gets pushed to an allowed
+    // CPU by the next __schedule here, once we are off its stack
+    bool migrate = false;
+    if (current->on_rq && current != rq->idle && 
+            !cpu_in_mask(cpu, current->cpus_allowed)) {
+        dequeue_task(rq, current);
+        migrate = true;
+    }
+
+    // Current keeps going until its class (or a wakeup of something more 
+    // important) says otherwise
+    if (current->on_rq && rq->curr == current && !rq->need_resched) {
+        next = current;
+    } else {
+        if (current->on_rq && rq->curr == current)
+            current->sched_class->put_prev(rq, current);
+        next = pick_next_task(rq);
+        if (!next)
+            next = rq->idle;
+    }
+    rq->need_resched = false;
+    rq->curr = next;
+
+    if (next != current) {
+        rq->switches++;
+        current->last_ran = read_tsc();
+        rq->prev = current;
+        rq->push_prev = migrate;
+    }
+
+    bool idle = next == rq->idle;
+    int nr_running = rq->nr_running;
+    spinlock_unlock(&rq->lock);
+
+    if (push)
+        sched_push_task(push);
+
+    // RT throttling counts on the tick to notice the budget ran out
+    tick_sched_update(idle, nr_running <= 1 && next->sched_class != &rt_sched_class);
+
+    if (next == current) {
+        if (from_irq)
+            load_next_task(&current->cpu_context);
+        return;
+    }
+
+    this_core_write(current_task, next);
+    // Kernel tasks run fine on whatever address space is loaded
+    // since the kernel half is the same in all of them, switching
+    // back to the task that had it loaded usually skips CR3 too
+    if (next->md)
+        vmm_switch_address_space(next->md->as);
+    else
+        vmm_enter_lazy_tlb();
+    context_switch(current, next, from_irq);
+}
+
+void schedule(void){
+    int_flags flags = save_and_disable_interrupts();
+    __schedule(false);
+    // Whenever we get picked again, with our own flags
+    restore_interrupts(flags);
+}
+
+void preempt_schedule_irq(void){
+    // Whatever the handler had to do is done, we only leave through here
+    this_core_write(in_irq, false);
+    __schedule(true);
+}
+
+uint64_t sched_deadline_ms(uint64_t ms){
+    return read_tsc() + ms * tsc_cycles_per_ms();
+}
+
+static void timeout_fn(struct ktimer *timer){
+    sched_wake_up(timer->data);
+}
+
+bool schedule_timeout(uint64_t deadline){
+    struct task *current = this_core_read(current_task);
+    if (read_tsc() >= deadline) {
+        current->state = TASK_RUNNING;
+        return false;
+    }
+
+    struct ktimer timer;
+    ktimer_init(&timer, timeout_fn, current);
+    ktimer_arm(&timer, deadline);
+    schedule();
+    // Also waits out the callback if it is running on another CPU
+    ktimer_cancel(&timer);
+
+    current->state = TASK_RUNNING;
+    return read_tsc() < deadline;
+}
+
+void sched_sleep_ms(uint64_t ms){
+    struct task *current = this_core_read(current_task);
+    uint64_t deadline = sched_deadline_ms(ms);
+
+    do {
+        current->state = TASK_SLEEPING_UNINTERRUPTIBLE;
+    } while (schedule_timeout(deadline));
+}
+
+// The class decides where current goes so that someone else gets picked first
+static void yield_current(void){
+    struct task *current = this_core_read(current_task);
+    struct runqueue *rq = &this_core_read(runqueues);
+
     int_flags flags;
-    spinlock_lock_intsave(&this_core_read(runqueue_lock), &flags);
+    spinlock_lock_intsave(&rq->lock, &flags);
+    if (current->on_rq && rq->curr == current) {
+        current->sched_class->yield(rq, current);
+        rq->need_resched = true;
+    }
+    spinlock_unlock_intrestore(&rq->lock, flags);
+}
 
-    struct list_node *runqueue = &this_core_read(cpu_runqueue);
-    
-    // If no current task, pick the first runnable task from this CPU's queue
-    if (!current) {
-        if (!list_empty(runqueue)) {
-            struct list_node *first = runqueue->next;
-            next = container_of(first, struct task, tasks_runnable);
+void sched_yield(void){
+    yield_current();
+    schedule();
+}
+
+// Same work a tick does when a slice runs out, on a private runqueue so 
+// nothing real gets scheduled
+static uint64_t bench_pick_next(const struct sched_class *class, struct runqueue *rq,
+                                            struct task *tasks, int nr_tasks){
+    const int iterations = 10000;
+
+    runqueue_init(rq);
+    for (int i = 0; i < nr_tasks; i++) {
+        sched_init_task(&tasks[i]);
+        tasks[i].sched_class = class;
+        tasks[i].priority = i % SCHED_NR_PRIO;
+        tasks[i].rt_priority = i % SCHED_NR_PRIO;
+        enqueue_task(rq, &tasks[i], false);
+    }
+
+    uint64_t start = read_tsc();
+    for (int i = 0; i < iterations; i++) {
+        struct task *next = class->pick_next(rq);
+        rq->curr = next;
+        // Out of slice right away so the prio class requeues it
+        next->time_slice = 1;
+        class->tick(rq, next);
+        class->put_prev(rq, next);
+    }
+    return (read_tsc() - start) / iterations;
+}
+
+void sched_bench_pick_next(void){
+    const int counts[] = { 1, 1000 };
+    struct task *tasks = kmalloc(1000 * sizeof(*tasks));
+    struct runqueue *rq = kmalloc(sizeof(*rq));
+    if (!tasks || !rq) {
+        KERROR("Not enough memory for the scheduler benchmark\n");
+        kfree(tasks);
+        kfree(rq);
+        return;
+    }
+    // Zeroed so nothing in them points anywhere
+    memset(tasks, 0, 1000 * sizeof(*tasks));
+
+    kprintf("Scheduler pick next + requeue:\n");
+    for (int c = 0; c < (int)NR_SCHED_CLASSES; c++) {
+        for (int i = 0; i < 2; i++) {
+            uint64_t cycles = bench_pick_next(sched_classes[c], rq, tasks, counts[i]);
+            kprintf("     %s, %d runnable: %lu cycles\n", 
+                    sched_classes[c]->name, counts[i], cycles);
         }
-    } else {
-        // Find next task
-        struct list_node *current_node = &current->tasks_runnable;
-        struct list_node *next_node = current_node->next;
-        
-        // wrap to beginning 
-        if (next_node == runqueue) {
-            next_node = runqueue->next;
+    }
+
+    kfree(tasks);
+    kfree(rq);
+}
+
+#define YIELD_BENCH_ROUNDS 10000
+
+static volatile bool yield_bench_irq;
+static volatile int yield_bench_done;
+static volatile uint64_t yield_bench_start;
+static volatile uint64_t yield_bench_end;
+
+static void yield_bench_task(void){
+    if (!yield_bench_start)
+        yield_bench_start = read_tsc();
+
+    for (int i = 0; i < YIELD_BENCH_ROUNDS; i++) {
+        if (yield_bench_irq) {
+            yield_current();
+            __asm__ __volatile__("int %0" : : "i"(SCHED_RESCHED_VECTOR) : "memory");
+        } else {
+            sched_yield();
         }
-        
-        // If this fails we have an empty run queue
-        if (next_node != runqueue) {
-            next = container_of(next_node, struct task, tasks_runnable);
+    }
+
+    // Both on the boot CPU so no need for atomics
+    if (++yield_bench_done == 2)
+        yield_bench_end = read_tsc();
+    task_exit(0);
+}
+
+void sched_bench_yield(void){
+    kprintf("Scheduler yield ping-pong, %d rounds each:\n", YIELD_BENCH_ROUNDS);
+
+    for (int mode = 0; mode < 2; mode++) {
+        yield_bench_irq = mode == 1;
+        yield_bench_done = 0;
+        yield_bench_start = 0;
+
+        for (int i = 0; i < 2; i++) {
+            struct task *task = create_kernel_task(yield_bench_task);
+            if (!task) {
+                KERROR("Not enough memory for the yield benchmark\n");
+                return;
+            }
+            task->priority = PRIO_DEFAULT;
+            task->cpu_id = 0;
+            sched_task(task, 0);
         }
+
+        // We are the idle task, this only comes back once both are gone
+        while (yield_bench_done < 2)
+            schedule();
+
+        uint64_t cycles = (yield_bench_end - yield_bench_start) / (2 * YIELD_BENCH_ROUNDS);
+        kprintf("     %s: %lu cycles per switch\n", 
+                yield_bench_irq ? "int + iretq" : "switch_to", cycles);
     }
+}
 
-    spinlock_unlock_intrestore(&this_core_read(runqueue_lock), flags);
-    
-    if (next && next != current) {
-        this_core_write(current_task, next);
-        load_next_task(&next->cpu_context);
+#define RT_BENCH_HOGS       2
+#define RT_BENCH_ROUNDS     200
+#define RT_BENCH_SLEEP_MS   2
+
+static volatile bool rt_bench_stop;
+static atomic rt_bench_done;         // Preemptible, so not a plain ++
+static volatile uint64_t rt_bench_woken;        // TSC the timer woke the sleeper at
+static struct task *rt_bench_sleeper;
+static uint64_t rt_bench_rounds;
+static uint64_t rt_bench_min, rt_bench_max, rt_bench_total;
+
+static void rt_bench_hog(void){
+    while (!rt_bench_stop)
+        cpu_pause();
+    atomic_inc(&rt_bench_done);
+    task_exit(0);
+}
+
+static void rt_bench_wake(struct ktimer *timer){
+    rt_bench_woken = read_tsc();
+    sched_wake_up(timer->data);
+}
+
+static void rt_bench_sleeper_task(void){
+    struct task *self = get_current_task();
+    struct ktimer timer;
+    ktimer_init(&timer, rt_bench_wake, self);
+
+    rt_bench_min = UINT64_MAX;
+    rt_bench_max = 0;
+    rt_bench_total = 0;
+    for (uint64_t i = 0; i < rt_bench_rounds; i++) {
+        self->state = TASK_SLEEPING_UNINTERRUPTIBLE;
+        ktimer_arm_ms(&timer, RT_BENCH_SLEEP_MS);
+        schedule();
+
+        uint64_t latency = read_tsc() - rt_bench_woken;
+        if (latency < rt_bench_min)
+            rt_bench_min = latency;
+        if (latency > rt_bench_max)
+            rt_bench_max = latency;
+        rt_bench_total += latency;
     }
-    load_next_task(&current->cpu_context);
-    // If next == current or no runnable tasks, just continue
+
+    rt_bench_stop = true;
+    atomic_inc(&rt_bench_done);
+    task_exit(0);
+}
+
+// Everything pinned to CPU 0 so the hogs can't be balanced away from it
+static struct task *rt_bench_task(void (*fn)(void)){
+    struct task *task = create_kernel_task(fn);
+    if (!task)
+        return NULL;
+    task->priority = PRIO_DEFAULT;
+    task->cpu_id = 0;
+    sched_set_affinity(task, 1);
+    return task;
 }
 
+void sched_bench_rt_latency(void){
+    uint64_t per_us = tsc_cycles_per_ms() / 1000;
+    if (!per_us)
+        per_us = 1;
+
+    kprintf("Wakeup to run latency, %d normal tasks spinning on CPU 0:\n", RT_BENCH_HOGS);
+
+    for (int rt = 1; rt >= 0; rt--) {
+        // Same priority as the hogs the sleeper mostly waits out their 
+        // slices, a handful of rounds already says enough
+        rt_bench_rounds = rt ? RT_BENCH_ROUNDS : RT_BENCH_ROUNDS / 10;
+        rt_bench_stop = false;
+        atomic_set(&rt_bench_done, 0);
+
+        struct task *hogs[RT_BENCH_HOGS];
+        for (int i = 0; i < RT_BENCH_HOGS; i++) {
+            hogs[i] = rt_bench_task(rt_bench_hog);
+            if (!hogs[i]) {
+                KERROR("Not enough memory for the latency benchmark\n");
+                rt_bench_stop = true;
+                return;
+            }
+            sched_task(hogs[i], 0);
+        }
+
+        rt_bench_sleeper = rt_bench_task(rt_bench_sleeper_task);
+        if (!rt_bench_sleeper) {
+            KERROR("Not enough memory for the latency benchmark\n");
+            rt_bench_stop = true;
+            return;
+        }
+        if (rt)
+            sched_setscheduler(rt_bench_sleeper, SCHED_FIFO, 0);
+        sched_task(rt_bench_sleeper, 0);
+
+        // We are CPU 0's idle task, back here only once they're all gone
+        while (atomic_read(&rt_bench_done) < RT_BENCH_HOGS + 1)
+            schedule();
+
+        kprintf("     %s: min %lu us, avg %lu us, max %lu us over %lu wakeups\n",
+                rt ? "SCHED_FIFO" : "normal", rt_bench_min / per_us, 
+                rt_bench_total / rt_bench_rounds / per_us, rt_bench_max / per_us,
+                rt_bench_rounds);
+    }
+}
 
 
 
@@ -103,44 +845,72 @@ void schedule(void){
 static void debug_print_runqueue(int cpu_id) {
     kprintf("=== CPU %d Runqueue ===\n", cpu_id);
     
-    spinlock_lock(&__percpu_runqueue_lock[cpu_id]);
+    struct runqueue *rq = &__percpu_runqueues[cpu_id];
+    spinlock_lock(&rq->lock);
     
-    struct list_node *runqueue = &__percpu_cpu_runqueue[cpu_id];
-    
-    if (list_empty(runqueue)) {
+    if (!rq->nr_running) {
         kprintf("  Runqueue is EMPTY\n");
-        spinlock_unlock(&__percpu_runqueue_lock[cpu_id]);
+        spinlock_unlock(&rq->lock);
         return;
     }
     
     int count = 0;
-    struct list_node *current = runqueue->next;
-    
-    kprintf("  Runqueue head: %p (next: %p, prev: %p)\n", 
-            runqueue, runqueue->next, runqueue->prev);
+    if (rq->rt.queue.nr_active) {
+        kprintf("  RT (%d tasks%s, throttled %lu times):\n", rq->rt.queue.nr_active,
+                rq->rt.throttled ? ", throttled" : "", rq->rt.throttle_count);
+        for (int prio = 0; prio < SCHED_NR_PRIO; prio++) {
+            struct list_node *queue = &rq->rt.queue.queues[prio];
+            for (struct list_node *node = queue->next; node != queue; node = node->next) {
+                struct task *task = container_of(node, struct task, tasks_runnable);
+                kprintf("  [%d] Task PID: %d, rt prio: %d, %s\n", count, task->pid, prio,
+                        task->policy == SCHED_RR ? "RR" : "FIFO");
+                count++;
+            }
+        }
+    }
+
+    for (int a = 0; a < 2; a++) {
+        struct prio_array *array = a == 0 ? rq->prio.active : rq->prio.expired;
+        kprintf("  %s (%d tasks):\n", a == 0 ? "Active" : "Expired", array->nr_active);
+
+        for (int prio = 0; prio < SCHED_NR_PRIO; prio++) {
+            struct list_node *queue = &array->queues[prio];
+            for (struct list_node *node = queue->next; node != queue; node = node->next) {
+                struct task *task = container_of(node, struct task, tasks_runnable);
+                kprintf("  [%d] Task PID: %d, prio: %d, slice: %d, addr: %p\n", 
+                        count, task->pid, prio, task->time_slice, task);
+                count++;
+            }
+        }
+    }
     
-    while (current != runqueue) {
-        struct task *task = container_of(current, struct task, tasks_runnable);
-        kprintf("  [%d] Task PID: %d, addr: %p, node: %p (next: %p, prev: %p)\n", 
-                count, task->pid, task, current, current->next, current->prev);
-        
-        current = current->next;
-        count++;
-        
-        // Safety check to prevent infinite loops
-        if (count > 100) {
-            kprintf("  ERROR: Runqueue traversal exceeded 100 nodes - possible corruption!\n");
-            break;
+    if (rq->fair.nr_running) {
+        kprintf("  Fair (%d tasks, min vruntime %lu):\n", 
+                rq->fair.nr_running, rq->fair.min_vruntime);
+        if (rq->fair.curr) {
+            kprintf("  [%d] Task PID: %d, vruntime: %lu (running)\n",
+                    count, rq->fair.curr->pid, rq->fair.curr->vruntime);
+            count++;
+        }
+        for (struct rb_node *node = rb_first(&rq->fair.tasks); node; node = rb_next(node)) {
+            struct task *task = rb_entry(node, struct task, run_node);
+            kprintf("  [%d] Task PID: %d, vruntime: %lu\n", count, task->pid, task->vruntime);
+            count++;
         }
     }
     
-    kprintf("  Total tasks in runqueue: %d\n", count);
-    spinlock_unlock(&__percpu_runqueue_lock[cpu_id]);
+    kprintf("  Total tasks in runqueue: %d, load %lu, %lu switches\n", 
+            count, rq->load, rq->switches);
+    spinlock_unlock(&rq->lock);
 }
 
 // Helper to print all CPU runqueues
 void debug_print_all_runqueues(void) {
-    for (int i = 0; i < 4; i++) {
+    for (int i = 0; i < total_cpus; i++) {
         debug_print_runqueue(i);
     }
+    sched_print_balance_stats();
+    kprintf("Wakeups: %lu, %lu through wake lists, %lu needed a kick\n",
+            atomic64_read(&wake_stats.wakeups), atomic64_read(&wake_stats.queued),
+            atomic64_read(&wake_stats.kicks));
 }
@@ -3,12 +3,19 @@
 #include <kernel/idt_init.h>
 #include <kernel/apic.h>
 #include <kernel/memutils.h>
+#include <kernel/vmm.h>
 #include <kernel/klogging.h>
 #include <kernel/task_manager.h>
 #include <kernel/spinlock.h>
+#include <kernel/huge_memory.h>
+#include <kernel/reclaim.h>
+#include <kernel/page_idle.h>
+#include <kernel/numa.h>
+#include <kernel/tick.h>
 
 static DEFINE_SPINLOCK(cpu_id_init);
 static uint32_t percpu_processor_ids[MAX_CORES]; 
+static uint32_t cpu_lapic_ids[MAX_CORES];
 static int cpu_id_ctr = 0;
 int total_cpus = 0;
 
@@ -33,37 +40,46 @@ uint32_t get_current_core_id(void) {
     return processor_id;
 }
 
+uint32_t cpu_to_lapic_id(int cpu) {
+    return cpu_lapic_ids[cpu];
+}
 
-static void boot_idle_task(void){  
-    apic_timer_enable();
-    
-    kprintf("Core: %d, TASK PID: %d\n",get_current_core_id(), this_core_read(current_task)->pid);
-    while(1)
-        __asm__ __volatile__("pause");
-    
-    /*while(1) {
-        kprintf("Core: %d, TASK PID: %d\n",get_current_core_id(), this_core_read(current_task)->pid);
-        for(volatile int i = 0; i < 100000000; i++); // Simple delay
-    }*/
+
+void smp_init_bsp(void) {
+    struct limine_smp_request *mp_request = get_smp_request();
+
+    spinlock_lock(&cpu_id_init);
+    init_percpu_data(cpu_id_ctr++);
+    spinlock_unlock(&cpu_id_init);
+
+    if (mp_request->response) {
+        cpu_lapic_ids[0] = mp_request->response->bsp_lapic_id;
+        numa_cpu_online(0, mp_request->response->bsp_lapic_id);
+    }
 }
 
 static void ap_entry_point(struct limine_smp_info *cpu_info) {
     init_gdt();
     reload_idt();
+    vmm_init_cpu();
    
     spinlock_lock(&cpu_id_init);
-    init_percpu_data(cpu_id_ctr++); 
+    uint32_t id = cpu_id_ctr++;
+    init_percpu_data(id); 
     spinlock_unlock(&cpu_id_init);
 
+    cpu_lapic_ids[id] = cpu_info->lapic_id;
+    numa_cpu_online(id, cpu_info->lapic_id);
+    sched_init_idle(id);
+
     if (apic_timer_init_cpu(cpu_info->lapic_id) != 0) {
         KERROR("Failed to initialize APIC timer on CPU %u\n", cpu_info->lapic_id);
         hcf();
     }
     
-    apic_timer_set_frequency(100); 
-    schedule();
-    while(1)
-        __asm__ __volatile__("pause");
+    tick_start_cpu();
+    kprintf("Core: %d is up\n", id);
+    cpu_idle();
 }
 
 void smp_init(void) {
@@ -77,33 +93,37 @@ void smp_init(void) {
     KSUCCESS("Found %lu CPUs\n", mp_response->cpu_count);
 
     apic_timer_init_cpu(mp_response->bsp_lapic_id);  
-    apic_timer_set_frequency(100);
 
     total_cpus = mp_response->cpu_count;
-    init_task_ctr(total_cpus);
+    if (total_cpus > MAX_CORES) {
+        KWARN("Only bringing up %d of %d CPUs, raise MAX_CORES for the rest\n",
+                                                    MAX_CORES, total_cpus);
+        total_cpus = MAX_CORES;
+    }
+
 
-    struct task *task1 = create_and_schedule_kernel_task(boot_idle_task);  
-    struct task *task2 = create_and_schedule_kernel_task(boot_idle_task);
-    struct task *task3 = create_and_schedule_kernel_task(boot_idle_task);
-    struct task *task4 = create_and_schedule_kernel_task(boot_idle_task);
-    KSUCCESS("Successfully created tasks for CPU IDs: %d %d %d %d\n",
-            task1->cpu_id, task2->cpu_id, task3->cpu_id, task4->cpu_id);
+    khugepaged_init();
+    kswapd_init();
+    kidled_init();
 
+    int started = 1;
     for (uint64_t i = 0; i < mp_response->cpu_count; i++) {
         struct limine_smp_info *cpu = mp_response->cpus[i];
         
-        if (cpu->lapic_id == mp_response->bsp_lapic_id) {     
-            spinlock_lock(&cpu_id_init);
-            init_percpu_data(cpu_id_ctr++); 
-            spinlock_unlock(&cpu_id_init);
-            continue; // Skip BSP
-        }
+        // BSP got its per CPU data in smp_init_bsp already
+        if (cpu->lapic_id == mp_response->bsp_lapic_id)
+            continue;
+        if (started++ >= total_cpus)
+            break;
 
         kprintf("Starting CPU %lu (LAPIC ID: %u)\n", i, cpu->lapic_id);
         cpu->goto_address = ap_entry_point;
     }
 
-    schedule();
+    // We are the boot CPU's idle task, real work preempts us from the 
+    // first tick on so the print below happens once this CPU goes idle
+    tick_start_cpu();
     for(volatile int i = 0; i < INT32_MAX; i++);
     debug_print_all_runqueues();    
+    tick_print_stats();
 }
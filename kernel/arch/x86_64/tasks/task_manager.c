@@ -1,34 +1,45 @@
 #include <kernel/task_manager.h>
+#include <kernel/numa.h>
 
-DEFINE_PER_CPU(int, task_counter);
-static DEFINE_SPINLOCK(task_counter_lock);
 extern int total_cpus;
 
-void init_task_ctr(int cpu_count){
-    for(int i = 0; i < cpu_count; i++)
-        __percpu_task_counter[i] = 0;
-}
+// Least loaded CPU in the task's affinity mask on one of its nodes, or on
+// any node if its policy doesn't care or none of its nodes has a CPU it 
+// may use. Nothing is locked so two tasks placed at the same time can end
+// up on the same CPU, the load balancer evens that out later
+int find_least_busy_cpu(struct task *task){
+    uint64_t nodes = mempolicy_cpu_nodes(task);
+    uint64_t allowed = task->cpus_allowed & cpu_online_mask();
+    int cpus = total_cpus ? total_cpus : 1;
+    int id = -1;
+
+    // Pinned somewhere that isn't up (yet), better than nowhere
+    if(!allowed)
+        allowed = cpu_online_mask() & ~sched_isolated_cpus;
 
-static int find_least_busy_cpu(void){
-    int id = 0;
-    int_flags flags;
-    spinlock_lock_intsave(&task_counter_lock, &flags); 
-    int min = __percpu_task_counter[0];
-    for(int i = 1; i < MAX_CORES; i++){
-        if(__percpu_task_counter[i] < min){
-            min = __percpu_task_counter[i];
-            id = i;
+    for(int pass = 0; pass < 2 && id < 0; pass++){
+        unsigned long min = UINT64_MAX;
+        for(int i = 0; i < cpus; i++){
+            if(!cpu_in_mask(i, allowed))
+                continue;
+            if(pass == 0 && !(nodes & (1UL << cpu_to_node(i))))
+                continue;
+            if(sched_load(i) < min){
+                min = sched_load(i);
+                id = i;
+            }
         }
     }
-    __percpu_task_counter[id] += 1;
-    spinlock_unlock_intrestore(&task_counter_lock, flags);
 
-    return id;
+    return id < 0 ? 0 : id;
 }
 
-struct task* create_and_schedule_kernel_task(void (*func)(void)){
+struct task* create_and_schedule_kernel_task(void (*func)(void), int priority){
     struct task* t = create_kernel_task(func);
-    int id = find_least_busy_cpu();
+    if (!t)
+        return NULL;
+    t->priority = priority;
+    int id = find_least_busy_cpu(t);
     t->cpu_id = id;
     sched_task(t, id);
     return t;
@@ -43,19 +54,26 @@ void task_exit(int exit_code) {
     current->state = TASK_ZOMBIE;
 
     sched_remove_task(current);
-    __percpu_task_counter[current->cpu_id] -= 1;
 
-    // Free if non kernel space task
+    // Free if non kernel space task, we are still running on its page tables 
+    // so we have to get off of them first
     if (current->md) {
-        mm_free(current->md);
+        vmm_switch_address_space(get_kernel_as());
+
+        // khugepaged pins other tasks' md under the task list lock, it goes
+        // away once the last user drops it
+        spinlock_lock(&task_list_lock);
+        struct mem_descriptor *md = current->md;
         current->md = NULL;
+        spinlock_unlock(&task_list_lock);
+
+        mm_put(md);
     }
 
-    // Wake parent if it's waiting
+    // Wake parent if it's waiting, wherever it is
     if (current->parent && current->parent->state == TASK_SLEEPING_INTERRUPTIBLE) {    
         task_add_zombie(current->parent, current);
-        // TODO: this below - tricky part is what if parent is on another CPU 
-        //wake_up_task(current->parent);
+        sched_wake_up(current->parent);
     }
 
     // If it has children orphan them
@@ -66,11 +84,12 @@ void task_exit(int exit_code) {
     schedule();
 }
 
-// Potential solution to the TODO above
+// Puts a task that was never queued (a freshly forked child) on a runqueue,
+// tasks that went to sleep come back through sched_wake_up instead
 void wake_up_task(struct task* task){
     task->state = TASK_RUNNING;
     // run it on the CPU that is least busy 
-    int id = find_least_busy_cpu();
+    int id = find_least_busy_cpu(task);
     task->cpu_id = id;
     sched_task(task, id); 
 }
@@ -1,4 +1,5 @@
 #include <kernel/tasks.h>
+#include <kernel/task_manager.h>
 #include <kernel/pmm.h>
 #include <kernel/smp.h>
 #include <klib/string.h>
@@ -34,9 +35,9 @@ struct task* create_task(void){
     task->pid = 0;
     task->tgid = task->pid;
     
-    // TODO: implement priority scheduler
     // Background task by default (for kernel use)
-    task->priority = 99;
+    task->priority = PRIO_BACKGROUND;
+    sched_init_task(task);
     // Backround task is immediately runnable
     task->state = TASK_RUNNING;
     // Kernel tasks share the kernel address space and don't require
@@ -45,6 +46,9 @@ struct task* create_task(void){
     // MD allocation will be handled separately depending on which function
     // uses create_task (fork, execv, clone etc.) 
     task->md = NULL;  
+    task->mempolicy.mode = MPOL_LOCAL;
+    task->mempolicy.nodes = 0;
+    task->mempolicy.il_next = 0;
     
     memset(&task->cpu_context, 0, sizeof(task->cpu_context));
 
@@ -61,7 +65,6 @@ struct task* create_task(void){
     return task;
 }
 
-#define KERNEL_STACK_SIZE 4*PAGE_SIZE
 struct task* create_kernel_task(void (*func)(void)) {
     struct task *ktask = create_task();
     
@@ -105,7 +108,9 @@ struct task* create_user_task(void){
     utask->pid = incr_pid_ctr();
     utask->tgid = utask->pid;
 
-    utask->md = kmalloc(sizeof(*utask->md));
+    // Fresh address space with nothing mapped in the user half, pages
+    // show up as the task faults on them
+    utask->md = mm_alloc();
     if(!utask->md){
         kfree(utask); // Free what we already allocated
         return NULL;
@@ -128,6 +133,59 @@ struct task* create_user_task(void){
     return utask;
 }
 
+// The child starts from the parent's last saved context, for now that is
+// wherever the parent got interrupted, once there are syscalls it will be 
+// the syscall frame. Either way the only difference the child sees is rax = 0 
+int fork(struct task *parent){
+    if(!parent || !parent->md){
+        KERROR("Cannot fork a NULL or kernel task, kernel tasks have no address space of their own\n");
+        return -1;
+    }
+
+    struct task *child = create_task();
+    if(!child)
+        return -1;
+
+    child->md = mm_copy(parent->md);
+    if(!child->md){
+        kfree(child);
+        return -1;
+    }
+
+    void *stack = kmalloc(KERNEL_STACK_SIZE);
+    if(!stack){
+        mm_free(child->md);
+        kfree(child);
+        return -1;
+    }
+    child->kernel_stack_base = stack;
+
+    child->pid = incr_pid_ctr();
+    child->tgid = child->pid;
+    child->priority = parent->priority;
+    child->sched_class = parent->sched_class;
+    child->policy = parent->policy;
+    child->rt_priority = parent->rt_priority;
+    child->cpus_allowed = parent->cpus_allowed;
+    child->mempolicy = parent->mempolicy;
+    child->cpu_context = parent->cpu_context;
+    child->cpu_context.rax = 0;
+
+    child->parent = parent;
+    task_add_child(parent, child);
+
+    list_init(&child->tasks_runnable);
+
+    int_flags flags;
+    spinlock_lock_intsave(&task_list_lock, &flags);
+    list_add_tail(&child->tasks, &all_tasks); 
+    spinlock_unlock_intrestore(&task_list_lock, flags);
+
+    wake_up_task(child);
+
+    return child->pid;
+}
+
 void task_destroy(struct task* task) {
     int_flags flags;
     spinlock_lock_intsave(&task_list_lock, &flags);
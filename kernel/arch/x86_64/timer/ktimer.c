@@ -0,0 +1,124 @@
+#include <kernel/ktimer.h>
+#include <kernel/tick.h>
+#include <kernel/timer.h>
+#include <kernel/smp.h>
+#include <kernel/spinlock.h>
+#include <kernel/memutils.h>
+
+struct ktimer_base {
+    spinlock lock;
+    struct list_node timers;        // Sorted by expiry, soonest first
+    struct ktimer *running;         // Whose callback is running right now
+};
+
+DEFINE_PER_CPU(struct ktimer_base, ktimer_bases);
+
+void ktimer_subsystem_init(void){
+    for (int i = 0; i < MAX_CORES; i++) {
+        spinlock_init(&__percpu_ktimer_bases[i].lock);
+        list_init(&__percpu_ktimer_bases[i].timers);
+        __percpu_ktimer_bases[i].running = NULL;
+    }
+}
+
+void ktimer_init(struct ktimer *timer, void (*fn)(struct ktimer *), void *data){
+    list_init(&timer->node);
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->data = data;
+    timer->cpu = -1;
+}
+
+void ktimer_arm(struct ktimer *timer, uint64_t expires){
+    ktimer_cancel(timer);
+
+    int cpu = get_current_core_id();
+    struct ktimer_base *base = &__percpu_ktimer_bases[cpu];
+
+    int_flags flags;
+    spinlock_lock_intsave(&base->lock, &flags);
+
+    // Timers are few and mostly far out, a linear walk is plenty
+    struct list_node *pos = base->timers.next;
+    while (pos != &base->timers) {
+        struct ktimer *other = container_of(pos, struct ktimer, node);
+        if (other->expires > expires)
+            break;
+        pos = pos->next;
+    }
+    timer->expires = expires;
+    timer->cpu = cpu;
+    list_add_tail(&timer->node, pos);
+    bool first = base->timers.next == &timer->node;
+
+    spinlock_unlock(&base->lock);
+    if (first)
+        tick_timer_changed(expires);
+    restore_interrupts(flags);
+}
+
+void ktimer_arm_ms(struct ktimer *timer, uint64_t ms){
+    ktimer_arm(timer, read_tsc() + ms * tsc_cycles_per_ms());
+}
+
+bool ktimer_cancel(struct ktimer *timer){
+    while (1) {
+        int cpu = *(volatile int *)&timer->cpu;
+        if (cpu == KTIMER_RUNNING) {
+            // Rearming itself from the callback, waiting would never end
+            if (this_core_read(ktimer_bases).running == timer)
+                return false;
+            cpu_relax();
+            continue;
+        }
+        if (cpu < 0)
+            return false;
+
+        struct ktimer_base *base = &__percpu_ktimer_bases[cpu];
+        int_flags flags;
+        spinlock_lock_intsave(&base->lock, &flags);
+        // Still on the list we locked, if it fired or moved try again
+        if (timer->cpu == cpu) {
+            list_del(&timer->node);
+            timer->cpu = -1;
+            spinlock_unlock_intrestore(&base->lock, flags);
+            return true;
+        }
+        spinlock_unlock_intrestore(&base->lock, flags);
+    }
+}
+
+uint64_t ktimer_next_expiry(void){
+    struct ktimer_base *base = &this_core_read(ktimer_bases);
+    uint64_t expires = UINT64_MAX;
+
+    spinlock_lock(&base->lock);
+    if (!list_empty(&base->timers))
+        expires = container_of(base->timers.next, struct ktimer, node)->expires;
+    spinlock_unlock(&base->lock);
+    return expires;
+}
+
+// Interrupts are off, the callbacks run without the lock so they can rearm
+void ktimer_run_expired(uint64_t now){
+    struct ktimer_base *base = &this_core_read(ktimer_bases);
+
+    spinlock_lock(&base->lock);
+    while (!list_empty(&base->timers)) {
+        struct ktimer *timer = container_of(base->timers.next, struct ktimer, node);
+        if (timer->expires > now)
+            break;
+
+        list_del(&timer->node);
+        timer->cpu = KTIMER_RUNNING;
+        base->running = timer;
+        spinlock_unlock(&base->lock);
+        timer->fn(timer);
+        spinlock_lock(&base->lock);
+        base->running = NULL;
+        // Unless it rearmed itself, after this it's the owner's again
+        if (timer->cpu == KTIMER_RUNNING)
+            *(volatile int *)&timer->cpu = -1;
+    }
+    spinlock_unlock(&base->lock);
+}
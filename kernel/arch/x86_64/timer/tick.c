@@ -0,0 +1,167 @@
+#include <kernel/tick.h>
+#include <kernel/ktimer.h>
+#include <kernel/apic.h>
+#include <kernel/timer.h>
+#include <kernel/cmdline.h>
+#include <kernel/scheduler.h>
+#include <kernel/memutils.h>
+#include <klib/string.h>
+
+enum tick_mode {
+    TICK_PERIODIC,
+    TICK_NOHZ_IDLE,
+    TICK_NOHZ_FULL,
+};
+
+static const char *tick_mode_names[] = { "periodic", "nohz idle", "nohz full" };
+
+struct tick_state {
+    uint64_t next_tick;     // TSC of the next scheduler tick, 0 while it's stopped
+    uint64_t armed;         // What the timer is set for, UINT64_MAX if nothing
+    uint64_t irqs;
+    uint64_t last_irqs;     // irqs at the last tick_print_stats
+    bool reduced;           // Stopped or slowed down, won't notice new work by itself
+};
+
+static enum tick_mode tick_mode = TICK_NOHZ_IDLE;
+static uint64_t tick_period;            // In TSC cycles
+static struct tick_state tick_states[MAX_CORES];
+static uint64_t last_stats_tsc;
+
+void tick_init(void){
+    const char *nohz = cmdline_get("nohz");
+    if (nohz && !strcmp(nohz, "off"))
+        tick_mode = TICK_PERIODIC;
+    else if (nohz && !strcmp(nohz, "full"))
+        tick_mode = TICK_NOHZ_FULL;
+    else if (nohz && strcmp(nohz, "idle"))
+        KWARN("Unknown nohz=%s, going with idle\n", nohz);
+
+    tick_period = tsc_cycles_per_ms() * 1000 / TICK_HZ;
+    last_stats_tsc = read_tsc();
+    ktimer_subsystem_init();
+
+    kprintf("Tick: %s, %s timer\n", tick_mode_names[tick_mode],
+            tick_mode == TICK_PERIODIC ? "periodic" :
+            apic_timer_tsc_deadline() ? "TSC deadline" : "one shot");
+}
+
+static void tick_program(struct tick_state *state){
+    uint64_t deadline = ktimer_next_expiry();
+    if (state->next_tick && state->next_tick < deadline)
+        deadline = state->next_tick;
+    if (deadline == state->armed)
+        return;
+
+    if (deadline == UINT64_MAX)
+        apic_timer_cancel();
+    else
+        apic_timer_arm(deadline);
+    state->armed = deadline;
+}
+
+void tick_start_cpu(void){
+    struct tick_state *state = &tick_states[get_current_core_id()];
+    state->irqs = 0;
+    state->last_irqs = 0;
+
+    if (tick_mode == TICK_PERIODIC) {
+        apic_timer_set_frequency(TICK_HZ);
+        apic_timer_enable();
+        return;
+    }
+
+    // Unmasked before arming, a one shot that expires while masked is lost
+    apic_timer_set_oneshot();
+    apic_timer_enable();
+    state->armed = UINT64_MAX;
+    state->next_tick = read_tsc() + tick_period;
+    state->reduced = false;
+    tick_program(state);
+}
+
+bool tick_interrupt(void){
+    struct tick_state *state = &tick_states[get_current_core_id()];
+    uint64_t now = read_tsc();
+    state->irqs++;
+
+    // Without one shot mode timers only get tick resolution
+    if (tick_mode == TICK_PERIODIC) {
+        ktimer_run_expired(now);
+        return true;
+    }
+
+    // Whatever it was armed for went off, tick_sched_update rearms it
+    state->armed = UINT64_MAX;
+    ktimer_run_expired(now);
+
+    // Stopped, or we are early and this was for a ktimer. The one shot
+    // count is rounded so allow a bit of slack
+    if (!state->next_tick || now + tick_period / 16 < state->next_tick)
+        return false;
+
+    // Missed ticks don't get replayed, we just go on from now
+    state->next_tick += tick_period;
+    if (state->next_tick <= now)
+        state->next_tick = now + tick_period;
+    return true;
+}
+
+void tick_sched_update(bool idle, bool alone){
+    if (tick_mode == TICK_PERIODIC)
+        return;
+
+    struct tick_state *state = &tick_states[get_current_core_id()];
+    uint64_t now = read_tsc();
+
+    if (idle) {
+        state->next_tick = 0;
+        state->reduced = true;
+    } else {
+        // Nobody to switch to, a tick a second is enough to keep the
+        // accounting going. Whoever queues a second task kicks us
+        uint64_t period = tick_period;
+        if (tick_mode == TICK_NOHZ_FULL && alone)
+            period = tick_period * TICK_HZ;
+
+        if (!state->next_tick || state->next_tick > now + period)
+            state->next_tick = now + period;
+        state->reduced = period != tick_period;
+    }
+
+    tick_program(state);
+}
+
+void tick_timer_changed(uint64_t expires){
+    if (tick_mode == TICK_PERIODIC)
+        return;
+
+    struct tick_state *state = &tick_states[get_current_core_id()];
+    if (expires < state->armed)
+        tick_program(state);
+}
+
+bool tick_reduced(int cpu){
+    return tick_mode != TICK_PERIODIC && *(volatile bool *)&tick_states[cpu].reduced;
+}
+
+bool tick_stopped(int cpu){
+    return tick_mode != TICK_PERIODIC && !*(volatile uint64_t *)&tick_states[cpu].next_tick;
+}
+
+void tick_print_stats(void){
+    int cpus = total_cpus ? total_cpus : 1;
+    uint64_t now = read_tsc();
+    uint64_t ms = (now - last_stats_tsc) / tsc_cycles_per_ms();
+    last_stats_tsc = now;
+
+    kprintf("Timer interrupts (%s, last %lu ms):\n", tick_mode_names[tick_mode], ms);
+    for (int i = 0; i < cpus; i++) {
+        struct tick_state *state = &tick_states[i];
+        uint64_t irqs = state->irqs;
+        uint64_t per_sec = ms ? (irqs - state->last_irqs) * 1000 / ms : 0;
+        state->last_irqs = irqs;
+        kprintf("     CPU %d: %lu/s, tick %s\n", i, per_sec,
+                tick_stopped(i) ? "stopped" : "running");
+    }
+}
@@ -1,5 +1,6 @@
 #include <kernel/timer.h>
 #include <kernel/klogging.h>
+#include <kernel/memutils.h>
 
 static void outb(uint16_t port, uint8_t val) {
     asm volatile ("outb %0, %1" : : "a"(val), "Nd"(port));
@@ -16,12 +17,6 @@ static uint8_t inb(uint16_t port) {
 }
 
 
-static inline uint64_t get_cpu_cycles(void) {
-    uint32_t lo, hi;
-    asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
-    return ((uint64_t)hi << 32) | lo;
-}
-
 // Pure CPU-based delay with calibration
 static uint64_t cpu_cycles_per_10ms = 0;
 
@@ -89,14 +84,14 @@ static void calibrate_with_rtc(void) {
     }
     
     // Now measure exactly 1 second using RTC
-    uint64_t start_cycles = get_cpu_cycles();
+    uint64_t start_cycles = read_tsc();
     start_second = current_second;
     
     while (current_second == start_second) {
         current_second = read_rtc_register(RTC_SECONDS);
     }
     
-    uint64_t end_cycles = get_cpu_cycles();
+    uint64_t end_cycles = read_tsc();
     uint64_t cycles_per_second = end_cycles - start_cycles;
     
     // Calculate 10ms worth of cycles
@@ -171,11 +166,16 @@ void cpu_wait_10ms(void) {
         calibrate_cpu_timing();
     }
     
-    uint64_t start = get_cpu_cycles();
+    uint64_t start = read_tsc();
     uint64_t target = start + cpu_cycles_per_10ms;
     
-    while (get_cpu_cycles() < target) {
+    while (read_tsc() < target) {
         asm volatile("pause");
     }
 }
 
+uint64_t tsc_cycles_per_ms(void) {
+    if (cpu_cycles_per_10ms == 0)
+        calibrate_cpu_timing();
+    return cpu_cycles_per_10ms / 10;
+}
@@ -0,0 +1,72 @@
+#ifndef __KERNEL_DS_RBTREE_H
+#define __KERNEL_DS_RBTREE_H
+
+// Same idea as the list, the node lives inside whatever we are sorting and
+// we get back to the owner with container_of. Loosely follows:
+// https://elixir.bootlin.com/linux/v6.6/source/include/linux/rbtree.h
+// but keeps an explicit parent pointer and color because it's easier to read
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <ds/lists.h>
+
+#define RB_RED   0
+#define RB_BLACK 1
+
+struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    int color;
+};
+
+struct rb_root {
+    struct rb_node *node;
+};
+
+#define RB_ROOT_INIT { NULL }
+
+// Optional, for trees that keep something computed from the subtree in each
+// node (max end, biggest gap...). Recompute has to rebuild the node's value
+// from its children only, the tree calls it bottom up after every change
+struct rb_augment {
+    void (*recompute)(struct rb_node *node);
+};
+
+static inline void rb_root_init(struct rb_root *root){
+    root->node = NULL;
+}
+
+static inline bool rb_empty(const struct rb_root *root){
+    return root->node == NULL;
+}
+
+// Caller walks down the tree to find where the node goes and hands us the
+// parent and the child pointer that should point at it, then calls
+// rb_insert_color to rebalance
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+                                                      struct rb_node **link){
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->color = RB_RED;
+    *link = node;
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root,
+                                const struct rb_augment *aug);
+void rb_erase(struct rb_node *node, struct rb_root *root,
+                                const struct rb_augment *aug);
+
+// Recomputes augmented values from node up to the root, for when the key
+// data of a node changes without the tree shape changing
+void rb_propagate(struct rb_node *node, const struct rb_augment *aug);
+
+struct rb_node* rb_first(const struct rb_root *root);
+struct rb_node* rb_last(const struct rb_root *root);
+struct rb_node* rb_next(const struct rb_node *node);
+struct rb_node* rb_prev(const struct rb_node *node);
+
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+
+#endif
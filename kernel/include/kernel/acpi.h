@@ -0,0 +1,40 @@
+#ifndef __KERNEL_ACPI_H
+#define __KERNEL_ACPI_H
+
+/* Just enough ACPI to find tables, nothing here runs AML. Tables are read
+ * straight through the HHDM so this works before any of our own memory 
+ * management is up */
+#include <stdint.h>
+#include <kernel/compiler.h>
+
+struct acpi_rsdp {
+    char signature[8];          // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;           // 0 for ACPI 1.0, everything after has the XSDT
+    uint32_t rsdt_address;
+    // ACPI 2.0+
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} _packed;
+
+struct acpi_sdt_header {
+    char signature[4];
+    uint32_t length;            // Whole table, header included
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} _packed;
+
+// Finds the RSDP and the root table, -1 if there's no usable ACPI
+int acpi_init(void);
+// First table with the signature ("SRAT", "SLIT", ...), NULL if there's none
+struct acpi_sdt_header *acpi_find_table(const char *signature);
+
+#endif
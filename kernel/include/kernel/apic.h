@@ -16,6 +16,8 @@
 #define APIC_DEST_FORMAT        0xE0
 #define APIC_SPURIOUS_VECTOR    0xF0
 #define APIC_ERROR_STATUS       0x280
+#define APIC_ICR_LOW            0x300
+#define APIC_ICR_HIGH           0x310
 #define APIC_LINT0              0x350
 #define APIC_LINT1              0x360
 #define APIC_ERROR              0x370
@@ -31,6 +33,13 @@
 #define APIC_TIMER_TSC_DEADLINE 0x00040000
 #define APIC_TIMER_VECTOR       0x40
 
+#define MSR_IA32_TSC_DEADLINE   0x6E0
+
+// Interrupt command register, fixed delivery to one physical destination
+#define APIC_ICR_PENDING        (1 << 12)
+#define APIC_ICR_ASSERT         (1 << 14)
+#define APIC_ICR_DEST_SHIFT     24
+
 int apic_global_init(void);
 int apic_timer_init_cpu(uint32_t cpu_id);
 void apic_timer_register_handler(void);
@@ -38,6 +47,17 @@ void apic_timer_register_handler(void);
 void apic_timer_calibrate(void);
 void apic_timer_set_frequency(uint32_t frequency);
 
+// One shot, TSC deadline when the CPU has it. Stays masked until enabled
+void apic_timer_set_oneshot(void);
+// Fires once at the given TSC value (right away if it's already past)
+void apic_timer_arm(uint64_t deadline);
+void apic_timer_cancel(void);
+bool apic_timer_tsc_deadline(void);
+
+void apic_eoi(void);
+// Fixed interrupt on the CPU with that local APIC ID
+void apic_send_ipi(uint32_t lapic_id, uint8_t vector);
+
 void apic_timer_enable(void);
 void apic_timer_disable(void);
 void apic_timer_handler(void);
@@ -229,7 +229,7 @@ static inline int atomic_try_cmpxchg(atomic *v, int *old_val, int new_val){
     char success;
     int prev = *old_val;
     __asm__ __volatile__(LOCK_PREFIX "cmpxchgl %3, %1; setz %0"
-                         : "=a" (success), "+m" (v->value), "+a" (prev)
+                         : "=qm" (success), "+m" (v->value), "+a" (prev)
                          : "r" (new_val)
                          : "memory");
     *old_val = prev;
@@ -240,7 +240,7 @@ static inline int atomic64_try_cmpxchg(atomic64 *v, long *old_val, long new_val)
     char success;
     long prev = *old_val;
     __asm__ __volatile__(LOCK_PREFIX "cmpxchgq %3, %1; setz %0"
-                         : "=a" (success), "+m" (v->value), "+a" (prev)
+                         : "=qm" (success), "+m" (v->value), "+a" (prev)
                          : "r" (new_val)
                          : "memory");
     *old_val = prev;
@@ -251,21 +251,21 @@ static inline int atomic64_try_cmpxchg(atomic64 *v, long *old_val, long new_val)
 static inline void atomic_set_bit(int bit, volatile unsigned long *addr){
     __asm__ __volatile__(LOCK_PREFIX "btsq %1, %0"
                          : "+m" (*addr)
-                         : "Ir" (bit)
+                         : "Ir" ((long)bit)
                          : "memory");
 }
 
 static inline void atomic_clear_bit(int bit, volatile unsigned long *addr){
     __asm__ __volatile__(LOCK_PREFIX "btrq %1, %0"
                          : "+m" (*addr)
-                         : "Ir" (bit)
+                         : "Ir" ((long)bit)
                          : "memory");
 }
 
 static inline void atomic_change_bit(int bit, volatile unsigned long *addr){
     __asm__ __volatile__(LOCK_PREFIX "btcq %1, %0"
                          : "+m" (*addr)
-                         : "Ir" (bit)
+                         : "Ir" ((long)bit)
                          : "memory");
 }
 
@@ -273,7 +273,7 @@ static inline int atomic_test_and_set_bit(int bit, volatile unsigned long *addr)
     char old_bit;
     __asm__ __volatile__(LOCK_PREFIX "btsq %2, %0; setc %1"
                          : "+m" (*addr), "=qm" (old_bit)
-                         : "Ir" (bit)
+                         : "Ir" ((long)bit)
                          : "memory");
     return old_bit;
 }
@@ -282,7 +282,7 @@ static inline int atomic_test_and_clear_bit(int bit, volatile unsigned long *add
     char old_bit;
     __asm__ __volatile__(LOCK_PREFIX "btrq %2, %0; setc %1"
                          : "+m" (*addr), "=qm" (old_bit)
-                         : "Ir" (bit)
+                         : "Ir" ((long)bit)
                          : "memory");
     return old_bit;
 }
@@ -291,7 +291,7 @@ static inline int atomic_test_and_change_bit(int bit, volatile unsigned long *ad
     char old_bit;
     __asm__ __volatile__(LOCK_PREFIX "btcq %2, %0; setc %1"
                          : "+m" (*addr), "=qm" (old_bit)
-                         : "Ir" (bit)
+                         : "Ir" ((long)bit)
                          : "memory");
     return old_bit;
 }
@@ -0,0 +1,46 @@
+#ifndef __KERNEL_BLKDEV_H
+#define __KERNEL_BLKDEV_H
+
+/* Anything that stores data in fixed size sectors (RAM disk for now, a 
+ * real disk driver later) sits behind one of these so swap doesn't care 
+ * what is actually on the other end. Requests are synchronous, the caller
+ * gets the data (or an error) when the call returns */
+#include <stdint.h>
+#include <ds/lists.h>
+
+#define SECTOR_SIZE 512
+#define BLKDEV_NAME_LEN 16
+
+struct block_device;
+
+struct blkdev_ops {
+    int (*read)(struct block_device *bdev, uint64_t sector, uint64_t count, void *buf);
+    int (*write)(struct block_device *bdev, uint64_t sector, uint64_t count, 
+                                                            const void *buf);
+    // Optional, the sectors hold nothing worth keeping anymore
+    int (*discard)(struct block_device *bdev, uint64_t sector, uint64_t count);
+};
+
+struct block_device {
+    char name[BLKDEV_NAME_LEN];
+    uint64_t nr_sectors;
+    const struct blkdev_ops *ops;
+    void *private;              // Whatever the driver needs
+    struct list_node list;
+};
+
+int blkdev_register(struct block_device *bdev);
+struct block_device *blkdev_find(const char *name);
+
+// All of these check the range against the device and return -1 if it 
+// doesn't fit or the driver fails
+int blkdev_read(struct block_device *bdev, uint64_t sector, uint64_t count, void *buf);
+int blkdev_write(struct block_device *bdev, uint64_t sector, uint64_t count, 
+                                                            const void *buf);
+int blkdev_discard(struct block_device *bdev, uint64_t sector, uint64_t count);
+
+// Sectors backed by kernel memory, allocated up front so writes never 
+// need memory (which matters when we swap to it)
+struct block_device *ramdisk_create(const char *name, uint64_t size);
+
+#endif
@@ -2,11 +2,65 @@
 #define __KERNEL_BUDDY_ALLOCATOR_H
 
 #define MAX_SUPPORTED_ORDER 20
-#define MAX_BUDDY_ARENAS 32
+#define MAX_BUDDY_ARENAS 64
 #define PAGE_FRAME_SIZE 4096
 
 #include <kernel/memutils.h>
 #include <kernel/klogging.h>
+#include <kernel/atomic.h>
+#include <ds/lists.h>
+
+// Bit numbers in page_frame flags, they get changed under different locks 
+// (LRU vs swap) so always go through the atomic bit helpers
+#define PG_LRU          0   // Sits on one of its node's LRU lists
+#define PG_ACTIVE       1   // ...the active one
+#define PG_REFERENCED   2   // Was accessed once already while on the inactive list
+#define PG_SWAPCACHE    3   // Holds the data of a swap slot, private is the entry
+#define PG_CLEAN        4   // Content is the same as what its swap slot holds
+#define PG_YOUNG        5   // Idle tracking took an accessed bit reclaim didn't see yet
+
+// Zones by what devices can reach, ISA DMA only sees the first 16MiB and 
+// plenty of PCI devices only do 32 bit addresses. Arenas never straddle a
+// boundary so every arena is in exactly one zone
+enum zone_type {
+    ZONE_DMA,
+    ZONE_DMA32,
+    ZONE_NORMAL,
+    MAX_NR_ZONES
+};
+
+#define ZONE_DMA_END        0x1000000UL
+#define ZONE_DMA32_END      0x100000000UL
+
+struct zone {
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+    atomic64 nr_free;
+    uint64_t nr_total;
+};
+
+extern struct zone zones[MAX_NR_ZONES];
+
+struct anon_family;
+
+// One of these exists for every page frame an arena hands out, we need it 
+// for things we can't store inside the page itself like reference counts
+// for pages shared between address spaces (copy on write)
+struct page_frame {
+    atomic refcount;            // Number of page table entries mapping this frame
+    uint8_t order;              // Order of the block this frame heads (freed with it)
+    uint8_t node;               // Memory node whose LRU lists the frame goes on
+    volatile unsigned long flags;
+
+    struct list_node lru;
+
+    // Reverse mapping of anonymous pages, every address space in the family
+    // that maps this frame maps it at index (fork keeps addresses as they are)
+    struct anon_family *mapping;
+    uint64_t index;
+    uint64_t private;           // Swap entry while PG_SWAPCACHE is set
+};
 
 struct free_block {
     uint8_t current_order;
@@ -18,27 +72,50 @@ struct buddy_arena{
     uint64_t base;              // Free memory starts at this address
     uint64_t length;            // Size in bytes
     uint8_t max_arena_order;    // Max power of 2 for block size 
+    uint8_t zone;
+    uint8_t node;               // NUMA node, arenas never straddle two either
     /* Array of pointers to free blocks differing in size by order of 2
      * freelist[20] is the biggest possible block which is 4GB and the 
      * lowest possible is freelist[0] which corresponds to a block size of 
      * 4096 bytes  (1 page)
      * each free_block points to the next from highest to lowest 20->0 */
     struct free_block *free_list[MAX_SUPPORTED_ORDER + 1];
+
+    // Frame metadata lives in the first pages of the arena itself, frame_base
+    // is the address frames[0] describes (the arena base before we carved it out)
+    struct page_frame *frames;
+    uint64_t frame_base;
+    uint64_t frame_count;
 };
 
 extern struct buddy_arena buddy_arenas[MAX_BUDDY_ARENAS];
 
+// Free pages over all arenas, cheap enough to check on every allocation
+uint64_t buddy_free_page_count(void);
+uint64_t buddy_total_page_count(void);
+uint64_t buddy_zone_free_page_count(enum zone_type zone);
+
 void buddy_allocator_init(void);
 int add_buddy_arena(uint8_t ba_cnt,uint64_t base, uint64_t len);
 void populate_buddy_blocks(uint8_t buddy_arena_counter);
+// Tries zone first and then the ones below it, so a plain allocation only 
+// eats into DMA memory once everything else is gone
+uint64_t buddy_alloc_pages_zone(uint8_t order, enum zone_type zone);
+// Nodes are tried closest to node first, only the ones in nodemask, and 
+// within each node the zones go the same way as above
+uint64_t buddy_alloc_pages_node(uint8_t order, enum zone_type zone, int node, uint64_t nodemask);
 uint64_t buddy_alloc_pages(uint8_t order); 
 uint64_t buddy_alloc_page(void);
 void buddy_free_pages(uint64_t phys_addr, uint8_t order);
 void buddy_free_page(uint64_t phys_addr);
 
+struct page_frame *phys_to_frame(uint64_t phys_addr);
+uint64_t frame_to_phys(struct page_frame *frame);
+
 // Debug functions
 void print_buddy_arena(uint8_t buddy_arena_counter);
 void print_arena_summary(uint8_t arena_idx);
+void print_zone_summary(void);
 
 static inline void* phys_to_virt(uint64_t phys_addr) {
     return (void*)(phys_addr + get_hhdm_offset());
@@ -0,0 +1,54 @@
+#ifndef __KERNEL_CMA_H
+#define __KERNEL_CMA_H
+
+/* Contiguous memory area. A physically contiguous chunk is set aside at 
+ * boot (cma=<size> on the command line) and kept out of the buddy allocator.
+ * While no driver needs it its pages get lent out for anonymous memory, when
+ * one asks for a contiguous range whatever got lent out in there is migrated
+ * somewhere else first. Same idea as Linux's CMA, with a single area */
+#include <kernel/buddy_allocator.h>
+#include <kernel/limine.h>
+#include <kernel/atomic.h>
+#include <stdbool.h>
+
+#define CMA_DEFAULT_SIZE    (16UL * 1024 * 1024)
+// Bounds the bitmaps, they are static since we run before any allocator
+#define CMA_MAX_SIZE        (256UL * 1024 * 1024)
+#define CMA_MAX_PAGES       (CMA_MAX_SIZE / PAGE_FRAME_SIZE)
+// Keeps the area out of the way of huge pages and gives drivers 2MiB alignment
+#define CMA_ALIGN           (2UL * 1024 * 1024)
+
+// How many candidate ranges cma_alloc tries before giving up
+#define CMA_ALLOC_RETRIES   8
+
+struct cma_stats {
+    atomic64 lent;              // Pages handed out for anonymous memory
+    atomic64 migrated;          // Lent pages moved out for a contiguous allocation
+    atomic64 migrate_failed;
+    atomic64 allocs;
+    atomic64 alloc_failed;
+};
+
+extern struct cma_stats cma_stats;
+
+// Picks the area out of the memory map, buddy_allocator_init calls it 
+// before any arena is set up so the range never makes it into the buddy
+void cma_reserve(struct limine_memmap_response *mmap);
+bool cma_contains(phys_addr phys);
+// [*start, *end) of the area, both 0 if there is none
+void cma_range(phys_addr *start, phys_addr *end);
+
+// One page for anonymous memory. Unless forced we only lend while the area
+// has more free pages than the buddy allocator does
+phys_addr cma_alloc_movable(bool force);
+// Last put of a lent page lands here instead of the buddy
+void cma_free_page(phys_addr phys);
+
+// nr_pages contiguous pages aligned to align_pages (a power of two), 
+// 0 if it can't be done
+phys_addr cma_alloc(uint64_t nr_pages, uint64_t align_pages);
+void cma_release(phys_addr phys, uint64_t nr_pages);
+
+void cma_print_stats(void);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef __KERNEL_CMDLINE_H
+#define __KERNEL_CMDLINE_H
+
+/* Kernel command line as handed over by Limine (the cmdline: line in 
+ * limine.conf). Arguments are split on spaces, either a bare flag like 
+ * "nosmp" or key=value like "cma=64M" */
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CMDLINE_MAX_LEN     512
+#define CMDLINE_MAX_ARGS    32
+
+// Copies the command line out of bootloader memory and splits it, 
+// has to run before anything asks for an argument
+void cmdline_init(void);
+
+// Value of key=value, NULL if it isn't there (or is a bare flag)
+const char *cmdline_get(const char *key);
+bool cmdline_has(const char *flag);
+
+// Size with an optional K, M or G suffix, def if missing or garbage
+uint64_t cmdline_get_size(const char *key, uint64_t def);
+
+// CPU list like "1,3-5" as a bitmask, 0 if missing or garbage
+uint64_t cmdline_get_cpu_mask(const char *key);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef __KERNEL_COMPLETION_H
+#define __KERNEL_COMPLETION_H
+
+// For waiting until something else is done, without the waiter and the one
+// finishing caring which of them gets there first
+#include <kernel/wait.h>
+
+struct completion {
+    unsigned int done;              // Under wait.lock
+    struct wait_queue_head wait;
+};
+
+#define COMPLETION_INIT(name) \
+    { .done = 0, .wait = WAIT_QUEUE_HEAD_INIT((name).wait) }
+
+#define DEFINE_COMPLETION(name) \
+    struct completion name = COMPLETION_INIT(name)
+
+void init_completion(struct completion *c);
+// Back to not done, nobody may be waiting on it
+void reinit_completion(struct completion *c);
+void wait_for_completion(struct completion *c);
+// False if it still wasn't done after ms
+bool wait_for_completion_timeout(struct completion *c, uint64_t ms);
+// Lets one waiter through (or the next one to come along)
+void complete(struct completion *c);
+// Everybody, now and from now on
+void complete_all(struct completion *c);
+bool completion_done(struct completion *c);
+
+#endif
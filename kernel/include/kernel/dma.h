@@ -0,0 +1,18 @@
+#ifndef __KERNEL_DMA_H
+#define __KERNEL_DMA_H
+
+/* Buffers devices and the CPU can both touch without any syncing. On x86 
+ * DMA snoops the caches so plain write back memory through the HHDM is 
+ * already coherent, and with no IOMMU the address the device gets is just 
+ * the physical one. Anything bigger than a page comes out of the contiguous
+ * area first since that's where big runs can still be found after uptime */
+#include <kernel/memutils.h>
+#include <stddef.h>
+
+// Zeroed, page granular and physically contiguous. Returns the kernel 
+// address and puts the one for the device into dma_handle
+void *dma_alloc_coherent(size_t size, phys_addr *dma_handle);
+// Same size as the allocation, like Linux wants it
+void dma_free_coherent(size_t size, void *vaddr, phys_addr dma_handle);
+
+#endif
@@ -9,6 +9,8 @@
 struct limine_framebuffer *fb_get(void);
 
 int fb_init(void);
+// Switches drawing over to a write combining mapping, needs the VMM up
+int fb_remap_wc(void);
 void fb_put_pixel(uint32_t x, uint32_t y, uint32_t color);
 void fb_clear(uint32_t color);
 void fb_put_char(char c, uint32_t x, uint32_t y, uint32_t fg_color, uint32_t bg_color);
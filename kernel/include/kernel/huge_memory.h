@@ -0,0 +1,45 @@
+#ifndef __KERNEL_HUGE_MEMORY_H
+#define __KERNEL_HUGE_MEMORY_H
+
+/* Transparent huge pages for anonymous user memory. Write faults in a 
+ * region that covers a whole aligned 2MiB range get a 2MiB page straight 
+ * away, khugepaged collapses fully populated and recently used runs of 
+ * 4KiB pages later on and anything that only touches part of a huge page
+ * (mprotect, munmap, brk) splits it first */
+#include <kernel/memmgr.h>
+#include <kernel/atomic.h>
+
+// How many 4KiB PTEs khugepaged looks at per pass before going back to sleep
+#define KHUGEPAGED_SCAN_PAGES   4096
+// Between two passes
+#define KHUGEPAGED_SLEEP_MS     1000
+// A run is only worth collapsing if at least this many of its pages got 
+// accessed since the last pass
+#define KHUGEPAGED_MIN_ACCESSED 256
+
+struct thp_stats {
+    atomic64 huge_faults;       // Faults served with a 2MiB page
+    atomic64 fault_fallbacks;   // Faults that wanted one but no order 9 block was free
+    atomic64 cow_copies;        // Huge copy on write faults that copied all 2MiB
+    atomic64 collapses;         // Runs of 4KiB pages merged by khugepaged
+    atomic64 splits;            // Huge pages split back into 4KiB ones
+    atomic64 scanned;           // PTEs khugepaged looked at
+};
+
+extern struct thp_stats thp_stats;
+
+// 0 if the fault got a huge page, -1 if the caller should map 4KiB pages
+int thp_anon_fault(struct mem_descriptor *mm, struct mem_region *region, 
+                                                    virt_addr fault_addr);
+// 0 when resolved, 1 when the page got split and the 4KiB copy on write 
+// path has to finish the job, -1 on failure
+int thp_cow_fault(struct mem_descriptor *mm, page_table_entry *pde, virt_addr vaddr);
+
+int thp_split(struct mem_descriptor *mm, virt_addr vaddr);
+// Splits the huge pages [start, end) only partially covers
+int thp_split_range_edges(struct mem_descriptor *mm, virt_addr start, virt_addr end);
+
+void khugepaged_init(void);
+void thp_print_stats(void);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef __KERNEL_IOREMAP_H
+#define __KERNEL_IOREMAP_H
+
+/* Mapping device memory (MMIO registers, framebuffers) into the kernel half
+ * with the caching it needs. Mappings come out of their own virtual range 
+ * and use 2MiB pages wherever the physical range allows it */
+#include <kernel/vmm.h>
+
+#define IA32_PAT_MSR    0x277
+
+// Memory types as the PAT encodes them
+#define PAT_UC  0x00
+#define PAT_WC  0x01
+#define PAT_WT  0x04
+#define PAT_WB  0x06
+
+// Our PAT: WB, WC, WT, UC and the same again in the upper half so the PAT 
+// bit (which sits in a different place in 2MiB entries) never matters. 
+// PWT|PCD keeps meaning UC like it does by default, and Limine's WC entry 
+// (PAT|PWT) stays WC in the HHDM mapping it made of the framebuffer
+#define PAT_LAYOUT  (((uint64_t)PAT_WB << 0)  | ((uint64_t)PAT_WC << 8)  | \
+                     ((uint64_t)PAT_WT << 16) | ((uint64_t)PAT_UC << 24) | \
+                     ((uint64_t)PAT_WB << 32) | ((uint64_t)PAT_WC << 40) | \
+                     ((uint64_t)PAT_WT << 48) | ((uint64_t)PAT_UC << 56))
+
+// What ioremap takes, and the PTE bits that select it with the layout above
+#define IOREMAP_UC  0
+#define IOREMAP_WC  1
+#define IOREMAP_WT  2
+#define IOREMAP_WB  3
+
+// 256GiB right below where the kernel image sits, same PML4 entry (511) 
+// so every address space sees new mappings without copying anything
+#define IOREMAP_START   0xFFFFFF8000000000UL
+#define IOREMAP_END     0xFFFFFFC000000000UL
+
+// Programs the PAT on the calling CPU, every CPU has to run it
+void pat_init_cpu(void);
+
+// Returns the virtual address of phys (doesn't have to be page aligned) 
+// or NULL if it couldn't be mapped
+void *ioremap(phys_addr phys, size_t size, int attr);
+void iounmap(void *addr);
+
+#endif
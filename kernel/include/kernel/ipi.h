@@ -0,0 +1,23 @@
+#ifndef __KERNEL_IPI_H
+#define __KERNEL_IPI_H
+
+/* IPIs whose sender spins until every target answered (TLB shootdowns).
+ * Handlers run with interrupts off, so a CPU spinning inside one never 
+ * takes the IPI, and if the sender holds what it spins on neither of them
+ * ever gets anywhere. Every spin wait loop relaxes through cpu_relax, 
+ * which answers whatever is pending for us in place of the IPI */
+#include <kernel/atomic.h>
+
+// Bit per CPU that still owes an answer, the sender clears nothing itself
+extern volatile unsigned long ipi_sync_pending;
+
+// Does what the pending IPIs would have, harmless if there are none
+void ipi_sync_handle(void);
+
+static inline void cpu_relax(void){
+    if (ipi_sync_pending)
+        ipi_sync_handle();
+    cpu_pause();
+}
+
+#endif
@@ -2,9 +2,9 @@
 #define __KERNEL_ISR_DISPATCHER_H
 
 #include <kernel/regs.h> 
+#include <kernel/smp.h>
 #include <stdint.h>
-
-#define KERNEL_SPACE_START 0xFFFF800000000000
+#include <stdbool.h>
 
 extern void isr0(void);
 extern void isr1(void);
@@ -41,6 +41,13 @@ extern void isr31(void);
 
 extern void build_iretq_frame(struct task_context*);
 
+DECLARE_PER_CPU(bool, in_irq);
+
+// Handling a hardware interrupt (or IPI) on this CPU, exceptions don't count
+static inline bool in_interrupt(void){
+    return this_core_read(in_irq);
+}
+
 void print_hex(uint32_t val);
 void isr_dispatch(struct interrupt_frame *fr);
 void print_check(void);
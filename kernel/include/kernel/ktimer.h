@@ -0,0 +1,36 @@
+#ifndef __KERNEL_KTIMER_H
+#define __KERNEL_KTIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <ds/lists.h>
+
+// One shot software timers. Each CPU keeps its own list sorted by expiry and
+// the local APIC timer gets armed for the first one, so a CPU with nothing 
+// to run and no timers pending takes no timer interrupts at all
+struct ktimer {
+    struct list_node node;
+    uint64_t expires;               // TSC
+    // Runs from the timer interrupt on the CPU that armed it
+    void (*fn)(struct ktimer *timer);
+    void *data;
+    int cpu;                        // Whose list it is on, -1 when not armed
+};
+
+// cpu while its callback runs, cancelling it waits for that to finish so an
+// on stack timer can go away as soon as ktimer_cancel returns
+#define KTIMER_RUNNING  (-2)
+
+void ktimer_subsystem_init(void);
+void ktimer_init(struct ktimer *timer, void (*fn)(struct ktimer *), void *data);
+// (Re)arms it on the current CPU
+void ktimer_arm(struct ktimer *timer, uint64_t expires);
+void ktimer_arm_ms(struct ktimer *timer, uint64_t ms);
+// True if it was still pending. Callable from the timer's own callback
+bool ktimer_cancel(struct ktimer *timer);
+
+// Current CPU, UINT64_MAX when nothing is pending
+uint64_t ktimer_next_expiry(void);
+void ktimer_run_expired(uint64_t now);
+
+#endif
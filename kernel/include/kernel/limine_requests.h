@@ -8,6 +8,8 @@ struct limine_memmap_request* get_memmap_request(void);
 struct limine_hhdm_request* get_hhdm_request(void);
 struct limine_kernel_address_request* get_kernel_address_request(void);
 struct limine_smp_request* get_smp_request(void);
+struct limine_kernel_file_request* get_kernel_file_request(void);
+struct limine_rsdp_request* get_rsdp_request(void);
 
 #endif
 
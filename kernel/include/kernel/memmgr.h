@@ -5,15 +5,26 @@
  * we use this to handle memory for processes and threads 
  * which we uniformally call tasks */
 #include <kernel/vmm.h>
+#include <kernel/spinlock.h>
+#include <ds/rbtree.h>
 
 #define STACK_SIZE (8 * 1024 * 1024)    // 8MB stack
 #define STACK_TOP 0x00007FFFFFFFFFFF
+#define USER_SPACE_END (STACK_TOP + 1)
 
-#define HEAP_GROW_SIZE (64 * 1024)   
-#define HEAP_GROW_ORDER 4               // 2^4 = 16 pages = 64KiB
+// mmap never hands out anything below this so NULL derefs keep faulting
+#define MMAP_MIN_ADDR 0x10000
+
+// Fault around window, each fault that continues right where the last one 
+// left off doubles it, anything else halves it. 512 pages = 2MiB
+#define FAULT_AROUND_MIN_PAGES 1
+#define FAULT_AROUND_MAX_PAGES 512
 #define HEAP_SIZE (1024 * 1024 * 1024)  // 1GB heap 
 #define GUARD_SIZE PAGE_SIZE 
 
+// How many recent mm_find_region hits we remember per memory descriptor
+#define MM_REGION_CACHE_SIZE 4
+
 // Page fault error code bits 
 #define PF_PRESENT    (1 << 0)  // Page was present (1) or not present (0)
 #define PF_WRITE      (1 << 1)  // Write (1) or read (0) access
@@ -29,32 +40,112 @@
 #define RP_STACK    (1 << 4)  // Special stack region
 #define RP_SHARED   (1 << 5)  // Shared between processes
 
+// mmap prot and flags, same values as Linux so userspace headers just work
+#define PROT_NONE       0x0
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+#define PROT_EXEC       0x4
+
+#define MAP_SHARED      0x01
+#define MAP_PRIVATE     0x02
+#define MAP_FIXED       0x10
+#define MAP_ANONYMOUS   0x20
+#define MAP_POPULATE    0x8000
+
+#define MAP_FAILED ((virt_addr)-1)
+
+// What idle tracking found in a region on its last pass over it, in 4KiB 
+// pages (a 2MiB page counts 512 times)
+struct idle_hist {
+    uint64_t hot;       // Accessed since the pass before
+    uint64_t warm;      // Accessed within the last IDLE_COLD_AGE passes
+    uint64_t cold;
+    uint64_t dirty;     // Written since the pass before
+};
+
+// end is inclusive, regions never overlap
 struct mem_region{
     virt_addr start;
     virt_addr end;
     uint64_t flags;
-    struct mem_region* next;
+    struct rb_node rb_node;  // Links into mem_descriptor regions, sorted by start
+
+    // Free space between the previous region (or MMAP_MIN_ADDR) and us, and
+    // the biggest such gap anywhere in our subtree so mmap can skip whole 
+    // subtrees that have no room
+    uint64_t gap_before;
+    uint64_t subtree_gap;
+
+    // Where the last fault around batch started and ended (exclusive) and 
+    // how many pages the next one will map
+    virt_addr fault_start;
+    virt_addr fault_end;
+    uint64_t fault_window;
+
+    // Published once a pass gets through the whole region, the scan one 
+    // fills up in the meantime. Split or merged regions keep what they had 
+    // until the next pass comes around
+    struct idle_hist idle;
+    struct idle_hist idle_scan;
+};
+
+// Address spaces that can share anonymous pages, a task and everything it
+// forked. A frame only has to remember its family and address to find 
+// every PTE that might map it. Counts both members and frames pointing here
+struct anon_family {
+    spinlock lock;
+    struct list_node mms;
+    atomic refcount;
 };
 
 struct mem_descriptor{
     struct addr_space *as;
-    // Regions such as text, data, stack, heap sections and others (linked list)
-    struct mem_region *regions; 
-
+    // The owning task plus whoever (khugepaged) is looking at it without
+    // holding the task list, the last mm_put frees it
+    atomic users;
+    // Serializes changes to the regions and page tables between the owner 
+    // (faults, mmap and friends) and khugepaged
+    spinlock lock;
+
+    // Regions such as text, data, stack, heap sections and others 
+    struct rb_root regions; 
+    uint64_t region_count;
+
+    // Faults tend to hit the same few regions over and over, this saves 
+    // us a tree walk for those. Any change to the tree clears it
+    struct mem_region *region_cache[MM_REGION_CACHE_SIZE];
+    int region_cache_next;
+
+    virt_addr start_brk;  // Where the heap begins, brk can't go below this
     virt_addr brk;
-    virt_addr mmap_base;
+    virt_addr mmap_base;  // mmap hands out ranges top down from here
 
     uint64_t total_vm;
     uint64_t rss; // Resident set size (how many pages in RAM the task has)
+    // Working set, hot and warm pages over all regions as of the last 
+    // complete idle tracking pass (of which there were idle_passes)
+    uint64_t wss_pages;
+    uint64_t idle_passes;
+
+    struct anon_family *family;
+    struct list_node family_node;
 };
 
 struct mem_descriptor* mm_alloc(void);
 void mm_free(struct mem_descriptor *mm);
+void mm_get(struct mem_descriptor *mm);
+void mm_put(struct mem_descriptor *mm);
 struct mem_descriptor* mm_copy(struct mem_descriptor *old_mm);  // for fork()
 
 int mm_setup_executable(struct mem_descriptor *mm, virt_addr code_start, 
                        virt_addr code_end, virt_addr data_end);
 
+// Sets up the shared zero page, has to run after vmm_init()
+int mm_init(void);
+
+void anon_family_get(struct anon_family *family);
+void anon_family_put(struct anon_family *family);
+
 // brk() is for heap 
 virt_addr mm_brk(struct mem_descriptor *mm, virt_addr new_brk);
 
@@ -62,16 +153,53 @@ struct mem_region* mm_find_region(struct mem_descriptor *mm, virt_addr addr);
 int mm_add_region(struct mem_descriptor *mm, virt_addr start, 
                                 virt_addr end, uint64_t flags);
 int mm_remove_region(struct mem_descriptor *mm, virt_addr start, virt_addr end);
+struct mem_region* mm_merge_region(struct mem_descriptor *mm, struct mem_region *region);
+
+static inline struct mem_region* mm_first_region(struct mem_descriptor *mm){
+    struct rb_node *node = rb_first(&mm->regions);
+    return node ? rb_entry(node, struct mem_region, rb_node) : NULL;
+}
+
+static inline struct mem_region* mm_next_region(struct mem_region *region){
+    struct rb_node *node = rb_next(&region->rb_node);
+    return node ? rb_entry(node, struct mem_region, rb_node) : NULL;
+}
+
+static inline struct mem_region* mm_prev_region(struct mem_region *region){
+    struct rb_node *node = rb_prev(&region->rb_node);
+    return node ? rb_entry(node, struct mem_region, rb_node) : NULL;
+}
 
 // for mmap()
 int mm_munmap(struct mem_descriptor *mm, virt_addr addr, size_t len);
 virt_addr mm_mmap(struct mem_descriptor *mm, virt_addr addr, size_t len, 
                                                     int prot, int flags);
 
+int mm_mprotect(struct mem_descriptor *mm, virt_addr addr, size_t len, int prot);
+
 bool mm_check_access(struct mem_descriptor *mm, virt_addr addr, uint64_t flags);
 
+// Leaf PTE flags a page in this region gets mapped with
+static inline uint64_t mm_region_pte_flags(struct mem_region *region){
+    uint64_t flags = PTE_PRESENT;
+    // PROT_NONE keeps the pages but user mode can't touch them
+    if (region->flags & (RP_READ | RP_WRITE | RP_EXEC))
+        flags |= PTE_USER;
+    if (region->flags & RP_WRITE)
+        flags |= PTE_WRITABLE;
+    if (!(region->flags & RP_EXEC))
+        flags |= PTE_NX;
+    return flags;
+}
+
 int mm_expand_stack(struct mem_descriptor *mm, virt_addr fault_addr);
-int mm_expand_heap(struct mem_descriptor *mm, virt_addr fault_addr);
-void mm_page_fault_handler(uint64_t fault_addr, uint64_t error_code);
+int mm_expand_heap(struct mem_descriptor *mm, virt_addr fault_addr, bool write);
+int mm_handle_cow_fault(struct mem_descriptor *mm, virt_addr fault_addr);
+int mm_anon_fault(struct mem_descriptor *mm, struct mem_region *region, 
+                                        virt_addr fault_addr, bool write);
+int mm_swap_fault(struct mem_descriptor *mm, struct mem_region *region, 
+                                virt_addr fault_addr, page_table_entry *pte);
+// Returns 0 if the fault was resolved and the task can continue
+int mm_page_fault_handler(uint64_t fault_addr, uint64_t error_code);
 
 #endif
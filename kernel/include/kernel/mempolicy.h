@@ -0,0 +1,29 @@
+#ifndef __KERNEL_MEMPOLICY_H
+#define __KERNEL_MEMPOLICY_H
+
+/* Per task NUMA memory policy, decides which node the task's pages come 
+ * from. Kernel tasks and early boot always allocate locally */
+#include <stdint.h>
+
+enum mempolicy_mode {
+    MPOL_LOCAL,         // Node of the CPU we're on, anything else if it's full
+    MPOL_BIND,          // Only the nodes in the mask, closest first
+    MPOL_INTERLEAVE,    // Round robin over the mask, page by page
+};
+
+struct mempolicy {
+    uint8_t mode;
+    uint64_t nodes;     // Bit per node, unused for MPOL_LOCAL
+    int il_next;        // Next node interleave hands out
+};
+
+struct task;
+
+// -1 if the mode is unknown or the mask has no node that exists
+int task_set_mempolicy(struct task *task, int mode, uint64_t nodes);
+// Node to try first and which nodes we may fall back to for the current task
+int mempolicy_node(uint64_t *nodemask);
+// Nodes whose CPUs the task should run on, all of them if it doesn't care
+uint64_t mempolicy_cpu_nodes(struct task *task);
+
+#endif
@@ -22,6 +22,36 @@ static inline phys_addr get_cr3(void) {
     return cr3;
 }
 
+// CR4.PGE enables global pages, entries marked with PTE_GLOBAL survive CR3 reloads
+#define CR4_PGE (1UL << 7)
+
+static inline uint64_t get_cr4(void) {
+    uint64_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void set_cr4(uint64_t cr4) {
+    __asm__ volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+static inline uint64_t read_msr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void write_msr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr" :: "c"(msr), "a"((uint32_t)value), 
+                                "d"((uint32_t)(value >> 32)) : "memory");
+}
+
+static inline uint64_t read_tsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
 static inline uint64_t get_hhdm_offset(void){ 
     struct limine_hhdm_request *hhdm_request = get_hhdm_request();
     
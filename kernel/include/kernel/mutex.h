@@ -0,0 +1,34 @@
+#ifndef __KERNEL_MUTEX_H
+#define __KERNEL_MUTEX_H
+
+/* Sleeping lock for task context, never from an interrupt handler. While 
+ * whoever holds it is running on another CPU we spin, it'll probably let go
+ * before a sleep and wakeup would even be done. Once the owner itself is 
+ * off the CPU (or we are wanted elsewhere) we go to sleep on the wait queue
+ * and unlock wakes one of us up */
+#include <kernel/wait.h>
+#include <kernel/atomic.h>
+
+struct mutex {
+    atomic64 owner;                 // struct task * of the holder, 0 when free
+    struct wait_queue_head wait;
+};
+
+#define MUTEX_INIT(name) \
+    { .owner = ATOMIC64_INIT(0), .wait = WAIT_QUEUE_HEAD_INIT((name).wait) }
+
+#define DEFINE_MUTEX(name) \
+    struct mutex name = MUTEX_INIT(name)
+
+void mutex_init(struct mutex *m);
+void mutex_lock(struct mutex *m);
+bool mutex_trylock(struct mutex *m);
+void mutex_unlock(struct mutex *m);
+
+static inline bool mutex_is_locked(struct mutex *m){
+    return atomic64_read(&m->owner) != 0;
+}
+
+void mutex_print_stats(void);
+
+#endif
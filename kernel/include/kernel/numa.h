@@ -0,0 +1,52 @@
+#ifndef __KERNEL_NUMA_H
+#define __KERNEL_NUMA_H
+
+/* NUMA topology from the ACPI SRAT (which memory and which CPUs sit on 
+ * which node) and SLIT (how far nodes are from each other). Without them
+ * everything is node 0. Proximity domains are renumbered to dense node ids
+ * in the order the SRAT mentions them */
+#include <stdint.h>
+#include <stdbool.h>
+#include <kernel/atomic.h>
+
+#define MAX_NUMA_NODES      8
+#define NUMA_MAX_RANGES     32
+#define NUMA_ALL_NODES      ((1UL << MAX_NUMA_NODES) - 1)
+
+// SLIT distances, 10 is local by definition
+#define NUMA_LOCAL_DISTANCE     10
+#define NUMA_REMOTE_DISTANCE    20
+
+// Counted on the node the page came from, same meaning as Linux's vmstat
+struct numa_stats {
+    atomic64 hit;       // Came from the node we asked for
+    atomic64 miss;      // Came from here although another node was asked for
+    atomic64 local;     // Allocated by a CPU on this node
+    atomic64 remote;    // Allocated by a CPU on another node
+};
+
+extern int nr_numa_nodes;
+extern struct numa_stats numa_stats[MAX_NUMA_NODES];
+
+// Has to run before the buddy allocator since arenas get split per node.
+// numa=off on the command line skips it
+void numa_init(void);
+// Each CPU reports its LAPIC id once its per CPU data is set up
+void numa_cpu_online(uint32_t cpu, uint32_t lapic_id);
+
+int phys_to_node(uint64_t phys);
+// Where the node range containing phys (or the gap it's in) ends, arenas 
+// get cut there so each one belongs to a single node
+uint64_t numa_range_end(uint64_t phys);
+
+int cpu_to_node(int cpu);
+// Node of the CPU we're running on
+int numa_node_id(void);
+int numa_distance(int from, int to);
+// i-th closest node to node, i = 0 is node itself
+int numa_fallback_node(int node, int i);
+
+void numa_count_alloc(int got, int wanted);
+void numa_print_stats(void);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef __KERNEL_PAGE_IDLE_H
+#define __KERNEL_PAGE_IDLE_H
+
+/* Idle page tracking. kidled keeps walking every task's regions, harvesting
+ * (and clearing) the accessed and dirty bits of their leaf entries. How many
+ * passes in a row found a page untouched is kept in the PTE itself, which 
+ * sorts every page into hot, warm or cold per region and gives each task a
+ * working set estimate: everything that got used in the last few passes */
+#include <kernel/memmgr.h>
+#include <kernel/atomic.h>
+
+// Leaf entries looked at per chunk (IDLE_CHUNK_SLEEP_MS apart), a 2MiB
+// entry counts as one
+#define IDLE_SCAN_PAGES     512
+// A new pass starts at most this often, so a page's age is roughly in 
+// seconds as long as a pass fits in there
+#define IDLE_PASS_MS        1000
+// Break between two chunks of the same pass
+#define IDLE_CHUNK_SLEEP_MS 10
+// Untouched for this many passes and it's cold
+#define IDLE_COLD_AGE       4
+
+struct idle_stats {
+    atomic64 scanned;       // Leaf entries looked at
+    atomic64 passes;        // Complete passes over every task
+};
+
+extern struct idle_stats idle_stats;
+
+void kidled_init(void);
+// Every task's working set and the histogram of each of its regions
+void idle_print_stats(void);
+
+#endif
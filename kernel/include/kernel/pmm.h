@@ -23,4 +23,17 @@ void kfree(void* ptr);
 uint64_t pmm_alloc_page(void);
 void pmm_free_page(uint64_t phys);
 
+// A refcounted block of 2^order frames, only the head frame's metadata is 
+// used and the whole block goes back to the buddy allocator with the last put
+uint64_t pmm_alloc_pages(uint8_t order);
+// Same but nothing above zone, for devices that can't reach all of memory
+uint64_t pmm_alloc_pages_zone(uint8_t order, enum zone_type zone);
+
+// Reference counting for frames mapped into user address spaces,
+// pmm_alloc_page hands out frames with a count of 1 and the last 
+// pmm_put_page returns the frame to the buddy allocator
+void pmm_get_page(uint64_t phys);
+void pmm_put_page(uint64_t phys);
+int pmm_page_refcount(uint64_t phys);
+
 #endif
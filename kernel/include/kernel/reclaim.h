@@ -0,0 +1,85 @@
+#ifndef __KERNEL_RECLAIM_H
+#define __KERNEL_RECLAIM_H
+
+/* Page reclaim for anonymous user memory. Every such page sits on an active
+ * or inactive LRU list of its memory node, aging is done by harvesting the
+ * accessed bits of the PTEs that map it (found through the reverse mapping)
+ * so pages that keep getting touched stay active and the rest drift to the
+ * tail of the inactive list where kswapd (or an allocation that came up
+ * empty) writes them out to swap */
+#include <kernel/memmgr.h>
+#include <kernel/buddy_allocator.h>
+#include <kernel/spinlock.h>
+#include <kernel/atomic.h>
+#include <kernel/numa.h>
+
+// One per NUMA node, pages go on the lists of the node they're on
+#define MAX_MEM_NODES       MAX_NUMA_NODES
+
+// How many pages get isolated from a list at a time
+#define SWAP_CLUSTER_MAX    32
+// Each round scans (LRU size >> priority) pages, dropping the priority
+// every time a round doesn't free enough. Same as Linux's DEF_PRIORITY
+#define RECLAIM_PRIORITY    12
+
+// A page shared by more address spaces than this doesn't get migrated
+#define MIGRATE_MAX_MAPPINGS 16
+
+// Longest kswapd sleeps without a wakeup before checking the watermarks
+#define KSWAPD_SLEEP_MS     100
+
+struct mem_node {
+    spinlock lru_lock;
+    struct list_node active;
+    struct list_node inactive;
+    uint64_t nr_active;
+    uint64_t nr_inactive;
+};
+
+extern struct mem_node mem_nodes[MAX_MEM_NODES];
+extern int nr_mem_nodes;
+
+struct reclaim_stats {
+    atomic64 scanned;           // Inactive pages looked at
+    atomic64 activated;         // Inactive pages that turned out to be in use
+    atomic64 deactivated;       // Active pages nobody touched since the last look
+    atomic64 reclaimed;         // Pages freed
+    atomic64 direct_reclaims;   // Allocations that had to reclaim themselves
+    atomic64 kswapd_wakeups;
+};
+
+extern struct reclaim_stats reclaim_stats;
+
+// Sets up the nodes and watermarks, has to run after the buddy allocator
+void reclaim_init(void);
+void kswapd_init(void);
+
+// Called on allocation, wakes kswapd up once we dip under the low watermark
+void reclaim_check_watermarks(void);
+bool reclaim_below_low_watermark(void);
+
+// pmm_alloc_page that reclaims and tries again if it comes up empty
+phys_addr alloc_page_or_reclaim(void);
+uint64_t reclaim_pages(uint64_t nr_pages);
+// For anonymous pages that can be migrated later, may come out of CMA
+phys_addr alloc_movable_page(void);
+
+// Moves an anonymous page to a fresh frame and repoints every PTE that 
+// maps it, the old frame is freed on success. 0 also if it was free already
+int migrate_page(phys_addr old_phys);
+
+// New anonymous pages start on the inactive list, they have to prove
+// themselves before they get to stay
+void lru_add_page(phys_addr phys);
+
+// Points the frame's reverse mapping at mm's family if it has none yet
+void page_set_anon_rmap(phys_addr phys, struct mem_descriptor *mm, virt_addr vaddr);
+// Frame idx of a huge page that got split takes over the head's mapping
+void rmap_inherit_huge(phys_addr phys, phys_addr head, int idx);
+
+// pmm calls this once the last reference to a frame is gone
+void page_frame_release(struct page_frame *frame);
+
+void reclaim_print_stats(void);
+
+#endif
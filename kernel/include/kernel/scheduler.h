@@ -1,24 +1,251 @@
 #ifndef __KERNEL_SCHEDULER_H
 #define __KERNEL_SCHEDULER_H
 
+/* The core only keeps per CPU runqueues and switches tasks, which task runs
+ * next is up to the scheduling class of the tasks involved. Classes are 
+ * checked in order, a runnable task of an earlier class always wins.
+ *
+ * rt:   POSIX style SCHED_FIFO and SCHED_RR, ahead of everything else. A 
+ *       queue per rt_priority (0 first), FIFO runs until it sleeps or 
+ *       something more important wakes up, RR also rotates within its 
+ *       level. Per CPU RT tasks get SCHED_RT_RUNTIME_MS out of every 
+ *       SCHED_RT_PERIOD_MS, after that they're throttled till the period 
+ *       ends so a runaway one can't lock up the CPU
+ * prio: O(1) scheduler in the style of Linux 2.6. Two priority arrays per 
+ *       CPU, a queue per priority level plus a bitmap of the levels that 
+ *       aren't empty. Next task is the head of the first set bit's queue in
+ *       the active array, a task that used up its timeslice moves to the 
+ *       expired array and once active runs dry the two swap
+ * fair: CFS style. Tasks sit in a red-black tree keyed by virtual runtime
+ *       (TSC cycles scaled by weight), the leftmost one runs and gets 
+ *       preempted once it had its share of the latency period
+ *
+ * New tasks get the prio class unless the command line says sched=fair.
+ *
+ * Every task has a mask of the CPUs it may run on, placement, wakeups and
+ * the balancer all stay inside it. CPUs given with isolcpus= are left out
+ * of the default mask and never balance, only tasks pinned there run there */
 #include <kernel/tasks.h>
 #include <kernel/regs.h>
 #include <kernel/smp.h>
+#include <kernel/spinlock.h>
+#include <kernel/ktimer.h>
+#include <ds/rbtree.h>
+
+#define SCHED_NR_PRIO       (MAX_PRIO + 1)
+#define SCHED_BITMAP_WORDS  ((SCHED_NR_PRIO + 63) / 64)
+
+// In timer ticks (10ms at 100Hz), priority 0 gets the max and MAX_PRIO the min
+#define SCHED_MIN_TIMESLICE 1
+#define SCHED_MAX_TIMESLICE 20
+
+// Fair class tunables in ms, turned into TSC cycles at boot
+#define SCHED_LATENCY_MS            24  // Every runnable task gets a go within this
+#define SCHED_MIN_GRANULARITY_MS    3   // Nobody gets preempted before running this long
+#define SCHED_WAKEUP_GRANULARITY_MS 4   // How far ahead current may be before a wakeup preempts it
+#define NICE_0_WEIGHT               1024
+
+// Real time class
+#define SCHED_NORMAL                0   // Whichever of prio and fair is the default
+#define SCHED_FIFO                  1
+#define SCHED_RR                    2
+#define SCHED_RR_TIMESLICE          10  // Ticks
+#define SCHED_RT_PERIOD_MS          1000
+#define SCHED_RT_RUNTIME_MS         950
+
+// Load balancing
+#define SCHED_BALANCE_INTERVAL      10  // Ticks between periodic balancing on a CPU
+#define SCHED_BALANCE_MAX_MOVE      4   // Tasks one periodic pass may pull
+#define SCHED_MIGRATION_COST_US     500 // Ran more recently than this, its cache is still warm
+#define SCHED_CACHE_NICE_TRIES      2   // Failed passes before cache hot tasks get pulled anyway
+
+// int $SCHED_RESCHED_VECTOR from a task saves its context like any interrupt
+// and runs preempt_schedule_irq(), the slow way to give up the CPU
+#define SCHED_RESCHED_VECTOR        0x41
+// Sent to a CPU that has wakeups on its wake list, or that has to give up
+// what it's running for something that just got queued
+#define SCHED_IPI_VECTOR            0x42
+
+struct prio_array {
+    uint64_t bitmap[SCHED_BITMAP_WORDS];
+    struct list_node queues[SCHED_NR_PRIO];
+    int nr_active;
+};
+
+struct prio_rq {
+    struct prio_array arrays[2];
+    struct prio_array *active;
+    struct prio_array *expired;
+};
+
+struct fair_rq {
+    struct rb_root tasks;       // Everything runnable except curr
+    struct task *curr;
+    uint64_t min_vruntime;      // Only moves forward, new and waking tasks start near it
+    unsigned long load;         // Sum of weights, curr included
+    int nr_running;
+    struct task *skip;          // Yielded, next pick passes it over if it can
+};
+
+struct rt_rq {
+    struct prio_array queue;    // Indexed by rt_priority, curr stays on it
+    uint64_t time;              // RT runtime so far this period, TSC cycles
+    uint64_t period_start;
+    bool throttled;
+    struct ktimer unthrottle;   // Armed for the end of the period while throttled
+    uint64_t throttle_count;
+};
+
+struct runqueue {
+    spinlock lock;
+    struct task *curr;
+    struct task *idle;          // Never queued, runs when nothing else can
+    bool need_resched;          // Set by tick and wakeups, schedule() acts on it
+    int nr_running;
+    unsigned long load;         // Sum of the queued tasks' weights
+    uint64_t switches;
+
+    struct list_node queued;    // Every queued task, whatever its class
+    // Just switched away from, the CPU can still be on its stack until the
+    // next tick so it can't be migrated yet
+    struct task *prev;
+    bool push_prev;             // prev was taken off to go to a CPU it's allowed on
+    int balance_ticks;
+    int balance_failed;         // Passes in a row that found an imbalance but moved nothing
+
+    struct rt_rq rt;
+    struct prio_rq prio;
+    struct fair_rq fair;
+};
+
+// Everything is called with the runqueue lock held
+struct sched_class {
+    const char *name;
+    void (*init_rq)(struct runqueue *rq);
+    // wakeup is false for a task that has never run
+    void (*enqueue)(struct runqueue *rq, struct task *task, bool wakeup);
+    void (*dequeue)(struct runqueue *rq, struct task *task);
+    // The task it returns is the one running from now on, NULL if the class has none
+    struct task *(*pick_next)(struct runqueue *rq);
+    // Current gets switched away from while staying runnable
+    void (*put_prev)(struct runqueue *rq, struct task *prev);
+    // Every timer tick for the running task, sets need_resched once it's time
+    void (*tick)(struct runqueue *rq, struct task *curr);
+    // task was just queued, preempt curr (same class) for it?
+    void (*check_preempt)(struct runqueue *rq, struct task *task);
+    // curr gives up the CPU but stays runnable, let the others go first
+    void (*yield)(struct runqueue *rq, struct task *curr);
+};
+
+extern const struct sched_class rt_sched_class;
+extern const struct sched_class prio_sched_class;
+extern const struct sched_class fair_sched_class;
 
 extern struct list_node all_tasks;
 
-DECLARE_PER_CPU(struct list_node, cpu_runqueue);
+extern uint64_t sched_isolated_cpus;
+
+DECLARE_PER_CPU(struct runqueue, runqueues);
 DECLARE_PER_CPU(struct task*, current_task);
 
+// Lockless peeks, only good as a hint
+static inline int sched_nr_running(int cpu){
+    return *(volatile int *)&__percpu_runqueues[cpu].nr_running;
+}
+
+static inline unsigned long sched_load(int cpu){
+    return *(volatile unsigned long *)&__percpu_runqueues[cpu].load;
+}
+
 void scheduler_init(void);
+// Scheduler part of a new task, the class it gets is the boot default
+void sched_init_task(struct task *task);
 void sched_task(struct task* t, int cpu_id);
 void sched_remove_task(struct task* t);
+// Task context only. A queued task that isn't running moves right away, a
+// running one the next time its CPU schedules. -1 if no CPU in mask is up
+int sched_set_affinity(struct task *task, uint64_t mask);
+
+// policy is one of SCHED_NORMAL, SCHED_FIFO or SCHED_RR, rt_priority goes
+// from 0 (first) to MAX_PRIO and only matters for the last two. Task 
+// context only, -1 if either is out of range
+int sched_setscheduler(struct task *task, int policy, int rt_priority);
+
+static inline bool sched_cpu_isolated(int cpu){
+    return cpu_in_mask(cpu, sched_isolated_cpus);
+}
+// Makes a sleeping task runnable again, false if it wasn't asleep. Any 
+// context, interrupt handlers just put it on the target CPU's wake list
+bool sched_wake_up(struct task *task);
+// Runs whatever got put on this CPU's wake list
+void sched_ttwu_pending(void);
+// SCHED_IPI_VECTOR after the EOI, never returns
+void sched_ipi_handler(void);
 
+// Timer interrupt calls this before schedule(), charges the tick to current
+void scheduler_tick(void);
+// From task context, returns once the caller gets picked again (never if
+// it isn't runnable anymore)
 void schedule(void);
+// From an interrupt handler on its way out, current's state has to be in 
+// cpu_context already. Never returns, we leave through whichever task runs
+void preempt_schedule_irq(void);
+void sched_yield(void);
+
+// TSC value ms from now
+uint64_t sched_deadline_ms(uint64_t ms);
+// Current's state is already set to one of the sleeping ones, sleeps until
+// woken or until the TSC passes deadline. Comes back running, true if it
+// got woken before the deadline
+bool schedule_timeout(uint64_t deadline);
+// Sleeps for at least ms, wakeups before that are ignored
+void sched_sleep_ms(uint64_t ms);
+
+int sched_timeslice(int priority);
+unsigned long sched_prio_to_weight(int priority);
+
+// Runqueue lock held. Moving a task between CPUs is a dequeue followed by
+// an enqueue with wakeup = false
+void enqueue_task(struct runqueue *rq, struct task *task, bool wakeup);
+void dequeue_task(struct runqueue *rq, struct task *task);
+
+void sched_balance_init(void);
+// Pulls tasks over to cpu from the busiest runqueue. idle means cpu has 
+// nothing waiting and only wants a single task
+void sched_balance(int cpu, bool idle);
+// Migrations per second since the last call and runqueue imbalance
+void sched_print_balance_stats(void);
+// Where a waking task should go. Its last CPU while its cache is still 
+// warm (or that CPU is idle anyway), otherwise an idle CPU close to it.
+// RT tasks go to the first CPU they can run on right away
+int sched_select_wake_cpu(struct task *task);
+
+void sched_idle_init(void);
+// Makes the code running on cpu right now its idle task, call once per CPU
+// after its per CPU data is set up
+void sched_init_idle(int cpu);
+// Never returns, sleeps in HLT or MWAIT until there's something to run
+void cpu_idle(void);
+// Gets cpu into schedule() soon, a store to its wake flag if it's in MWAIT
+// and a SCHED_IPI_VECTOR otherwise
+void sched_kick_cpu(int cpu);
 
 struct task* get_current_task(void);
 
 extern void load_next_task(struct task_context* cont);
+extern void switch_to(uint64_t *prev_sp, uint64_t next_sp);
+extern void switch_to_interrupted(uint64_t *prev_sp, struct task_context *next);
+extern void resume_switched(uint64_t next_sp);
 void debug_print_all_runqueues(void);
 
+// Times picking the next task with 1 and 1000 tasks queued, for each class
+void sched_bench_pick_next(void);
+// Two tasks yielding to each other on the boot CPU, once through switch_to
+// and once through the interrupt path. Has to run before the other CPUs
+// are up, as the boot CPU's idle task
+void sched_bench_yield(void);
+// Timer wakeup to running, for a task on a CPU kept busy by normal tasks,
+// once as SCHED_FIFO and once as a normal task. Needs the tick going
+void sched_bench_rt_latency(void);
+
 #endif
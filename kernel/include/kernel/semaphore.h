@@ -0,0 +1,28 @@
+#ifndef __KERNEL_SEMAPHORE_H
+#define __KERNEL_SEMAPHORE_H
+
+// Counting semaphore, down sleeps while the count is 0. Unlike a mutex 
+// anyone can up it, interrupt handlers included
+#include <kernel/wait.h>
+#include <kernel/atomic.h>
+
+struct semaphore {
+    atomic count;
+    struct wait_queue_head wait;
+};
+
+#define SEMAPHORE_INIT(name, n) \
+    { .count = ATOMIC_INIT(n), .wait = WAIT_QUEUE_HEAD_INIT((name).wait) }
+
+#define DEFINE_SEMAPHORE(name, n) \
+    struct semaphore name = SEMAPHORE_INIT(name, n)
+
+void sema_init(struct semaphore *sem, int count);
+void down(struct semaphore *sem);
+// Doesn't sleep, true if it took one
+bool down_trylock(struct semaphore *sem);
+// False if nothing came up within ms
+bool down_timeout(struct semaphore *sem, uint64_t ms);
+void up(struct semaphore *sem);
+
+#endif
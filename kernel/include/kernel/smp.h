@@ -2,10 +2,13 @@
 #define __KERNEL_SMP_H
 
 #include <kernel/limine_requests.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 extern int total_cpus;
 
-#define MAX_CORES 4 
+// Bounded by the bits in addr_space->cpu_mask
+#define MAX_CORES 64
 
 #define DECLARE_PER_CPU(type, name) \
     extern type __percpu_##name[MAX_CORES]
@@ -25,7 +28,24 @@ extern int total_cpus;
 #define this_core_write(var, value) \
     (__percpu_##var[get_current_core_id()] = (value))
 
+// Bit n for CPU n, MAX_CORES of them fit
+static inline bool cpu_in_mask(int cpu, uint64_t mask){
+    return mask & (1UL << cpu);
+}
+
+// CPUs we brought up (just the boot CPU until smp_init)
+static inline uint64_t cpu_online_mask(void){
+    if (total_cpus >= MAX_CORES)
+        return ~0UL;
+    return total_cpus ? (1UL << total_cpus) - 1 : 1;
+}
+
 void smp_init(void);
+// Per CPU data of the boot CPU, it becomes CPU 0. Everything that reads 
+// per CPU variables (allocators included) depends on it
+void smp_init_bsp(void);
 uint32_t get_current_core_id(void);
+// Where IPIs for a CPU have to be addressed
+uint32_t cpu_to_lapic_id(int cpu);
 
 #endif
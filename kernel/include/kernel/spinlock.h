@@ -2,6 +2,7 @@
 #define __KERNEL_SPINLOCK_H
 
 #include <kernel/atomic.h>
+#include <kernel/ipi.h>
 #include <stdint.h>
 
 typedef uint64_t int_flags;
@@ -53,7 +54,7 @@ static inline void spinlock_lock(spinlock *lock){
         // If we didn't get it we spin infinitely but while checking with 
         // atomic_read as that instruction is less expensive than xchg 
         while (atomic_read(&lock->lock) != 0) {
-            cpu_pause();  
+            cpu_relax();  
         }
     }
 }
@@ -117,7 +118,7 @@ static inline void rwlock_read_lock(rwlock *lock){
         
         // Wait if a writer has the lock
         while (old_val & RWLOCK_WRITER_MASK) {
-            cpu_pause();
+            cpu_relax();
             old_val = atomic_read(&lock->lock);
         }
         
@@ -159,7 +160,7 @@ static inline void rwlock_write_lock(rwlock *lock){
     while (atomic_cmpxchg(&lock->lock, 0, RWLOCK_WRITER_MASK) != 0) {
         // Wait for all readers and writers to finish
         while (atomic_read(&lock->lock) != 0) {
-            cpu_pause();
+            cpu_relax();
         }
     }
 }
@@ -190,7 +191,7 @@ static inline void ticket_spinlock_lock(ticket_spinlock *lock){
     int my_ticket = atomic_add_return(1, &lock->next_ticket) - 1;
     
     while (atomic_read(&lock->serving_ticket) != my_ticket) {
-        cpu_pause();
+        cpu_relax();
     }
 }
 
@@ -0,0 +1,99 @@
+#ifndef __KERNEL_SWAP_H
+#define __KERNEL_SWAP_H
+
+/* Swap areas live on block devices and are split into page sized slots.
+ * A swapped out page leaves a swap entry in every PTE that mapped it, each
+ * of those holds a reference on the slot. While a frame still has (or
+ * again has) the slot's data it sits in the swap cache, which holds one
+ * more reference, so everyone faulting on the same slot ends up on the
+ * same frame instead of reading it in twice */
+#include <kernel/vmm.h>
+#include <kernel/blkdev.h>
+#include <kernel/atomic.h>
+#include <stdbool.h>
+
+#define MAX_SWAP_AREAS          4
+#define SECTORS_PER_PAGE        (PAGE_SIZE / SECTOR_SIZE)
+
+// Size of the RAM disk we swap to when nothing better is around
+#define SWAP_RAMDISK_SIZE       (16 * 1024 * 1024)
+
+// Slots read along with the one that faulted, aligned so sequential faults
+// hit the ones we already brought in. 8 is Linux's default page-cluster
+#define SWAP_READAHEAD_PAGES    8
+
+// Swap entry layout, area index in bits 1-4 and the slot number in the
+// address bits, present bit is always clear
+#define SWP_TYPE_SHIFT  1
+#define SWP_TYPE_MASK   0xF
+
+static inline page_table_entry swp_entry(int type, uint64_t slot){
+    return (slot << PAGE_SHIFT) | ((uint64_t)type << SWP_TYPE_SHIFT) | PTE_SWAP;
+}
+
+static inline bool is_swap_pte(page_table_entry pte){
+    return !(pte & PTE_PRESENT) && (pte & PTE_SWAP);
+}
+
+static inline int swp_type(page_table_entry entry){
+    return (entry >> SWP_TYPE_SHIFT) & SWP_TYPE_MASK;
+}
+
+static inline uint64_t swp_slot(page_table_entry entry){
+    return PTE_ADDR(entry) >> PAGE_SHIFT;
+}
+
+struct swap_area {
+    struct block_device *bdev;
+    bool active;
+    int priority;               // Higher gets used first
+
+    uint64_t nr_slots;
+    uint64_t used;
+    uint64_t next;              // Next fit cursor, keeps a batch of swap outs together
+
+    uint16_t *slot_count;       // References on each slot, 0 is free
+    phys_addr *cache;           // Frame holding the slot's data or 0
+};
+
+struct swap_stats {
+    atomic64 swap_outs;         // Pages written out
+    atomic64 swap_ins;          // Pages read in for a fault
+    atomic64 cache_hits;        // Faults that found their page in the swap cache
+    atomic64 readahead;         // Pages read in by readahead
+};
+
+extern struct swap_stats swap_stats;
+
+// Creates the RAM disk and swaps to it
+int swap_init(void);
+int swap_on(struct block_device *bdev, int priority);
+
+void swap_entry_dup(page_table_entry entry);
+void swap_entry_free(page_table_entry entry);
+int swap_count(page_table_entry entry);
+
+// Gets a free slot and puts phys in the swap cache for it, the cache's
+// reference is the only one on the slot. 0 if swap is full
+page_table_entry swap_alloc_cached(phys_addr phys);
+// Only dups the entry if phys is still what the cache holds for it, that
+// way a slot that got freed under us never gets a PTE pointing at it
+int swap_entry_dup_cached(page_table_entry entry, phys_addr phys);
+
+// Both hand back the frame with a reference for the caller, 0 on failure
+phys_addr swap_cache_lookup(page_table_entry entry);
+phys_addr swap_read_in(page_table_entry entry);
+void swap_readahead(page_table_entry entry);
+
+// Drops phys from the swap cache if nobody but the cache and the caller
+// holds it anymore, true if it did
+bool swap_cache_release_unused(phys_addr phys);
+// Drops phys from the swap cache if no swap entry points at the slot
+// anymore, the data only lives in the frame from then on
+bool swap_cache_try_free(phys_addr phys);
+
+int swap_writepage(page_table_entry entry, phys_addr phys);
+
+void swap_print_stats(void);
+
+#endif
@@ -7,9 +7,10 @@
 
 extern int cpu_id;
 
-struct task* create_and_schedule_kernel_task(void (*func)(void));
-void init_task_ctr(int cpu_count);
+// priority is one of the PRIO_* levels from tasks.h
+struct task* create_and_schedule_kernel_task(void (*func)(void), int priority);
 void task_exit(int exit_code);
 void wake_up_task(struct task* task);
+int find_least_busy_cpu(struct task *task);
 
 #endif
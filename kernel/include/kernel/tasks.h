@@ -4,7 +4,9 @@
 #include <kernel/memmgr.h>
 #include <kernel/regs.h>
 #include <kernel/spinlock.h>
+#include <kernel/mempolicy.h>
 #include <ds/lists.h>
+#include <ds/rbtree.h>
 
 #define TASK_RUNNING 0x0
 #define TASK_SLEEPING_INTERRUPTIBLE 0x1
@@ -15,8 +17,23 @@
 #define TASK_ZOMBIE 0x6
 #define TASK_DEAD 0x7
 
+// Task priorities, lower runs first and gets longer timeslices
+#define MAX_PRIO            100
+#define PRIO_INTERACTIVE    20      // Something is usually waiting on these
+#define PRIO_DEFAULT        50
+#define PRIO_BACKGROUND     90      // Scanners and other housekeeping
+#define PRIO_IDLE           MAX_PRIO
+
+#define KERNEL_STACK_SIZE 4*PAGE_SIZE
+
+// Only the signals we actually raise for now
+#define SIGSEGV 11
+
 extern spinlock task_list_lock;
 
+struct prio_array;
+struct sched_class;
+
 struct task {
     // MUST BE FIRST!!! The way we save 
     // currently running task is by getting 
@@ -30,11 +47,38 @@ struct task {
     uint32_t tgid;  // Thread Group ID - used to see if thread belongs to process  
 
     int cpu_id;
+    // CPUs it may run on, bit n for CPU n. Change it through sched_set_affinity
+    uint64_t cpus_allowed;
     // From 0 to 100 with 0 being the highest priority
     int priority;
+    const struct sched_class *sched_class;
+    int policy;                     // SCHED_NORMAL, SCHED_FIFO or SCHED_RR
+    int rt_priority;                // 0 runs first, real time policies only
+    bool on_rq;                     // Queued on its CPU's runqueue (running counts)
+    struct list_node rq_node;       // On its runqueue's list of queued tasks, for the balancer
+    uint64_t last_ran;              // TSC when it last got switched out, 0 if never
+    // Kernel stack pointer switch_to left it at, 0 if it was last stopped by
+    // an interrupt (or never ran) and cpu_context has to be used instead
+    uint64_t switch_sp;
+    // Woken from an interrupt, waiting on another CPU's wake list
+    struct task *wake_next;
+    atomic wake_pending;
+
+    // O(1) class
+    int time_slice;                 // Ticks left before it goes to the expired array
+    struct prio_array *array;       // The one it's queued on, NULL if it isn't
+
+    // Fair class, times are TSC cycles
+    struct rb_node run_node;
+    uint64_t vruntime;              // Runtime scaled by NICE_0_WEIGHT / weight
+    uint64_t exec_start;            // When we last charged it
+    uint64_t sum_exec;              // Total runtime
+    uint64_t prev_sum_exec;         // sum_exec when it got the CPU this time
+    unsigned long weight;           // Load it adds to its runqueue, from priority
     uint8_t state;
 
     struct mem_descriptor *md;
+    struct mempolicy mempolicy;
 
     void* kernel_stack_base;
     struct task *parent;
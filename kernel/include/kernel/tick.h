@@ -0,0 +1,39 @@
+#ifndef __KERNEL_TICK_H
+#define __KERNEL_TICK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TICK_HZ 100
+
+/* The scheduler tick (TICK_HZ) drives timeslices and balancing. How it is
+ * delivered is picked on the command line:
+ *
+ * nohz=off:  periodic local APIC timer on every CPU, same as it always was
+ * nohz=idle: (default) one shot or TSC deadline timer armed for the next 
+ *            tick or ktimer, an idle CPU only wakes up for its ktimers
+ * nohz=full: like idle, and a CPU with a single runnable task drops down
+ *            to one tick a second since there's nobody to switch to
+ *
+ * A CPU whose tick is stopped or slowed down doesn't find new work on its
+ * own, whoever queues some kicks it (see sched_kick_cpu) */
+void tick_init(void);
+// Sets the timer up and starts ticking, interrupts get unmasked here
+void tick_start_cpu(void);
+// From the timer interrupt, true if this one is a scheduler tick
+bool tick_interrupt(void);
+// From schedule() before switching to next, rearms or stops the timer. 
+// alone means nothing else is waiting and next doesn't need the tick for
+// its accounting either, nohz=full slows the tick down then
+void tick_sched_update(bool idle, bool alone);
+// After a ktimer got armed on this CPU, in case it expires before whatever
+// the timer is set for now
+void tick_timer_changed(uint64_t expires);
+bool tick_stopped(int cpu);
+// Stopped, or down to the nohz=full rate
+bool tick_reduced(int cpu);
+
+// Timer interrupts per second on each CPU since the last call
+void tick_print_stats(void);
+
+#endif
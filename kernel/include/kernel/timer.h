@@ -5,5 +5,7 @@
 
 void run_pit_tests(void);
 void cpu_wait_10ms(void);
+// Calibrates on first use, same numbers cpu_wait_10ms goes by
+uint64_t tsc_cycles_per_ms(void);
 
 #endif
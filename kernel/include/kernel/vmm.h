@@ -3,11 +3,17 @@
 
 #include <kernel/memutils.h>
 #include <kernel/compiler.h>
+#include <kernel/atomic.h>
 
 #define PAGE_SIZE 4096
 #define PAGE_SHIFT 12
 #define PAGE_MASK (~(PAGE_SIZE-1))
 
+// 2MiB pages mapped straight from a PD entry
+#define HUGE_PAGE_ORDER 9
+#define HUGE_PAGE_SIZE (PAGE_SIZE << HUGE_PAGE_ORDER)
+#define HUGE_PAGE_MASK (~(HUGE_PAGE_SIZE-1))
+
 #define PTE_PRESENT         (1UL << 0)
 #define PTE_WRITABLE        (1UL << 1)
 #define PTE_USER            (1UL << 2)
@@ -19,6 +25,36 @@
 #define PTE_GLOBAL          (1UL << 8)
 #define PTE_NX              (1UL << 63)
 
+// Same bit as PTE_PAT but on PDP and PD entries it means the entry maps
+// a 1GiB or 2MiB page directly instead of pointing to the next table
+#define PTE_HUGE            (1UL << 7)
+
+// Bits 9-11 are ignored by the MMU and left for the OS to use
+// COW marks a page that is shared read only after fork and has to be copied 
+// on the first write
+#define PTE_COW             (1UL << 9)
+
+// On a non present entry the MMU ignores everything, a swapped out page 
+// leaves its swap entry there and this bit tells it apart from an empty one
+#define PTE_SWAP            (1UL << 10)
+
+// Bits 52-58 are ignored too (on 4KiB and 2MiB leaves), idle tracking keeps
+// how many scans in a row found the page untouched in 52-55
+#define PTE_IDLE_SHIFT      52
+#define PTE_IDLE_MAX        15
+#define PTE_IDLE_MASK       ((uint64_t)PTE_IDLE_MAX << PTE_IDLE_SHIFT)
+
+// Has other CPUs flush their TLBs, see vmm_shootdown
+#define VMM_SHOOTDOWN_VECTOR 0x43
+
+// Everything from here up is the kernel half which every address space shares
+#define KERNEL_SPACE_START 0xFFFF800000000000
+
+// Up to this many pages we invalidate one by one with invlpg, above it a full
+// flush is cheaper than the invlpg loop. 33 is what Linux settled on after
+// measuring (tlb_single_page_flush_ceiling)
+#define VMM_FLUSH_THRESHOLD 33
+
 // On x86_64 we use 48 bits for a VA and it consists of
 // 9 bits for PML4, 9 for PDP, 9 for PD and final 9 for PT 
 // these macros get those indexes, the remaining 12 bits are 
@@ -31,6 +67,7 @@
 
 // Get PTE entry from address
 #define PTE_ADDR(pte) ((pte) & 0x000FFFFFFFFFF000UL)
+#define PTE_FLAGS(pte) ((pte) & ~0x000FFFFFFFFFF000UL)
 
 
 struct page_table {
@@ -41,15 +78,71 @@ struct addr_space{
     struct page_table *pml4;
     uint64_t total_pages;
     uint64_t flags;
+    // Bit per CPU that has this address space in CR3, anything on one of 
+    // those can have its translations cached in a TLB we can't flush yet
+    volatile unsigned long cpu_mask;
+    // The part of cpu_mask that only kept it loaded because a kernel task 
+    // came next (lazy TLB), nothing there touches user addresses
+    volatile unsigned long lazy_mask;
+    // Bumped every time a translation gets taken away, a CPU that loaded 
+    // an older generation reloads CR3 before running user code on it again
+    atomic64 tlb_gen;
+};
+
+struct tlb_stats {
+    atomic64 cr3_writes;
+    atomic64 cr3_skipped;       // Switches that kept what was loaded
+    atomic64 stale_reloads;     // Skippable switches that had to flush anyway
+    atomic64 shootdowns;        // Flushes other CPUs had to do for us
+};
+
+extern struct tlb_stats tlb_stats;
+
+// CPUs really running on as, shootdowns can skip the lazy ones
+static inline unsigned long as_active_cpus(struct addr_space *as){
+    return as->cpu_mask & ~as->lazy_mask;
+}
+
+// Frames and page tables that lose their last mapping can't be handed back
+// while a TLB (or paging structure cache) might still point at them. The 
+// gather holds on to them so tearing down a whole range costs one flush 
+// instead of one per page, it only flushes early when the batch fills up
+#define TLB_GATHER_BATCH 64
+
+struct tlb_gather {
+    struct addr_space *as;
+    virt_addr start;    // Range that has to be flushed, end is exclusive
+    virt_addr end;
+
+    phys_addr frames[TLB_GATHER_BATCH];
+    int nr_frames;
+    phys_addr tables[TLB_GATHER_BATCH];
+    int nr_tables;
 };
 
 int vmm_init(void);
+void vmm_init_cpu(void);
 struct addr_space *vmm_create_address_space(void);
 void vmm_destroy_address_space(struct addr_space *as);
 
 struct page_table *vmm_alloc_page_table(void);
 void vmm_free_page_table(struct page_table *pt);
+// Both stop early and hand back the PD (or PDP) entry if it maps a huge 
+// page, check PTE_HUGE if that matters to you
 page_table_entry *vmm_walk_page_table(struct addr_space *as, virt_addr vaddr, bool create);
+page_table_entry *vmm_walk_pd(struct addr_space *as, virt_addr vaddr, bool create);
+
+// Turns the 2MiB mapping covering vaddr into a table of 4KiB ones, a huge 
+// page someone else also maps gets copied instead of carved up
+int vmm_split_huge(struct addr_space *as, virt_addr vaddr);
+
+// Rewrites the protection of every user mapping in [start, end), only 
+// PTE_WRITABLE, PTE_USER and PTE_NX are taken from flags. Pages that weren't 
+// writable before become copy on write instead so a shared frame (or the 
+// zero page) never ends up writable behind anyone's back. Unless shared is
+// set, MAP_SHARED frames are there to be written by everyone mapping them
+int vmm_protect_range(struct addr_space *as, virt_addr start, virt_addr end, 
+                                                uint64_t flags, bool shared);
 
 
 int vmm_map_page(struct addr_space *as,virt_addr vaddr, phys_addr paddr, uint64_t flags);
@@ -58,11 +151,61 @@ int vmm_map_range(struct addr_space *as, virt_addr vaddr,
         phys_addr paddr, uint64_t size, uint64_t flags);
 int vmm_unmap_range(struct addr_space *as, virt_addr vaddr, uint64_t size);
 
+// Same as vmm_map_page but leaves the TLB alone, only safe when the entry 
+// wasn't present before (x86 never caches non present translations)
+int vmm_map_page_no_flush(struct addr_space *as, virt_addr vaddr, 
+                                    phys_addr paddr, uint64_t flags);
+
+void tlb_gather_init(struct tlb_gather *tlb, struct addr_space *as);
+// For whoever takes mappings away by hand. The entries pointing at them 
+// must already be gone, a full batch gets flushed (and freed) right away
+void tlb_gather_frame(struct tlb_gather *tlb, virt_addr vaddr, phys_addr phys);
+void tlb_gather_table(struct tlb_gather *tlb, virt_addr start, 
+                                    virt_addr end, phys_addr phys);
+// Flushes whatever got gathered so far and drops the frames and tables
+void tlb_gather_flush(struct tlb_gather *tlb);
+
+// Clears every user mapping in [start, end), frames are dropped (refcounted)
+// and page tables left empty are freed, all through the gather. Returns the 
+// number of pages that were unmapped
+uint64_t vmm_zap_range(struct tlb_gather *tlb, virt_addr start, virt_addr end);
+
+// Called for every present leaf in [start, end), size is PAGE_SIZE for 
+// PTEs and HUGE_PAGE_SIZE for 2MiB PD entries (addr is where the leaf
+// starts, which can be below start for those). Return non zero to stop
+typedef int (*vmm_walk_fn)(page_table_entry *entry, virt_addr addr, 
+                                            uint64_t size, void *arg);
+// Skips missing tables whole, returns whatever stopped the walk or 0
+int vmm_walk_range(struct addr_space *as, virt_addr start, virt_addr end, 
+                                                    vmm_walk_fn fn, void *arg);
+
+// Duplicates the page tables of [start, end) from src into dst, frames are
+// shared and get their refcount bumped, with cow set writable pages become 
+// read only copy on write pages in both address spaces
+int vmm_copy_range(struct addr_space *dst, struct addr_space *src,
+        virt_addr start, virt_addr end, bool cow);
+
 
 // Address translation
 phys_addr vmm_virt_to_phys(struct addr_space *as, virt_addr vaddr);
 bool vmm_is_mapped(struct addr_space *as, virt_addr vaddr);
+// Only writes CR3 if as isn't what this CPU already has loaded (or its
+// TLB generation moved on since)
 void vmm_switch_address_space(struct addr_space* as);
+// Next task is a kernel task, it borrows whatever is loaded
+void vmm_enter_lazy_tlb(void);
+// Call after changing or removing translations in as, flushes our own TLB
+// if it's loaded here, CPUs running on it get a shootdown and lazy ones 
+// flush on return
+void vmm_flush_tlb_as(struct addr_space *as, virt_addr start, virt_addr end);
+void vmm_bump_tlb_gen(struct addr_space *as);
+// Flushes [start, end) of as on every CPU in cpus but ours and waits until
+// they all did, as NULL is for the kernel half (global entries included)
+void vmm_shootdown(struct addr_space *as, unsigned long cpus, 
+                            virt_addr start, virt_addr end);
+// Flushes whatever a pending shootdown asks of this CPU
+void vmm_shootdown_poll(void);
+void vmm_print_tlb_stats(void);
 
 int vmm_handle_page_fault(struct addr_space* as, virt_addr fault_addr, 
                             uint64_t error_code);
@@ -82,13 +225,40 @@ static inline size_t vmm_pages_in_range(virt_addr start, virt_addr end){
 }
 
 // Translation lookaside buffer stuff
+// Note: reloading CR3 only drops non global entries, kernel mappings stay
 static inline void vmm_flush_tlb(void) {
     __asm__ volatile("mov %%cr3, %%rax; mov %%rax, %%cr3" ::: "rax", "memory");
 }
 
+// Toggling CR4.PGE is the only way to also get rid of global entries 
+static inline void vmm_flush_tlb_all(void) {
+    uint64_t cr4 = get_cr4();
+    if (cr4 & CR4_PGE) {
+        set_cr4(cr4 & ~CR4_PGE);
+        set_cr4(cr4);
+    } else {
+        vmm_flush_tlb();
+    }
+}
+
 static inline void vmm_flush_tlb_single(virt_addr vaddr) {
     __asm__ volatile("invlpg (%0)" :: "r"(vaddr) : "memory");
 }
 
+// invlpg also works on global entries so small ranges are handled the same 
+// way for both halves, for big ranges we have to pick the right full flush
+static inline void vmm_flush_tlb_range(virt_addr start, virt_addr end) {
+    if (vmm_pages_in_range(start, end) > VMM_FLUSH_THRESHOLD) {
+        if (start >= KERNEL_SPACE_START)
+            vmm_flush_tlb_all();
+        else
+            vmm_flush_tlb();
+        return;
+    }
+
+    for (virt_addr v = vmm_page_align_down(start); v < end; v += PAGE_SIZE)
+        vmm_flush_tlb_single(v);
+}
+
 void test_vmm(void);
 #endif
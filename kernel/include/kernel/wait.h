@@ -0,0 +1,96 @@
+#ifndef __KERNEL_WAIT_H
+#define __KERNEL_WAIT_H
+
+/* Wait queues, a list of sleeping tasks waiting for some condition. The
+ * waiter puts itself on the queue and marks itself asleep *before* checking
+ * the condition, the waker changes the condition *before* calling wake_up,
+ * that way a wakeup can't slip in between the check and the sleep.
+ *
+ * Exclusive waiters are for things only one of them can have (a mutex, a
+ * semaphore count), wake_up stops after the first exclusive one so we don't
+ * get the whole herd up just for all but one to go back to sleep */
+#include <kernel/spinlock.h>
+#include <kernel/scheduler.h>
+#include <ds/lists.h>
+
+struct wait_queue_head {
+    spinlock lock;
+    struct list_node waiters;
+};
+
+struct wait_queue_entry {
+    struct list_node node;
+    struct task *task;
+    bool exclusive;
+    bool woken;         // Got an exclusive wakeup since the last prepare_to_wait
+};
+
+#define WAIT_QUEUE_HEAD_INIT(name) \
+    { .lock = SPINLOCK_INIT, .waiters = { &(name).waiters, &(name).waiters } }
+
+#define DEFINE_WAIT_QUEUE(name) \
+    struct wait_queue_head name = WAIT_QUEUE_HEAD_INIT(name)
+
+void wait_queue_init(struct wait_queue_head *wq);
+void wait_entry_init(struct wait_queue_entry *entry, bool exclusive);
+
+// Lockless peek, only meaningful after the waker changed the condition
+static inline bool wait_queue_active(struct wait_queue_head *wq){
+    return !list_empty(&wq->waiters);
+}
+
+// Queues the entry (if it isn't already) and sets current's state
+void prepare_to_wait(struct wait_queue_head *wq, struct wait_queue_entry *entry, int state);
+// An exclusive wakeup that came in after the last check never got used,
+// finish_wait passes it on to the next waiter
+void finish_wait(struct wait_queue_head *wq, struct wait_queue_entry *entry);
+
+// Every non exclusive waiter and the first exclusive one
+void wake_up(struct wait_queue_head *wq);
+void wake_up_all(struct wait_queue_head *wq);
+
+#define __wait_event(wq, condition, exclusive) do {                         \
+    struct wait_queue_entry __wait;                                         \
+    wait_entry_init(&__wait, exclusive);                                    \
+    while (1) {                                                             \
+        prepare_to_wait(&(wq), &__wait, TASK_SLEEPING_UNINTERRUPTIBLE);     \
+        if (condition)                                                      \
+            break;                                                          \
+        schedule();                                                         \
+    }                                                                       \
+    finish_wait(&(wq), &__wait);                                            \
+} while (0)
+
+// Sleeps until condition is true, it gets checked again after every wakeup
+#define wait_event(wq, condition) do {                                      \
+    if (!(condition))                                                       \
+        __wait_event(wq, condition, false);                                 \
+} while (0)
+
+#define wait_event_exclusive(wq, condition) do {                            \
+    if (!(condition))                                                       \
+        __wait_event(wq, condition, true);                                  \
+} while (0)
+
+// Gives up after ms, evaluates to whether the condition ended up true
+#define wait_event_timeout(wq, condition, ms) ({                            \
+    bool __done = (condition);                                              \
+    if (!__done) {                                                          \
+        struct wait_queue_entry __wait;                                     \
+        uint64_t __deadline = sched_deadline_ms(ms);                        \
+        wait_entry_init(&__wait, false);                                    \
+        while (1) {                                                         \
+            prepare_to_wait(&(wq), &__wait, TASK_SLEEPING_UNINTERRUPTIBLE); \
+            if ((__done = (condition)))                                     \
+                break;                                                      \
+            if (!schedule_timeout(__deadline))                              \
+                break;                                                      \
+        }                                                                   \
+        finish_wait(&(wq), &__wait);                                        \
+        if (!__done)                                                        \
+            __done = (condition);                                           \
+    }                                                                       \
+    __done;                                                                 \
+})
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef __KERNEL_ZRAM_H
+#define __KERNEL_ZRAM_H
+
+/* Block device that keeps whatever is written to it LZ4 compressed in
+ * memory. Meant for swap, a page going out to zram costs a compression 
+ * and usually well under half a page instead of a whole one like ram0.
+ * Only whole, page aligned pages can be read or written */
+#include <kernel/blkdev.h>
+#include <kernel/vmm.h>
+#include <kernel/atomic.h>
+
+// Size the device pretends to have, memory only gets used for what's stored
+#define ZRAM_SWAP_SIZE      (64 * 1024 * 1024)
+
+// Anything that doesn't compress below this gets stored as it is, 
+// decompressing it would cost time for barely any memory saved
+#define ZRAM_HUGE_THRESHOLD (PAGE_SIZE * 3 / 4)
+
+struct zram_stats {
+    atomic64 stores;
+    atomic64 loads;
+    atomic64 same_pages;        // Filled with one repeating word, nothing stored
+    atomic64 huge_pages;        // Incompressible, stored raw
+    atomic64 failed_stores;     // Pool ran out of memory
+    atomic64 store_cycles;      // TSC cycles spent in stores/loads
+    atomic64 load_cycles;
+};
+
+struct block_device *zram_create(const char *name, uint64_t size);
+void zram_print_stats(struct block_device *bdev);
+
+#endif
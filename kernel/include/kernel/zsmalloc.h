@@ -0,0 +1,48 @@
+#ifndef __KERNEL_ZSMALLOC_H
+#define __KERNEL_ZSMALLOC_H
+
+/* Allocator for lots of small objects whose sizes are all over the place
+ * (compressed pages). Sizes get rounded up to 32 byte classes and every 
+ * class carves its objects out of small blocks of 1-4 contiguous pages,
+ * picking the block size that wastes the least at the end. Objects are 
+ * referred to by handles, not pointers, a handle is the block's physical
+ * address with the object's index in the low bits */
+#include <kernel/buddy_allocator.h>
+#include <kernel/spinlock.h>
+#include <ds/lists.h>
+
+#define ZS_ALIGN            32
+#define ZS_MAX_SIZE         PAGE_FRAME_SIZE
+#define ZS_NR_CLASSES       (ZS_MAX_SIZE / ZS_ALIGN)
+#define ZS_MAX_BLOCK_ORDER  2
+
+struct zs_class {
+    uint32_t size;
+    uint8_t order;              // Block is 1 << order pages
+    uint16_t objs_per_block;
+    struct list_node partial;   // Blocks with at least one free object
+    uint64_t nr_blocks;
+    uint64_t objs_used;
+};
+
+struct zs_pool {
+    spinlock lock;
+    struct zs_class classes[ZS_NR_CLASSES];
+    uint64_t pages_used;
+};
+
+struct zs_pool *zs_create_pool(void);
+// Every object has to be freed already
+void zs_destroy_pool(struct zs_pool *pool);
+
+// Returns 0 if size is 0, too big or we're out of memory
+uint64_t zs_malloc(struct zs_pool *pool, size_t size);
+void zs_free(struct zs_pool *pool, uint64_t handle);
+
+// Everything is in the HHDM so this is just arithmetic, the pointer stays
+// good until the handle gets freed
+void *zs_map(struct zs_pool *pool, uint64_t handle);
+
+uint64_t zs_pool_pages(struct zs_pool *pool);
+
+#endif
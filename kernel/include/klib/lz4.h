@@ -0,0 +1,27 @@
+#ifndef __KERNEL_LIB_LZ4_H
+#define __KERNEL_LIB_LZ4_H
+
+/* LZ4 block format, the same thing liblz4's LZ4_compress_default and 
+ * LZ4_decompress_safe produce and read, without the frame format around it.
+ * Greedy single hash table matcher with positions kept in 16 bits, so one 
+ * call compresses at most 64KiB (we only ever feed it pages anyway) */
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ4_HASH_LOG        12
+#define LZ4_WORKMEM_SIZE    ((1 << LZ4_HASH_LOG) * sizeof(uint16_t))
+#define LZ4_MAX_INPUT_SIZE  0x10000
+
+// Worst case output for incompressible input
+#define LZ4_COMPRESS_BOUND(n) ((n) + (n) / 255 + 16)
+
+// Returns the compressed size, 0 if it doesn't fit in dst_cap (or src is 
+// too big). wrkmem has to be LZ4_WORKMEM_SIZE bytes
+size_t lz4_compress(const uint8_t *src, size_t src_len, uint8_t *dst, 
+                                        size_t dst_cap, void *wrkmem);
+
+// Returns the decompressed size or -1 if the input is malformed or 
+// wouldn't fit, never reads or writes out of bounds
+int lz4_decompress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap);
+
+#endif
@@ -0,0 +1,77 @@
+#include <kernel/blkdev.h>
+#include <kernel/spinlock.h>
+#include <kernel/klogging.h>
+#include <klib/string.h>
+#include <stdbool.h>
+
+static struct list_node blkdev_list = { &blkdev_list, &blkdev_list };
+static DEFINE_SPINLOCK(blkdev_lock);
+
+int blkdev_register(struct block_device *bdev){
+    if(!bdev || !bdev->ops || !bdev->ops->read || !bdev->ops->write){
+        KERROR("Block device is missing read or write\n");
+        return -1;
+    }
+
+    if(blkdev_find(bdev->name)){
+        KERROR("Block device %s already exists\n", bdev->name);
+        return -1;
+    }
+
+    int_flags flags;
+    spinlock_lock_intsave(&blkdev_lock, &flags);
+    list_add_tail(&bdev->list, &blkdev_list);
+    spinlock_unlock_intrestore(&blkdev_lock, flags);
+
+    KSUCCESS("Block device %s registered, %lu KiB\n", bdev->name, 
+                                    bdev->nr_sectors * SECTOR_SIZE / 1024);
+    return 0;
+}
+
+struct block_device *blkdev_find(const char *name){
+    struct block_device *found = NULL;
+
+    int_flags flags;
+    spinlock_lock_intsave(&blkdev_lock, &flags);
+    for(struct list_node *node = blkdev_list.next; node != &blkdev_list; node = node->next){
+        struct block_device *bdev = container_of(node, struct block_device, list);
+        if(strcmp(bdev->name, name) == 0){
+            found = bdev;
+            break;
+        }
+    }
+    spinlock_unlock_intrestore(&blkdev_lock, flags);
+
+    return found;
+}
+
+static bool blkdev_range_ok(struct block_device *bdev, uint64_t sector, uint64_t count){
+    return bdev && count && sector < bdev->nr_sectors && 
+           count <= bdev->nr_sectors - sector;
+}
+
+int blkdev_read(struct block_device *bdev, uint64_t sector, uint64_t count, void *buf){
+    if(!blkdev_range_ok(bdev, sector, count)){
+        KERROR("Read past the end of a block device\n");
+        return -1;
+    }
+    return bdev->ops->read(bdev, sector, count, buf);
+}
+
+int blkdev_write(struct block_device *bdev, uint64_t sector, uint64_t count, 
+                                                            const void *buf){
+    if(!blkdev_range_ok(bdev, sector, count)){
+        KERROR("Write past the end of a block device\n");
+        return -1;
+    }
+    return bdev->ops->write(bdev, sector, count, buf);
+}
+
+int blkdev_discard(struct block_device *bdev, uint64_t sector, uint64_t count){
+    if(!blkdev_range_ok(bdev, sector, count))
+        return -1;
+    // Nothing to do for devices that can't make use of it
+    if(!bdev->ops->discard)
+        return 0;
+    return bdev->ops->discard(bdev, sector, count);
+}
@@ -0,0 +1,98 @@
+#include <kernel/blkdev.h>
+#include <kernel/pmm.h>
+#include <kernel/vmm.h>
+#include <klib/string.h>
+
+#define RAMDISK_SECTORS_PER_PAGE (PAGE_SIZE / SECTOR_SIZE)
+
+// Pages don't have to be contiguous, we just keep a table of them
+struct ramdisk {
+    phys_addr *pages;
+    uint64_t nr_pages;
+};
+
+// Requests can start and end in the middle of a page so we go page by page
+static void ramdisk_copy(struct ramdisk *rd, uint64_t sector, uint64_t count, 
+                                                    void *buf, bool write){
+    uint8_t *ptr = buf;
+    uint64_t offset = sector * SECTOR_SIZE;
+    uint64_t left = count * SECTOR_SIZE;
+
+    while (left) {
+        uint64_t page_off = offset % PAGE_SIZE;
+        uint64_t chunk = PAGE_SIZE - page_off;
+        if (chunk > left)
+            chunk = left;
+
+        uint8_t *page = phys_to_virt(rd->pages[offset / PAGE_SIZE]);
+        if (write)
+            memcpy(page + page_off, ptr, chunk);
+        else
+            memcpy(ptr, page + page_off, chunk);
+
+        ptr += chunk;
+        offset += chunk;
+        left -= chunk;
+    }
+}
+
+static int ramdisk_read(struct block_device *bdev, uint64_t sector, uint64_t count, void *buf){
+    ramdisk_copy(bdev->private, sector, count, buf, false);
+    return 0;
+}
+
+static int ramdisk_write(struct block_device *bdev, uint64_t sector, uint64_t count, 
+                                                            const void *buf){
+    ramdisk_copy(bdev->private, sector, count, (void*)buf, true);
+    return 0;
+}
+
+static const struct blkdev_ops ramdisk_ops = {
+    .read = ramdisk_read,
+    .write = ramdisk_write,
+    .discard = NULL,
+};
+
+struct block_device *ramdisk_create(const char *name, uint64_t size){
+    uint64_t nr_pages = vmm_page_align_up(size) / PAGE_SIZE;
+    if (!nr_pages || strlen(name) >= BLKDEV_NAME_LEN)
+        return NULL;
+
+    struct block_device *bdev = kmalloc(sizeof(*bdev));
+    struct ramdisk *rd = kmalloc(sizeof(*rd));
+    phys_addr *pages = kmalloc(nr_pages * sizeof(phys_addr));
+    if (!bdev || !rd || !pages)
+        goto fail;
+
+    for (uint64_t i = 0; i < nr_pages; i++) {
+        pages[i] = pmm_alloc_page();
+        if (!pages[i]) {
+            while (i--)
+                pmm_put_page(pages[i]);
+            goto fail;
+        }
+        memset(phys_to_virt(pages[i]), 0, PAGE_SIZE);
+    }
+
+    rd->pages = pages;
+    rd->nr_pages = nr_pages;
+
+    memcpy(bdev->name, name, strlen(name) + 1);
+    bdev->nr_sectors = nr_pages * RAMDISK_SECTORS_PER_PAGE;
+    bdev->ops = &ramdisk_ops;
+    bdev->private = rd;
+
+    if (blkdev_register(bdev) != 0) {
+        for (uint64_t i = 0; i < nr_pages; i++)
+            pmm_put_page(pages[i]);
+        goto fail;
+    }
+    return bdev;
+
+fail:
+    KERROR("Couldn't create RAM disk %s\n", name);
+    kfree(pages);
+    kfree(rd);
+    kfree(bdev);
+    return NULL;
+}
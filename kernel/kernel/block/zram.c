@@ -0,0 +1,267 @@
+#include <kernel/zram.h>
+#include <kernel/zsmalloc.h>
+#include <kernel/pmm.h>
+#include <kernel/spinlock.h>
+#include <klib/lz4.h>
+#include <klib/string.h>
+
+#define ZRAM_SECTORS_PER_PAGE (PAGE_SIZE / SECTOR_SIZE)
+
+#define ZRAM_SAME   (1 << 0)    // handle holds the fill word, nothing allocated
+#define ZRAM_HUGE   (1 << 1)    // Stored uncompressed
+
+struct zram_slot {
+    uint64_t handle;
+    uint16_t size;
+    uint8_t flags;
+};
+
+// One lock for everything, compression goes through the shared buffers
+// and loads have to keep discards from freeing the object under them
+struct zram {
+    spinlock lock;
+    struct zs_pool *pool;
+    struct zram_slot *slots;
+    uint64_t nr_pages;
+
+    uint8_t *buffer;
+    void *wrkmem;
+
+    uint64_t stored_pages;
+    uint64_t compr_bytes;
+    struct zram_stats stats;
+};
+
+static inline bool zram_slot_empty(struct zram_slot *slot){
+    return !slot->handle && !(slot->flags & ZRAM_SAME);
+}
+
+static void zram_free_slot(struct zram *zram, struct zram_slot *slot){
+    if (zram_slot_empty(slot))
+        return;
+
+    if (!(slot->flags & ZRAM_SAME))
+        zs_free(zram->pool, slot->handle);
+
+    zram->stored_pages--;
+    zram->compr_bytes -= slot->size;
+    slot->handle = 0;
+    slot->size = 0;
+    slot->flags = 0;
+}
+
+// Zeroed pages are the usual case but any repeating word is just as cheap
+static bool page_same_filled(const void *page, uint64_t *value){
+    const uint64_t *words = page;
+    for (size_t i = 1; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        if (words[i] != words[0])
+            return false;
+    }
+    *value = words[0];
+    return true;
+}
+
+static int zram_store(struct zram *zram, uint64_t index, const void *src){
+    struct zram_slot *slot = &zram->slots[index];
+    uint64_t value;
+
+    int_flags flags;
+    spinlock_lock_intsave(&zram->lock, &flags);
+
+    if (page_same_filled(src, &value)) {
+        zram_free_slot(zram, slot);
+        slot->handle = value;
+        slot->flags = ZRAM_SAME;
+        zram->stored_pages++;
+        atomic64_inc(&zram->stats.same_pages);
+        spinlock_unlock_intrestore(&zram->lock, flags);
+        return 0;
+    }
+
+    size_t size = lz4_compress(src, PAGE_SIZE, zram->buffer, 
+                                ZRAM_HUGE_THRESHOLD, zram->wrkmem);
+    const void *data = zram->buffer;
+    uint8_t slot_flags = 0;
+    if (!size) {
+        size = PAGE_SIZE;
+        data = src;
+        slot_flags = ZRAM_HUGE;
+    }
+
+    uint64_t handle = zs_malloc(zram->pool, size);
+    if (!handle) {
+        atomic64_inc(&zram->stats.failed_stores);
+        spinlock_unlock_intrestore(&zram->lock, flags);
+        return -1;
+    }
+    memcpy(zs_map(zram->pool, handle), data, size);
+
+    zram_free_slot(zram, slot);
+    slot->handle = handle;
+    slot->size = size;
+    slot->flags = slot_flags;
+    zram->stored_pages++;
+    zram->compr_bytes += size;
+    if (slot_flags & ZRAM_HUGE)
+        atomic64_inc(&zram->stats.huge_pages);
+
+    spinlock_unlock_intrestore(&zram->lock, flags);
+    return 0;
+}
+
+static int zram_load(struct zram *zram, uint64_t index, void *dst){
+    struct zram_slot *slot = &zram->slots[index];
+    int ret = 0;
+
+    int_flags flags;
+    spinlock_lock_intsave(&zram->lock, &flags);
+
+    if (slot->flags & ZRAM_SAME) {
+        uint64_t *words = dst;
+        for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+            words[i] = slot->handle;
+    } else if (!slot->handle) {
+        // Never written, reads back as zeroes like any other disk
+        memset(dst, 0, PAGE_SIZE);
+    } else if (slot->flags & ZRAM_HUGE) {
+        memcpy(dst, zs_map(zram->pool, slot->handle), PAGE_SIZE);
+    } else if (lz4_decompress(zs_map(zram->pool, slot->handle), slot->size, 
+                                                dst, PAGE_SIZE) != PAGE_SIZE) {
+        KERROR("zram: slot %lu doesn't decompress\n", index);
+        ret = -1;
+    }
+
+    spinlock_unlock_intrestore(&zram->lock, flags);
+    return ret;
+}
+
+static bool zram_aligned(uint64_t sector, uint64_t count){
+    return !(sector % ZRAM_SECTORS_PER_PAGE) && !(count % ZRAM_SECTORS_PER_PAGE);
+}
+
+static int zram_read(struct block_device *bdev, uint64_t sector, uint64_t count, void *buf){
+    struct zram *zram = bdev->private;
+    if (!zram_aligned(sector, count))
+        return -1;
+
+    uint8_t *ptr = buf;
+    for (uint64_t i = 0; i < count / ZRAM_SECTORS_PER_PAGE; i++) {
+        uint64_t start = read_tsc();
+        if (zram_load(zram, sector / ZRAM_SECTORS_PER_PAGE + i, ptr + i * PAGE_SIZE) != 0)
+            return -1;
+        atomic64_add(read_tsc() - start, &zram->stats.load_cycles);
+        atomic64_inc(&zram->stats.loads);
+    }
+    return 0;
+}
+
+static int zram_write(struct block_device *bdev, uint64_t sector, uint64_t count, 
+                                                            const void *buf){
+    struct zram *zram = bdev->private;
+    if (!zram_aligned(sector, count))
+        return -1;
+
+    const uint8_t *ptr = buf;
+    for (uint64_t i = 0; i < count / ZRAM_SECTORS_PER_PAGE; i++) {
+        uint64_t start = read_tsc();
+        if (zram_store(zram, sector / ZRAM_SECTORS_PER_PAGE + i, ptr + i * PAGE_SIZE) != 0)
+            return -1;
+        atomic64_add(read_tsc() - start, &zram->stats.store_cycles);
+        atomic64_inc(&zram->stats.stores);
+    }
+    return 0;
+}
+
+// Partial pages are left alone, the rest of the page might still matter
+static int zram_discard(struct block_device *bdev, uint64_t sector, uint64_t count){
+    struct zram *zram = bdev->private;
+    uint64_t first = (sector + ZRAM_SECTORS_PER_PAGE - 1) / ZRAM_SECTORS_PER_PAGE;
+    uint64_t end = (sector + count) / ZRAM_SECTORS_PER_PAGE;
+
+    int_flags flags;
+    spinlock_lock_intsave(&zram->lock, &flags);
+    for (uint64_t i = first; i < end; i++)
+        zram_free_slot(zram, &zram->slots[i]);
+    spinlock_unlock_intrestore(&zram->lock, flags);
+    return 0;
+}
+
+static const struct blkdev_ops zram_ops = {
+    .read = zram_read,
+    .write = zram_write,
+    .discard = zram_discard,
+};
+
+struct block_device *zram_create(const char *name, uint64_t size){
+    uint64_t nr_pages = vmm_page_align_up(size) / PAGE_SIZE;
+    if (!nr_pages || strlen(name) >= BLKDEV_NAME_LEN)
+        return NULL;
+
+    struct block_device *bdev = kmalloc(sizeof(*bdev));
+    struct zram *zram = kmalloc(sizeof(*zram));
+    struct zram_slot *slots = kmalloc(nr_pages * sizeof(struct zram_slot));
+    uint8_t *buffer = kmalloc(LZ4_COMPRESS_BOUND(PAGE_SIZE));
+    void *wrkmem = kmalloc(LZ4_WORKMEM_SIZE);
+    struct zs_pool *pool = zs_create_pool();
+    if (!bdev || !zram || !slots || !buffer || !wrkmem || !pool)
+        goto fail;
+
+    memset(zram, 0, sizeof(*zram));
+    memset(slots, 0, nr_pages * sizeof(struct zram_slot));
+    spinlock_init(&zram->lock);
+    zram->pool = pool;
+    zram->slots = slots;
+    zram->nr_pages = nr_pages;
+    zram->buffer = buffer;
+    zram->wrkmem = wrkmem;
+
+    memcpy(bdev->name, name, strlen(name) + 1);
+    bdev->nr_sectors = nr_pages * ZRAM_SECTORS_PER_PAGE;
+    bdev->ops = &zram_ops;
+    bdev->private = zram;
+
+    if (blkdev_register(bdev) != 0)
+        goto fail;
+    return bdev;
+
+fail:
+    KERROR("Couldn't create zram device %s\n", name);
+    zs_destroy_pool(pool);
+    kfree(wrkmem);
+    kfree(buffer);
+    kfree(slots);
+    kfree(zram);
+    kfree(bdev);
+    return NULL;
+}
+
+void zram_print_stats(struct block_device *bdev){
+    if (!bdev || bdev->ops != &zram_ops)
+        return;
+
+    struct zram *zram = bdev->private;
+    uint64_t stores = atomic64_read(&zram->stats.stores);
+    uint64_t loads = atomic64_read(&zram->stats.loads);
+    uint64_t orig = zram->stored_pages * PAGE_SIZE;
+    uint64_t mem_used = zs_pool_pages(zram->pool) * PAGE_SIZE;
+
+    kprintf("zram %s:\n", bdev->name);
+    kprintf("     Stored pages:   %lu (%lu same filled, %lu incompressible)\n", 
+            zram->stored_pages, atomic64_read(&zram->stats.same_pages), 
+            atomic64_read(&zram->stats.huge_pages));
+    kprintf("     Original:       %lu KiB\n", orig / 1024);
+    kprintf("     Compressed:     %lu KiB\n", zram->compr_bytes / 1024);
+    kprintf("     Memory used:    %lu KiB\n", mem_used / 1024);
+    // Ratio over what we actually hold in memory, allocator waste included
+    if (mem_used)
+        kprintf("     Ratio:          %lu.%lu\n", orig / mem_used, 
+                                                (orig * 10 / mem_used) % 10);
+    if (stores)
+        kprintf("     Incompressible: %lu%% of stores\n", 
+                    atomic64_read(&zram->stats.huge_pages) * 100 / stores);
+    kprintf("     Failed stores:  %lu\n", atomic64_read(&zram->stats.failed_stores));
+    kprintf("     Store:          %lu, avg %lu cycles\n", stores, 
+                    stores ? atomic64_read(&zram->stats.store_cycles) / stores : 0);
+    kprintf("     Load:           %lu, avg %lu cycles\n", loads, 
+                    loads ? atomic64_read(&zram->stats.load_cycles) / loads : 0);
+}
@@ -0,0 +1,140 @@
+#include <kernel/cmdline.h>
+#include <kernel/limine_requests.h>
+#include <kernel/klogging.h>
+#include <klib/string.h>
+
+struct cmdline_arg {
+    const char *key;
+    const char *value;
+};
+
+// Bootloader reclaimable memory might be gone by the time someone asks so
+// we keep our own copy, the args point into it
+static char cmdline_buf[CMDLINE_MAX_LEN];
+static struct cmdline_arg cmdline_args[CMDLINE_MAX_ARGS];
+static int cmdline_argc = 0;
+
+void cmdline_init(void){
+    struct limine_kernel_file_request *req = get_kernel_file_request();
+    if (!req->response || !req->response->kernel_file)
+        return;
+
+    const char *src = req->response->kernel_file->cmdline;
+    if (!src || !*src)
+        return;
+
+    size_t len = strlen(src);
+    if (len >= CMDLINE_MAX_LEN) {
+        KWARN("Command line is longer than %d characters, cutting it off\n", 
+                                                        CMDLINE_MAX_LEN - 1);
+        len = CMDLINE_MAX_LEN - 1;
+    }
+    memcpy(cmdline_buf, src, len);
+    cmdline_buf[len] = '\0';
+
+    char *save;
+    for (char *tok = kstrtok_r(cmdline_buf, " ", &save); tok; 
+                                        tok = kstrtok_r(NULL, " ", &save)) {
+        // Several spaces in a row give us empty tokens
+        if (!*tok)
+            continue;
+        if (cmdline_argc >= CMDLINE_MAX_ARGS) {
+            KWARN("Too many command line arguments, ignoring the rest\n");
+            break;
+        }
+
+        char *eq = strchr(tok, '=');
+        if (eq)
+            *eq = '\0';
+        cmdline_args[cmdline_argc].key = tok;
+        cmdline_args[cmdline_argc].value = eq ? eq + 1 : NULL;
+        cmdline_argc++;
+    }
+
+    kprintf("Command line: %s\n", src);
+}
+
+static struct cmdline_arg *cmdline_find(const char *key){
+    // Last one wins, same as Linux
+    for (int i = cmdline_argc - 1; i >= 0; i--) {
+        if (strcmp(cmdline_args[i].key, key) == 0)
+            return &cmdline_args[i];
+    }
+    return NULL;
+}
+
+const char *cmdline_get(const char *key){
+    struct cmdline_arg *arg = cmdline_find(key);
+    return arg ? arg->value : NULL;
+}
+
+bool cmdline_has(const char *flag){
+    return cmdline_find(flag) != NULL;
+}
+
+uint64_t cmdline_get_size(const char *key, uint64_t def){
+    const char *str = cmdline_get(key);
+    if (!str || *str < '0' || *str > '9')
+        return def;
+
+    uint64_t val = 0;
+    for (; *str >= '0' && *str <= '9'; str++)
+        val = val * 10 + (uint64_t)(*str - '0');
+
+    switch (*str) {
+        case 'G': case 'g': val <<= 30; str++; break;
+        case 'M': case 'm': val <<= 20; str++; break;
+        case 'K': case 'k': val <<= 10; str++; break;
+        default: break;
+    }
+
+    if (*str) {
+        KWARN("Couldn't make sense of %s=%s\n", key, cmdline_get(key));
+        return def;
+    }
+    return val;
+}
+
+static const char *parse_uint(const char *str, uint64_t *val){
+    if (*str < '0' || *str > '9')
+        return NULL;
+    *val = 0;
+    for (; *str >= '0' && *str <= '9'; str++)
+        *val = *val * 10 + (uint64_t)(*str - '0');
+    return str;
+}
+
+uint64_t cmdline_get_cpu_mask(const char *key){
+    const char *str = cmdline_get(key);
+    uint64_t mask = 0;
+    if (!str)
+        return 0;
+
+    while (*str) {
+        uint64_t first, last;
+        str = parse_uint(str, &first);
+        if (!str)
+            goto bad;
+        last = first;
+        if (*str == '-') {
+            str = parse_uint(str + 1, &last);
+            if (!str)
+                goto bad;
+        }
+        if (last < first || last >= 64)
+            goto bad;
+
+        for (uint64_t cpu = first; cpu <= last; cpu++)
+            mask |= 1UL << cpu;
+
+        if (*str == ',')
+            str++;
+        else if (*str)
+            goto bad;
+    }
+    return mask;
+
+bad:
+    KWARN("Couldn't make sense of %s=%s\n", key, cmdline_get(key));
+    return 0;
+}
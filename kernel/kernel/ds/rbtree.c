@@ -0,0 +1,280 @@
+#include <ds/rbtree.h>
+
+// Plain CLRS red-black tree, NULL children count as black leaves. 
+// Augmented values are kept right by recomputing bottom up: rotations only 
+// touch the two nodes that moved, everything else goes through rb_propagate
+
+static inline void augment_node(struct rb_node *node, const struct rb_augment *aug){
+    if (aug && aug->recompute)
+        aug->recompute(node);
+}
+
+void rb_propagate(struct rb_node *node, const struct rb_augment *aug){
+    if (!aug || !aug->recompute)
+        return;
+
+    while (node) {
+        aug->recompute(node);
+        node = node->parent;
+    }
+}
+
+static void replace_child(struct rb_root *root, struct rb_node *parent,
+                          struct rb_node *old, struct rb_node *new_node){
+    if (!parent)
+        root->node = new_node;
+    else if (parent->left == old)
+        parent->left = new_node;
+    else
+        parent->right = new_node;
+}
+
+static void rotate_left(struct rb_node *x, struct rb_root *root,
+                                const struct rb_augment *aug){
+    struct rb_node *y = x->right;
+
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+
+    y->parent = x->parent;
+    replace_child(root, x->parent, x, y);
+
+    y->left = x;
+    x->parent = y;
+
+    // x is below y now so it goes first
+    augment_node(x, aug);
+    augment_node(y, aug);
+}
+
+static void rotate_right(struct rb_node *x, struct rb_root *root,
+                                const struct rb_augment *aug){
+    struct rb_node *y = x->left;
+
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+
+    y->parent = x->parent;
+    replace_child(root, x->parent, x, y);
+
+    y->right = x;
+    x->parent = y;
+
+    augment_node(x, aug);
+    augment_node(y, aug);
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root,
+                                const struct rb_augment *aug){
+    // New leaf changes the subtree of every ancestor
+    rb_propagate(node, aug);
+
+    struct rb_node *parent;
+    while ((parent = node->parent) && parent->color == RB_RED) {
+        // Parent is red so it isn't the root, grandparent always exists
+        struct rb_node *gparent = parent->parent;
+
+        if (parent == gparent->left) {
+            struct rb_node *uncle = gparent->right;
+            if (uncle && uncle->color == RB_RED) {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rotate_left(parent, root, aug);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rotate_right(gparent, root, aug);
+        } else {
+            struct rb_node *uncle = gparent->left;
+            if (uncle && uncle->color == RB_RED) {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rotate_right(parent, root, aug);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rotate_left(gparent, root, aug);
+        }
+    }
+    root->node->color = RB_BLACK;
+}
+
+// x took the place of a removed black node and is "double black", since x 
+// can be a NULL leaf we carry its parent around separately
+static void erase_fixup(struct rb_node *x, struct rb_node *parent,
+                        struct rb_root *root, const struct rb_augment *aug){
+    while (x != root->node && (!x || x->color == RB_BLACK)) {
+        if (x == parent->left) {
+            struct rb_node *w = parent->right;
+            if (w->color == RB_RED) {
+                w->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_left(parent, root, aug);
+                w = parent->right;
+            }
+            if ((!w->left || w->left->color == RB_BLACK) &&
+                (!w->right || w->right->color == RB_BLACK)) {
+                w->color = RB_RED;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (!w->right || w->right->color == RB_BLACK) {
+                    w->left->color = RB_BLACK;
+                    w->color = RB_RED;
+                    rotate_right(w, root, aug);
+                    w = parent->right;
+                }
+                w->color = parent->color;
+                parent->color = RB_BLACK;
+                if (w->right)
+                    w->right->color = RB_BLACK;
+                rotate_left(parent, root, aug);
+                x = root->node;
+                break;
+            }
+        } else {
+            struct rb_node *w = parent->left;
+            if (w->color == RB_RED) {
+                w->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_right(parent, root, aug);
+                w = parent->left;
+            }
+            if ((!w->left || w->left->color == RB_BLACK) &&
+                (!w->right || w->right->color == RB_BLACK)) {
+                w->color = RB_RED;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (!w->left || w->left->color == RB_BLACK) {
+                    w->right->color = RB_BLACK;
+                    w->color = RB_RED;
+                    rotate_left(w, root, aug);
+                    w = parent->left;
+                }
+                w->color = parent->color;
+                parent->color = RB_BLACK;
+                if (w->left)
+                    w->left->color = RB_BLACK;
+                rotate_right(parent, root, aug);
+                x = root->node;
+                break;
+            }
+        }
+    }
+    if (x)
+        x->color = RB_BLACK;
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root,
+                                const struct rb_augment *aug){
+    struct rb_node *child, *parent;
+    int color;
+
+    if (!node->left || !node->right) {
+        child = node->left ? node->left : node->right;
+        parent = node->parent;
+        color = node->color;
+
+        replace_child(root, parent, node, child);
+        if (child)
+            child->parent = parent;
+    } else {
+        // Two children, the in order successor takes the node's place
+        struct rb_node *succ = node->right;
+        while (succ->left)
+            succ = succ->left;
+
+        color = succ->color;
+        child = succ->right;
+
+        if (succ->parent == node) {
+            parent = succ;
+        } else {
+            parent = succ->parent;
+            parent->left = child;
+            if (child)
+                child->parent = parent;
+
+            succ->right = node->right;
+            node->right->parent = succ;
+        }
+
+        succ->left = node->left;
+        node->left->parent = succ;
+        succ->color = node->color;
+
+        replace_child(root, node->parent, node, succ);
+        succ->parent = node->parent;
+    }
+
+    // The successor (if any) sits above parent so this covers it too
+    rb_propagate(parent, aug);
+
+    if (color == RB_BLACK)
+        erase_fixup(child, parent, root, aug);
+
+    node->parent = node->left = node->right = NULL;
+}
+
+struct rb_node* rb_first(const struct rb_root *root){
+    struct rb_node *node = root->node;
+    if (!node)
+        return NULL;
+    while (node->left)
+        node = node->left;
+    return node;
+}
+
+struct rb_node* rb_last(const struct rb_root *root){
+    struct rb_node *node = root->node;
+    if (!node)
+        return NULL;
+    while (node->right)
+        node = node->right;
+    return node;
+}
+
+struct rb_node* rb_next(const struct rb_node *node){
+    if (node->right) {
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        return (struct rb_node*)node;
+    }
+
+    struct rb_node *parent;
+    while ((parent = node->parent) && node == parent->right)
+        node = parent;
+    return parent;
+}
+
+struct rb_node* rb_prev(const struct rb_node *node){
+    if (node->left) {
+        node = node->left;
+        while (node->right)
+            node = node->right;
+        return (struct rb_node*)node;
+    }
+
+    struct rb_node *parent;
+    while ((parent = node->parent) && node == parent->left)
+        node = parent;
+    return parent;
+}
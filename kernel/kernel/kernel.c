@@ -4,11 +4,17 @@
 #include <kernel/tty.h>
 #include <kernel/klogging.h>
 #include <kernel/vmm.h>
+#include <kernel/memmgr.h>
 #include <kernel/pmm.h>
 #include <kernel/apic.h>
 #include <kernel/timer.h>
 #include <kernel/smp.h>
 #include <kernel/scheduler.h>
+#include <kernel/reclaim.h>
+#include <kernel/swap.h>
+#include <kernel/cmdline.h>
+#include <kernel/numa.h>
+#include <kernel/tick.h>
 
 //#include <tests/malloc_tests.h>
 //#include <tests/vmm_tests.h>
@@ -32,6 +38,12 @@ void _start(void) {
     init_gdt();
     init_idt();
 
+    // The allocators already look at it (cma=, numa=)
+    cmdline_init();
+    // Arenas are split per node and allocations go by the CPU's node
+    numa_init();
+    smp_init_bsp();
+
     buddy_allocator_init();
     slab_allocator_init();
 
@@ -39,16 +51,33 @@ void _start(void) {
         KERROR("Failed to initialize virtual memory manager\n");
     else
         KSUCCESS("Virtual memory manager initialized properly\n");
+
+    if(fb_remap_wc() != 0)
+        KWARN("Framebuffer stays on the bootloader's mapping\n");
+
+    if(mm_init() != 0)
+        KERROR("Failed to initialize task memory manager\n");
+
+    reclaim_init();
+    if(swap_init() != 0)
+        KWARN("No swap, anonymous memory can't be reclaimed\n");
    
     apic_global_init();
     apic_timer_register_handler();
     reload_idt();
     
+    tick_init();
     scheduler_init();
+    if(cmdline_has("sched_bench")) {
+        sched_bench_pick_next();
+        sched_bench_yield();
+    }
  
     smp_init(); 
+    // Needs the tick, which the boot CPU only starts in smp_init
+    if(cmdline_has("sched_bench"))
+        sched_bench_rt_latency();
     
-    while(1)
-        __asm__ __volatile__("pause");
+    cpu_idle();
 }
 
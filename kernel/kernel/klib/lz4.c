@@ -0,0 +1,191 @@
+#include <klib/lz4.h>
+#include <klib/string.h>
+
+// Format constants from the LZ4 block spec: matches are at least 4 bytes,
+// the last 5 bytes are always literals and the last match starts at least
+// 12 bytes before the end
+#define LZ4_MIN_MATCH       4
+#define LZ4_LAST_LITERALS   5
+#define LZ4_MFLIMIT         12
+#define LZ4_MAX_OFFSET      65535
+
+// Misses in a row before we start skipping ahead faster, incompressible 
+// data gets through quickly this way (liblz4 does the same)
+#define LZ4_SKIP_TRIGGER    6
+
+static inline uint32_t lz4_read32(const uint8_t *p){
+    uint32_t v;
+    __builtin_memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t seq){
+    return (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static inline uint8_t* lz4_write_length(uint8_t *op, size_t len){
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+size_t lz4_compress(const uint8_t *src, size_t src_len, uint8_t *dst, 
+                                        size_t dst_cap, void *wrkmem){
+    if (src_len > LZ4_MAX_INPUT_SIZE)
+        return 0;
+
+    uint16_t *table = wrkmem;
+    memset(table, 0, LZ4_WORKMEM_SIZE);
+
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + src_len;
+    const uint8_t *mflimit = end - LZ4_MFLIMIT;
+    const uint8_t *matchlimit = end - LZ4_LAST_LITERALS;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dst_cap;
+
+    if (src_len > LZ4_MFLIMIT) {
+        ip++;
+        uint32_t misses = 0;
+
+        while (ip < mflimit) {
+            uint32_t seq = lz4_read32(ip);
+            uint32_t h = lz4_hash(seq);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint16_t)(ip - src);
+
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != seq) {
+                ip += 1 + (misses++ >> LZ4_SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            // Whatever matches right before the hash hit belongs to the match too
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            const uint8_t *mp = ip + LZ4_MIN_MATCH;
+            const uint8_t *rp = ref + LZ4_MIN_MATCH;
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            size_t lit_len = ip - anchor;
+            size_t match_len = mp - ip - LZ4_MIN_MATCH;
+            // token + lengths + literals + offset
+            if ((size_t)(oend - op) < 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1)
+                return 0;
+
+            uint8_t *token = op++;
+            if (lit_len >= 15) {
+                *token = 15 << 4;
+                op = lz4_write_length(op, lit_len - 15);
+            } else {
+                *token = (uint8_t)(lit_len << 4);
+            }
+            memcpy(op, anchor, lit_len);
+            op += lit_len;
+
+            uint16_t offset = (uint16_t)(ip - ref);
+            *op++ = offset & 0xFF;
+            *op++ = offset >> 8;
+
+            if (match_len >= 15) {
+                *token |= 15;
+                op = lz4_write_length(op, match_len - 15);
+            } else {
+                *token |= (uint8_t)match_len;
+            }
+
+            ip = mp;
+            anchor = ip;
+
+            // Cheap way to find more matches inside long repeats
+            if (ip < mflimit)
+                table[lz4_hash(lz4_read32(ip - 2))] = (uint16_t)(ip - 2 - src);
+        }
+    }
+
+    size_t lit_len = end - anchor;
+    if ((size_t)(oend - op) < 1 + lit_len / 255 + 1 + lit_len)
+        return 0;
+
+    if (lit_len >= 15) {
+        *op++ = 15 << 4;
+        op = lz4_write_length(op, lit_len - 15);
+    } else {
+        *op++ = (uint8_t)(lit_len << 4);
+    }
+    memcpy(op, anchor, lit_len);
+    op += lit_len;
+
+    return op - dst;
+}
+
+int lz4_decompress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap){
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + src_len;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dst_cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                lit_len += b;
+            } while (b == 255);
+        }
+
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // The last sequence has no match
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst))
+            return -1;
+
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ4_MIN_MATCH;
+
+        if (match_len > (size_t)(oend - op))
+            return -1;
+
+        // Byte by byte since the match can overlap what we're writing
+        const uint8_t *match = op - offset;
+        while (match_len--)
+            *op++ = *match++;
+    }
+
+    return op - dst;
+}
@@ -0,0 +1,249 @@
+#include <kernel/cma.h>
+#include <kernel/cmdline.h>
+#include <kernel/spinlock.h>
+#include <kernel/reclaim.h>
+#include <kernel/pmm.h>
+
+struct cma_stats cma_stats;
+
+static phys_addr cma_base = 0;
+static uint64_t cma_nr_pages = 0;
+
+/* used:   the page isn't free, either lent out or part of a contiguous range
+ * pinned: the page belongs to a contiguous range (or one being put together)
+ *         and must not be lent, a lent page freed while pinned stays ours */
+static uint64_t cma_used[CMA_MAX_PAGES / 64];
+static uint64_t cma_pinned[CMA_MAX_PAGES / 64];
+static uint64_t cma_nr_free = 0;
+// Next fit for lending so we don't hammer the start of the area
+static uint64_t cma_cursor = 0;
+
+static DEFINE_SPINLOCK(cma_lock);
+
+static inline bool map_test(uint64_t *map, uint64_t idx){
+    return map[idx / 64] & (1UL << (idx % 64));
+}
+
+static inline void map_set(uint64_t *map, uint64_t idx){
+    map[idx / 64] |= 1UL << (idx % 64);
+}
+
+static inline void map_clear(uint64_t *map, uint64_t idx){
+    map[idx / 64] &= ~(1UL << (idx % 64));
+}
+
+void cma_reserve(struct limine_memmap_response *mmap){
+    uint64_t size = cmdline_get_size("cma", CMA_DEFAULT_SIZE);
+    size &= ~(CMA_ALIGN - 1);
+    if (!size)
+        return;
+    if (size > CMA_MAX_SIZE) {
+        KWARN("cma=%lu MiB is more than we can track, using %lu MiB\n",
+                        size / (1024 * 1024), CMA_MAX_SIZE / (1024 * 1024));
+        size = CMA_MAX_SIZE;
+    }
+
+    // Top of the biggest usable entry, leaving at least an eighth at the 
+    // bottom for frame metadata and ordinary allocations
+    phys_addr best_start = 0;
+    uint64_t best_len = 0;
+
+    for (uint64_t i = 0; i < mmap->entry_count; i++) {
+        struct limine_memmap_entry *entry = mmap->entries[i];
+        if (entry->type != LIMINE_MEMMAP_USABLE)
+            continue;
+
+        phys_addr end = (entry->base + entry->length) & ~(CMA_ALIGN - 1);
+        if (end < size || end - size < entry->base + entry->length / 8)
+            continue;
+        if (entry->length > best_len) {
+            best_len = entry->length;
+            best_start = end - size;
+        }
+    }
+
+    if (!best_len) {
+        KWARN("No room for a %lu MiB contiguous area\n", size / (1024 * 1024));
+        return;
+    }
+
+    cma_base = best_start;
+    cma_nr_pages = size / PAGE_FRAME_SIZE;
+    cma_nr_free = cma_nr_pages;
+
+    KSUCCESS("Reserved %lu MiB contiguous area at 0x%lx\n", 
+                                        size / (1024 * 1024), cma_base);
+}
+
+bool cma_contains(phys_addr phys){
+    return phys >= cma_base && phys < cma_base + cma_nr_pages * PAGE_FRAME_SIZE;
+}
+
+void cma_range(phys_addr *start, phys_addr *end){
+    *start = cma_base;
+    *end = cma_base + cma_nr_pages * PAGE_FRAME_SIZE;
+}
+
+phys_addr cma_alloc_movable(bool force){
+    if (!cma_nr_pages)
+        return 0;
+
+    int_flags flags;
+    spinlock_lock_intsave(&cma_lock, &flags);
+
+    if (!cma_nr_free || (!force && cma_nr_free <= buddy_free_page_count())) {
+        spinlock_unlock_intrestore(&cma_lock, flags);
+        return 0;
+    }
+
+    uint64_t idx = cma_cursor;
+    for (uint64_t n = 0; n < cma_nr_pages; n++, idx++) {
+        if (idx == cma_nr_pages)
+            idx = 0;
+        if (!map_test(cma_used, idx))
+            break;
+    }
+    map_set(cma_used, idx);
+    cma_nr_free--;
+    cma_cursor = idx + 1 == cma_nr_pages ? 0 : idx + 1;
+
+    spinlock_unlock_intrestore(&cma_lock, flags);
+
+    phys_addr phys = cma_base + idx * PAGE_FRAME_SIZE;
+    struct page_frame *frame = phys_to_frame(phys);
+    atomic_set(&frame->refcount, 1);
+    frame->order = 0;
+
+    atomic64_inc(&cma_stats.lent);
+    return phys;
+}
+
+void cma_free_page(phys_addr phys){
+    uint64_t idx = (phys - cma_base) / PAGE_FRAME_SIZE;
+
+    int_flags flags;
+    spinlock_lock_intsave(&cma_lock, &flags);
+    // Pinned means cma_alloc is taking this range over, it just got it
+    if (!map_test(cma_pinned, idx) && map_test(cma_used, idx)) {
+        map_clear(cma_used, idx);
+        cma_nr_free++;
+    }
+    spinlock_unlock_intrestore(&cma_lock, flags);
+}
+
+// Caller holds cma_lock. Returns how far into the window the first pinned
+// page is, nr_pages if there is none
+static uint64_t find_pinned(uint64_t start, uint64_t nr_pages){
+    for (uint64_t i = 0; i < nr_pages; i++) {
+        if (map_test(cma_pinned, start + i))
+            return i;
+    }
+    return nr_pages;
+}
+
+// Pinning first means nothing in the window gets lent out again while 
+// we're busy moving the rest out of the way
+static bool cma_isolate(uint64_t start, uint64_t nr_pages){
+    for (uint64_t i = 0; i < nr_pages; i++) {
+        phys_addr phys = cma_base + (start + i) * PAGE_FRAME_SIZE;
+        if (!pmm_page_refcount(phys))
+            continue;
+
+        if (migrate_page(phys) != 0) {
+            atomic64_inc(&cma_stats.migrate_failed);
+            return false;
+        }
+        atomic64_inc(&cma_stats.migrated);
+    }
+    return true;
+}
+
+phys_addr cma_alloc(uint64_t nr_pages, uint64_t align_pages){
+    if (!nr_pages || nr_pages > cma_nr_pages)
+        return 0;
+    if (!align_pages)
+        align_pages = 1;
+
+    int tries = 0;
+    for (uint64_t start = 0; start + nr_pages <= cma_nr_pages && tries < CMA_ALLOC_RETRIES;
+                                                            start += align_pages) {
+        int_flags flags;
+        spinlock_lock_intsave(&cma_lock, &flags);
+
+        uint64_t pinned = find_pinned(start, nr_pages);
+        if (pinned < nr_pages) {
+            spinlock_unlock_intrestore(&cma_lock, flags);
+            // Next window has to start past it
+            start = (start + pinned) & ~(align_pages - 1);
+            continue;
+        }
+
+        for (uint64_t i = start; i < start + nr_pages; i++) {
+            map_set(cma_pinned, i);
+            if (!map_test(cma_used, i)) {
+                map_set(cma_used, i);
+                cma_nr_free--;
+            }
+        }
+        spinlock_unlock_intrestore(&cma_lock, flags);
+
+        tries++;
+        if (cma_isolate(start, nr_pages)) {
+            atomic64_inc(&cma_stats.allocs);
+            return cma_base + start * PAGE_FRAME_SIZE;
+        }
+
+        // Whatever we managed to clear goes back, the rest stays lent
+        spinlock_lock_intsave(&cma_lock, &flags);
+        for (uint64_t i = start; i < start + nr_pages; i++) {
+            map_clear(cma_pinned, i);
+            if (!pmm_page_refcount(cma_base + i * PAGE_FRAME_SIZE)) {
+                map_clear(cma_used, i);
+                cma_nr_free++;
+            }
+        }
+        spinlock_unlock_intrestore(&cma_lock, flags);
+    }
+
+    atomic64_inc(&cma_stats.alloc_failed);
+    return 0;
+}
+
+void cma_release(phys_addr phys, uint64_t nr_pages){
+    if (!cma_contains(phys) || !cma_contains(phys + (nr_pages - 1) * PAGE_FRAME_SIZE)) {
+        KERROR("cma_release of 0x%lx isn't ours\n", phys);
+        return;
+    }
+
+    uint64_t start = (phys - cma_base) / PAGE_FRAME_SIZE;
+
+    int_flags flags;
+    spinlock_lock_intsave(&cma_lock, &flags);
+    for (uint64_t i = start; i < start + nr_pages; i++) {
+        if (!map_test(cma_pinned, i)) {
+            KERROR("cma_release of 0x%lx that was never allocated\n", 
+                                        cma_base + i * PAGE_FRAME_SIZE);
+            continue;
+        }
+        map_clear(cma_pinned, i);
+        map_clear(cma_used, i);
+        cma_nr_free++;
+    }
+    spinlock_unlock_intrestore(&cma_lock, flags);
+}
+
+void cma_print_stats(void){
+    kprintf("Contiguous memory area:\n");
+    if (!cma_nr_pages) {
+        kprintf("     None reserved\n");
+        return;
+    }
+    kprintf("     Range:           0x%lx - 0x%lx\n", cma_base, 
+                                cma_base + cma_nr_pages * PAGE_FRAME_SIZE);
+    kprintf("     Free pages:      %lu of %lu\n", cma_nr_free, cma_nr_pages);
+    kprintf("     Lent:            %lu\n", atomic64_read(&cma_stats.lent));
+    kprintf("     Migrated:        %lu\n", atomic64_read(&cma_stats.migrated));
+    kprintf("     Migrate fails:   %lu\n", atomic64_read(&cma_stats.migrate_failed));
+    kprintf("     Allocations:     %lu\n", atomic64_read(&cma_stats.allocs));
+    kprintf("     Failed allocs:   %lu\n", atomic64_read(&cma_stats.alloc_failed));
+}
@@ -0,0 +1,266 @@
+#include <kernel/huge_memory.h>
+#include <kernel/pmm.h>
+#include <kernel/scheduler.h>
+#include <kernel/task_manager.h>
+#include <kernel/reclaim.h>
+#include <klib/string.h>
+
+struct thp_stats thp_stats;
+
+int thp_anon_fault(struct mem_descriptor *mm, struct mem_region *region, 
+                                                    virt_addr fault_addr) {
+    virt_addr base = fault_addr & HUGE_PAGE_MASK;
+
+    // Shared mappings are populated up front with 4KiB pages anyway
+    if (base < region->start || base + HUGE_PAGE_SIZE - 1 > region->end ||
+            (region->flags & RP_SHARED))
+        return -1;
+
+    // Something is already mapped in here, khugepaged can deal with it later
+    page_table_entry *pde = vmm_walk_pd(mm->as, base, true);
+    if (!pde || (*pde & PTE_PRESENT))
+        return -1;
+
+    phys_addr phys = pmm_alloc_pages(HUGE_PAGE_ORDER);
+    if (!phys) {
+        atomic64_inc(&thp_stats.fault_fallbacks);
+        return -1;
+    }
+    memset(phys_to_virt(phys), 0, HUGE_PAGE_SIZE);
+
+    // Nothing was present so there is nothing to flush
+    *pde = phys | mm_region_pte_flags(region) | PTE_HUGE;
+    mm->as->total_pages += 512;
+    mm->rss += 512;
+    // Huge pages stay off the LRU, only the pieces of a split one go there
+    page_set_anon_rmap(phys, mm, base);
+
+    region->fault_start = base;
+    region->fault_end = base + HUGE_PAGE_SIZE;
+
+    atomic64_inc(&thp_stats.huge_faults);
+    return 0;
+}
+
+int thp_cow_fault(struct mem_descriptor *mm, page_table_entry *pde, virt_addr vaddr) {
+    virt_addr base = vaddr & HUGE_PAGE_MASK;
+    phys_addr old_phys = PTE_ADDR(*pde);
+    uint64_t flags = (PTE_FLAGS(*pde) & ~PTE_COW) | PTE_WRITABLE;
+
+    if (pmm_page_refcount(old_phys) == 1) {
+        *pde = old_phys | flags;
+        vmm_flush_tlb_as(mm->as, base, base + HUGE_PAGE_SIZE);
+        return 0;
+    }
+
+    phys_addr new_phys = pmm_alloc_pages(HUGE_PAGE_ORDER);
+    if (new_phys) {
+        memcpy(phys_to_virt(new_phys), phys_to_virt(old_phys), HUGE_PAGE_SIZE);
+        *pde = new_phys | flags;
+        vmm_flush_tlb_as(mm->as, base, base + HUGE_PAGE_SIZE);
+        pmm_put_page(old_phys);
+        atomic64_inc(&thp_stats.cow_copies);
+        return 0;
+    }
+
+    // No 2MiB block around, splitting a shared huge page already gives us 
+    // private 4KiB copies so the normal path finishes it off
+    if (thp_split(mm, base) != 0)
+        return -1;
+    return 1;
+}
+
+int thp_split(struct mem_descriptor *mm, virt_addr vaddr) {
+    page_table_entry *pde = vmm_walk_pd(mm->as, vaddr, false);
+    if (!pde || !(*pde & PTE_PRESENT) || !(*pde & PTE_HUGE))
+        return 0;
+
+    if (vmm_split_huge(mm->as, vaddr) != 0)
+        return -1;
+
+    atomic64_inc(&thp_stats.splits);
+    return 0;
+}
+
+int thp_split_range_edges(struct mem_descriptor *mm, virt_addr start, virt_addr end) {
+    if ((start & ~HUGE_PAGE_MASK) && thp_split(mm, start) != 0)
+        return -1;
+    if ((end & ~HUGE_PAGE_MASK) && thp_split(mm, end) != 0)
+        return -1;
+    return 0;
+}
+
+// Caller holds mm->lock. The PD entry comes out first and everyone running 
+// on the address space gets a shootdown, from then on anything touching 
+// the range faults and waits for mm->lock so the copy can't miss a write
+static void khugepaged_collapse(struct mem_descriptor *mm, virt_addr base) {
+    page_table_entry *pde = vmm_walk_pd(mm->as, base, false);
+    if (!pde || !(*pde & PTE_PRESENT) || (*pde & PTE_HUGE))
+        return;
+
+    struct page_table *pt = phys_to_virt(PTE_ADDR(*pde));
+    uint64_t ignored = PTE_ACCESSED | PTE_DIRTY | PTE_IDLE_MASK;
+    uint64_t flags = PTE_FLAGS(pt->entries[0]) & ~ignored;
+    int accessed = 0;
+
+    atomic64_add(512, &thp_stats.scanned);
+
+    for (int i = 0; i < 512; i++) {
+        page_table_entry pte = pt->entries[i];
+
+        // Fully populated, private and all mapped the same way
+        if (!(pte & PTE_PRESENT) || (PTE_FLAGS(pte) & ~ignored) != flags ||
+                (pte & PTE_COW) || !(pte & PTE_WRITABLE) ||
+                pmm_page_refcount(PTE_ADDR(pte)) != 1)
+            return;
+
+        // Idle tracking may have beaten us to the bit, age 0 means it 
+        // found it set on its last pass
+        if ((pte & PTE_ACCESSED) || !(pte & PTE_IDLE_MASK))
+            accessed++;
+    }
+
+    if (accessed < KHUGEPAGED_MIN_ACCESSED) {
+        // Start counting from scratch for the next pass. The CPU sets the 
+        // bits with a locked RMW so we clear them (PTE_ACCESSED) the same way
+        for (int i = 0; i < 512; i++)
+            atomic_clear_bit(5, (volatile unsigned long*)&pt->entries[i]);
+        return;
+    }
+
+    phys_addr huge = pmm_alloc_pages(HUGE_PAGE_ORDER);
+    if (!huge)
+        return;
+
+    page_table_entry old_pde = *pde;
+    *pde = 0;
+    vmm_flush_tlb_as(mm->as, base, base + HUGE_PAGE_SIZE);
+
+    for (int i = 0; i < 512; i++)
+        memcpy(phys_to_virt(huge + i * PAGE_SIZE), 
+               phys_to_virt(PTE_ADDR(pt->entries[i])), PAGE_SIZE);
+
+    *pde = huge | flags | PTE_HUGE;
+    page_set_anon_rmap(huge, mm, base);
+
+    // Lazy CPUs can still walk the old table through their paging structure
+    // caches, the gather has them leave before it goes back to the allocator.
+    // Frames first, an early flush must not free the table we are reading
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb, mm->as);
+    for (int i = 0; i < 512; i++)
+        tlb_gather_frame(&tlb, base + i * PAGE_SIZE, PTE_ADDR(pt->entries[i]));
+    tlb_gather_table(&tlb, base, base + HUGE_PAGE_SIZE, PTE_ADDR(old_pde));
+    tlb_gather_flush(&tlb);
+
+    atomic64_inc(&thp_stats.collapses);
+}
+
+// Returns how much of the budget is left
+static uint64_t khugepaged_scan_mm(struct mem_descriptor *mm, virt_addr *cursor, 
+                                                            uint64_t budget) {
+    int_flags flags;
+    spinlock_lock_intsave(&mm->lock, &flags);
+
+    struct mem_region *region = mm_first_region(mm);
+    for (; region && budget; region = mm_next_region(region)) {
+        if (region->end < *cursor)
+            continue;
+        if (!(region->flags & RP_WRITE) || (region->flags & RP_SHARED))
+            continue;
+
+        virt_addr from = region->start > *cursor ? region->start : *cursor;
+        virt_addr base = (from + HUGE_PAGE_SIZE - 1) & HUGE_PAGE_MASK;
+
+        for (; base + HUGE_PAGE_SIZE - 1 <= region->end && budget; base += HUGE_PAGE_SIZE) {
+            budget = budget > 512 ? budget - 512 : 0;
+            *cursor = base + HUGE_PAGE_SIZE;
+            khugepaged_collapse(mm, base);
+        }
+    }
+
+    spinlock_unlock_intrestore(&mm->lock, flags);
+
+    // Went through the whole thing, next pass starts over
+    if (!region && budget)
+        *cursor = 0;
+    return budget;
+}
+
+// The task with pid (the first one if pid is 0), or the one after it. Its 
+// mm comes back pinned so the scan itself doesn't need the task list
+static struct mem_descriptor *khugepaged_next_mm(uint32_t *pid, bool after) {
+    struct mem_descriptor *mm = NULL;
+    bool found = *pid == 0;
+
+    int_flags flags;
+    spinlock_lock_intsave(&task_list_lock, &flags);
+
+    for (struct list_node *node = all_tasks.next; node != &all_tasks; node = node->next) {
+        struct task *task = container_of(node, struct task, tasks);
+        if (!found) {
+            if (task->pid != *pid)
+                continue;
+            found = true;
+            if (after)
+                continue;
+        }
+        if (!task->md || task->state == TASK_ZOMBIE)
+            continue;
+
+        *pid = task->pid;
+        mm = task->md;
+        mm_get(mm);
+        break;
+    }
+
+    spinlock_unlock_intrestore(&task_list_lock, flags);
+    return mm;
+}
+
+// Picks up where the previous pass left off (task and address) so a big 
+// address space still gets covered bit by bit
+static void khugepaged_scan(void) {
+    static uint32_t scan_pid = 0;
+    static virt_addr scan_addr = 0;
+    uint64_t budget = KHUGEPAGED_SCAN_PAGES;
+    bool after = false;
+
+    while (budget) {
+        struct mem_descriptor *mm = khugepaged_next_mm(&scan_pid, after);
+        if (!mm) {
+            // Either we reached the end of the list or the task we were on is gone
+            scan_pid = 0;
+            scan_addr = 0;
+            return;
+        }
+
+        budget = khugepaged_scan_mm(mm, &scan_addr, budget);
+        mm_put(mm);
+        // Budget left means we got through all of it, on to the next task
+        after = true;
+    }
+}
+
+static void khugepaged(void) {
+    while (1) {
+        khugepaged_scan();
+
+        sched_sleep_ms(KHUGEPAGED_SLEEP_MS);
+    }
+}
+
+void khugepaged_init(void) {
+    if (!create_and_schedule_kernel_task(khugepaged, PRIO_BACKGROUND))
+        KERROR("Couldn't start khugepaged\n");
+}
+
+void thp_print_stats(void) {
+    kprintf("Transparent huge pages:\n");
+    kprintf("     Huge faults:     %lu\n", atomic64_read(&thp_stats.huge_faults));
+    kprintf("     Fault fallbacks: %lu\n", atomic64_read(&thp_stats.fault_fallbacks));
+    kprintf("     COW copies:      %lu\n", atomic64_read(&thp_stats.cow_copies));
+    kprintf("     Collapses:       %lu\n", atomic64_read(&thp_stats.collapses));
+    kprintf("     Splits:          %lu\n", atomic64_read(&thp_stats.splits));
+    kprintf("     PTEs scanned:    %lu\n", atomic64_read(&thp_stats.scanned));
+}
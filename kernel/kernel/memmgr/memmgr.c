@@ -1,5 +1,174 @@
 #include <kernel/memmgr.h>
 #include <kernel/pmm.h>
+#include <kernel/scheduler.h>
+#include <kernel/huge_memory.h>
+#include <kernel/reclaim.h>
+#include <kernel/swap.h>
+#include <klib/string.h>
+
+// One zeroed frame shared by every read fault on anonymous memory, it is 
+// only ever mapped read only so nobody can dirty it. The kernel holds a 
+// reference to it forever so the usual get/put on map/unmap never frees it
+static phys_addr zero_page = 0;
+
+int mm_init(void){
+    zero_page = pmm_alloc_page();
+    if(!zero_page){
+        KERROR("Couldn't allocate the zero page\n");
+        return -1;
+    }
+    memset(phys_to_virt(zero_page), 0, PAGE_SIZE);
+    return 0;
+}
+
+static struct anon_family* anon_family_alloc(void){
+    struct anon_family *family = kmalloc(sizeof(*family));
+    if(!family)
+        return NULL;
+
+    spinlock_init(&family->lock);
+    list_init(&family->mms);
+    atomic_set(&family->refcount, 0);
+    return family;
+}
+
+void anon_family_get(struct anon_family *family){
+    atomic_inc(&family->refcount);
+}
+
+void anon_family_put(struct anon_family *family){
+    if(atomic_dec_and_test(&family->refcount))
+        kfree(family);
+}
+
+static void anon_family_join(struct mem_descriptor *mm, struct anon_family *family){
+    anon_family_get(family);
+
+    int_flags flags;
+    spinlock_lock_intsave(&family->lock, &flags);
+    list_add_tail(&mm->family_node, &family->mms);
+    spinlock_unlock_intrestore(&family->lock, flags);
+
+    mm->family = family;
+}
+
+// Once we're off the list reclaim can't find us anymore, so this has to 
+// happen before the page tables go away
+static void anon_family_leave(struct mem_descriptor *mm){
+    struct anon_family *family = mm->family;
+
+    int_flags flags;
+    spinlock_lock_intsave(&family->lock, &flags);
+    list_del(&mm->family_node);
+    spinlock_unlock_intrestore(&family->lock, flags);
+
+    mm->family = NULL;
+    anon_family_put(family);
+}
+
+static inline struct mem_region* rb_to_region(struct rb_node *node){
+    return rb_entry(node, struct mem_region, rb_node);
+}
+
+static void region_recompute_gap(struct rb_node *node){
+    struct mem_region *region = rb_to_region(node);
+    uint64_t gap = region->gap_before;
+
+    if(node->left && rb_to_region(node->left)->subtree_gap > gap)
+        gap = rb_to_region(node->left)->subtree_gap;
+    if(node->right && rb_to_region(node->right)->subtree_gap > gap)
+        gap = rb_to_region(node->right)->subtree_gap;
+
+    region->subtree_gap = gap;
+}
+
+static const struct rb_augment region_gap_aug = {
+    .recompute = region_recompute_gap,
+};
+
+// Has to be called whenever the region before this one changes its end
+static void mm_update_gap(struct mem_region *region){
+    struct mem_region *prev = mm_prev_region(region);
+    virt_addr floor = prev ? prev->end + 1 : MMAP_MIN_ADDR;
+
+    region->gap_before = region->start > floor ? region->start - floor : 0;
+    rb_propagate(&region->rb_node, &region_gap_aug);
+}
+
+static void mm_region_cache_clear(struct mem_descriptor *mm){
+    for(int i = 0; i < MM_REGION_CACHE_SIZE; i++)
+        mm->region_cache[i] = NULL;
+    mm->region_cache_next = 0;
+}
+
+// Regions don't overlap so going left/right by start and end is enough
+static struct mem_region* mm_lookup_region(struct mem_descriptor *mm, virt_addr vaddr){
+    struct rb_node *node = mm->regions.node;
+    while(node){
+        struct mem_region *region = rb_to_region(node);
+        if(vaddr < region->start)
+            node = node->left;
+        else if(vaddr > region->end)
+            node = node->right;
+        else
+            return region;
+    }
+    return NULL;
+}
+
+// First region that ends at or after vaddr, either the one containing it or 
+// the closest one above it
+static struct mem_region* mm_region_from(struct mem_descriptor *mm, virt_addr vaddr){
+    struct rb_node *node = mm->regions.node;
+    struct mem_region *found = NULL;
+    while(node){
+        struct mem_region *region = rb_to_region(node);
+        if(region->end >= vaddr){
+            found = region;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return found;
+}
+
+// Puts an already filled in region into the tree, no merging 
+static int mm_link_region(struct mem_descriptor *mm, struct mem_region *new_region){
+    struct rb_node **link = &mm->regions.node;
+    struct rb_node *parent = NULL;
+    while(*link){
+        struct mem_region *region = rb_to_region(*link);
+        parent = *link;
+
+        if(new_region->end < region->start)
+            link = &(*link)->left;
+        else if(new_region->start > region->end)
+            link = &(*link)->right;
+        else {
+            KERROR("New region overlaps an existing one\n");
+            kprintf("New: %lx - %lx\nOld: %lx - %lx\n", new_region->start, 
+                            new_region->end, region->start, region->end);
+            return -1;
+        }
+    }
+
+    rb_link_node(&new_region->rb_node, parent, link);
+
+    struct mem_region *prev = mm_prev_region(new_region);
+    virt_addr floor = prev ? prev->end + 1 : MMAP_MIN_ADDR;
+    new_region->gap_before = new_region->start > floor ? new_region->start - floor : 0;
+
+    rb_insert_color(&new_region->rb_node, &mm->regions, &region_gap_aug);
+
+    struct mem_region *next = mm_next_region(new_region);
+    if(next)
+        mm_update_gap(next);
+
+    mm->region_count++;
+    mm_region_cache_clear(mm);
+    return 0;
+}
 
 int mm_add_region(struct mem_descriptor *mm, virt_addr start, 
         virt_addr end, uint64_t flags){
@@ -10,115 +179,270 @@ int mm_add_region(struct mem_descriptor *mm, virt_addr start,
     }
 
     struct mem_region *region = kmalloc(sizeof(*region));
+    if(!region)
+        return -1;
 
     region->start = start;
     region->end = end;
     region->flags = flags;
-    region->next = mm->regions;
-    mm->regions = region;
+    region->fault_start = 0;
+    region->fault_end = 0;
+    region->fault_window = FAULT_AROUND_MIN_PAGES;
+    memset(&region->idle, 0, sizeof(region->idle));
+    memset(&region->idle_scan, 0, sizeof(region->idle_scan));
 
+    if(mm_link_region(mm, region) != 0){
+        kfree(region);
+        return -1;
+    }
+    mm->total_vm += vmm_pages_in_range(start, end + 1);
+
+    mm_merge_region(mm, region);
     return 0;
 }
 
+static void mm_erase_region(struct mem_descriptor *mm, struct mem_region *region){
+    struct mem_region *next = mm_next_region(region);
+
+    rb_erase(&region->rb_node, &mm->regions, &region_gap_aug);
+    if(next)
+        mm_update_gap(next);
+
+    mm->region_count--;
+    mm_region_cache_clear(mm);
+    kfree(region);
+}
+
 int mm_remove_region(struct mem_descriptor *mm, virt_addr start, virt_addr end){
     if(!mm || start >= end){
     KERROR("NULL task mem descriptor or start addr is bigger than end addr\n");
         return -1;
     }
     
-    struct mem_region **current = &(mm->regions);
-    while(*current){
-        if((*current)->start == start && (*current)->end == end){
-            struct mem_region *rmr = *current;
-            *current = (*current)->next;
-            kfree(rmr);
-            return 0;
-        }
-        current = &((*current)->next);
+    struct mem_region *region = mm_lookup_region(mm, start);
+    if(region && region->start == start && region->end == end){
+        mm->total_vm -= vmm_pages_in_range(start, end + 1);
+        mm_erase_region(mm, region);
+        return 0;
     }
     KERROR("Couldn't find region to remove, check start and end VAs\n"); 
     return -1;
 }
 
+// Folds the region into its neighbours if they touch it and have exactly 
+// the same flags, returns whatever region ended up covering it
+struct mem_region* mm_merge_region(struct mem_descriptor *mm, struct mem_region *region){
+    struct mem_region *prev = mm_prev_region(region);
+    if(prev && prev->end + 1 == region->start && prev->flags == region->flags){
+        prev->end = region->end;
+        mm_erase_region(mm, region);
+        region = prev;
+    }
+
+    struct mem_region *next = mm_next_region(region);
+    if(next && region->end + 1 == next->start && region->flags == next->flags){
+        region->end = next->end;
+        mm_erase_region(mm, next);
+    }
+
+    return region;
+}
+
+// Cuts the region containing addr in two so that addr starts a region
+static int mm_split_region(struct mem_descriptor *mm, virt_addr addr){
+    struct mem_region *region = mm_lookup_region(mm, addr);
+    if(!region || region->start == addr)
+        return 0;
+
+    struct mem_region *upper = kmalloc(sizeof(*upper));
+    if(!upper)
+        return -1;
+
+    *upper = *region;
+    upper->start = addr;
+    region->end = addr - 1;
+
+    // Lower half keeps its place in the tree, only the key of the new one 
+    // has to be checked against the rest
+    if(mm_link_region(mm, upper) != 0){
+        region->end = upper->end;
+        kfree(upper);
+        return -1;
+    }
+    return 0;
+}
+
 struct mem_region *mm_find_region(struct mem_descriptor *mm, virt_addr vaddr){
     if(!mm){
         KERROR("Task mem descriptor provided is NULL\n");
         return NULL;
     }
-    
-    struct mem_region *region = mm->regions;
-    while(region){
-        if(region->start <= vaddr && vaddr <= region->end)
-            return region;
 
-        region = region->next;
+    for(int i = 0; i < MM_REGION_CACHE_SIZE; i++){
+        struct mem_region *region = mm->region_cache[i];
+        if(region && region->start <= vaddr && vaddr <= region->end)
+            return region;
+    }
+    
+    struct mem_region *region = mm_lookup_region(mm, vaddr);
+    if(region){
+        mm->region_cache[mm->region_cache_next] = region;
+        mm->region_cache_next = (mm->region_cache_next + 1) % MM_REGION_CACHE_SIZE;
+        return region;
     }
-    KERROR("Couldn't find region");
+    KERROR("Couldn't find region\n");
     return NULL;
 }
 
 // Only for user space as kernel tasks will have NULL mem descriptor
 struct mem_descriptor *mm_alloc(void){
     struct mem_descriptor *mem_desc = kmalloc(sizeof(*mem_desc));
+    if(!mem_desc)
+        return NULL;
+
+    struct anon_family *family = anon_family_alloc();
     struct addr_space *as = vmm_create_address_space();
     
-    if(!as)
+    if(!as || !family){
+        if(as)
+            vmm_destroy_address_space(as);
+        kfree(family);
+        kfree(mem_desc);
         return NULL;
+    }
 
     mem_desc->as = as;
-    mem_desc->regions = NULL;
+    atomic_set(&mem_desc->users, 1);
+    spinlock_init(&mem_desc->lock);
+    rb_root_init(&mem_desc->regions);
+    mem_desc->region_count = 0;
+    mm_region_cache_clear(mem_desc);
+    mem_desc->start_brk = 0;
     mem_desc->brk = 0;
-    mem_desc->mmap_base = 0;
+    mem_desc->mmap_base = USER_SPACE_END - STACK_SIZE - GUARD_SIZE;
     mem_desc->total_vm = 0;
     mem_desc->rss = 0;
+    mem_desc->wss_pages = 0;
+    mem_desc->idle_passes = 0;
+    anon_family_join(mem_desc, family);
 
     return mem_desc;
 }
 
+void mm_get(struct mem_descriptor *mm){
+    atomic_inc(&mm->users);
+}
+
+void mm_put(struct mem_descriptor *mm){
+    if(atomic_dec_and_test(&mm->users))
+        mm_free(mm);
+}
+
 void mm_free(struct mem_descriptor *mm){
     if(!mm){
         KERROR("Cannot free NULL task memory descriptor\n");
         return;
     }
 
+    anon_family_leave(mm);
     vmm_destroy_address_space(mm->as);
     
-    struct mem_region *current = mm->regions;
-    struct mem_region *next;
-
+    // Whole tree goes away so there is no point in rebalancing
+    struct mem_region *current = mm_first_region(mm);
     while (current) {
-        next = current->next;
+        struct mem_region *next = mm_next_region(current);
         kfree(current);
         current = next;
     }
 
-    mm->regions = NULL; 
+    rb_root_init(&mm->regions);
     kfree(mm);
 }
 
+// Regions are copied as is, page tables are duplicated level by level and
+// private pages end up shared read only between parent and child until 
+// one of them writes to it, that way fork is mostly page table work
+struct mem_descriptor *mm_copy(struct mem_descriptor *old_mm){
+    if(!old_mm){
+        KERROR("Cannot copy NULL task memory descriptor\n");
+        return NULL;
+    }
+
+    struct mem_descriptor *mm = mm_alloc();
+    if(!mm)
+        return NULL;
+
+    mm->start_brk = old_mm->start_brk;
+    mm->brk = old_mm->brk;
+    mm->mmap_base = old_mm->mmap_base;
+    mm->rss = old_mm->rss;
+
+    // The child maps the parent's pages at the same addresses so it joins 
+    // the parent's family, it has to be there before it maps any of them
+    anon_family_leave(mm);
+    anon_family_join(mm, old_mm->family);
+
+    int_flags flags;
+    spinlock_lock_intsave(&old_mm->lock, &flags);
+
+    // Guard regions have nothing mapped so copying them costs nothing, 
+    // PROT_NONE ones might though so they aren't skipped
+    for(struct mem_region *region = mm_first_region(old_mm); region; 
+                                    region = mm_next_region(region)){
+        if(mm_add_region(mm, region->start, region->end, region->flags) != 0)
+            goto fail;
+
+        bool cow = !(region->flags & RP_SHARED);
+        if(vmm_copy_range(mm->as, old_mm->as, region->start, region->end + 1, cow) != 0)
+            goto fail;
+    }
+
+    mm->total_vm = old_mm->total_vm;
+
+    // Parent lost the write bit on its private pages, the user half is not 
+    // global so a CR3 reload is enough to get rid of stale writable entries
+    vmm_flush_tlb_as(old_mm->as, 0, KERNEL_SPACE_START);
+    spinlock_unlock_intrestore(&old_mm->lock, flags);
+    return mm;
+
+fail:
+    spinlock_unlock_intrestore(&old_mm->lock, flags);
+    KERROR("Couldn't copy memory descriptor\n");
+    mm_free(mm);
+    vmm_flush_tlb_as(old_mm->as, 0, KERNEL_SPACE_START);
+    return NULL;
+}
+
 int mm_setup_executable(struct mem_descriptor *mm, 
                        virt_addr code_start, virt_addr code_end, virt_addr data_end) {
     
     // TODO: virtually map code and data segment, we'll get some info from 
     // elf loader when I do make it
-    mm_add_region(mm, code_start, code_end, RP_READ | RP_EXEC);
-    virt_addr data_start = (code_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-    mm_add_region(mm, data_start, data_end, RP_READ | RP_WRITE);
+    // Region ends are inclusive so the next region starts on the page 
+    // after the last byte, not on the aligned end (that one is still ours)
+    if(mm_add_region(mm, code_start, code_end, RP_READ | RP_EXEC) != 0)
+        return -1;
+    virt_addr data_start = vmm_page_align_up(code_end + 1);
+    if(mm_add_region(mm, data_start, data_end, RP_READ | RP_WRITE) != 0)
+        return -1;
 
-    virt_addr heap_start = (data_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    virt_addr heap_start = vmm_page_align_up(data_end + 1);
     virt_addr heap_end = heap_start + HEAP_SIZE - 1;
+    mm->start_brk = heap_start;
     mm->brk = heap_start;
     
     virt_addr guard_heap = heap_end + GUARD_SIZE;
-    mm_add_region(mm, heap_start, heap_end, RP_READ | RP_WRITE | RP_HEAP);  
-    mm_add_region(mm, heap_end + 1, guard_heap, 0);
+    if(mm_add_region(mm, heap_start, heap_end, RP_READ | RP_WRITE | RP_HEAP) != 0 ||
+       mm_add_region(mm, heap_end + 1, guard_heap, 0) != 0)
+        return -1;
 
     virt_addr stack_top = STACK_TOP;
     virt_addr stack_bottom = stack_top - STACK_SIZE + 1;
     virt_addr guard_stack = stack_bottom - GUARD_SIZE;
     
-    mm_add_region(mm, guard_stack, stack_bottom - 1, 0);
-    mm_add_region(mm, stack_bottom, stack_top, RP_READ | RP_WRITE | RP_STACK);
+    if(mm_add_region(mm, guard_stack, stack_bottom - 1, 0) != 0 ||
+       mm_add_region(mm, stack_bottom, stack_top, RP_READ | RP_WRITE | RP_STACK) != 0)
+        return -1;
     
     return 0;
 }
@@ -137,43 +461,560 @@ bool mm_check_access(struct mem_descriptor *mm, virt_addr addr, uint64_t access_
     return (region->flags & access_flags) == access_flags;
 }
 
+static phys_addr alloc_zeroed_page(void) {
+    phys_addr phys = alloc_movable_page();
+    if (phys)
+        memset(phys_to_virt(phys), 0, PAGE_SIZE);
+    return phys;
+}
+
+static int mm_install_anon_page(struct mem_descriptor *mm, struct mem_region *region, 
+                                virt_addr vaddr, bool write, bool flush) {
+    uint64_t flags = mm_region_pte_flags(region);
+    phys_addr phys;
+
+    // The zero page would turn into a private copy on the first write, a 
+    // shared region always gets frames of its own whatever the access
+    if (write || (region->flags & RP_SHARED)) {
+        write = true;
+        phys = alloc_zeroed_page();
+        if (!phys)
+            return -1;
+    } else {
+        if (flags & PTE_WRITABLE)
+            flags = (flags & ~PTE_WRITABLE) | PTE_COW;
+        phys = zero_page;
+        pmm_get_page(zero_page);
+    }
+
+    int ret = flush ? vmm_map_page(mm->as, vaddr, phys, flags)
+                    : vmm_map_page_no_flush(mm->as, vaddr, phys, flags);
+    if (ret != 0) {
+        pmm_put_page(phys);
+        return -1;
+    }
+
+    if (write) {
+        page_set_anon_rmap(phys, mm, vaddr);
+        lru_add_page(phys);
+    }
+
+    // Zero page mappings count too, that way unmapping doesn't have to care
+    // what was behind a PTE
+    mm->rss++;
+    return 0;
+}
+
+// Mapped or swapped out, either way fault around has to leave it alone
+static bool mm_pte_used(struct mem_descriptor *mm, virt_addr vaddr) {
+    page_table_entry *pte = vmm_walk_page_table(mm->as, vaddr, false);
+    return pte && *pte;
+}
+
+// Sequential means the fault lands right next to the previous batch, on 
+// either side since stacks are walked downwards
+static virt_addr fault_around_window(struct mem_region *region, virt_addr page,
+                                                        virt_addr *batch_end) {
+    bool ascending = region->fault_end && page == region->fault_end;
+    bool descending = region->fault_start && page + PAGE_SIZE == region->fault_start;
+
+    if (ascending || descending) {
+        region->fault_window *= 2;
+        if (region->fault_window > FAULT_AROUND_MAX_PAGES)
+            region->fault_window = FAULT_AROUND_MAX_PAGES;
+    } else {
+        region->fault_window /= 2;
+        if (region->fault_window < FAULT_AROUND_MIN_PAGES)
+            region->fault_window = FAULT_AROUND_MIN_PAGES;
+    }
+
+    uint64_t span = (region->fault_window - 1) * PAGE_SIZE;
+    virt_addr start, end;
+
+    // With no history yet a stack is assumed to grow down
+    if (descending || (!ascending && (region->flags & RP_STACK))) {
+        start = page - region->start > span ? page - span : region->start;
+        end = page + PAGE_SIZE;
+    } else {
+        start = page;
+        end = region->end - page > span ? page + span + PAGE_SIZE : region->end + 1;
+    }
+
+    *batch_end = end;
+    return start;
+}
+
+// Nothing is mapped for anonymous memory until it's touched. Reads get the 
+// shared zero page (copy on write if the region is writable so the first 
+// write swaps it out), writes get fresh zeroed frames. Neighbouring pages 
+// are mapped along with the faulting one, how many depends on how 
+// sequential the faults in this region have been so far
+int mm_anon_fault(struct mem_descriptor *mm, struct mem_region *region, 
+                                        virt_addr fault_addr, bool write) {
+    virt_addr page = vmm_page_align_down(fault_addr);
+
+    // Writes into a region big enough for a whole aligned 2MiB page try to 
+    // get one, reads stay on the zero page
+    if (write && thp_anon_fault(mm, region, fault_addr) == 0)
+        return 0;
+
+    // The faulting page is the only one that matters, if that fails so do we
+    if (mm_install_anon_page(mm, region, page, write, true) != 0)
+        return -1;
+
+    virt_addr end;
+    virt_addr start = fault_around_window(region, page, &end);
+
+    // None of these were present so there is nothing to flush. We go 
+    // outwards from the faulting page and stop at the first failure, so the
+    // batch stays one contiguous range around it
+    for (virt_addr va = page; va > start; va -= PAGE_SIZE) {
+        if (mm_pte_used(mm, va - PAGE_SIZE))
+            continue;
+        if (mm_install_anon_page(mm, region, va - PAGE_SIZE, write, false) != 0) {
+            start = va;
+            break;
+        }
+    }
+    for (virt_addr va = page + PAGE_SIZE; va < end; va += PAGE_SIZE) {
+        if (mm_pte_used(mm, va))
+            continue;
+        if (mm_install_anon_page(mm, region, va, write, false) != 0) {
+            end = va;
+            break;
+        }
+    }
+
+    region->fault_start = start;
+    region->fault_end = end;
+    return 0;
+}
+
+// Stack pages are pretty much always written right after they are touched
+// so we skip the zero page and go straight for real frames
 int mm_expand_stack(struct mem_descriptor *mm, virt_addr fault_addr) {
-    phys_addr phys_page = pmm_alloc_page();
-    if (phys_page == 0) {
-        return -1; 
+    struct mem_region *region = mm_find_region(mm, fault_addr);
+    if (!region || !(region->flags & RP_STACK))
+        return -1;
+
+    return mm_anon_fault(mm, region, fault_addr, true);
+}
+
+// brk only moves the bound, pages below it are mapped when they fault. A 
+// fault above brk but inside the heap region bumps brk to cover whatever 
+// the fault around window mapped, so growth speeds up for streaming tasks.
+// Unlike the stack, a heap read can come long before the first write (or 
+// never see one, think calloc'd arrays scanned for zeroes) so reads get the 
+// zero page like any other anonymous memory
+int mm_expand_heap(struct mem_descriptor *mm, virt_addr fault_addr, bool write) {
+    struct mem_region *region = mm_find_region(mm, fault_addr);
+    if (!region || !(region->flags & RP_HEAP))
+        return -1;
+
+    if (mm_anon_fault(mm, region, fault_addr, write) != 0)
+        return -1;
+
+    if (region->fault_end > mm->brk)
+        mm->brk = region->fault_end;
+
+    return 0;
+}
+
+// Drops every mapped page in [start, end) along with the page tables that 
+// end up empty, the caller decides when the gather gets flushed
+static void mm_zap_range(struct mem_descriptor *mm, struct tlb_gather *tlb,
+                                            virt_addr start, virt_addr end) {
+    uint64_t zapped = vmm_zap_range(tlb, start, end);
+    mm->rss = mm->rss > zapped ? mm->rss - zapped : 0;
+}
+
+virt_addr mm_brk(struct mem_descriptor *mm, virt_addr new_brk) {
+    if (!mm)
+        return 0;
+
+    // brk(0) just asks where the break is
+    if (new_brk == 0)
+        return mm->brk;
+
+    int_flags flags;
+    spinlock_lock_intsave(&mm->lock, &flags);
+
+    struct mem_region *heap = mm_find_region(mm, mm->start_brk);
+    if (!heap || new_brk < mm->start_brk || new_brk > heap->end + 1)
+        goto out;
+
+    // Shrinking has to give back whatever got faulted in above the new break
+    virt_addr old_end = vmm_page_align_up(mm->brk);
+    virt_addr new_end = vmm_page_align_up(new_brk);
+    if (new_end < old_end) {
+        if (thp_split_range_edges(mm, new_end, old_end) != 0)
+            goto out;
+
+        struct tlb_gather tlb;
+        tlb_gather_init(&tlb, mm->as);
+        mm_zap_range(mm, &tlb, new_end, old_end);
+        tlb_gather_flush(&tlb);
     }
-    uint64_t flags = PTE_PRESENT | PTE_WRITABLE | PTE_USER | PTE_NX;
-    // vmm_map_page aligns both fault_addr and phys addr down to page size 
-    // so it is perfect for allocating 1 page for the stack
-    return vmm_map_page(mm->as, fault_addr, phys_page, flags);
+
+    mm->brk = new_brk;
+out:
+    spinlock_unlock_intrestore(&mm->lock, flags);
+    return mm->brk;
 }
 
+static int _mm_munmap(struct mem_descriptor *mm, virt_addr addr, size_t len);
+
+// Top down search for len bytes of free space that end at or below limit.
+// Only subtrees whose biggest gap fits are visited, rightmost first 
+static struct mem_region* find_gap_topdown(struct rb_node *node, 
+                                        virt_addr limit, uint64_t len) {
+    if (!node || rb_to_region(node)->subtree_gap < len)
+        return NULL;
+
+    struct mem_region *region = rb_to_region(node);
+    if (region->start > limit)
+        return find_gap_topdown(node->left, limit, len);
+
+    struct mem_region *found = find_gap_topdown(node->right, limit, len);
+    if (found)
+        return found;
 
-int mm_expand_heap(struct mem_descriptor *mm, virt_addr fault_addr) {
-    if(fault_addr < mm->brk){
-        KERROR("Fault address is lower than heap brk - something is seriously wrong\n");
-        kprintf("Fault addr: %lx\nHeap brk: %lx\n", fault_addr, mm->brk);
+    if (region->gap_before >= len)
+        return region;
+
+    return find_gap_topdown(node->left, limit, len);
+}
+
+static virt_addr mm_find_free_range(struct mem_descriptor *mm, uint64_t len) {
+    virt_addr limit = mm->mmap_base;
+
+    // The tree only knows about gaps below a region's start, the one that 
+    // limit cuts through has to be checked by hand
+    struct mem_region *above = mm_region_from(mm, limit);
+    if (above && above->start < limit) {
+        limit = above->start;
+    } else {
+        struct mem_region *below = above ? mm_prev_region(above) : NULL;
+        if (!above && mm->regions.node)
+            below = rb_to_region(rb_last(&mm->regions));
+
+        virt_addr floor = below ? below->end + 1 : MMAP_MIN_ADDR;
+        if (limit > floor && limit - floor >= len)
+            return limit - len;
+    }
+
+    struct mem_region *region = find_gap_topdown(mm->regions.node, limit, len);
+    if (!region)
         return 0;
+
+    virt_addr top = region->start < limit ? region->start : limit;
+    return top - len;
+}
+
+static bool mm_range_is_free(struct mem_descriptor *mm, virt_addr start, uint64_t len) {
+    if (start < MMAP_MIN_ADDR || start + len > USER_SPACE_END || start + len < start)
+        return false;
+
+    struct mem_region *region = mm_region_from(mm, start);
+    return !region || region->start >= start + len;
+}
+
+// Maps the whole range up front, no flushes since none of it was present 
+static int mm_populate(struct mem_descriptor *mm, virt_addr start, virt_addr end) {
+    struct mem_region *region = NULL;
+
+    for (virt_addr va = start; va < end; va += PAGE_SIZE) {
+        if (!region || va > region->end) {
+            region = mm_find_region(mm, va);
+            if (!region)
+                return -1;
+        }
+
+        if (mm_pte_used(mm, va))
+            continue;
+
+        if (mm_install_anon_page(mm, region, va, region->flags & RP_WRITE, false) != 0)
+            return -1;
     }
+    return 0;
+}
 
-    virt_addr grow_start = mm->brk;
-    
-    phys_addr phys_start = buddy_alloc_pages(HEAP_GROW_ORDER);
-    if (phys_start == 0) {
+virt_addr mm_mmap(struct mem_descriptor *mm, virt_addr addr, size_t len, 
+                                                    int prot, int flags) {
+    if (!mm || len == 0)
+        return MAP_FAILED;
+
+    // No files yet so anonymous memory is all there is
+    if (!(flags & MAP_ANONYMOUS)) {
+        KERROR("mmap: only anonymous mappings are supported\n");
+        return MAP_FAILED;
+    }
+
+    if (!(flags & MAP_PRIVATE) == !(flags & MAP_SHARED)) {
+        KERROR("mmap: mapping has to be either private or shared\n");
+        return MAP_FAILED;
+    }
+
+    len = vmm_page_align_up(len);
+
+    if ((flags & MAP_FIXED) && ((addr & ~PAGE_MASK) || addr < MMAP_MIN_ADDR ||
+                addr + len > USER_SPACE_END || addr + len < addr))
+        return MAP_FAILED;
+
+    uint64_t region_flags = 0;
+    if (prot & PROT_READ)
+        region_flags |= RP_READ;
+    if (prot & PROT_WRITE)
+        region_flags |= RP_WRITE;
+    if (prot & PROT_EXEC)
+        region_flags |= RP_EXEC;
+    if (flags & MAP_SHARED)
+        region_flags |= RP_SHARED;
+
+    int_flags int_flags;
+    spinlock_lock_intsave(&mm->lock, &int_flags);
+
+    if (flags & MAP_FIXED) {
+        // Whatever was there gets replaced
+        if (_mm_munmap(mm, addr, len) != 0)
+            goto fail;
+    } else {
+        // The hint is used if it happens to be free, otherwise we pick 
+        addr = vmm_page_align_down(addr);
+        if (!addr || !mm_range_is_free(mm, addr, len))
+            addr = mm_find_free_range(mm, len);
+        if (!addr)
+            goto fail;
+    }
+
+    if (mm_add_region(mm, addr, addr + len - 1, region_flags) != 0)
+        goto fail;
+
+    // Shared anonymous memory has no backing object, the frames themselves
+    // are what gets shared on fork, so they have to exist before that. 
+    // Whatever the prot, an mprotect later must find them there
+    if ((flags & MAP_SHARED) || ((flags & MAP_POPULATE) && (region_flags & RP_READ))) {
+        if (mm_populate(mm, addr, addr + len) != 0) {
+            _mm_munmap(mm, addr, len);
+            goto fail;
+        }
+    }
+
+    spinlock_unlock_intrestore(&mm->lock, int_flags);
+    return addr;
+
+fail:
+    spinlock_unlock_intrestore(&mm->lock, int_flags);
+    return MAP_FAILED;
+}
+
+// Regions sticking out of the range are split so only the covered part goes,
+// every frame and emptied page table is released behind a single flush
+static int _mm_munmap(struct mem_descriptor *mm, virt_addr addr, size_t len) {
+    virt_addr end = addr + vmm_page_align_up(len);
+    if (end > USER_SPACE_END || end < addr)
         return -1;
+
+    if (mm_split_region(mm, addr) != 0 || mm_split_region(mm, end) != 0)
+        return -1;
+    if (thp_split_range_edges(mm, addr, end) != 0)
+        return -1;
+
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb, mm->as);
+
+    struct mem_region *region = mm_region_from(mm, addr);
+    while (region && region->start < end) {
+        struct mem_region *next = mm_next_region(region);
+
+        mm_zap_range(mm, &tlb, region->start, region->end + 1);
+        mm->total_vm -= vmm_pages_in_range(region->start, region->end + 1);
+        mm_erase_region(mm, region);
+
+        region = next;
     }
-    
-    uint64_t flags = PTE_PRESENT | PTE_WRITABLE | PTE_USER | PTE_NX;
-    int ret = vmm_map_range(mm->as, grow_start, phys_start, HEAP_GROW_SIZE, flags);
 
-    if (ret != 0) 
-        buddy_free_pages(phys_start, HEAP_GROW_ORDER);
-    
-    mm->brk = grow_start + HEAP_GROW_SIZE;
-    
+    tlb_gather_flush(&tlb);
+    return 0;
+}
+
+int mm_munmap(struct mem_descriptor *mm, virt_addr addr, size_t len) {
+    if (!mm || (addr & ~PAGE_MASK) || len == 0)
+        return -1;
+
+    int_flags flags;
+    spinlock_lock_intsave(&mm->lock, &flags);
+    int ret = _mm_munmap(mm, addr, len);
+    spinlock_unlock_intrestore(&mm->lock, flags);
     return ret;
 }
 
+int mm_mprotect(struct mem_descriptor *mm, virt_addr addr, size_t len, int prot) {
+    if (!mm || (addr & ~PAGE_MASK) || len == 0)
+        return -1;
+
+    virt_addr end = addr + vmm_page_align_up(len);
+    if (end > USER_SPACE_END || end < addr)
+        return -1;
+
+    uint64_t new_flags = 0;
+    if (prot & PROT_READ)
+        new_flags |= RP_READ;
+    if (prot & PROT_WRITE)
+        new_flags |= RP_WRITE;
+    if (prot & PROT_EXEC)
+        new_flags |= RP_EXEC;
+
+    int_flags flags;
+    spinlock_lock_intsave(&mm->lock, &flags);
+    int ret = -1;
+
+    // Like Linux the whole range has to be mapped, holes make it fail
+    virt_addr expected = addr;
+    struct mem_region *region = mm_region_from(mm, addr);
+    for (; region && region->start < end; region = mm_next_region(region)) {
+        if (region->start > expected)
+            goto out;
+        expected = region->end + 1;
+    }
+    if (expected < end)
+        goto out;
+
+    if (mm_split_region(mm, addr) != 0 || mm_split_region(mm, end) != 0)
+        goto out;
+    if (thp_split_range_edges(mm, addr, end) != 0)
+        goto out;
+
+    region = mm_region_from(mm, addr);
+    for (; region && region->start < end; region = mm_next_region(region)) {
+        // Heap, stack and shared are what the region is, not how it's accessed
+        region->flags = new_flags | (region->flags & (RP_HEAP | RP_STACK | RP_SHARED));
+        if (vmm_protect_range(mm->as, region->start, region->end + 1, 
+                mm_region_pte_flags(region), region->flags & RP_SHARED) != 0)
+            goto out;
+    }
+
+    // Pieces that now match their neighbours fold back together
+    region = mm_region_from(mm, addr ? addr - 1 : 0);
+    while (region && region->start <= end) {
+        region = mm_merge_region(mm, region);
+        region = mm_next_region(region);
+    }
+
+    ret = 0;
+out:
+    spinlock_unlock_intrestore(&mm->lock, flags);
+    return ret;
+}
+
+int mm_handle_cow_fault(struct mem_descriptor *mm, virt_addr fault_addr) {
+    virt_addr vaddr = vmm_page_align_down(fault_addr);
+    page_table_entry *pte = vmm_walk_page_table(mm->as, vaddr, false);
+
+    if (pte && (*pte & PTE_PRESENT) && (*pte & PTE_HUGE) && (*pte & PTE_COW)) {
+        int ret = thp_cow_fault(mm, pte, vaddr);
+        if (ret <= 0)
+            return ret;
+        // Got split, finish with the 4KiB page we actually hit
+        pte = vmm_walk_page_table(mm->as, vaddr, false);
+    }
+
+    if (!pte || !(*pte & PTE_PRESENT) || !(*pte & PTE_COW)) {
+        KERROR("Write fault on a read only page that isn't copy on write\n");
+        return -1;
+    }
+
+    phys_addr old_phys = PTE_ADDR(*pte);
+    uint64_t flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_WRITABLE;
+
+    // A local invlpg isn't enough for any of the changes below, a CPU we 
+    // ran on earlier can still have the read only entry cached and would
+    // skip the CR3 reload when we come back if the generation didn't move
+
+    // No point in copying zeroes, and the zero page itself must never 
+    // become writable no matter what its refcount says
+    if (old_phys == zero_page) {
+        phys_addr new_phys = alloc_zeroed_page();
+        if (!new_phys)
+            return -1;
+
+        *pte = new_phys | flags;
+        vmm_flush_tlb_as(mm->as, vaddr, vaddr + PAGE_SIZE);
+        pmm_put_page(zero_page);
+        page_set_anon_rmap(new_phys, mm, vaddr);
+        lru_add_page(new_phys);
+        return 0;
+    }
+
+    // A swap cache copy nobody can fault on anymore only costs us a copy
+    swap_cache_try_free(old_phys);
+
+    // Everyone else already made their own copy so the page is ours again
+    if (pmm_page_refcount(old_phys) == 1) {
+        *pte = old_phys | flags;
+        vmm_flush_tlb_as(mm->as, vaddr, vaddr + PAGE_SIZE);
+        return 0;
+    }
+
+    phys_addr new_phys = alloc_movable_page();
+    if (!new_phys)
+        return -1;
+
+    memcpy(phys_to_virt(new_phys), phys_to_virt(old_phys), PAGE_SIZE);
+    *pte = new_phys | flags;
+    vmm_flush_tlb_as(mm->as, vaddr, vaddr + PAGE_SIZE);
+
+    pmm_put_page(old_phys);
+    page_set_anon_rmap(new_phys, mm, vaddr);
+    lru_add_page(new_phys);
+    return 0;
+}
+
+// The page comes back through the swap cache so everyone that had it 
+// swapped out ends up sharing the same frame again. It's mapped copy on 
+// write (private) unless we turn out to be the only one left holding it
+int mm_swap_fault(struct mem_descriptor *mm, struct mem_region *region, 
+                                virt_addr fault_addr, page_table_entry *pte) {
+    virt_addr vaddr = vmm_page_align_down(fault_addr);
+    page_table_entry entry = *pte;
+
+    phys_addr phys = swap_cache_lookup(entry);
+    if (phys) {
+        atomic64_inc(&swap_stats.cache_hits);
+    } else {
+        phys = swap_read_in(entry);
+        if (!phys)
+            return -1;
+        atomic64_inc(&swap_stats.swap_ins);
+        swap_readahead(entry);
+    }
+
+    uint64_t flags = mm_region_pte_flags(region);
+    bool shared = region->flags & RP_SHARED;
+    if ((flags & PTE_WRITABLE) && !shared)
+        flags = (flags & ~PTE_WRITABLE) | PTE_COW;
+
+    // Nothing was present so there is nothing to flush, our lookup 
+    // reference becomes the mapping's
+    *pte = phys | flags;
+    mm->as->total_pages++;
+    mm->rss++;
+    page_set_anon_rmap(phys, mm, vaddr);
+
+    // Drops the cache too if we were the last one on the slot
+    swap_entry_free(entry);
+
+    if ((flags & PTE_COW) && pmm_page_refcount(phys) == 1) {
+        *pte = (*pte & ~PTE_COW) | PTE_WRITABLE;
+        vmm_flush_tlb_as(mm->as, vaddr, vaddr + PAGE_SIZE);
+    } else if (shared && (flags & PTE_WRITABLE) && phys_to_frame(phys)) {
+        // Can get written while the cache still has it, so the copy on 
+        // swap is no good anymore
+        atomic_clear_bit(PG_CLEAN, &phys_to_frame(phys)->flags);
+    }
+    return 0;
+}
+
 static uint64_t err_code_to_access_flags(uint64_t error_code) {
     uint64_t access_flags = 0;
     
@@ -190,19 +1031,57 @@ static uint64_t err_code_to_access_flags(uint64_t error_code) {
     return access_flags;
 }
 
-void mm_page_fault_handler(uint64_t fault_addr, uint64_t error_code) {
-    
-    struct mem_descriptor *mm = NULL;
+// Someone else (khugepaged) may have fixed the mapping up while we were 
+// waiting for the lock
+static bool fault_already_resolved(struct mem_descriptor *mm, virt_addr fault_addr,
+                                                        uint64_t error_code) {
+    page_table_entry *pte = vmm_walk_page_table(mm->as, fault_addr, false);
+    if (!pte || !(*pte & PTE_PRESENT) || !(*pte & PTE_USER))
+        return false;
+    return !(error_code & PF_WRITE) || (*pte & PTE_WRITABLE);
+}
+
+static int handle_fault_locked(struct mem_descriptor *mm, uint64_t fault_addr, 
+                                                        uint64_t error_code) {
     uint64_t access_flags = err_code_to_access_flags(error_code); 
-    if (!mm_check_access(mm, fault_addr, access_flags)) {
-        // Should be SIGSEGV but we don't have that yet
-        return;
+    if (!mm_check_access(mm, fault_addr, access_flags)) 
+        return -1;
+
+    if (fault_already_resolved(mm, fault_addr, error_code))
+        return 0;
+
+    // Page is there but read only, only copy on write pages get here legally
+    if (error_code & PF_PRESENT) {
+        if (error_code & PF_WRITE)
+            return mm_handle_cow_fault(mm, fault_addr);
+        return -1;
     }
 
     struct mem_region *region = mm_find_region(mm, fault_addr);
+
+    page_table_entry *pte = vmm_walk_page_table(mm->as, fault_addr, false);
+    if (pte && is_swap_pte(*pte))
+        return mm_swap_fault(mm, region, fault_addr, pte);
+
     if (region->flags & RP_STACK) 
-        mm_expand_stack(mm, fault_addr);
-    else if (region->flags & RP_HEAP) 
-        mm_expand_heap(mm, fault_addr);
-    
+        return mm_expand_stack(mm, fault_addr);
+    if (region->flags & RP_HEAP) 
+        return mm_expand_heap(mm, fault_addr, error_code & PF_WRITE);
+
+    return mm_anon_fault(mm, region, fault_addr, error_code & PF_WRITE);
+}
+
+int mm_page_fault_handler(uint64_t fault_addr, uint64_t error_code) {
+    struct task *current = get_current_task();
+    struct mem_descriptor *mm = current ? current->md : NULL;
+
+    // Kernel tasks have no user half to fault on
+    if (!mm) 
+        return -1;
+
+    // Interrupt gate, interrupts are already off in here
+    spinlock_lock(&mm->lock);
+    int ret = handle_fault_locked(mm, fault_addr, error_code);
+    spinlock_unlock(&mm->lock);
+    return ret;
 }
@@ -0,0 +1,68 @@
+#include <kernel/mempolicy.h>
+#include <kernel/numa.h>
+#include <kernel/scheduler.h>
+#include <kernel/tasks.h>
+
+int task_set_mempolicy(struct task *task, int mode, uint64_t nodes){
+    if (!task || (mode != MPOL_LOCAL && mode != MPOL_BIND && mode != MPOL_INTERLEAVE))
+        return -1;
+
+    if (mode == MPOL_LOCAL) {
+        nodes = 0;
+    } else {
+        nodes &= (1UL << nr_numa_nodes) - 1;
+        if (!nodes)
+            return -1;
+    }
+
+    task->mempolicy.mode = mode;
+    task->mempolicy.nodes = nodes;
+    task->mempolicy.il_next = __builtin_ctzl(nodes | (1UL << 63));
+    return 0;
+}
+
+static int interleave_next(struct mempolicy *pol){
+    int node = pol->il_next;
+
+    // Next set bit after node, wrapping around
+    uint64_t above = pol->nodes & ~((2UL << node) - 1);
+    pol->il_next = __builtin_ctzl(above ? above : pol->nodes);
+    return node;
+}
+
+int mempolicy_node(uint64_t *nodemask){
+    int local = numa_node_id();
+    struct task *task = get_current_task();
+    *nodemask = NUMA_ALL_NODES;
+
+    // Kernel tasks, or nobody is running yet
+    if (!task || !task->md)
+        return local;
+
+    struct mempolicy *pol = &task->mempolicy;
+    switch (pol->mode) {
+        case MPOL_BIND:
+            *nodemask = pol->nodes;
+            if (pol->nodes & (1UL << local))
+                return local;
+            // Closest one we're allowed on
+            for (int i = 0; i < nr_numa_nodes; i++) {
+                int node = numa_fallback_node(local, i);
+                if (pol->nodes & (1UL << node))
+                    return node;
+            }
+            return local;
+        case MPOL_INTERLEAVE:
+            // Only one CPU runs the task at a time so il_next needs no lock
+            return interleave_next(pol);
+        default:
+            return local;
+    }
+}
+
+uint64_t mempolicy_cpu_nodes(struct task *task){
+    // A bound task should run where its memory is
+    if (task && task->mempolicy.mode == MPOL_BIND)
+        return task->mempolicy.nodes;
+    return NUMA_ALL_NODES;
+}
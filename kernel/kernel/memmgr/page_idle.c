@@ -0,0 +1,191 @@
+#include <kernel/page_idle.h>
+#include <kernel/pmm.h>
+#include <kernel/scheduler.h>
+#include <kernel/task_manager.h>
+#include <kernel/memutils.h>
+#include <kernel/timer.h>
+#include <klib/string.h>
+
+struct idle_stats idle_stats;
+
+struct idle_walk {
+    struct idle_hist *hist;
+    uint64_t budget;
+    virt_addr next;     // Where the walk has to pick up again
+};
+
+// The CPU sets accessed and dirty bits with locked RMWs so the entry only
+// changes through cmpxchg. No flush, same as reclaim's aging a cached 
+// translation just makes the page look idle a bit longer than it is
+static int idle_scan_entry(page_table_entry *entry, virt_addr addr, uint64_t size, void *arg){
+    struct idle_walk *walk = arg;
+    if (!walk->budget) {
+        walk->next = addr;
+        return 1;
+    }
+    walk->budget--;
+
+    page_table_entry old = *entry;
+    page_table_entry new;
+    uint64_t age;
+    do {
+        age = (old & PTE_IDLE_MASK) >> PTE_IDLE_SHIFT;
+        if (old & PTE_ACCESSED)
+            age = 0;
+        else if (age < PTE_IDLE_MAX)
+            age++;
+        new = (old & ~(PTE_ACCESSED | PTE_DIRTY | PTE_IDLE_MASK)) | (age << PTE_IDLE_SHIFT);
+    } while (!atomic64_try_cmpxchg((atomic64*)entry, (long*)&old, new));
+
+    // Reclaim ages pages off the same bit, it still gets to see this one
+    struct page_frame *frame = phys_to_frame(PTE_ADDR(old));
+    if ((old & PTE_ACCESSED) && frame)
+        atomic_set_bit(PG_YOUNG, &frame->flags);
+
+    uint64_t pages = size / PAGE_SIZE;
+    if (age == 0)
+        walk->hist->hot += pages;
+    else if (age < IDLE_COLD_AGE)
+        walk->hist->warm += pages;
+    else
+        walk->hist->cold += pages;
+    if (old & PTE_DIRTY)
+        walk->hist->dirty += pages;
+
+    walk->next = addr + size;
+    return 0;
+}
+
+// Returns how much of the budget is left, cursor is 0 again once the 
+// whole address space got covered
+static uint64_t idle_scan_mm(struct mem_descriptor *mm, virt_addr *cursor, uint64_t budget){
+    struct idle_walk walk = { .budget = budget };
+
+    spinlock_lock(&mm->lock);
+
+    struct mem_region *region = mm_first_region(mm);
+    for (; region; region = mm_next_region(region)) {
+        if (region->end < *cursor)
+            continue;
+
+        virt_addr from = region->start > *cursor ? region->start : *cursor;
+        walk.hist = &region->idle_scan;
+        if (vmm_walk_range(mm->as, from, region->end + 1, idle_scan_entry, &walk)) {
+            *cursor = walk.next;
+            break;
+        }
+
+        region->idle = region->idle_scan;
+        memset(&region->idle_scan, 0, sizeof(region->idle_scan));
+        *cursor = region->end + 1;
+    }
+
+    if (!region) {
+        uint64_t wss = 0;
+        for (region = mm_first_region(mm); region; region = mm_next_region(region))
+            wss += region->idle.hot + region->idle.warm;
+        mm->wss_pages = wss;
+        mm->idle_passes++;
+        *cursor = 0;
+    }
+
+    spinlock_unlock(&mm->lock);
+
+    atomic64_add(budget - walk.budget, &idle_stats.scanned);
+    return walk.budget;
+}
+
+// Same bookkeeping as khugepaged, we remember the task and address we 
+// stopped at. Returns true once the pass went through every task
+static bool idle_scan(void){
+    static uint32_t scan_pid = 0;
+    static virt_addr scan_addr = 0;
+    uint64_t budget = IDLE_SCAN_PAGES;
+    bool found = scan_pid == 0;
+
+    int_flags flags;
+    spinlock_lock_intsave(&task_list_lock, &flags);
+
+    struct list_node *node;
+    for (node = all_tasks.next; node != &all_tasks && budget; node = node->next) {
+        struct task *task = container_of(node, struct task, tasks);
+        if (!found) {
+            if (task->pid != scan_pid)
+                continue;
+            found = true;
+        }
+        if (!task->md || task->state == TASK_ZOMBIE)
+            continue;
+
+        // A different task than last time starts from the bottom
+        if (task->pid != scan_pid)
+            scan_addr = 0;
+        scan_pid = task->pid;
+        budget = idle_scan_mm(task->md, &scan_addr, budget);
+    }
+
+    bool done = false;
+    if (!found) {
+        // The task we were on is gone, start over
+        scan_pid = 0;
+        scan_addr = 0;
+    } else if (node == &all_tasks && scan_addr == 0) {
+        // Got through the last one too
+        scan_pid = 0;
+        done = true;
+    }
+
+    spinlock_unlock_intrestore(&task_list_lock, flags);
+    return done;
+}
+
+static void kidled(void){
+    uint64_t pass_start = read_tsc();
+
+    while (1) {
+        if (!idle_scan()) {
+            sched_sleep_ms(IDLE_CHUNK_SLEEP_MS);
+            continue;
+        }
+        atomic64_inc(&idle_stats.passes);
+
+        // A pass that took longer than IDLE_PASS_MS is followed right away
+        uint64_t ms = (read_tsc() - pass_start) / tsc_cycles_per_ms();
+        if (ms < IDLE_PASS_MS)
+            sched_sleep_ms(IDLE_PASS_MS - ms);
+        pass_start = read_tsc();
+    }
+}
+
+void kidled_init(void){
+    if (!create_and_schedule_kernel_task(kidled, PRIO_BACKGROUND))
+        KERROR("Couldn't start kidled\n");
+}
+
+void idle_print_stats(void){
+    kprintf("Idle page tracking: %lu passes, %lu entries scanned\n",
+            atomic64_read(&idle_stats.passes), atomic64_read(&idle_stats.scanned));
+
+    int_flags flags;
+    spinlock_lock_intsave(&task_list_lock, &flags);
+
+    for (struct list_node *node = all_tasks.next; node != &all_tasks; node = node->next) {
+        struct task *task = container_of(node, struct task, tasks);
+        struct mem_descriptor *mm = task->md;
+        if (!mm || task->state == TASK_ZOMBIE)
+            continue;
+
+        spinlock_lock(&mm->lock);
+        kprintf("     PID %u: rss %lu wss %lu pages (%lu passes)\n", task->pid, 
+                                        mm->rss, mm->wss_pages, mm->idle_passes);
+        for (struct mem_region *region = mm_first_region(mm); region; 
+                                            region = mm_next_region(region)) {
+            kprintf("         %lx-%lx hot %lu warm %lu cold %lu dirty %lu\n", 
+                    region->start, region->end, region->idle.hot, 
+                    region->idle.warm, region->idle.cold, region->idle.dirty);
+        }
+        spinlock_unlock(&mm->lock);
+    }
+
+    spinlock_unlock_intrestore(&task_list_lock, flags);
+}
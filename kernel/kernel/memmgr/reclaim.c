@@ -0,0 +1,567 @@
+#include <kernel/reclaim.h>
+#include <kernel/swap.h>
+#include <kernel/pmm.h>
+#include <kernel/task_manager.h>
+#include <kernel/cma.h>
+#include <kernel/numa.h>
+#include <kernel/wait.h>
+#include <klib/string.h>
+
+struct mem_node mem_nodes[MAX_MEM_NODES];
+int nr_mem_nodes = 1;
+
+struct reclaim_stats reclaim_stats;
+
+// In pages, zero until reclaim_init so early allocations never poke kswapd
+static uint64_t wmark_min = 0;
+static uint64_t wmark_low = 0;
+static uint64_t wmark_high = 0;
+
+static volatile bool kswapd_wanted = false;
+static DEFINE_WAIT_QUEUE(kswapd_wait);
+
+void reclaim_init(void){
+    nr_mem_nodes = nr_numa_nodes;
+    for (int i = 0; i < MAX_MEM_NODES; i++) {
+        spinlock_init(&mem_nodes[i].lru_lock);
+        list_init(&mem_nodes[i].active);
+        list_init(&mem_nodes[i].inactive);
+        mem_nodes[i].nr_active = 0;
+        mem_nodes[i].nr_inactive = 0;
+    }
+
+    // Linux derives min from sqrt(memory) and puts low and high at 5/4 and
+    // 3/2 of it, a flat fraction is close enough for the sizes we run on
+    uint64_t total = buddy_total_page_count();
+    wmark_min = total / 128;
+    if (wmark_min < 128)
+        wmark_min = 128;
+    if (wmark_min > 16384)
+        wmark_min = 16384;
+    wmark_low = wmark_min + wmark_min / 4;
+    wmark_high = wmark_min + wmark_min / 2;
+
+    KSUCCESS("Reclaim watermarks (pages): min %lu low %lu high %lu\n",
+                                        wmark_min, wmark_low, wmark_high);
+}
+
+bool reclaim_below_low_watermark(void){
+    return buddy_free_page_count() < wmark_low;
+}
+
+// The pmm calls this with its lock dropped, waking kswapd takes runqueue locks
+void reclaim_check_watermarks(void){
+    if (!kswapd_wanted && reclaim_below_low_watermark()) {
+        kswapd_wanted = true;
+        wake_up(&kswapd_wait);
+    }
+}
+
+static bool get_page_unless_zero(struct page_frame *frame){
+    int count = atomic_read(&frame->refcount);
+    while (count) {
+        if (atomic_try_cmpxchg(&frame->refcount, &count, count + 1))
+            return true;
+    }
+    return false;
+}
+
+void lru_add_page(phys_addr phys){
+    struct page_frame *frame = phys_to_frame(phys);
+    if (!frame || test_bit(PG_LRU, &frame->flags))
+        return;
+
+    frame->node = phys_to_node(phys);
+    struct mem_node *node = &mem_nodes[frame->node];
+
+    int_flags flags;
+    spinlock_lock_intsave(&node->lru_lock, &flags);
+    if (!test_bit(PG_LRU, &frame->flags)) {
+        atomic_set_bit(PG_LRU, &frame->flags);
+        list_add_head(&frame->lru, &node->inactive);
+        node->nr_inactive++;
+    }
+    spinlock_unlock_intrestore(&node->lru_lock, flags);
+}
+
+// Caller holds the node's lru_lock
+static void lru_del_locked(struct mem_node *node, struct page_frame *frame){
+    list_del(&frame->lru);
+    if (test_bit(PG_ACTIVE, &frame->flags))
+        node->nr_active--;
+    else
+        node->nr_inactive--;
+    atomic_clear_bit(PG_LRU, &frame->flags);
+    atomic_clear_bit(PG_ACTIVE, &frame->flags);
+}
+
+void page_set_anon_rmap(phys_addr phys, struct mem_descriptor *mm, virt_addr vaddr){
+    struct page_frame *frame = phys_to_frame(phys);
+    if (!frame || frame->mapping)
+        return;
+
+    anon_family_get(mm->family);
+    frame->index = vmm_page_align_down(vaddr);
+    frame->mapping = mm->family;
+}
+
+void rmap_inherit_huge(phys_addr phys, phys_addr head, int idx){
+    struct page_frame *frame = phys_to_frame(phys);
+    struct page_frame *head_frame = phys_to_frame(head);
+    if (!frame || !head_frame || !head_frame->mapping)
+        return;
+
+    // Frame 0 of a huge page we carved up is the head itself
+    if (frame != head_frame) {
+        anon_family_get(head_frame->mapping);
+        frame->mapping = head_frame->mapping;
+    }
+    frame->index = head_frame->index + (uint64_t)idx * PAGE_SIZE;
+    lru_add_page(phys);
+}
+
+void page_frame_release(struct page_frame *frame){
+    if (test_bit(PG_LRU, &frame->flags)) {
+        struct mem_node *node = &mem_nodes[frame->node];
+        int_flags flags;
+        spinlock_lock_intsave(&node->lru_lock, &flags);
+        if (test_bit(PG_LRU, &frame->flags))
+            lru_del_locked(node, frame);
+        spinlock_unlock_intrestore(&node->lru_lock, flags);
+    }
+
+    if (frame->mapping) {
+        anon_family_put(frame->mapping);
+        frame->mapping = NULL;
+    }
+
+    frame->index = 0;
+    frame->private = 0;
+    frame->flags = 0;
+}
+
+typedef int (*rmap_one_fn)(struct mem_descriptor *mm, page_table_entry *pte, void *arg);
+
+// Calls fn for every PTE in the frame's family that maps it. We can't wait
+// for an mm's lock in here, a fault holding its mm->lock can end up in 
+// reclaim itself, so busy ones are reported through busy and skipped
+static int rmap_walk(struct page_frame *frame, phys_addr phys, rmap_one_fn fn,
+                                                        void *arg, int *busy){
+    struct anon_family *family = frame->mapping;
+    int ret = 0;
+    *busy = 0;
+
+    if (!family)
+        return 0;
+
+    int_flags flags;
+    spinlock_lock_intsave(&family->lock, &flags);
+
+    for (struct list_node *node = family->mms.next; node != &family->mms; node = node->next) {
+        struct mem_descriptor *mm = container_of(node, struct mem_descriptor, family_node);
+
+        if (!spinlockrylock(&mm->lock)) {
+            (*busy)++;
+            continue;
+        }
+
+        page_table_entry *pte = vmm_walk_page_table(mm->as, frame->index, false);
+        if (pte && (*pte & PTE_PRESENT) && !(*pte & PTE_HUGE) && PTE_ADDR(*pte) == phys)
+            ret += fn(mm, pte, arg);
+
+        spinlock_unlock(&mm->lock);
+    }
+
+    spinlock_unlock_intrestore(&family->lock, flags);
+    return ret;
+}
+
+// The CPU sets accessed bits with a locked RMW, so clearing has to be
+// atomic too. No flush, a stale TLB entry just means we see the page as
+// idle a little longer than it is, same tradeoff Linux makes on x86
+static int test_clear_young_one(struct mem_descriptor *mm, page_table_entry *pte, void *arg){
+    (void)mm;
+    (void)arg;
+    return atomic_test_and_clear_bit(5, (volatile unsigned long*)pte);
+}
+
+static int page_referenced(struct page_frame *frame, phys_addr phys){
+    int busy;
+    int referenced = rmap_walk(frame, phys, test_clear_young_one, NULL, &busy);
+    // Idle tracking clears accessed bits on its own schedule, whatever it
+    // took from us it left here
+    referenced += atomic_test_and_clear_bit(PG_YOUNG, &frame->flags);
+    // Somebody is in there right now, count it as a use
+    return referenced + busy;
+}
+
+struct unmap_args {
+    page_table_entry entry;
+    phys_addr phys;
+    virt_addr vaddr;
+};
+
+// The PTE is swapped for the swap entry and every CPU running on the 
+// address space gets a shootdown before we let go of the frame, whatever
+// they write through a stale TLB entry until then still makes it to swap.
+// CPUs that only hold it lazily (kernel task on top) reload CR3 on their
+// way back, the next access faults and waits for mm->lock
+static int try_to_unmap_one(struct mem_descriptor *mm, page_table_entry *pte, void *arg){
+    struct unmap_args *args = arg;
+
+    if (swap_entry_dup_cached(args->entry, args->phys) != 0)
+        return 0;
+
+    atomic64_xchg((atomic64*)pte, args->entry);
+    vmm_flush_tlb_as(mm->as, args->vaddr, args->vaddr + PAGE_SIZE);
+
+    mm->as->total_pages--;
+    mm->rss--;
+    // Caller pinned the frame, this never frees it
+    pmm_put_page(args->phys);
+    return 1;
+}
+
+// Page is isolated and pinned by us. Returns true if it's gone for good
+// once we drop the pin
+static bool shrink_page(struct page_frame *frame, phys_addr phys){
+    page_table_entry entry;
+    if (test_bit(PG_SWAPCACHE, &frame->flags)) {
+        entry = frame->private;
+    } else {
+        entry = swap_alloc_cached(phys);
+        if (!entry)
+            return false;
+    }
+
+    struct unmap_args args = { .entry = entry, .phys = phys, .vaddr = frame->index };
+    int busy;
+    rmap_walk(frame, phys, try_to_unmap_one, &args, &busy);
+
+    // Still mapped somewhere (its mm was busy), stays in the swap cache and
+    // we try again next time it comes around
+    if (atomic_read(&frame->refcount) != 2)
+        return false;
+
+    // Pages that came in from swap and weren't written since don't need
+    // to go out again
+    if (!test_bit(PG_CLEAN, &frame->flags)) {
+        if (swap_writepage(entry, phys) != 0)
+            return false;
+        atomic_set_bit(PG_CLEAN, &frame->flags);
+    }
+
+    return swap_cache_release_unused(phys);
+}
+
+// Takes up to nr pages off the tail of a list, pinned so they can't be
+// freed while we look at them
+static int isolate_pages(struct mem_node *node, struct list_node *list,
+                                struct list_node *isolated, int nr){
+    int taken = 0;
+
+    int_flags flags;
+    spinlock_lock_intsave(&node->lru_lock, &flags);
+
+    for (int scanned = 0; scanned < nr && !list_empty(list); scanned++) {
+        struct page_frame *frame = container_of(list->prev, struct page_frame, lru);
+
+        // On its way to being freed, page_frame_release takes it off
+        if (!get_page_unless_zero(frame)) {
+            list_del(&frame->lru);
+            list_add_head(&frame->lru, list);
+            continue;
+        }
+
+        lru_del_locked(node, frame);
+        list_add_tail(&frame->lru, isolated);
+        taken++;
+    }
+
+    spinlock_unlock_intrestore(&node->lru_lock, flags);
+    return taken;
+}
+
+static void putback_page(struct mem_node *node, struct page_frame *frame, bool active){
+    int_flags flags;
+    spinlock_lock_intsave(&node->lru_lock, &flags);
+    atomic_set_bit(PG_LRU, &frame->flags);
+    if (active) {
+        atomic_set_bit(PG_ACTIVE, &frame->flags);
+        list_add_head(&frame->lru, &node->active);
+        node->nr_active++;
+    } else {
+        list_add_head(&frame->lru, &node->inactive);
+        node->nr_inactive++;
+    }
+    spinlock_unlock_intrestore(&node->lru_lock, flags);
+}
+
+// Active pages that weren't touched since the last look go to the inactive
+// list where they get one more chance before being swapped out
+static void shrink_active(struct mem_node *node, int nr){
+    struct list_node isolated;
+    list_init(&isolated);
+    isolate_pages(node, &node->active, &isolated, nr);
+
+    while (!list_empty(&isolated)) {
+        struct page_frame *frame = container_of(isolated.next, struct page_frame, lru);
+        list_del(&frame->lru);
+        phys_addr phys = frame_to_phys(frame);
+
+        bool referenced = page_referenced(frame, phys) > 0;
+        if (!referenced) {
+            atomic_clear_bit(PG_REFERENCED, &frame->flags);
+            atomic64_inc(&reclaim_stats.deactivated);
+        }
+        putback_page(node, frame, referenced);
+        pmm_put_page(phys);
+    }
+}
+
+// Accessed once gets a second chance on the inactive list, accessed again
+// (or by more than one mapping) and it goes to the active list
+static uint64_t shrink_inactive(struct mem_node *node, int nr){
+    struct list_node isolated;
+    list_init(&isolated);
+    isolate_pages(node, &node->inactive, &isolated, nr);
+
+    uint64_t reclaimed = 0;
+    while (!list_empty(&isolated)) {
+        struct page_frame *frame = container_of(isolated.next, struct page_frame, lru);
+        list_del(&frame->lru);
+        phys_addr phys = frame_to_phys(frame);
+
+        atomic64_inc(&reclaim_stats.scanned);
+
+        int referenced = page_referenced(frame, phys);
+        if (referenced) {
+            bool activate = referenced > 1 || test_bit(PG_REFERENCED, &frame->flags);
+            if (activate) {
+                atomic_clear_bit(PG_REFERENCED, &frame->flags);
+                atomic64_inc(&reclaim_stats.activated);
+            } else {
+                atomic_set_bit(PG_REFERENCED, &frame->flags);
+            }
+            putback_page(node, frame, activate);
+        } else if (shrink_page(frame, phys)) {
+            reclaimed++;
+        } else {
+            putback_page(node, frame, false);
+        }
+
+        pmm_put_page(phys);
+    }
+
+    atomic64_add(reclaimed, &reclaim_stats.reclaimed);
+    return reclaimed;
+}
+
+static uint64_t shrink_node(struct mem_node *node, uint64_t nr_to_scan){
+    uint64_t reclaimed = 0;
+
+    while (nr_to_scan) {
+        int batch = nr_to_scan > SWAP_CLUSTER_MAX ? SWAP_CLUSTER_MAX : nr_to_scan;
+        nr_to_scan -= batch;
+
+        // Keep the inactive list at least as long as the active one so
+        // there's always something aged to pick from
+        if (node->nr_inactive < node->nr_active)
+            shrink_active(node, batch);
+
+        reclaimed += shrink_inactive(node, batch);
+    }
+
+    return reclaimed;
+}
+
+uint64_t reclaim_pages(uint64_t nr_pages){
+    uint64_t reclaimed = 0;
+
+    for (int prio = RECLAIM_PRIORITY; prio >= 0 && reclaimed < nr_pages; prio--) {
+        for (int i = 0; i < nr_mem_nodes && reclaimed < nr_pages; i++) {
+            struct mem_node *node = &mem_nodes[i];
+            uint64_t scan = (node->nr_active + node->nr_inactive) >> prio;
+            if (scan < SWAP_CLUSTER_MAX)
+                scan = SWAP_CLUSTER_MAX;
+            reclaimed += shrink_node(node, scan);
+        }
+    }
+
+    return reclaimed;
+}
+
+phys_addr alloc_page_or_reclaim(void){
+    phys_addr phys = pmm_alloc_page();
+    if (phys)
+        return phys;
+
+    atomic64_inc(&reclaim_stats.direct_reclaims);
+    if (!reclaim_pages(SWAP_CLUSTER_MAX))
+        return 0;
+    return pmm_alloc_page();
+}
+
+phys_addr alloc_movable_page(void){
+    // CMA pages go out first while that area has more free than the rest, 
+    // otherwise it would sit there unused until a driver wants it
+    phys_addr phys = cma_alloc_movable(false);
+    if (phys)
+        return phys;
+
+    phys = alloc_page_or_reclaim();
+    if (phys)
+        return phys;
+    return cma_alloc_movable(true);
+}
+
+struct migrate_pte {
+    struct mem_descriptor *mm;
+    page_table_entry *pte;
+    page_table_entry old;
+};
+
+// Same dance as try_to_unmap_one except everything has to hold still at 
+// once, so every mm in the family stays locked until the copy is done
+int migrate_page(phys_addr old_phys){
+    struct page_frame *old = phys_to_frame(old_phys);
+    if (!old)
+        return -1;
+    // Already on its way back to the allocator
+    if (!get_page_unless_zero(old))
+        return 0;
+
+    // A page in the swap cache has to stay where the cache points, 
+    // unless we can drop it from there first
+    if (test_bit(PG_SWAPCACHE, &old->flags))
+        swap_cache_try_free(old_phys);
+
+    struct anon_family *family = old->mapping;
+    phys_addr new_phys = 0;
+    if (!family || old->order || !test_bit(PG_LRU, &old->flags) ||
+            test_bit(PG_SWAPCACHE, &old->flags))
+        goto out;
+
+    new_phys = alloc_page_or_reclaim();
+    if (!new_phys)
+        goto out;
+
+    struct migrate_pte ptes[MIGRATE_MAX_MAPPINGS];
+    int nr_ptes = 0;
+    int locked = 0;
+    bool ok = true;
+
+    int_flags flags;
+    spinlock_lock_intsave(&family->lock, &flags);
+
+    struct list_node *node;
+    for (node = family->mms.next; node != &family->mms; node = node->next) {
+        struct mem_descriptor *mm = container_of(node, struct mem_descriptor, family_node);
+        if (!spinlockrylock(&mm->lock)) {
+            ok = false;
+            break;
+        }
+        locked++;
+
+        page_table_entry *pte = vmm_walk_page_table(mm->as, old->index, false);
+        if (!pte || !(*pte & PTE_PRESENT) || (*pte & PTE_HUGE) || PTE_ADDR(*pte) != old_phys)
+            continue;
+
+        if (nr_ptes == MIGRATE_MAX_MAPPINGS) {
+            ok = false;
+            break;
+        }
+        ptes[nr_ptes].mm = mm;
+        ptes[nr_ptes].pte = pte;
+        ptes[nr_ptes].old = atomic64_xchg((atomic64*)pte, 0);
+        vmm_bump_tlb_gen(mm->as);
+        nr_ptes++;
+    }
+
+    // Anyone that got on after the bump faults and waits for mm->lock
+    for (int i = 0; ok && i < nr_ptes; i++) {
+        if (as_active_cpus(ptes[i].mm->as))
+            ok = false;
+    }
+    // Every reference has to be one of ours, anything else (reclaim has it 
+    // isolated for example) could still touch the old frame
+    if (ok && atomic_read(&old->refcount) != nr_ptes + 1)
+        ok = false;
+
+    if (ok) {
+        memcpy(phys_to_virt(new_phys), phys_to_virt(old_phys), PAGE_SIZE);
+
+        struct page_frame *new = phys_to_frame(new_phys);
+        atomic_set(&new->refcount, nr_ptes);
+        anon_family_get(family);
+        new->mapping = family;
+        new->index = old->index;
+
+        for (int i = 0; i < nr_ptes; i++)
+            *ptes[i].pte = new_phys | PTE_FLAGS(ptes[i].old);
+        atomic_sub(nr_ptes, &old->refcount);
+    } else {
+        for (int i = 0; i < nr_ptes; i++)
+            *ptes[i].pte = ptes[i].old;
+    }
+
+    // Unlock the ones we got, in the same order
+    for (node = family->mms.next; locked; node = node->next, locked--) {
+        struct mem_descriptor *mm = container_of(node, struct mem_descriptor, family_node);
+        spinlock_unlock(&mm->lock);
+    }
+    spinlock_unlock_intrestore(&family->lock, flags);
+
+    if (ok) {
+        lru_add_page(new_phys);
+        // Our pin was the last one, this frees it
+        pmm_put_page(old_phys);
+        return 0;
+    }
+
+out:
+    if (new_phys)
+        pmm_put_page(new_phys);
+    pmm_put_page(old_phys);
+    return -1;
+}
+
+static void kswapd(void){
+    while (1) {
+        if (kswapd_wanted || reclaim_below_low_watermark()) {
+            atomic64_inc(&reclaim_stats.kswapd_wakeups);
+
+            // Keep going until there's some headroom again, or until a
+            // whole pass gets nothing back (no swap left or all in use)
+            while (buddy_free_page_count() < wmark_high) {
+                if (!reclaim_pages(SWAP_CLUSTER_MAX))
+                    break;
+            }
+            kswapd_wanted = false;
+        }
+
+        // Normally the allocation that crosses the low watermark wakes us, 
+        // the timeout is for frees and allocations that went around the pmm
+        wait_event_timeout(kswapd_wait, kswapd_wanted, KSWAPD_SLEEP_MS);
+    }
+}
+
+void kswapd_init(void){
+    if (!create_and_schedule_kernel_task(kswapd, PRIO_INTERACTIVE))
+        KERROR("Couldn't start kswapd\n");
+}
+
+void reclaim_print_stats(void){
+    kprintf("Reclaim:\n");
+    for (int i = 0; i < nr_mem_nodes; i++)
+        kprintf("     Node %d: %lu active, %lu inactive\n", i,
+                mem_nodes[i].nr_active, mem_nodes[i].nr_inactive);
+    kprintf("     Free pages:      %lu (low %lu, high %lu)\n",
+            buddy_free_page_count(), wmark_low, wmark_high);
+    kprintf("     Scanned:         %lu\n", atomic64_read(&reclaim_stats.scanned));
+    kprintf("     Activated:       %lu\n", atomic64_read(&reclaim_stats.activated));
+    kprintf("     Deactivated:     %lu\n", atomic64_read(&reclaim_stats.deactivated));
+    kprintf("     Reclaimed:       %lu\n", atomic64_read(&reclaim_stats.reclaimed));
+    kprintf("     Direct reclaims: %lu\n", atomic64_read(&reclaim_stats.direct_reclaims));
+    kprintf("     kswapd wakeups:  %lu\n", atomic64_read(&reclaim_stats.kswapd_wakeups));
+}
@@ -0,0 +1,436 @@
+#include <kernel/swap.h>
+#include <kernel/reclaim.h>
+#include <kernel/zram.h>
+#include <kernel/pmm.h>
+#include <kernel/spinlock.h>
+#include <klib/string.h>
+
+struct swap_stats swap_stats;
+
+static struct swap_area swap_areas[MAX_SWAP_AREAS];
+static int nr_swap_areas = 0;
+
+// Covers slot counts and the swap cache of every area, the frame flags
+// that go with the cache (PG_SWAPCACHE, private) only change under it too
+static DEFINE_SPINLOCK(swap_lock);
+
+// zram goes first, a compressed page costs a fraction of what it would
+// on ram0 which only gets used once zram is full
+int swap_init(void){
+    struct block_device *zram = zram_create("zram0", ZRAM_SWAP_SIZE);
+    if(zram)
+        swap_on(zram, 10);
+
+    struct block_device *bdev = ramdisk_create("ram0", SWAP_RAMDISK_SIZE);
+    if(!bdev)
+        return zram ? 0 : -1;
+    return swap_on(bdev, 0);
+}
+
+int swap_on(struct block_device *bdev, int priority){
+    if(!bdev)
+        return -1;
+
+    uint64_t nr_slots = bdev->nr_sectors / SECTORS_PER_PAGE;
+    if(!nr_slots || nr_slots > (1UL << 40)){
+        KERROR("%s can't be used for swap\n", bdev->name);
+        return -1;
+    }
+
+    uint16_t *slot_count = kmalloc(nr_slots * sizeof(uint16_t));
+    phys_addr *cache = kmalloc(nr_slots * sizeof(phys_addr));
+    if(!slot_count || !cache){
+        kfree(slot_count);
+        kfree(cache);
+        return -1;
+    }
+    memset(slot_count, 0, nr_slots * sizeof(uint16_t));
+    memset(cache, 0, nr_slots * sizeof(phys_addr));
+
+    int_flags flags;
+    spinlock_lock_intsave(&swap_lock, &flags);
+
+    if(nr_swap_areas == MAX_SWAP_AREAS){
+        spinlock_unlock_intrestore(&swap_lock, flags);
+        KERROR("Too many swap areas\n");
+        kfree(slot_count);
+        kfree(cache);
+        return -1;
+    }
+
+    struct swap_area *area = &swap_areas[nr_swap_areas++];
+    area->bdev = bdev;
+    area->priority = priority;
+    area->nr_slots = nr_slots;
+    area->used = 0;
+    area->next = 0;
+    area->slot_count = slot_count;
+    area->cache = cache;
+    area->active = true;
+
+    spinlock_unlock_intrestore(&swap_lock, flags);
+
+    KSUCCESS("Swapping to %s, %lu slots\n", bdev->name, nr_slots);
+    return 0;
+}
+
+// Caller holds swap_lock
+static struct swap_area* entry_to_area(page_table_entry entry){
+    int type = swp_type(entry);
+    if(type >= nr_swap_areas || !swap_areas[type].active ||
+            swp_slot(entry) >= swap_areas[type].nr_slots){
+        KERROR("Bad swap entry %lx\n", entry);
+        return NULL;
+    }
+    return &swap_areas[type];
+}
+
+static void swap_cache_clear_frame(phys_addr phys){
+    struct page_frame *frame = phys_to_frame(phys);
+    if(!frame)
+        return;
+    atomic_clear_bit(PG_SWAPCACHE, &frame->flags);
+    atomic_clear_bit(PG_CLEAN, &frame->flags);
+    frame->private = 0;
+}
+
+// Caller holds swap_lock, once nothing holds the slot the device gets told
+// (zram for example can give the memory back)
+static bool swap_slot_put(struct swap_area *area, uint64_t slot){
+    if(--area->slot_count[slot])
+        return false;
+    area->used--;
+    return true;
+}
+
+static void swap_discard(page_table_entry entry){
+    struct swap_area *area = &swap_areas[swp_type(entry)];
+    blkdev_discard(area->bdev, swp_slot(entry) * SECTORS_PER_PAGE, SECTORS_PER_PAGE);
+}
+
+void swap_entry_dup(page_table_entry entry){
+    int_flags flags;
+    spinlock_lock_intsave(&swap_lock, &flags);
+
+    struct swap_area *area = entry_to_area(entry);
+    if(area){
+        uint64_t slot = swp_slot(entry);
+        if(!area->slot_count[slot] || area->slot_count[slot] == UINT16_MAX)
+            KERROR("Can't dup swap entry %lx\n", entry);
+        else
+            area->slot_count[slot]++;
+    }
+
+    spinlock_unlock_intrestore(&swap_lock, flags);
+}
+
+int swap_entry_dup_cached(page_table_entry entry, phys_addr phys){
+    int ret = -1;
+
+    int_flags flags;
+    spinlock_lock_intsave(&swap_lock, &flags);
+
+    struct swap_area *area = entry_to_area(entry);
+    uint64_t slot = swp_slot(entry);
+    if(area && area->cache[slot] == phys && area->slot_count[slot] < UINT16_MAX){
+        area->slot_count[slot]++;
+        ret = 0;
+    }
+
+    spinlock_unlock_intrestore(&swap_lock, flags);
+    return ret;
+}
+
+// When only the cache is left on the slot nobody can ever fault on it
+// again, so the cache lets go of the frame and the slot is free
+void swap_entry_free(page_table_entry entry){
+    phys_addr drop = 0;
+    bool freed = false;
+
+    int_flags flags;
+    spinlock_lock_intsave(&swap_lock, &flags);
+
+    struct swap_area *area = entry_to_area(entry);
+    uint64_t slot = swp_slot(entry);
+    if(!area || !area->slot_count[slot]){
+        spinlock_unlock_intrestore(&swap_lock, flags);
+        KERROR("Freeing swap entry %lx that isn't in use\n", entry);
+        return;
+    }
+
+    freed = swap_slot_put(area, slot);
+    if(!freed && area->slot_count[slot] == 1 && area->cache[slot]){
+        drop = area->cache[slot];
+        area->cache[slot] = 0;
+        swap_cache_clear_frame(drop);
+        freed = swap_slot_put(area, slot);
+    }
+
+    spinlock_unlock_intrestore(&swap_lock, flags);
+
+    if(drop)
+        pmm_put_page(drop);
+    if(freed)
+        swap_discard(entry);
+}
+
+int swap_count(page_table_entry entry){
+    int count = 0;
+
+    int_flags flags;
+    spinlock_lock_intsave(&swap_lock, &flags);
+    struct swap_area *area = entry_to_area(entry);
+    if(area)
+        count = area->slot_count[swp_slot(entry)];
+    spinlock_unlock_intrestore(&swap_lock, flags);
+
+    return count;
+}
+
+// Highest priority area with room, next fit inside it so a batch of pages
+// reclaimed together lands in neighbouring slots (and readahead pays off)
+page_table_entry swap_alloc_cached(phys_addr phys){
+    struct page_frame *frame = phys_to_frame(phys);
+    if(!frame)
+        return 0;
+
+    int_flags flags;
+    spinlock_lock_intsave(&swap_lock, &flags);
+
+    struct swap_area *best = NULL;
+    int type = 0;
+    for(int i = 0; i < nr_swap_areas; i++){
+        struct swap_area *area = &swap_areas[i];
+        if(!area->active || area->used == area->nr_slots)
+            continue;
+        if(!best || area->priority > best->priority){
+            best = area;
+            type = i;
+        }
+    }
+
+    page_table_entry entry = 0;
+    if(best){
+        for(uint64_t i = 0; i < best->nr_slots; i++){
+            uint64_t slot = (best->next + i) % best->nr_slots;
+            if(best->slot_count[slot])
+                continue;
+
+            best->slot_count[slot] = 1;
+            best->cache[slot] = phys;
+            best->used++;
+            best->next = slot + 1;
+
+            entry = swp_entry(type, slot);
+            pmm_get_page(phys);
+            frame->private = entry;
+            atomic_clear_bit(PG_CLEAN, &frame->flags);
+            atomic_set_bit(PG_SWAPCACHE, &frame->flags);
+            break;
+        }
+    }
+
+    spinlock_unlock_intrestore(&swap_lock, flags);
+    return entry;
+}
+
+phys_addr swap_cache_lookup(page_table_entry entry){
+    phys_addr phys = 0;
+
+    int_flags flags;
+    spinlock_lock_intsave(&swap_lock, &flags);
+    struct swap_area *area = entry_to_area(entry);
+    if(area){
+        phys = area->cache[swp_slot(entry)];
+        if(phys)
+            pmm_get_page(phys);
+    }
+    spinlock_unlock_intrestore(&swap_lock, flags);
+
+    return phys;
+}
+
+// The slot has to still be in use, a readahead can race with the last
+// entry going away
+static int swap_cache_add(page_table_entry entry, phys_addr phys){
+    struct page_frame *frame = phys_to_frame(phys);
+    int ret = -1;
+
+    int_flags flags;
+    spinlock_lock_intsave(&swap_lock, &flags);
+
+    struct swap_area *area = entry_to_area(entry);
+    uint64_t slot = swp_slot(entry);
+    if(frame && area && area->slot_count[slot] && !area->cache[slot] &&
+            area->slot_count[slot] < UINT16_MAX){
+        area->cache[slot] = phys;
+        area->slot_count[slot]++;
+        pmm_get_page(phys);
+        frame->private = entry;
+        // Just came off the device so the slot is as good as the frame
+        atomic_set_bit(PG_CLEAN, &frame->flags);
+        atomic_set_bit(PG_SWAPCACHE, &frame->flags);
+        ret = 0;
+    }
+
+    spinlock_unlock_intrestore(&swap_lock, flags);
+    return ret;
+}
+
+static int swap_readpage(page_table_entry entry, phys_addr phys){
+    struct swap_area *area = &swap_areas[swp_type(entry)];
+    return blkdev_read(area->bdev, swp_slot(entry) * SECTORS_PER_PAGE,
+                                    SECTORS_PER_PAGE, phys_to_virt(phys));
+}
+
+int swap_writepage(page_table_entry entry, phys_addr phys){
+    struct swap_area *area = &swap_areas[swp_type(entry)];
+    if(blkdev_write(area->bdev, swp_slot(entry) * SECTORS_PER_PAGE,
+                                SECTORS_PER_PAGE, phys_to_virt(phys)) != 0)
+        return -1;
+
+    atomic64_inc(&swap_stats.swap_outs);
+    return 0;
+}
+
+// Reading happens without the lock, if someone else reads the same slot
+// in at the same time the loser throws its copy away and takes theirs
+phys_addr swap_read_in(page_table_entry entry){
+    phys_addr phys = swap_cache_lookup(entry);
+    if(phys)
+        return phys;
+
+    phys = alloc_page_or_reclaim();
+    if(!phys)
+        return 0;
+
+    if(swap_readpage(entry, phys) != 0){
+        pmm_put_page(phys);
+        return 0;
+    }
+
+    if(swap_cache_add(entry, phys) != 0){
+        pmm_put_page(phys);
+        return swap_cache_lookup(entry);
+    }
+
+    lru_add_page(phys);
+    return phys;
+}
+
+// Brings in the other used slots of the aligned window around entry. Pages
+// only sit in the swap cache until someone faults on them, if nobody does
+// reclaim drops them without writing anything since they're still clean
+void swap_readahead(page_table_entry entry){
+    // No point in pushing out other pages to make room for guesses
+    if(reclaim_below_low_watermark())
+        return;
+
+    int type = swp_type(entry);
+    uint64_t first = swp_slot(entry) & ~(uint64_t)(SWAP_READAHEAD_PAGES - 1);
+
+    for(uint64_t slot = first; slot < first + SWAP_READAHEAD_PAGES; slot++){
+        if(slot == swp_slot(entry))
+            continue;
+
+        int_flags flags;
+        spinlock_lock_intsave(&swap_lock, &flags);
+        struct swap_area *area = &swap_areas[type];
+        bool wanted = slot < area->nr_slots && area->slot_count[slot] && !area->cache[slot];
+        spinlock_unlock_intrestore(&swap_lock, flags);
+
+        if(!wanted)
+            continue;
+
+        phys_addr phys = pmm_alloc_page();
+        if(!phys)
+            return;
+
+        page_table_entry ra_entry = swp_entry(type, slot);
+        if(swap_readpage(ra_entry, phys) == 0 && swap_cache_add(ra_entry, phys) == 0){
+            lru_add_page(phys);
+            atomic64_inc(&swap_stats.readahead);
+        }
+        // The cache has its own reference, ours goes
+        pmm_put_page(phys);
+    }
+}
+
+bool swap_cache_release_unused(phys_addr phys){
+    struct page_frame *frame = phys_to_frame(phys);
+    bool released = false, freed = false;
+    page_table_entry entry = 0;
+
+    int_flags flags;
+    spinlock_lock_intsave(&swap_lock, &flags);
+
+    // Lookups take their reference under the lock so this can't change
+    // under us
+    if(frame && test_bit(PG_SWAPCACHE, &frame->flags) &&
+            atomic_read(&frame->refcount) == 2){
+        entry = frame->private;
+        struct swap_area *area = entry_to_area(entry);
+        if(area){
+            area->cache[swp_slot(entry)] = 0;
+            swap_cache_clear_frame(phys);
+            freed = swap_slot_put(area, swp_slot(entry));
+            released = true;
+        }
+    }
+
+    spinlock_unlock_intrestore(&swap_lock, flags);
+
+    if(released)
+        pmm_put_page(phys);
+    if(freed)
+        swap_discard(entry);
+    return released;
+}
+
+bool swap_cache_try_free(phys_addr phys){
+    struct page_frame *frame = phys_to_frame(phys);
+    if(!frame || !test_bit(PG_SWAPCACHE, &frame->flags))
+        return false;
+
+    bool released = false;
+    page_table_entry entry = 0;
+
+    int_flags flags;
+    spinlock_lock_intsave(&swap_lock, &flags);
+
+    if(test_bit(PG_SWAPCACHE, &frame->flags)){
+        entry = frame->private;
+        struct swap_area *area = entry_to_area(entry);
+        uint64_t slot = swp_slot(entry);
+        if(area && area->slot_count[slot] == 1){
+            area->cache[slot] = 0;
+            swap_cache_clear_frame(phys);
+            swap_slot_put(area, slot);
+            released = true;
+        }
+    }
+
+    spinlock_unlock_intrestore(&swap_lock, flags);
+
+    if(released){
+        pmm_put_page(phys);
+        swap_discard(entry);
+    }
+    return released;
+}
+
+void swap_print_stats(void){
+    kprintf("Swap:\n");
+    for(int i = 0; i < nr_swap_areas; i++){
+        struct swap_area *area = &swap_areas[i];
+        kprintf("     %s: %lu/%lu slots used, priority %d\n", area->bdev->name,
+                area->used, area->nr_slots, area->priority);
+    }
+    kprintf("     Swap outs:   %lu\n", atomic64_read(&swap_stats.swap_outs));
+    kprintf("     Swap ins:    %lu\n", atomic64_read(&swap_stats.swap_ins));
+    kprintf("     Cache hits:  %lu\n", atomic64_read(&swap_stats.cache_hits));
+    kprintf("     Readahead:   %lu\n", atomic64_read(&swap_stats.readahead));
+
+    for(int i = 0; i < nr_swap_areas; i++)
+        zram_print_stats(swap_areas[i].bdev);
+}
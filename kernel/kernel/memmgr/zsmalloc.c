@@ -0,0 +1,172 @@
+#include <kernel/zsmalloc.h>
+#include <kernel/pmm.h>
+#include <klib/string.h>
+
+// Handle is the block's physical address, the object index fits in the 
+// page offset bits since a class never has more than 4096 objects per block
+#define ZS_IDX_MASK     (PAGE_FRAME_SIZE - 1)
+
+// The block's head frame keeps the bookkeeping, private holds the class
+// and index the in use count and the first free object. Free objects keep
+// the index of the next free one in their first two bytes
+#define ZS_FREE_END     0xFFFF
+#define ZS_INUSE(idx)           ((idx) & 0xFFFF)
+#define ZS_FREE_HEAD(idx)       (((idx) >> 16) & 0xFFFF)
+#define ZS_META(inuse, head)    ((uint64_t)(inuse) | ((uint64_t)(head) << 16))
+
+static inline int zs_class_index(size_t size){
+    return (size + ZS_ALIGN - 1) / ZS_ALIGN - 1;
+}
+
+// Most objects per wasted byte, on a tie the smaller block wins since 
+// it's easier to get and to give back
+static void zs_class_init(struct zs_class *class, uint32_t size){
+    uint64_t best_used = 0;
+    uint8_t best_order = 0;
+
+    for (uint8_t order = 0; order <= ZS_MAX_BLOCK_ORDER; order++) {
+        uint64_t block = PAGE_FRAME_SIZE << order;
+        uint64_t used = (block / size) * size;
+        // used/block > best_used/best_block without the division
+        if (used * (PAGE_FRAME_SIZE << best_order) > best_used * block) {
+            best_used = used;
+            best_order = order;
+        }
+    }
+
+    class->size = size;
+    class->order = best_order;
+    class->objs_per_block = (PAGE_FRAME_SIZE << best_order) / size;
+    class->nr_blocks = 0;
+    class->objs_used = 0;
+    list_init(&class->partial);
+}
+
+struct zs_pool *zs_create_pool(void){
+    struct zs_pool *pool = kmalloc(sizeof(*pool));
+    if (!pool)
+        return NULL;
+
+    spinlock_init(&pool->lock);
+    pool->pages_used = 0;
+    for (int i = 0; i < ZS_NR_CLASSES; i++)
+        zs_class_init(&pool->classes[i], (i + 1) * ZS_ALIGN);
+
+    return pool;
+}
+
+void zs_destroy_pool(struct zs_pool *pool){
+    if (!pool)
+        return;
+
+    for (int i = 0; i < ZS_NR_CLASSES; i++) {
+        if (pool->classes[i].objs_used)
+            KWARN("zsmalloc: class %u still has %lu objects\n", 
+                    pool->classes[i].size, pool->classes[i].objs_used);
+    }
+    kfree(pool);
+}
+
+// Threads every object onto the free list, first one on top
+static phys_addr zs_alloc_block(struct zs_class *class, int class_idx){
+    phys_addr block = pmm_alloc_pages(class->order);
+    if (!block)
+        return 0;
+
+    uint8_t *base = phys_to_virt(block);
+    for (uint16_t i = 0; i < class->objs_per_block; i++) {
+        uint16_t next = (i + 1 < class->objs_per_block) ? i + 1 : ZS_FREE_END;
+        __builtin_memcpy(base + (uint64_t)i * class->size, &next, sizeof(next));
+    }
+
+    struct page_frame *head = phys_to_frame(block);
+    head->private = class_idx;
+    head->index = ZS_META(0, 0);
+    return block;
+}
+
+uint64_t zs_malloc(struct zs_pool *pool, size_t size){
+    if (!size || size > ZS_MAX_SIZE)
+        return 0;
+
+    int class_idx = zs_class_index(size);
+    struct zs_class *class = &pool->classes[class_idx];
+
+    int_flags flags;
+    spinlock_lock_intsave(&pool->lock, &flags);
+
+    // Get a new block without the lock held, if somebody else refilled the
+    // class meanwhile ours just sits on the partial list for next time
+    if (list_empty(&class->partial)) {
+        spinlock_unlock_intrestore(&pool->lock, flags);
+        phys_addr block = zs_alloc_block(class, class_idx);
+        if (!block)
+            return 0;
+
+        spinlock_lock_intsave(&pool->lock, &flags);
+        list_add_head(&phys_to_frame(block)->lru, &class->partial);
+        class->nr_blocks++;
+        pool->pages_used += 1UL << class->order;
+    }
+
+    struct page_frame *head = container_of(class->partial.next, struct page_frame, lru);
+    phys_addr block = frame_to_phys(head);
+    uint64_t inuse = ZS_INUSE(head->index);
+    uint16_t idx = ZS_FREE_HEAD(head->index);
+
+    uint16_t next;
+    __builtin_memcpy(&next, (uint8_t*)phys_to_virt(block) + (uint64_t)idx * class->size, 
+                                                                        sizeof(next));
+    head->index = ZS_META(inuse + 1, next);
+    if (next == ZS_FREE_END)
+        list_del(&head->lru);
+    class->objs_used++;
+
+    spinlock_unlock_intrestore(&pool->lock, flags);
+    return block | idx;
+}
+
+void zs_free(struct zs_pool *pool, uint64_t handle){
+    if (!handle)
+        return;
+
+    phys_addr block = handle & ~(uint64_t)ZS_IDX_MASK;
+    uint16_t idx = handle & ZS_IDX_MASK;
+    struct page_frame *head = phys_to_frame(block);
+    struct zs_class *class = &pool->classes[head->private];
+
+    int_flags flags;
+    spinlock_lock_intsave(&pool->lock, &flags);
+
+    uint64_t inuse = ZS_INUSE(head->index);
+    uint16_t free_head = ZS_FREE_HEAD(head->index);
+    __builtin_memcpy((uint8_t*)phys_to_virt(block) + (uint64_t)idx * class->size, 
+                                                    &free_head, sizeof(free_head));
+    class->objs_used--;
+
+    // It was full so it's not on the partial list
+    if (free_head == ZS_FREE_END)
+        list_add_head(&head->lru, &class->partial);
+
+    if (--inuse == 0) {
+        list_del(&head->lru);
+        class->nr_blocks--;
+        pool->pages_used -= 1UL << class->order;
+        spinlock_unlock_intrestore(&pool->lock, flags);
+        pmm_put_page(block);
+        return;
+    }
+
+    head->index = ZS_META(inuse, idx);
+    spinlock_unlock_intrestore(&pool->lock, flags);
+}
+
+void *zs_map(struct zs_pool *pool, uint64_t handle){
+    phys_addr block = handle & ~(uint64_t)ZS_IDX_MASK;
+    struct zs_class *class = &pool->classes[phys_to_frame(block)->private];
+    return (uint8_t*)phys_to_virt(block) + (handle & ZS_IDX_MASK) * class->size;
+}
+
+uint64_t zs_pool_pages(struct zs_pool *pool){
+    return pool->pages_used;
+}
@@ -0,0 +1,56 @@
+#include <kernel/completion.h>
+
+// complete_all leaves it here for good
+#define COMPLETION_ALL  UINT32_MAX
+
+void init_completion(struct completion *c){
+    c->done = 0;
+    wait_queue_init(&c->wait);
+}
+
+void reinit_completion(struct completion *c){
+    c->done = 0;
+}
+
+static bool try_wait(struct completion *c){
+    int_flags flags;
+    bool done = false;
+
+    spinlock_lock_intsave(&c->wait.lock, &flags);
+    if (c->done) {
+        if (c->done != COMPLETION_ALL)
+            c->done--;
+        done = true;
+    }
+    spinlock_unlock_intrestore(&c->wait.lock, flags);
+    return done;
+}
+
+void wait_for_completion(struct completion *c){
+    wait_event_exclusive(c->wait, try_wait(c));
+}
+
+bool wait_for_completion_timeout(struct completion *c, uint64_t ms){
+    return wait_event_timeout(c->wait, try_wait(c), ms);
+}
+
+void complete(struct completion *c){
+    int_flags flags;
+    spinlock_lock_intsave(&c->wait.lock, &flags);
+    if (c->done != COMPLETION_ALL)
+        c->done++;
+    spinlock_unlock_intrestore(&c->wait.lock, flags);
+    wake_up(&c->wait);
+}
+
+void complete_all(struct completion *c){
+    int_flags flags;
+    spinlock_lock_intsave(&c->wait.lock, &flags);
+    c->done = COMPLETION_ALL;
+    spinlock_unlock_intrestore(&c->wait.lock, flags);
+    wake_up_all(&c->wait);
+}
+
+bool completion_done(struct completion *c){
+    return *(volatile unsigned int *)&c->done != 0;
+}
@@ -0,0 +1,79 @@
+#include <kernel/mutex.h>
+
+static struct {
+    atomic64 fast;          // Free on the first try
+    atomic64 spun;          // Got it while spinning on a running owner
+    atomic64 slept;         // Had to go to sleep for it
+} mutex_stats;
+
+void mutex_init(struct mutex *m){
+    atomic64_init(&m->owner, 0);
+    wait_queue_init(&m->wait);
+}
+
+bool mutex_trylock(struct mutex *m){
+    long self = (long)get_current_task();
+    return atomic64_cmpxchg(&m->owner, 0, self) == 0;
+}
+
+// The owner's task struct can't go anywhere while it holds a lock, but it
+// may have dropped it and exited since we read the pointer. So owner is only
+// ever compared, and cpu_id read through it can be stale, which only makes
+// us stop spinning a bit early or late
+static bool owner_running(struct task *owner){
+    int cpu = *(volatile int *)&owner->cpu_id;
+    if (cpu < 0 || cpu >= MAX_CORES)
+        return false;
+    return *(struct task * volatile *)&__percpu_runqueues[cpu].curr == owner;
+}
+
+// True if we got the lock without sleeping
+static bool mutex_spin_on_owner(struct mutex *m){
+    struct runqueue *rq = &this_core_read(runqueues);
+
+    while (1) {
+        struct task *owner = (struct task *)atomic64_read(&m->owner);
+        if (!owner) {
+            if (mutex_trylock(m))
+                return true;
+            continue;
+        }
+
+        // Sleeping owner won't be back any time soon, and if something 
+        // wants our CPU spinning just keeps it waiting
+        if (!owner_running(owner) || *(volatile bool *)&rq->need_resched)
+            return false;
+
+        cpu_relax();
+    }
+}
+
+void mutex_lock(struct mutex *m){
+    if (mutex_trylock(m)) {
+        atomic64_inc(&mutex_stats.fast);
+        return;
+    }
+
+    if (mutex_spin_on_owner(m)) {
+        atomic64_inc(&mutex_stats.spun);
+        return;
+    }
+
+    atomic64_inc(&mutex_stats.slept);
+    wait_event_exclusive(m->wait, mutex_trylock(m));
+}
+
+void mutex_unlock(struct mutex *m){
+    // The xchg orders the release before the peek at the waiters, anyone 
+    // who queued after it sees the lock free in its own trylock
+    atomic64_xchg(&m->owner, 0);
+    if (wait_queue_active(&m->wait))
+        wake_up(&m->wait);
+}
+
+void mutex_print_stats(void){
+    kprintf("Mutexes:\n");
+    kprintf("     Uncontended:     %lu\n", atomic64_read(&mutex_stats.fast));
+    kprintf("     Spun on owner:   %lu\n", atomic64_read(&mutex_stats.spun));
+    kprintf("     Slept:           %lu\n", atomic64_read(&mutex_stats.slept));
+}
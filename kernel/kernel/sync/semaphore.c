@@ -0,0 +1,29 @@
+#include <kernel/semaphore.h>
+
+void sema_init(struct semaphore *sem, int count){
+    atomic_init(&sem->count, count);
+    wait_queue_init(&sem->wait);
+}
+
+bool down_trylock(struct semaphore *sem){
+    int count = atomic_read(&sem->count);
+    while (count > 0) {
+        if (atomic_try_cmpxchg(&sem->count, &count, count - 1))
+            return true;
+    }
+    return false;
+}
+
+void down(struct semaphore *sem){
+    wait_event_exclusive(sem->wait, down_trylock(sem));
+}
+
+bool down_timeout(struct semaphore *sem, uint64_t ms){
+    return wait_event_timeout(sem->wait, down_trylock(sem), ms);
+}
+
+void up(struct semaphore *sem){
+    atomic_inc(&sem->count);
+    if (wait_queue_active(&sem->wait))
+        wake_up(&sem->wait);
+}
@@ -0,0 +1,84 @@
+#include <kernel/wait.h>
+
+void wait_queue_init(struct wait_queue_head *wq){
+    spinlock_init(&wq->lock);
+    list_init(&wq->waiters);
+}
+
+void wait_entry_init(struct wait_queue_entry *entry, bool exclusive){
+    list_init(&entry->node);
+    entry->task = get_current_task();
+    entry->exclusive = exclusive;
+    entry->woken = false;
+}
+
+void prepare_to_wait(struct wait_queue_head *wq, struct wait_queue_entry *entry, int state){
+    int_flags flags;
+    spinlock_lock_intsave(&wq->lock, &flags);
+    if (list_empty(&entry->node)) {
+        // Exclusive ones at the back so every wake_up gets to the others too
+        if (entry->exclusive)
+            list_add_tail(&entry->node, &wq->waiters);
+        else
+            list_add_head(&entry->node, &wq->waiters);
+    }
+    // Whatever woke us before this gets used by the check that follows
+    entry->woken = false;
+    entry->task->state = state;
+    spinlock_unlock_intrestore(&wq->lock, flags);
+}
+
+static void __wake_up_locked(struct wait_queue_head *wq, bool all);
+
+void finish_wait(struct wait_queue_head *wq, struct wait_queue_entry *entry){
+    entry->task->state = TASK_RUNNING;
+
+    // Always under the lock, a waker may be holding on to the entry still
+    // and it lives on our stack
+    int_flags flags;
+    spinlock_lock_intsave(&wq->lock, &flags);
+    if (!list_empty(&entry->node)) {
+        list_del(&entry->node);
+        list_init(&entry->node);
+    }
+    // The condition was already true when the waker picked us, the 
+    // up()/complete() it was for belongs to whoever is next in line
+    if (entry->woken)
+        __wake_up_locked(wq, false);
+    spinlock_unlock_intrestore(&wq->lock, flags);
+}
+
+static void __wake_up_locked(struct wait_queue_head *wq, bool all){
+    struct list_node *node = wq->waiters.next;
+    while (node != &wq->waiters) {
+        struct wait_queue_entry *entry = container_of(node, struct wait_queue_entry, node);
+        node = node->next;
+
+        // Non exclusive ones stay queued and take themselves off in 
+        // finish_wait. An exclusive one we woke comes off now, or the next
+        // wake_up would stop at it again instead of waking the one behind
+        if (entry->exclusive) {
+            list_del(&entry->node);
+            list_init(&entry->node);
+        }
+        if (sched_wake_up(entry->task) && entry->exclusive && !all) {
+            entry->woken = true;
+            break;
+        }
+    }
+}
+
+static void __wake_up(struct wait_queue_head *wq, bool all){
+    int_flags flags;
+    spinlock_lock_intsave(&wq->lock, &flags);
+    __wake_up_locked(wq, all);
+    spinlock_unlock_intrestore(&wq->lock, flags);
+}
+
+void wake_up(struct wait_queue_head *wq){
+    __wake_up(wq, false);
+}
+
+void wake_up_all(struct wait_queue_head *wq){
+    __wake_up(wq, true);
+}
@@ -11,3 +11,9 @@ set -e
 qemu-system-x86_64 -bios /usr/share/OVMF/x64/OVMF.4m.fd -cdrom LunOS.iso -m 512M -smp 4 -cpu host -enable-kvm
 
 #qemu-system-x86_64 -bios /usr/share/OVMF/x64/OVMF.4m.fd -cdrom LunOS.iso -m 512M -smp 4 -cpu host -enable-kvm -s -S
+
+# Two NUMA nodes with two CPUs and 512M each, node 1 is twice as far away
+#qemu-system-x86_64 -bios /usr/share/OVMF/x64/OVMF.4m.fd -cdrom LunOS.iso -m 1G -smp 4 -cpu host -enable-kvm \
+#    -object memory-backend-ram,id=m0,size=512M -object memory-backend-ram,id=m1,size=512M \
+#    -numa node,nodeid=0,cpus=0-1,memdev=m0 -numa node,nodeid=1,cpus=2-3,memdev=m1 \
+#    -numa dist,src=0,dst=1,val=20